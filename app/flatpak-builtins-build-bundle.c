@@ -51,6 +51,7 @@ static gboolean opt_oci = FALSE;
 static char **opt_gpg_key_ids;
 static char *opt_gpg_homedir;
 static char *opt_from_commit;
+static char *opt_compression;
 
 static GOptionEntry options[] = {
   { "runtime", 0, 0, G_OPTION_ARG_NONE, &opt_runtime, N_("Export runtime instead of app"), NULL },
@@ -62,6 +63,7 @@ static GOptionEntry options[] = {
   { "gpg-homedir", 0, 0, G_OPTION_ARG_STRING, &opt_gpg_homedir, N_("GPG Homedir to use when looking for keyrings"), N_("HOMEDIR") },
   { "from-commit", 0, 0, G_OPTION_ARG_STRING, &opt_from_commit, N_("OSTree commit to create a delta bundle from"), N_("COMMIT") },
   { "oci", 0, 0, G_OPTION_ARG_NONE, &opt_oci, N_("Export oci image instead of flatpak bundle"), NULL },
+  { "compression", 0, 0, G_OPTION_ARG_STRING, &opt_compression, N_("Compression format for OCI layers (gzip, zstd)"), N_("FORMAT") },
   { NULL }
 };
 
@@ -393,6 +395,8 @@ build_oci (OstreeRepo *repo, GFile *dir,
   g_autofree char *dir_uri = NULL;
   g_autoptr(FlatpakOciRegistry) registry = NULL;
   g_autoptr(FlatpakOciLayerWriter) layer_writer = NULL;
+  FlatpakOciLayerCompression compression;
+  g_autoptr(GError) local_error = NULL;
   struct archive *archive;
   g_autofree char *uncompressed_digest = NULL;
   g_autofree char *timestamp = NULL;
@@ -432,7 +436,14 @@ build_oci (OstreeRepo *repo, GFile *dir,
   if (registry == NULL)
     return FALSE;
 
-  layer_writer = flatpak_oci_registry_write_layer (registry, cancellable, error);
+  compression = flatpak_oci_layer_compression_from_string (opt_compression, &local_error);
+  if (local_error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  layer_writer = flatpak_oci_registry_write_layer (registry, compression, cancellable, error);
   if (layer_writer == NULL)
     return FALSE;
 
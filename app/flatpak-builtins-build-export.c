@@ -37,6 +37,7 @@ static char *opt_subject;
 static char *opt_body;
 static char *opt_arch;
 static gboolean opt_runtime;
+static gboolean opt_incremental;
 static gboolean opt_update_appstream;
 static gboolean opt_no_update_summary;
 static gboolean opt_disable_fsync;
@@ -71,6 +72,7 @@ static GOptionEntry options[] = {
   { "collection-id", 0, 0, G_OPTION_ARG_STRING, &opt_collection_id, N_("Collection ID"), "COLLECTION-ID" },
   { "disable-fsync", 0, 0, G_OPTION_ARG_NONE, &opt_disable_fsync, "Do not invoke fsync()", NULL },
   { "disable-sandbox", 0, 0, G_OPTION_ARG_NONE, &opt_disable_sandbox, "Do not sandbox icon validator", NULL },
+  { "incremental", 0, 0, G_OPTION_ARG_NONE, &opt_incremental, N_("Reuse unchanged files from the previous export of this branch"), NULL },
 
   { NULL }
 };
@@ -257,6 +259,289 @@ add_file_to_mtree (GFile             *file,
   return TRUE;
 }
 
+#define EXPORT_STATE_VARIANT_FORMAT "a(sstttttu)"
+
+/* Stat data recorded for each regular file in the previous export of a
+ * branch. If it all matches on the next export we know the canonicalized
+ * content object is unchanged and can reuse its checksum without reading
+ * the file. The mode is the canonicalized (post commit filter) one, so
+ * permission changes that don't affect the committed object are ignored. */
+typedef struct
+{
+  char   *checksum;
+  guint64 dev;
+  guint64 ino;
+  guint64 mtime;
+  guint64 mtime_usec;
+  guint64 size;
+  guint32 mode;
+} ExportStateEntry;
+
+typedef struct
+{
+  GHashTable      *old_entries; /* relative path → ExportStateEntry, or NULL */
+  GVariantBuilder *new_entries;
+  CommitData      *commit_data;
+  guint            n_reused;
+} ExportState;
+
+static void
+export_state_entry_free (ExportStateEntry *entry)
+{
+  g_free (entry->checksum);
+  g_free (entry);
+}
+
+static GFile *
+get_export_state_file (GFile *repofile, const char *full_branch)
+{
+  g_autoptr(GFile) state_dir = g_file_get_child (repofile, "flatpak-export-state");
+  g_autofree char *name = g_strdup (full_branch);
+
+  return g_file_get_child (state_dir, g_strdelimit (name, "/", '_'));
+}
+
+static GHashTable *
+load_export_state (GFile *state_file)
+{
+  g_autofree char *path = g_file_get_path (state_file);
+  g_autoptr(GMappedFile) mfile = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) state_v = NULL;
+  GHashTable *entries;
+  GVariantIter iter;
+  const char *entry_path;
+  const char *checksum;
+  guint64 dev, ino, mtime, mtime_usec, size;
+  guint32 mode;
+
+  mfile = g_mapped_file_new (path, FALSE, NULL);
+  if (mfile == NULL)
+    return NULL;
+
+  bytes = g_mapped_file_get_bytes (mfile);
+  state_v = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (EXPORT_STATE_VARIANT_FORMAT),
+                                                          bytes, FALSE));
+
+  entries = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                   (GDestroyNotify) export_state_entry_free);
+
+  g_variant_iter_init (&iter, state_v);
+  while (g_variant_iter_next (&iter, "(&s&stttttu)", &entry_path, &checksum,
+                              &dev, &ino, &mtime, &mtime_usec, &size, &mode))
+    {
+      ExportStateEntry *entry = g_new0 (ExportStateEntry, 1);
+
+      entry->checksum = g_strdup (checksum);
+      entry->dev = dev;
+      entry->ino = ino;
+      entry->mtime = mtime;
+      entry->mtime_usec = mtime_usec;
+      entry->size = size;
+      entry->mode = mode;
+      g_hash_table_replace (entries, g_strdup (entry_path), entry);
+    }
+
+  return entries;
+}
+
+static gboolean
+save_export_state (GFile        *state_file,
+                   GVariant     *state_v,
+                   GCancellable *cancellable,
+                   GError      **error)
+{
+  g_autoptr(GFile) state_dir = g_file_get_parent (state_file);
+  g_autoptr(GError) local_error = NULL;
+
+  if (!g_file_make_directory_with_parents (state_dir, cancellable, &local_error) &&
+      !g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_EXISTS))
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  return g_file_replace_contents (state_file,
+                                  g_variant_get_data (state_v),
+                                  g_variant_get_size (state_v),
+                                  NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION,
+                                  NULL, cancellable, error);
+}
+
+/* Equivalent of ostree_repo_write_directory_to_mtree with the commit
+ * filter and SKIP_XATTRS semantics used above, except that regular files
+ * whose stat data matches the recorded state from the previous export are
+ * inserted by their recorded checksum instead of being read and hashed
+ * again; the objects are already in the repo from the parent commit. */
+static gboolean
+export_dir_to_mtree (OstreeRepo        *repo,
+                     GFile             *dir,
+                     OstreeMutableTree *mtree,
+                     const char        *path,
+                     ExportState       *state,
+                     GCancellable      *cancellable,
+                     GError           **error)
+{
+  g_autoptr(GFileInfo) dir_info = NULL;
+  g_autoptr(GFileEnumerator) dir_enum = NULL;
+  g_autoptr(GVariant) dirmeta = NULL;
+  g_autofree guchar *dirmeta_csum = NULL;
+  g_autofree char *dirmeta_checksum = NULL;
+
+  dir_info = g_file_query_info (dir,
+                                "standard::name,standard::type,unix::mode,unix::uid,unix::gid",
+                                G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                cancellable, error);
+  if (dir_info == NULL)
+    return FALSE;
+
+  if (commit_filter (repo, path, dir_info, state->commit_data) == OSTREE_REPO_COMMIT_FILTER_SKIP)
+    return TRUE;
+
+  dirmeta = ostree_create_directory_metadata (dir_info, NULL);
+  if (!ostree_repo_write_metadata (repo, OSTREE_OBJECT_TYPE_DIR_META, NULL,
+                                   dirmeta, &dirmeta_csum, cancellable, error))
+    return FALSE;
+
+  dirmeta_checksum = ostree_checksum_from_bytes (dirmeta_csum);
+  ostree_mutable_tree_set_metadata_checksum (mtree, dirmeta_checksum);
+
+  dir_enum = g_file_enumerate_children (dir,
+                                        "standard::name,standard::type,standard::size,"
+                                        "standard::is-symlink,standard::symlink-target,"
+                                        "unix::device,unix::inode,unix::mode,unix::uid,unix::gid,"
+                                        "time::modified,time::modified-usec",
+                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                        cancellable, error);
+  if (dir_enum == NULL)
+    return FALSE;
+
+  while (TRUE)
+    {
+      GFileInfo *child_info;
+      GFile *child;
+      g_autofree char *child_path = NULL;
+      const char *name;
+      GFileType file_type;
+
+      if (!g_file_enumerator_iterate (dir_enum, &child_info, &child, cancellable, error))
+        return FALSE;
+      if (child_info == NULL)
+        break;
+
+      name = g_file_info_get_name (child_info);
+      child_path = g_build_filename (path, name, NULL);
+
+      if (commit_filter (repo, child_path, child_info, state->commit_data) == OSTREE_REPO_COMMIT_FILTER_SKIP)
+        continue;
+
+      file_type = g_file_info_get_file_type (child_info);
+      if (file_type == G_FILE_TYPE_DIRECTORY)
+        {
+          g_autoptr(OstreeMutableTree) child_mtree = NULL;
+
+          if (!ostree_mutable_tree_ensure_dir (mtree, name, &child_mtree, error))
+            return FALSE;
+
+          if (!export_dir_to_mtree (repo, child, child_mtree, child_path, state,
+                                    cancellable, error))
+            return FALSE;
+        }
+      else if (file_type == G_FILE_TYPE_REGULAR ||
+               file_type == G_FILE_TYPE_SYMBOLIC_LINK)
+        {
+          g_autofree char *checksum = NULL;
+          guint64 dev = g_file_info_get_attribute_uint32 (child_info, "unix::device");
+          guint64 ino = g_file_info_get_attribute_uint64 (child_info, "unix::inode");
+          guint64 mtime = g_file_info_get_attribute_uint64 (child_info, "time::modified");
+          guint64 mtime_usec = g_file_info_get_attribute_uint32 (child_info, "time::modified-usec");
+          guint64 size = g_file_info_get_size (child_info);
+          guint32 mode = g_file_info_get_attribute_uint32 (child_info, "unix::mode");
+
+          if (file_type == G_FILE_TYPE_REGULAR && state->old_entries != NULL)
+            {
+              ExportStateEntry *old = g_hash_table_lookup (state->old_entries, child_path);
+
+              if (old != NULL &&
+                  old->dev == dev && old->ino == ino &&
+                  old->mtime == mtime && old->mtime_usec == mtime_usec &&
+                  old->size == size && old->mode == mode)
+                {
+                  gboolean have_object = FALSE;
+
+                  /* Guard against the object having been pruned since the
+                     previous export */
+                  if (!ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_FILE, old->checksum,
+                                               &have_object, cancellable, error))
+                    return FALSE;
+
+                  if (have_object)
+                    {
+                      checksum = g_strdup (old->checksum);
+                      state->n_reused++;
+                    }
+                }
+            }
+
+          if (checksum == NULL)
+            {
+              g_autoptr(GInputStream) raw_input = NULL;
+              g_autoptr(GInputStream) input = NULL;
+              g_autofree guchar *child_file_csum = NULL;
+              guint64 length;
+
+              if (file_type == G_FILE_TYPE_REGULAR)
+                {
+                  raw_input = (GInputStream *) g_file_read (child, cancellable, error);
+                  if (raw_input == NULL)
+                    return FALSE;
+                }
+
+              if (!ostree_raw_file_to_content_stream (raw_input, child_info, NULL,
+                                                      &input, &length,
+                                                      cancellable, error))
+                return FALSE;
+
+              if (!ostree_repo_write_content (repo, NULL, input, length,
+                                              &child_file_csum, cancellable, error))
+                return FALSE;
+
+              checksum = ostree_checksum_from_bytes (child_file_csum);
+            }
+
+          if (!ostree_mutable_tree_replace_file (mtree, name, checksum, error))
+            return FALSE;
+
+          if (file_type == G_FILE_TYPE_REGULAR)
+            g_variant_builder_add (state->new_entries, "(sstttttu)",
+                                   child_path, checksum,
+                                   dev, ino, mtime, mtime_usec, size, mode);
+        }
+      else
+        {
+          return flatpak_fail (error, "Unsupported file type for file %s", child_path);
+        }
+    }
+
+  return TRUE;
+}
+
+static gboolean
+export_directory_to_mtree (OstreeRepo               *repo,
+                           GFile                    *dir,
+                           OstreeMutableTree        *mtree,
+                           OstreeRepoCommitModifier *modifier,
+                           ExportState              *state,
+                           GCancellable             *cancellable,
+                           GError                  **error)
+{
+  if (opt_incremental)
+    return export_dir_to_mtree (repo, dir, mtree, "/", state, cancellable, error);
+
+  return ostree_repo_write_directory_to_mtree (repo, dir, mtree, modifier,
+                                               cancellable, error);
+}
+
 static gboolean
 find_file_in_tree (GFile *base, const char *filename)
 {
@@ -360,17 +645,107 @@ add_args (GPtrArray *argv_array, ...)
   va_end (args);
 }
 
+/* Validation results keyed by icon content, so repeated exports only
+ * pay the sandboxed subprocess cost for icons that actually changed.
+ * Only successes are cached; a failure aborts the export and should
+ * re-run to reproduce its error message. */
+static GKeyFile *
+icon_validation_cache_get (const char **path_out)
+{
+  static GKeyFile *cache;
+  static char *cache_path;
+
+  if (cache == NULL)
+    {
+      cache_path = g_build_filename (g_get_user_cache_dir (),
+                                     "flatpak", "icon-validation", NULL);
+      cache = g_key_file_new ();
+      g_key_file_load_from_file (cache, cache_path, G_KEY_FILE_NONE, NULL);
+    }
+
+  if (path_out)
+    *path_out = cache_path;
+
+  return cache;
+}
+
 static gboolean
-validate_icon_file (GFile *file, GError **error)
+icon_validation_cache_lookup (const char *icon_checksum)
+{
+  return g_key_file_has_key (icon_validation_cache_get (NULL),
+                             "validated", icon_checksum, NULL);
+}
+
+static void
+icon_validation_cache_add (const char *icon_checksum)
+{
+  const char *cache_path;
+  GKeyFile *cache = icon_validation_cache_get (&cache_path);
+  g_autofree char *dir = g_path_get_dirname (cache_path);
+
+  g_key_file_set_boolean (cache, "validated", icon_checksum, TRUE);
+
+  /* Saving is best effort, worst case the next export revalidates */
+  if (g_mkdir_with_parents (dir, 0755) == 0)
+    g_key_file_save_to_file (cache, cache_path, NULL);
+}
+
+typedef struct
+{
+  char *path;
+  char *checksum; /* NULL if the file couldn't be read */
+} PendingIcon;
+
+static void
+pending_icon_free (gpointer data)
+{
+  PendingIcon *icon = data;
+
+  g_free (icon->path);
+  g_free (icon->checksum);
+  g_free (icon);
+}
+
+/* Set while validate_exported_icons () walks the icon tree, since the
+ * visitor callback has no user data pointer */
+static GPtrArray *pending_icons;
+
+static gboolean
+collect_icon_file (GFile *file, GError **error)
+{
+  const char *name = flatpak_file_get_path_cached (file);
+  g_autofree char *icon_data = NULL;
+  g_autofree char *icon_checksum = NULL;
+  gsize icon_len;
+  PendingIcon *icon;
+
+  if (g_file_get_contents (name, &icon_data, &icon_len, NULL))
+    icon_checksum = g_compute_checksum_for_data (G_CHECKSUM_SHA256,
+                                                 (guchar *) icon_data, icon_len);
+
+  if (icon_checksum != NULL && icon_validation_cache_lookup (icon_checksum))
+    return TRUE;
+
+  icon = g_new0 (PendingIcon, 1);
+  icon->path = g_strdup (name);
+  icon->checksum = g_steal_pointer (&icon_checksum);
+  g_ptr_array_add (pending_icons, icon);
+
+  return TRUE;
+}
+
+/* Validates all the icons with a single (optionally sandboxed)
+ * validator process, so the bwrap setup cost is paid once per export
+ * instead of once per icon */
+static gboolean
+validate_icon_files (GPtrArray *icons, GError **error)
 {
   g_autoptr(GPtrArray) args = NULL;
-  const char *name;
   int status;
   g_autofree char *err = NULL;
+  guint i;
   const char *validate_icon = LIBEXECDIR "/flatpak-validate-icon";
 
-  name = flatpak_file_get_path_cached (file);
-
   if (g_getenv ("FLATPAK_VALIDATE_ICON"))
     validate_icon = g_getenv ("FLATPAK_VALIDATE_ICON");
 
@@ -378,10 +753,17 @@ validate_icon_file (GFile *file, GError **error)
 
 #ifndef DISABLE_SANDBOXED_TRIGGERS
   if (!opt_disable_sandbox)
-    add_args (args, validate_icon, "--sandbox", "512", "512", name, NULL);
+    add_args (args, validate_icon, "--sandbox", "512", "512", NULL);
   else
 #endif
-    add_args (args, validate_icon, "512", "512", name, NULL);
+    add_args (args, validate_icon, "512", "512", NULL);
+
+  for (i = 0; i < icons->len; i++)
+    {
+      PendingIcon *icon = g_ptr_array_index (icons, i);
+
+      g_ptr_array_add (args, g_strdup (icon->path));
+    }
 
   g_ptr_array_add (args, NULL);
 
@@ -394,7 +776,7 @@ validate_icon_file (GFile *file, GError **error)
   if (!g_spawn_check_exit_status (status, NULL))
     {
       g_debug ("Icon validation: %s", err);
-      return flatpak_fail (error, "%s is not a valid icon: %s", name, err);
+      return flatpak_fail (error, "Invalid icons: %s", err);
     }
 
   return TRUE;
@@ -406,9 +788,28 @@ validate_exported_icons (GFile      *export,
                          GError    **error)
 {
   g_autoptr(GFile) icondir = NULL;
+  g_autoptr(GPtrArray) icons = NULL;
+  guint i;
 
   icondir = g_file_resolve_relative_path (export, "share/icons/hicolor");
-  visit_files_in_tree (icondir, validate_icon_file, error);
+
+  pending_icons = g_ptr_array_new_with_free_func (pending_icon_free);
+  visit_files_in_tree (icondir, collect_icon_file, error);
+  icons = g_steal_pointer (&pending_icons);
+
+  if (*error == NULL && icons->len > 0 &&
+      validate_icon_files (icons, error))
+    {
+      /* Remember the whole batch, only unseen icons get revalidated
+       * next export */
+      for (i = 0; i < icons->len; i++)
+        {
+          PendingIcon *icon = g_ptr_array_index (icons, i);
+
+          if (icon->checksum != NULL)
+            icon_validation_cache_add (icon->checksum);
+        }
+    }
 
   return !*error;
 }
@@ -775,10 +1176,15 @@ flatpak_builtin_build_export (int argc, char **argv, GCancellable *cancellable,
   OstreeRepoTransactionStats stats;
   g_autoptr(OstreeRepoCommitModifier) modifier = NULL;
   CommitData commit_data = {0};
+  g_autoptr(GFile) export_state_file = NULL;
+  g_autoptr(GHashTable) old_export_state = NULL;
+  g_autoptr(GVariantBuilder) new_export_state = NULL;
+  ExportState export_state = {0};
   g_auto(GVariantDict) metadata_dict = FLATPAK_VARIANT_DICT_INITIALIZER;
   g_autoptr(GVariant) metadata_dict_v = NULL;
   gboolean is_runtime = FALSE;
   gboolean is_extension = FALSE;
+  gboolean skip_commit = FALSE;
   guint64 installed_size = 0, download_size = 0;
   struct timespec ts;
   const char *collection_id;
@@ -936,6 +1342,18 @@ flatpak_builtin_build_export (int argc, char **argv, GCancellable *cancellable,
    * the command line. */
   collection_id = ostree_repo_get_collection_id (repo);
 
+  if (opt_incremental)
+    {
+      export_state_file = get_export_state_file (repofile, full_branch);
+      if (parent != NULL)
+        old_export_state = load_export_state (export_state_file);
+      new_export_state = g_variant_builder_new (G_VARIANT_TYPE (EXPORT_STATE_VARIANT_FORMAT));
+
+      export_state.old_entries = old_export_state;
+      export_state.new_entries = new_export_state;
+      export_state.commit_data = &commit_data;
+    }
+
   if (!ostree_repo_prepare_transaction (repo, NULL, cancellable, error))
     goto out;
 
@@ -960,7 +1378,7 @@ flatpak_builtin_build_export (int argc, char **argv, GCancellable *cancellable,
     {
       commit_data.exclude = (const char **) opt_exclude;
       commit_data.include = (const char **) opt_include;
-      if (!ostree_repo_write_directory_to_mtree (repo, files, files_mtree, modifier, cancellable, error))
+      if (!export_directory_to_mtree (repo, files, files_mtree, modifier, &export_state, cancellable, error))
         goto out;
       commit_data.exclude = NULL;
       commit_data.include = NULL;
@@ -969,7 +1387,7 @@ flatpak_builtin_build_export (int argc, char **argv, GCancellable *cancellable,
     {
       commit_data.exclude = (const char **) opt_exclude;
       commit_data.include = (const char **) opt_include;
-      if (!ostree_repo_write_directory_to_mtree (repo, usr, files_mtree, modifier, cancellable, error))
+      if (!export_directory_to_mtree (repo, usr, files_mtree, modifier, &export_state, cancellable, error))
         goto out;
       commit_data.exclude = NULL;
       commit_data.include = NULL;
@@ -978,7 +1396,7 @@ flatpak_builtin_build_export (int argc, char **argv, GCancellable *cancellable,
     {
       commit_data.exclude = (const char **) opt_exclude;
       commit_data.include = (const char **) opt_include;
-      if (!ostree_repo_write_directory_to_mtree (repo, files, files_mtree, modifier, cancellable, error))
+      if (!export_directory_to_mtree (repo, files, files_mtree, modifier, &export_state, cancellable, error))
         goto out;
       commit_data.exclude = NULL;
       commit_data.include = NULL;
@@ -986,6 +1404,8 @@ flatpak_builtin_build_export (int argc, char **argv, GCancellable *cancellable,
       if (!ostree_mutable_tree_ensure_dir (mtree, "export", &export_mtree, error))
         goto out;
 
+      /* The export dir is only a handful of files, not worth tracking
+         incrementally */
       if (!ostree_repo_write_directory_to_mtree (repo, export, export_mtree, modifier, cancellable, error))
         goto out;
     }
@@ -996,39 +1416,6 @@ flatpak_builtin_build_export (int argc, char **argv, GCancellable *cancellable,
   if (!ostree_repo_write_mtree (repo, mtree, &root, cancellable, error))
     goto out;
 
-  if (!flatpak_repo_collect_sizes (repo, root, &installed_size, &download_size, cancellable, error))
-    goto out;
-
-  /* Binding information. xa.ref is deprecated in favour of the OSTree keys, but
-   * keep it around for backwards compatibility. */
-  g_variant_dict_insert_value (&metadata_dict, "ostree.collection-binding",
-                               g_variant_new_string ((collection_id != NULL) ? collection_id : ""));
-  g_variant_dict_insert_value (&metadata_dict, "ostree.ref-binding",
-                               g_variant_new_strv ((const gchar * const *) &full_branch, 1));
-  g_variant_dict_insert_value (&metadata_dict, "xa.ref", g_variant_new_string (full_branch));
-
-  g_variant_dict_insert_value (&metadata_dict, "xa.metadata", g_variant_new_string (metadata_contents));
-  g_variant_dict_insert_value (&metadata_dict, "xa.installed-size", g_variant_new_uint64 (GUINT64_TO_BE (installed_size)));
-  g_variant_dict_insert_value (&metadata_dict, "xa.download-size", g_variant_new_uint64 (GUINT64_TO_BE (download_size)));
-
-  if (opt_endoflife && *opt_endoflife)
-    g_variant_dict_insert_value (&metadata_dict, OSTREE_COMMIT_META_KEY_ENDOFLIFE,
-                                 g_variant_new_string (opt_endoflife));
-
-  if (opt_endoflife_rebase && *opt_endoflife_rebase)
-    {
-      g_auto(GStrv) full_ref_parts = g_strsplit (full_branch, "/", 0);
-      g_autofree char *rebased_ref = g_build_filename (full_ref_parts[0], opt_endoflife_rebase, full_ref_parts[2], full_ref_parts[3], NULL);
-
-      if (!flatpak_is_valid_name (opt_endoflife_rebase, error))
-        return glnx_prefix_error (error, "Invalid name in --end-of-life-rebase");
-
-      g_variant_dict_insert_value (&metadata_dict, OSTREE_COMMIT_META_KEY_ENDOFLIFE_REBASE,
-                                   g_variant_new_string (rebased_ref));
-    }
-
-  metadata_dict_v = g_variant_ref_sink (g_variant_dict_end (&metadata_dict));
-
   /* The timestamp is used for the commit metadata and AppStream data */
   if (opt_timestamp != NULL)
     {
@@ -1036,54 +1423,124 @@ flatpak_builtin_build_export (int argc, char **argv, GCancellable *cancellable,
         return flatpak_fail (error, _("Could not parse '%s'"), opt_timestamp);
     }
 
-  if (opt_timestamp == NULL)
+  /* If the tree is unchanged from the parent commit a new commit would
+     differ only in timestamp, yet mirrors and delta generation
+     downstream would treat it as a new publish. Leave the ref where it
+     is instead, unless new end-of-life metadata was requested. */
+  if (parent != NULL &&
+      !(opt_endoflife && *opt_endoflife) &&
+      !(opt_endoflife_rebase && *opt_endoflife_rebase))
     {
-      if (!ostree_repo_write_commit (repo, parent, subject, body, metadata_dict_v,
-                                     OSTREE_REPO_FILE (root),
-                                     &commit_checksum, cancellable, error))
+      g_autoptr(GFile) parent_root = NULL;
+
+      if (!ostree_repo_read_commit (repo, parent, &parent_root, NULL, cancellable, error))
         goto out;
+
+      if (g_file_equal (root, parent_root))
+        {
+          g_debug ("Contents unchanged from %s, not creating a new commit", parent);
+          skip_commit = TRUE;
+          commit_checksum = g_strdup (parent);
+        }
     }
-  else
+
+  if (!skip_commit)
     {
-      if (!ostree_repo_write_commit_with_time (repo, parent, subject, body,
-                                               metadata_dict_v,
-                                               OSTREE_REPO_FILE (root),
-                                               ts.tv_sec, &commit_checksum,
-                                               cancellable, error))
+      if (!flatpak_repo_collect_sizes (repo, root, &installed_size, &download_size, cancellable, error))
         goto out;
-    }
 
-  if (opt_gpg_key_ids)
-    {
-      char **iter;
+      /* Binding information. xa.ref is deprecated in favour of the OSTree keys, but
+       * keep it around for backwards compatibility. */
+      g_variant_dict_insert_value (&metadata_dict, "ostree.collection-binding",
+                                   g_variant_new_string ((collection_id != NULL) ? collection_id : ""));
+      g_variant_dict_insert_value (&metadata_dict, "ostree.ref-binding",
+                                   g_variant_new_strv ((const gchar * const *) &full_branch, 1));
+      g_variant_dict_insert_value (&metadata_dict, "xa.ref", g_variant_new_string (full_branch));
+
+      g_variant_dict_insert_value (&metadata_dict, "xa.metadata", g_variant_new_string (metadata_contents));
+      g_variant_dict_insert_value (&metadata_dict, "xa.installed-size", g_variant_new_uint64 (GUINT64_TO_BE (installed_size)));
+      g_variant_dict_insert_value (&metadata_dict, "xa.download-size", g_variant_new_uint64 (GUINT64_TO_BE (download_size)));
+
+      if (opt_endoflife && *opt_endoflife)
+        g_variant_dict_insert_value (&metadata_dict, OSTREE_COMMIT_META_KEY_ENDOFLIFE,
+                                     g_variant_new_string (opt_endoflife));
+
+      if (opt_endoflife_rebase && *opt_endoflife_rebase)
+        {
+          g_auto(GStrv) full_ref_parts = g_strsplit (full_branch, "/", 0);
+          g_autofree char *rebased_ref = g_build_filename (full_ref_parts[0], opt_endoflife_rebase, full_ref_parts[2], full_ref_parts[3], NULL);
 
-      for (iter = opt_gpg_key_ids; iter && *iter; iter++)
+          if (!flatpak_is_valid_name (opt_endoflife_rebase, error))
+            return glnx_prefix_error (error, "Invalid name in --end-of-life-rebase");
+
+          g_variant_dict_insert_value (&metadata_dict, OSTREE_COMMIT_META_KEY_ENDOFLIFE_REBASE,
+                                       g_variant_new_string (rebased_ref));
+        }
+
+      metadata_dict_v = g_variant_ref_sink (g_variant_dict_end (&metadata_dict));
+
+      if (opt_timestamp == NULL)
         {
-          const char *keyid = *iter;
-
-          if (!ostree_repo_sign_commit (repo,
-                                        commit_checksum,
-                                        keyid,
-                                        opt_gpg_homedir,
-                                        cancellable,
-                                        error))
+          if (!ostree_repo_write_commit (repo, parent, subject, body, metadata_dict_v,
+                                         OSTREE_REPO_FILE (root),
+                                         &commit_checksum, cancellable, error))
+            goto out;
+        }
+      else
+        {
+          if (!ostree_repo_write_commit_with_time (repo, parent, subject, body,
+                                                   metadata_dict_v,
+                                                   OSTREE_REPO_FILE (root),
+                                                   ts.tv_sec, &commit_checksum,
+                                                   cancellable, error))
             goto out;
         }
-    }
 
-  if (collection_id != NULL)
-    {
-      OstreeCollectionRef ref = { (char *) collection_id, full_branch };
-      ostree_repo_transaction_set_collection_ref (repo, &ref, commit_checksum);
-    }
-  else
-    {
-      ostree_repo_transaction_set_ref (repo, NULL, full_branch, commit_checksum);
+      if (opt_gpg_key_ids)
+        {
+          char **iter;
+
+          for (iter = opt_gpg_key_ids; iter && *iter; iter++)
+            {
+              const char *keyid = *iter;
+
+              if (!ostree_repo_sign_commit (repo,
+                                            commit_checksum,
+                                            keyid,
+                                            opt_gpg_homedir,
+                                            cancellable,
+                                            error))
+                goto out;
+            }
+        }
+
+      if (collection_id != NULL)
+        {
+          OstreeCollectionRef ref = { (char *) collection_id, full_branch };
+          ostree_repo_transaction_set_collection_ref (repo, &ref, commit_checksum);
+        }
+      else
+        {
+          ostree_repo_transaction_set_ref (repo, NULL, full_branch, commit_checksum);
+        }
     }
 
   if (!ostree_repo_commit_transaction (repo, &stats, cancellable, error))
     goto out;
 
+  /* Save the refreshed state even if the commit was skipped, as the
+     stat data may have changed without the content doing so */
+  if (opt_incremental)
+    {
+      g_autoptr(GVariant) new_state_v =
+        g_variant_ref_sink (g_variant_builder_end (new_export_state));
+
+      if (!save_export_state (export_state_file, new_state_v, cancellable, error))
+        goto out;
+
+      g_debug ("Incremental export: reused %u unchanged files", export_state.n_reused);
+    }
+
   if (opt_update_appstream &&
       !flatpak_repo_generate_appstream (repo, (const char **) opt_gpg_key_ids, opt_gpg_homedir,
                                         (opt_timestamp != NULL) ? ts.tv_sec : 0, cancellable, error))
@@ -70,7 +70,11 @@ import_oci (OstreeRepo *repo, GFile *file,
   if (registry == NULL)
     return NULL;
 
-  index = flatpak_oci_registry_load_index (registry, cancellable, error);
+  if (opt_ref)
+    /* We only need the one manifest, so don't parse the whole index */
+    index = flatpak_oci_registry_load_index_for_ref (registry, opt_ref, cancellable, error);
+  else
+    index = flatpak_oci_registry_load_index (registry, cancellable, error);
   if (index == NULL)
     return NULL;
 
@@ -289,6 +289,68 @@ spawn_delta_generation (GMainContext *context,
   return TRUE;
 }
 
+typedef struct
+{
+  char   *ref;
+  char   *from;
+  char   *to;
+  guint64 size;
+} DeltaTask;
+
+static void
+delta_task_free (DeltaTask *task)
+{
+  g_free (task->ref);
+  g_free (task->from);
+  g_free (task->to);
+  g_free (task);
+}
+
+/* Estimate of how expensive a delta is to generate, so that the
+   biggest ones can be scheduled first. Flatpak commits record their
+   download size in the commit metadata; for other commits (such as
+   appstream2, which deltas quickly anyway) we just return 0. */
+static guint64
+get_delta_cost (GVariant *commit_variant)
+{
+  g_autoptr(GVariant) metadata = g_variant_get_child_value (commit_variant, 0);
+  guint64 download_size;
+
+  if (g_variant_lookup (metadata, "xa.download-size", "t", &download_size))
+    return GUINT64_FROM_BE (download_size);
+
+  return 0;
+}
+
+static gint
+compare_delta_tasks (gconstpointer a, gconstpointer b)
+{
+  const DeltaTask *task_a = *(DeltaTask **) a;
+  const DeltaTask *task_b = *(DeltaTask **) b;
+
+  if (task_a->size != task_b->size)
+    return task_a->size > task_b->size ? -1 : 1;
+
+  return g_strcmp0 (task_a->ref, task_b->ref);
+}
+
+static void
+queue_delta_task (GPtrArray  *delta_tasks,
+                  GVariant   *commit_variant,
+                  const char *ref,
+                  const char *from,
+                  const char *to)
+{
+  DeltaTask *task = g_new0 (DeltaTask, 1);
+
+  task->ref = g_strdup (ref);
+  task->from = g_strdup (from);
+  task->to = g_strdup (to);
+  task->size = get_delta_cost (commit_variant);
+
+  g_ptr_array_add (delta_tasks, task);
+}
+
 static gboolean
 generate_all_deltas (OstreeRepo   *repo,
                      GPtrArray   **unwanted_deltas,
@@ -307,6 +369,7 @@ generate_all_deltas (OstreeRepo   *repo,
   int n_spawned_delta_generate = 0;
   g_autoptr(GMainContextPopDefault) context = NULL;
   g_autoptr(GPtrArray) ignore_patterns = g_ptr_array_new_with_free_func ((GDestroyNotify)g_pattern_spec_free);
+  g_autoptr(GPtrArray) delta_tasks = g_ptr_array_new_with_free_func ((GDestroyNotify)delta_task_free);
 
   g_print ("Generating static deltas\n");
 
@@ -398,12 +461,7 @@ generate_all_deltas (OstreeRepo   *repo,
 
       /* From empty */
       if (!g_hash_table_contains (all_deltas_hash, commit))
-        {
-          if (!spawn_delta_generation (context, &n_spawned_delta_generate, repo, params,
-                                       ref, NULL, commit,
-                                       error))
-            return FALSE;
-        }
+        queue_delta_task (delta_tasks, variant, ref, NULL, commit);
 
       /* Mark this one as wanted */
       g_hash_table_insert (wanted_deltas_hash, g_strdup (commit), GINT_TO_POINTER (1));
@@ -424,12 +482,7 @@ generate_all_deltas (OstreeRepo   *repo,
           g_autofree char *from_parent = g_strdup_printf ("%s-%s", parent_commit, commit);
 
           if (!g_hash_table_contains (all_deltas_hash, from_parent))
-            {
-              if (!spawn_delta_generation (context, &n_spawned_delta_generate, repo, params,
-                                           ref, parent_commit, commit,
-                                           error))
-                return FALSE;
-            }
+            queue_delta_task (delta_tasks, variant, ref, parent_commit, commit);
 
           /* Mark parent-to-current as wanted */
           g_hash_table_insert (wanted_deltas_hash, g_strdup (from_parent), GINT_TO_POINTER (1));
@@ -449,6 +502,20 @@ generate_all_deltas (OstreeRepo   *repo,
         }
     }
 
+  /* Schedule the biggest deltas first, so the job pool doesn't spend
+     the end of the run waiting on a single large straggler */
+  g_ptr_array_sort (delta_tasks, compare_delta_tasks);
+
+  for (i = 0; i < delta_tasks->len; i++)
+    {
+      DeltaTask *task = g_ptr_array_index (delta_tasks, i);
+
+      if (!spawn_delta_generation (context, &n_spawned_delta_generate, repo, params,
+                                   task->ref, task->from, task->to,
+                                   error))
+        return FALSE;
+    }
+
   while (n_spawned_delta_generate > 0)
     g_main_context_iteration (context, TRUE);
 
@@ -102,6 +102,30 @@ get_lang_default (FlatpakDir *dir)
   return g_strjoinv (";", langs);
 }
 
+static char *
+parse_checkout_threads (const char *value, GError **error)
+{
+  if (strcmp (value, "auto") != 0 && atoi (value) < 1)
+    {
+      flatpak_fail (error, _("'%s' is not a valid thread count (positive number or 'auto')"), value);
+      return NULL;
+    }
+
+  return g_strdup (value);
+}
+
+static char *
+print_verbatim (const char *value)
+{
+  return g_strdup (value);
+}
+
+static char *
+get_checkout_threads_default (FlatpakDir *dir)
+{
+  return g_strdup ("1");
+}
+
 typedef struct
 {
   const char *name;
@@ -112,6 +136,7 @@ typedef struct
 
 ConfigKey keys[] = {
   { "languages", parse_lang, print_lang, get_lang_default },
+  { "checkout-threads", parse_checkout_threads, print_verbatim, get_checkout_threads_default },
 };
 
 static ConfigKey *
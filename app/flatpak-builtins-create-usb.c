@@ -250,6 +250,55 @@ add_runtime (GHashTable   *all_refs,
   return TRUE;
 }
 
+/* Pull @collection_refs (an a(sss) variant) from @src_repo_uri into
+ * @dest_repo, inside the caller's repo transaction. */
+static gboolean
+copy_collection_refs (OstreeRepo   *dest_repo,
+                      const char   *src_repo_uri,
+                      GVariant     *collection_refs,
+                      const char  **subpaths,
+                      GCancellable *cancellable,
+                      GError      **error)
+{
+  GVariantBuilder builder;
+  g_autoptr(GVariant) opts = NULL;
+  g_autoptr(OstreeAsyncProgress) progress = NULL;
+  g_auto(GLnxConsoleRef) console = { 0, };
+  OstreeRepoPullFlags flags = OSTREE_REPO_PULL_FLAGS_MIRROR;
+
+  glnx_console_lock (&console);
+
+  if (console.is_tty)
+    progress = ostree_async_progress_new_and_connect (ostree_repo_pull_default_console_progress_changed, &console);
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+  g_variant_builder_add (&builder, "{s@v}", "collection-refs",
+                         g_variant_new_variant (collection_refs));
+  if (subpaths != NULL)
+    {
+      g_variant_builder_add (&builder, "{s@v}", "subdirs",
+                             g_variant_new_variant (g_variant_new_strv (subpaths, -1)));
+    }
+  g_variant_builder_add (&builder, "{s@v}", "flags",
+                         g_variant_new_variant (g_variant_new_int32 (flags)));
+  g_variant_builder_add (&builder, "{s@v}", "depth",
+                         g_variant_new_variant (g_variant_new_int32 (0)));
+  g_variant_builder_add (&builder, "{s@v}", "inherit-transaction",
+                         g_variant_new_variant (g_variant_new_boolean (TRUE)));
+  opts = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  if (!ostree_repo_pull_with_options (dest_repo, src_repo_uri,
+                                      opts,
+                                      progress,
+                                      cancellable, error))
+    return FALSE;
+
+  if (progress != NULL)
+    ostree_async_progress_finish (progress);
+
+  return TRUE;
+}
+
 /* Copied from src/ostree/ot-builtin-create-usb.c in ostree.git, with slight modifications */
 static gboolean
 ostree_create_usb (GOptionContext *context,
@@ -261,8 +310,6 @@ ostree_create_usb (GOptionContext *context,
                    GCancellable   *cancellable,
                    GError        **error)
 {
-  g_autoptr(OstreeAsyncProgress) progress = NULL;
-  g_auto(GLnxConsoleRef) console = { 0, };
   guint num_refs = 0;
 
   /* Open the destination repository on the USB stick or create it if it doesn’t exist.
@@ -300,59 +347,69 @@ ostree_create_usb (GOptionContext *context,
   if (!ostree_repo_is_writable (dest_repo, error))
     return glnx_prefix_error (error, "Cannot write to repository");
 
-  /* Copy across all of the collection–refs to the destination repo. We have to
-   * do it one ref at a time in order to get the subpaths right. */
+  /* Copy across all of the collection–refs to the destination repo. Refs with
+   * subpaths have to be pulled one at a time in order to get the subpaths
+   * right, but the rest can go into a single pull, which dedups objects shared
+   * between refs up front. All the pulls happen inside one destination repo
+   * transaction, so the new objects are moved into place and synced to disk
+   * once at the end instead of per ref, which matters a lot on slow flash
+   * media. */
+
+  g_autofree char *src_repo_uri = g_file_get_uri (ostree_repo_get_path (src_repo));
+  g_autoptr(FlatpakRepoTransaction) transaction = NULL;
+  GVariantBuilder full_refs_builder;
+  guint num_full_refs = 0;
+
+  transaction = flatpak_repo_transaction_start (dest_repo, cancellable, error);
+  if (transaction == NULL)
+    return FALSE;
+
+  g_variant_builder_init (&full_refs_builder, G_VARIANT_TYPE ("a(sss)"));
 
   GLNX_HASH_TABLE_FOREACH_KV (all_refs, OstreeCollectionRef *, c_r, CommitAndSubpaths *, c_s)
   {
-    GVariantBuilder builder;
-    g_autoptr(GVariant) opts = NULL;
-    OstreeRepoPullFlags flags = OSTREE_REPO_PULL_FLAGS_MIRROR;
-    GVariantBuilder refs_builder;
-
     num_refs++;
 
-    g_variant_builder_init (&refs_builder, G_VARIANT_TYPE ("a(sss)"));
-    g_variant_builder_add (&refs_builder, "(sss)",
-                           c_r->collection_id, c_r->ref_name,
-                           c_s->commit ? c_s->commit : "");
-
-    glnx_console_lock (&console);
+    if (c_s->subpaths == NULL)
+      {
+        num_full_refs++;
+        g_variant_builder_add (&full_refs_builder, "(sss)",
+                               c_r->collection_id, c_r->ref_name,
+                               c_s->commit ? c_s->commit : "");
+        continue;
+      }
 
-    if (console.is_tty)
-      progress = ostree_async_progress_new_and_connect (ostree_repo_pull_default_console_progress_changed, &console);
+    {
+      GVariantBuilder refs_builder;
 
-    g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+      g_variant_builder_init (&refs_builder, G_VARIANT_TYPE ("a(sss)"));
+      g_variant_builder_add (&refs_builder, "(sss)",
+                             c_r->collection_id, c_r->ref_name,
+                             c_s->commit ? c_s->commit : "");
 
-    g_variant_builder_add (&builder, "{s@v}", "collection-refs",
-                           g_variant_new_variant (g_variant_builder_end (&refs_builder)));
-    if (c_s->subpaths != NULL)
-      {
-        g_variant_builder_add (&builder, "{s@v}", "subdirs",
-                               g_variant_new_variant (g_variant_new_strv ((const char * const *) c_s->subpaths, -1)));
-      }
-    g_variant_builder_add (&builder, "{s@v}", "flags",
-                           g_variant_new_variant (g_variant_new_int32 (flags)));
-    g_variant_builder_add (&builder, "{s@v}", "depth",
-                           g_variant_new_variant (g_variant_new_int32 (0)));
-    opts = g_variant_ref_sink (g_variant_builder_end (&builder));
-
-    g_autofree char *src_repo_uri = g_file_get_uri (ostree_repo_get_path (src_repo));
-
-    if (!ostree_repo_pull_with_options (dest_repo, src_repo_uri,
-                                        opts,
-                                        progress,
-                                        cancellable, error))
-      {
-        ostree_repo_abort_transaction (dest_repo, cancellable, NULL);
+      if (!copy_collection_refs (dest_repo, src_repo_uri,
+                                 g_variant_builder_end (&refs_builder),
+                                 (const char **) c_s->subpaths,
+                                 cancellable, error))
         return FALSE;
-      }
+    }
+  }
 
-    if (progress != NULL)
-      ostree_async_progress_finish (progress);
+  if (num_full_refs > 0)
+    {
+      if (!copy_collection_refs (dest_repo, src_repo_uri,
+                                 g_variant_builder_end (&full_refs_builder),
+                                 NULL,
+                                 cancellable, error))
+        return FALSE;
+    }
+  else
+    {
+      g_variant_builder_clear (&full_refs_builder);
+    }
 
-    glnx_console_unlock (&console);
-  }
+  if (!ostree_repo_commit_transaction (dest_repo, NULL, cancellable, error))
+    return FALSE;
 
   /* Ensure a summary file is present to make it easier to look up commit checksums. */
   /* FIXME: It should be possible to work without this, but find_remotes_cb() in
@@ -66,6 +66,10 @@ static GOptionEntry options[] = {
   { NULL }
 };
 
+/* Flags shared by the AddFull and AddNamedFull portal calls */
+#define DOCUMENT_ADD_FLAGS_REUSE_EXISTING (1 << 0)
+#define DOCUMENT_ADD_FLAGS_PERSISTENT (1 << 1)
+
 gboolean
 flatpak_builtin_document_export (int argc, char **argv,
                                  GCancellable *cancellable,
@@ -73,21 +77,23 @@ flatpak_builtin_document_export (int argc, char **argv,
 {
   g_autoptr(GOptionContext) context = NULL;
   g_autoptr(GVariant) reply = NULL;
+  g_autoptr(GVariant) extra = NULL;
   g_autoptr(GDBusConnection) session_bus = NULL;
   g_autoptr(GPtrArray) permissions = NULL;
   g_autoptr(GPtrArray) revocations = NULL;
-  const char *file;
+  g_autoptr(GUnixFDList) fd_list = NULL;
+  g_autofree const char **doc_ids = NULL;
   g_autofree char *mountpoint = NULL;
-  g_autofree char *basename = NULL;
-  g_autofree char *dirname = NULL;
-  g_autofree char *doc_path = NULL;
+  char **files;
+  int n_files;
   XdpDbusDocuments *documents;
+  const char *first_app = "";
+  gboolean have_revocations;
+  guint flags = 0;
   int fd, fd_id;
-  int i;
-  GUnixFDList *fd_list = NULL;
-  const char *doc_id;
+  int i, j;
 
-  context = g_option_context_new (_("FILE - Export a file to apps"));
+  context = g_option_context_new (_("FILE… - Export files to apps"));
   g_option_context_set_translation_domain (context, GETTEXT_PACKAGE);
 
   if (!flatpak_option_context_parse (context, options, &argc, &argv,
@@ -98,12 +104,11 @@ flatpak_builtin_document_export (int argc, char **argv,
   if (argc < 2)
     return usage_error (context, _("FILE must be specified"), error);
 
-  if (argc > 2)
-    return usage_error (context, _("Too many arguments"), error);
+  if (opt_noexist && argc > 2)
+    return usage_error (context, _("Only one FILE can be specified with --noexist"), error);
 
-  file = argv[1];
-  dirname = g_path_get_dirname (file);
-  basename = g_path_get_basename (file);
+  files = argv + 1;
+  n_files = argc - 1;
 
   session_bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, error);
   if (session_bus == NULL)
@@ -116,106 +121,163 @@ flatpak_builtin_document_export (int argc, char **argv,
   if (documents == NULL)
     return FALSE;
 
-  if (!xdp_dbus_documents_call_get_mount_point_sync (documents, &mountpoint,
-                                                     NULL, error))
-    return FALSE;
+  permissions = g_ptr_array_new ();
+  if (opt_allow_read)
+    g_ptr_array_add (permissions, "read");
+  if (opt_allow_write)
+    g_ptr_array_add (permissions, "write");
+  if (opt_allow_delete)
+    g_ptr_array_add (permissions, "delete");
+  if (opt_allow_grant_permissions)
+    g_ptr_array_add (permissions, "grant-permissions");
+  g_ptr_array_add (permissions, NULL);
 
-  if (opt_noexist)
-    fd = open (dirname, O_PATH | O_CLOEXEC);
-  else
-    fd = open (file, O_PATH | O_CLOEXEC);
+  revocations = g_ptr_array_new ();
+  if (opt_forbid_read)
+    g_ptr_array_add (revocations, "read");
+  if (opt_forbid_write)
+    g_ptr_array_add (revocations, "write");
+  if (opt_forbid_delete)
+    g_ptr_array_add (revocations, "delete");
+  if (opt_forbid_grant_permissions)
+    g_ptr_array_add (revocations, "grant-permissions");
+  g_ptr_array_add (revocations, NULL);
 
-  if (fd == -1)
-    {
-      glnx_set_error_from_errno (error);
-      return FALSE;
-    }
+  have_revocations = opt_forbid_read || opt_forbid_write ||
+                     opt_forbid_delete || opt_forbid_grant_permissions;
+
+  if (opt_apps != NULL && opt_apps[0] != NULL)
+    first_app = opt_apps[0];
 
+  if (!opt_unique)
+    flags |= DOCUMENT_ADD_FLAGS_REUSE_EXISTING;
+  if (!opt_transient)
+    flags |= DOCUMENT_ADD_FLAGS_PERSISTENT;
+
+  /* All files are exported in a single AddFull/AddNamedFull call, which
+   * also grants the first app its permissions and returns the fuse
+   * mountpoint, so exporting N files is one round trip rather than
+   * 2 + N of them */
   fd_list = g_unix_fd_list_new ();
-  fd_id = g_unix_fd_list_append (fd_list, fd, error);
-  close (fd);
 
   if (opt_noexist)
     {
+      g_autofree char *dirname = g_path_get_dirname (files[0]);
+      g_autofree char *basename = g_path_get_basename (files[0]);
+
+      fd = open (dirname, O_PATH | O_CLOEXEC);
+      if (fd == -1)
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+
+      fd_id = g_unix_fd_list_append (fd_list, fd, error);
+      close (fd);
+      if (fd_id == -1)
+        return FALSE;
+
       reply = g_dbus_connection_call_with_unix_fd_list_sync (session_bus,
                                                              "org.freedesktop.portal.Documents",
                                                              "/org/freedesktop/portal/documents",
                                                              "org.freedesktop.portal.Documents",
-                                                             "AddNamed",
-                                                             g_variant_new ("(h^aybb)", fd_id, basename, !opt_unique, !opt_transient),
-                                                             G_VARIANT_TYPE ("(s)"),
+                                                             "AddNamedFull",
+                                                             g_variant_new ("(h^ayus^as)", fd_id, basename,
+                                                                            flags, first_app,
+                                                                            (const char **) permissions->pdata),
+                                                             G_VARIANT_TYPE ("(sa{sv})"),
                                                              G_DBUS_CALL_FLAGS_NONE,
                                                              30000,
                                                              fd_list, NULL,
                                                              NULL,
                                                              error);
+      if (reply == NULL)
+        return FALSE;
+
+      doc_ids = g_new0 (const char *, 2);
+      g_variant_get (reply, "(&s@a{sv})", &doc_ids[0], &extra);
     }
   else
     {
+      GVariantBuilder fd_builder;
+
+      g_variant_builder_init (&fd_builder, G_VARIANT_TYPE ("ah"));
+      for (i = 0; i < n_files; i++)
+        {
+          fd = open (files[i], O_PATH | O_CLOEXEC);
+          if (fd == -1)
+            {
+              glnx_set_error_from_errno (error);
+              return FALSE;
+            }
+
+          fd_id = g_unix_fd_list_append (fd_list, fd, error);
+          close (fd);
+          if (fd_id == -1)
+            return FALSE;
+
+          g_variant_builder_add (&fd_builder, "h", fd_id);
+        }
+
       reply = g_dbus_connection_call_with_unix_fd_list_sync (session_bus,
                                                              "org.freedesktop.portal.Documents",
                                                              "/org/freedesktop/portal/documents",
                                                              "org.freedesktop.portal.Documents",
-                                                             "Add",
-                                                             g_variant_new ("(hbb)", fd_id, !opt_unique, !opt_transient),
-                                                             G_VARIANT_TYPE ("(s)"),
+                                                             "AddFull",
+                                                             g_variant_new ("(@ahus^as)",
+                                                                            g_variant_builder_end (&fd_builder),
+                                                                            flags, first_app,
+                                                                            (const char **) permissions->pdata),
+                                                             G_VARIANT_TYPE ("(asa{sv})"),
                                                              G_DBUS_CALL_FLAGS_NONE,
                                                              30000,
                                                              fd_list, NULL,
                                                              NULL,
                                                              error);
+      if (reply == NULL)
+        return FALSE;
+
+      g_variant_get (reply, "(^a&s@a{sv})", &doc_ids, &extra);
     }
-  g_object_unref (fd_list);
 
-  if (reply == NULL)
+  if (!g_variant_lookup (extra, "mountpoint", "^ay", &mountpoint) &&
+      !xdp_dbus_documents_call_get_mount_point_sync (documents, &mountpoint,
+                                                     NULL, error))
     return FALSE;
 
-  g_variant_get (reply, "(&s)", &doc_id);
-
-  permissions = g_ptr_array_new ();
-  if (opt_allow_read)
-    g_ptr_array_add (permissions, "read");
-  if (opt_allow_write)
-    g_ptr_array_add (permissions, "write");
-  if (opt_allow_delete)
-    g_ptr_array_add (permissions, "delete");
-  if (opt_allow_grant_permissions)
-    g_ptr_array_add (permissions, "grant-permissions");
-  g_ptr_array_add (permissions, NULL);
-
-  revocations = g_ptr_array_new ();
-  if (opt_forbid_read)
-    g_ptr_array_add (revocations, "read");
-  if (opt_forbid_write)
-    g_ptr_array_add (revocations, "write");
-  if (opt_forbid_delete)
-    g_ptr_array_add (revocations, "delete");
-  if (opt_forbid_grant_permissions)
-    g_ptr_array_add (revocations, "grant-permissions");
-  g_ptr_array_add (revocations, NULL);
+  for (j = 0; opt_apps != NULL && opt_apps[j] != NULL; j++)
+    {
+      for (i = 0; doc_ids[i] != NULL; i++)
+        {
+          /* The first app already got its permissions in the add call */
+          if (j > 0 &&
+              !xdp_dbus_documents_call_grant_permissions_sync (documents,
+                                                               doc_ids[i],
+                                                               opt_apps[j],
+                                                               (const char **) permissions->pdata,
+                                                               NULL,
+                                                               error))
+            return FALSE;
+
+          if (have_revocations &&
+              !xdp_dbus_documents_call_revoke_permissions_sync (documents,
+                                                                doc_ids[i],
+                                                                opt_apps[j],
+                                                                (const char **) revocations->pdata,
+                                                                NULL,
+                                                                error))
+            return FALSE;
+        }
+    }
 
-  for (i = 0; opt_apps != NULL && opt_apps[i] != NULL; i++)
+  for (i = 0; doc_ids[i] != NULL; i++)
     {
-      if (!xdp_dbus_documents_call_grant_permissions_sync (documents,
-                                                           doc_id,
-                                                           opt_apps[i],
-                                                           (const char **) permissions->pdata,
-                                                           NULL,
-                                                           error))
-        return FALSE;
+      g_autofree char *basename = g_path_get_basename (files[i]);
+      g_autofree char *doc_path = g_build_filename (mountpoint, doc_ids[i], basename, NULL);
 
-      if (!xdp_dbus_documents_call_revoke_permissions_sync (documents,
-                                                            doc_id,
-                                                            opt_apps[i],
-                                                            (const char **) revocations->pdata,
-                                                            NULL,
-                                                            error))
-        return FALSE;
+      g_print ("%s\n", doc_path);
     }
 
-  doc_path = g_build_filename (mountpoint, doc_id, basename, NULL);
-  g_print ("%s\n", doc_path);
-
   return TRUE;
 }
 
@@ -239,6 +301,10 @@ flatpak_complete_document_export (FlatpakCompletion *completion)
 
       flatpak_complete_file (completion, "__FLATPAK_FILE");
       break;
+
+    default: /* FILE */
+      flatpak_complete_file (completion, "__FLATPAK_FILE");
+      break;
     }
 
   return TRUE;
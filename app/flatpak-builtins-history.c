@@ -126,6 +126,8 @@ print_history (GPtrArray    *dirs,
 {
   FlatpakTablePrinter *printer;
   sd_journal *j;
+  guint64 since_usec = since ? (guint64) g_date_time_to_unix (since) * G_USEC_PER_SEC : 0;
+  guint64 until_usec = until ? (guint64) g_date_time_to_unix (until) * G_USEC_PER_SEC : 0;
   int r;
   int i;
   int k;
@@ -152,7 +154,17 @@ print_history (GPtrArray    *dirs,
       return FALSE;
     }
 
-  if (reverse)
+  /* The journal is indexed by timestamp, so instead of scanning it
+     from one end we can seek directly to the near edge of the
+     requested window and stop at the far edge, making the query cost
+     proportional to the window rather than the whole journal. The
+     index uses the receive timestamp while the --since/--until checks
+     below use the source timestamp, so the per-entry filters are kept. */
+  if (!reverse && since)
+    ret = sd_journal_seek_realtime_usec (j, since_usec);
+  else if (reverse && until)
+    ret = sd_journal_seek_realtime_usec (j, until_usec);
+  else if (reverse)
     ret = sd_journal_seek_tail (j);
   else
     ret = sd_journal_seek_head (j);
@@ -160,6 +172,17 @@ print_history (GPtrArray    *dirs,
     while ((reverse && sd_journal_previous (j) > 0) ||
            (!reverse && sd_journal_next (j) > 0))
       {
+        /* Stop once we're past the far edge of the window */
+        if ((!reverse && until) || (reverse && since))
+          {
+            guint64 rt;
+
+            if (sd_journal_get_realtime_usec (j, &rt) == 0 &&
+                ((!reverse && rt > until_usec) ||
+                 (reverse && rt < since_usec)))
+              break;
+          }
+
         /* determine whether to skip this entry */
 
         if (dirs)
@@ -47,6 +47,7 @@ static gboolean opt_no_deploy;
 static gboolean opt_no_related;
 static gboolean opt_no_deps;
 static gboolean opt_no_static_deltas;
+static int opt_max_parallel_downloads;
 static gboolean opt_runtime;
 static gboolean opt_app;
 static gboolean opt_bundle;
@@ -62,6 +63,7 @@ static GOptionEntry options[] = {
   { "no-related", 0, 0, G_OPTION_ARG_NONE, &opt_no_related, N_("Don't install related refs"), NULL },
   { "no-deps", 0, 0, G_OPTION_ARG_NONE, &opt_no_deps, N_("Don't verify/install runtime dependencies"), NULL },
   { "no-static-deltas", 0, 0, G_OPTION_ARG_NONE, &opt_no_static_deltas, N_("Don't use static deltas"), NULL },
+  { "max-parallel-downloads", 0, 0, G_OPTION_ARG_INT, &opt_max_parallel_downloads, N_("Download up to N operations concurrently"), N_("N") },
   { "runtime", 0, 0, G_OPTION_ARG_NONE, &opt_runtime, N_("Look for runtime with the specified name"), NULL },
   { "app", 0, 0, G_OPTION_ARG_NONE, &opt_app, N_("Look for app with the specified name"), NULL },
   { "bundle", 0, 0, G_OPTION_ARG_NONE, &opt_bundle, N_("Assume LOCATION is a .flatpak single-file bundle"), NULL },
@@ -159,6 +161,8 @@ install_bundle (FlatpakDir *dir,
   flatpak_transaction_set_no_pull (transaction, opt_no_pull);
   flatpak_transaction_set_no_deploy (transaction, opt_no_deploy);
   flatpak_transaction_set_disable_static_deltas (transaction, opt_no_static_deltas);
+  if (opt_max_parallel_downloads > 0)
+    flatpak_transaction_set_max_parallel_downloads (transaction, opt_max_parallel_downloads);
   flatpak_transaction_set_disable_dependencies (transaction, opt_no_deps);
   flatpak_transaction_set_disable_related (transaction, opt_no_related);
   flatpak_transaction_set_reinstall (transaction, opt_reinstall);
@@ -232,6 +236,8 @@ install_from (FlatpakDir *dir,
   flatpak_transaction_set_no_pull (transaction, opt_no_pull);
   flatpak_transaction_set_no_deploy (transaction, opt_no_deploy);
   flatpak_transaction_set_disable_static_deltas (transaction, opt_no_static_deltas);
+  if (opt_max_parallel_downloads > 0)
+    flatpak_transaction_set_max_parallel_downloads (transaction, opt_max_parallel_downloads);
   flatpak_transaction_set_disable_dependencies (transaction, opt_no_deps);
   flatpak_transaction_set_disable_related (transaction, opt_no_related);
   flatpak_transaction_set_reinstall (transaction, opt_reinstall);
@@ -453,6 +459,8 @@ flatpak_builtin_install (int argc, char **argv, GCancellable *cancellable, GErro
   flatpak_transaction_set_no_pull (transaction, opt_no_pull);
   flatpak_transaction_set_no_deploy (transaction, opt_no_deploy);
   flatpak_transaction_set_disable_static_deltas (transaction, opt_no_static_deltas);
+  if (opt_max_parallel_downloads > 0)
+    flatpak_transaction_set_max_parallel_downloads (transaction, opt_max_parallel_downloads);
   flatpak_transaction_set_disable_dependencies (transaction, opt_no_deps);
   flatpak_transaction_set_disable_related (transaction, opt_no_related);
   flatpak_transaction_set_reinstall (transaction, opt_reinstall);
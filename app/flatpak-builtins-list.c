@@ -199,7 +199,6 @@ print_table_for_refs (gboolean      print_apps,
           char *ref, *partial_ref;
           g_auto(GStrv) parts = NULL;
           const char *repo = NULL;
-          g_autoptr(FlatpakDeploy) deploy = NULL;
           g_autoptr(GVariant) deploy_data = NULL;
           const char *active;
           const char *alt_id;
@@ -221,8 +220,10 @@ print_table_for_refs (gboolean      print_apps,
           if (arch != NULL && strcmp (arch, parts[2]) != 0)
             continue;
 
-          deploy = flatpak_dir_load_deployed (dir, ref, NULL, cancellable, NULL);
-          deploy_data = flatpak_deploy_get_deploy_data (deploy, FLATPAK_DEPLOY_VERSION_CURRENT, cancellable, NULL);
+          /* The deploy data carries all the columns we print, so don't
+           * do a full flatpak_dir_load_deployed() with its metadata and
+           * override keyfile parsing for each ref */
+          deploy_data = flatpak_dir_get_deploy_data (dir, ref, FLATPAK_DEPLOY_VERSION_CURRENT, cancellable, NULL);
           if (deploy_data == NULL)
             continue;
 
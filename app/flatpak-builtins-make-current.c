@@ -88,7 +88,7 @@ flatpak_builtin_make_current_app (int argc, char **argv, GCancellable *cancellab
   if (ref == NULL)
     return FALSE;
 
-  if (!flatpak_dir_lock (dir, &lock,
+  if (!flatpak_dir_lock (dir, &lock, LOCK_EX,
                          cancellable, error))
     return FALSE;
 
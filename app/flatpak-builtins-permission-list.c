@@ -52,74 +52,88 @@ get_ids_for_table (XdpDbusPermissionStore *store,
   return ids;
 }
 
-static gboolean
-list_table (XdpDbusPermissionStore *store,
-            const char             *table,
-            const char             *id,
-            FlatpakTablePrinter    *printer,
-            GError                **error)
+static void
+add_entry_rows (FlatpakTablePrinter *printer,
+                const char          *table,
+                const char          *id,
+                GVariant            *permissions,
+                GVariant            *data,
+                gboolean             show_empty)
 {
-  const char *one_id[2];
-  char **ids;
-  int i;
+  g_autoptr(GVariant) d = NULL;
+  g_autofree char *txt = NULL;
+  GVariantIter iter;
+  char *key;
+  GVariantIter *val;
 
-  if (id)
-    {
-      one_id[0] = id;
-      one_id[1] = NULL;
-      ids = (char **) one_id;
-    }
-  else
+  d = g_variant_get_child_value (data, 0);
+  txt = g_variant_print (d, FALSE);
+
+  if (g_variant_iter_init (&iter, permissions) == 0 && show_empty)
     {
-      if (!xdp_dbus_permission_store_call_list_sync (store, table, &ids, NULL, error))
-        return FALSE;
+      flatpak_table_printer_add_column (printer, table);
+      flatpak_table_printer_add_column (printer, id);
+      flatpak_table_printer_add_column (printer, "");
+      flatpak_table_printer_add_column (printer, "");
+      flatpak_table_printer_add_column (printer, txt);
+      flatpak_table_printer_finish_row (printer);
     }
 
-  for (i = 0; ids[i]; i++)
+  while (g_variant_iter_loop (&iter, "{sas}", &key, &val))
     {
-      g_autoptr(GVariant) permissions = NULL;
-      g_autoptr(GVariant) data = NULL;
-      g_autoptr(GVariant) d = NULL;
-      g_autofree char *txt = NULL;
-      GVariantIter iter;
-      char *key;
-      GVariantIter *val;
-
-      if (!xdp_dbus_permission_store_call_lookup_sync (store, table, ids[i], &permissions, &data, NULL, error))
-        return FALSE;
+      char *p;
 
-      d = g_variant_get_child_value (data, 0);
-      txt = g_variant_print (d, FALSE);
+      flatpak_table_printer_add_column (printer, table);
+      flatpak_table_printer_add_column (printer, id);
+      flatpak_table_printer_add_column (printer, key);
+      flatpak_table_printer_add_column (printer, "");
 
-      if (g_variant_iter_init (&iter, permissions) == 0 && id != 0)
+      while (g_variant_iter_loop (val, "s", &p))
         {
-          flatpak_table_printer_add_column (printer, table);
-          flatpak_table_printer_add_column (printer, ids[i]);
-          flatpak_table_printer_add_column (printer, "");
-          flatpak_table_printer_add_column (printer, "");
-          flatpak_table_printer_add_column (printer, txt);
-          flatpak_table_printer_finish_row (printer);
+          flatpak_table_printer_append_with_comma (printer, p);
         }
 
-      while (g_variant_iter_loop (&iter, "{sas}", &key, &val))
-        {
-          char *p;
+      flatpak_table_printer_add_column (printer, txt);
+      flatpak_table_printer_finish_row (printer);
+    }
+}
+
+static gboolean
+list_table (XdpDbusPermissionStore *store,
+            const char             *table,
+            const char             *id,
+            FlatpakTablePrinter    *printer,
+            GError                **error)
+{
+  g_autoptr(GVariant) entries = NULL;
+  GVariantIter entries_iter;
+  const char *entry_id;
+  GVariant *permissions;
+  GVariant *data;
 
-          flatpak_table_printer_add_column (printer, table);
-          flatpak_table_printer_add_column (printer, ids[i]);
-          flatpak_table_printer_add_column (printer, key);
-          flatpak_table_printer_add_column (printer, "");
+  if (id)
+    {
+      g_autoptr(GVariant) one_permissions = NULL;
+      g_autoptr(GVariant) one_data = NULL;
 
-          while (g_variant_iter_loop (val, "s", &p))
-            {
-              flatpak_table_printer_append_with_comma (printer, p);
-            }
+      if (!xdp_dbus_permission_store_call_lookup_sync (store, table, id,
+                                                       &one_permissions, &one_data,
+                                                       NULL, error))
+        return FALSE;
 
-          flatpak_table_printer_add_column (printer, txt);
-          flatpak_table_printer_finish_row (printer);
-        }
+      add_entry_rows (printer, table, id, one_permissions, one_data, TRUE);
+      return TRUE;
     }
 
+  /* The whole table arrives in one reply rather than one Lookup
+   * round trip per id */
+  if (!get_permission_table_entries (store, table, &entries, NULL, error))
+    return FALSE;
+
+  g_variant_iter_init (&entries_iter, entries);
+  while (g_variant_iter_loop (&entries_iter, "(&s@a{sas}@v)", &entry_id, &permissions, &data))
+    add_entry_rows (printer, table, entry_id, permissions, data, FALSE);
+
   return TRUE;
 }
 
@@ -48,25 +48,26 @@ list_for_app (XdpDbusPermissionStore *store,
               FlatpakTablePrinter    *printer,
               GError                **error)
 {
-  char **ids;
-  int i;
-
-  if (!xdp_dbus_permission_store_call_list_sync (store, table, &ids, NULL, error))
+  g_autoptr(GVariant) entries = NULL;
+  GVariantIter entries_iter;
+  const char *id;
+  GVariant *permissions;
+  GVariant *data;
+
+  /* The whole table arrives in one reply rather than one Lookup
+   * round trip per id */
+  if (!get_permission_table_entries (store, table, &entries, NULL, error))
     return FALSE;
 
-  for (i = 0; ids[i]; i++)
+  g_variant_iter_init (&entries_iter, entries);
+  while (g_variant_iter_loop (&entries_iter, "(&s@a{sas}@v)", &id, &permissions, &data))
     {
-      g_autoptr(GVariant) permissions = NULL;
-      g_autoptr(GVariant) data = NULL;
       g_autoptr(GVariant) d = NULL;
       g_autofree char *txt = NULL;
       GVariantIter iter;
       char *key;
       GVariantIter *val;
 
-      if (!xdp_dbus_permission_store_call_lookup_sync (store, table, ids[i], &permissions, &data, NULL, error))
-        return FALSE;
-
       d = g_variant_get_child_value (data, 0);
       txt = g_variant_print (d, FALSE);
 
@@ -79,7 +80,7 @@ list_for_app (XdpDbusPermissionStore *store,
             continue;
 
           flatpak_table_printer_add_column (printer, table);
-          flatpak_table_printer_add_column (printer, ids[i]);
+          flatpak_table_printer_add_column (printer, id);
           flatpak_table_printer_add_column (printer, key);
           flatpak_table_printer_add_column (printer, "");
 
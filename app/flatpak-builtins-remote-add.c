@@ -48,7 +48,9 @@ static char *opt_description;
 static char *opt_homepage;
 static char *opt_icon;
 static char *opt_default_branch;
+static char *opt_summary_arch;
 static char *opt_url;
+static char **opt_url_mirrors;
 static char *opt_collection_id = NULL;
 static gboolean opt_from;
 static char **opt_gpg_import;
@@ -76,7 +78,9 @@ static GOptionEntry common_options[] = {
   { "homepage", 0, 0, G_OPTION_ARG_STRING, &opt_homepage, N_("URL for a website for this remote"), N_("URL") },
   { "icon", 0, 0, G_OPTION_ARG_STRING, &opt_icon, N_("URL for an icon for this remote"), N_("URL") },
   { "default-branch", 0, 0, G_OPTION_ARG_STRING, &opt_default_branch, N_("Default branch to use for this remote"), N_("BRANCH") },
+  { "summary-arch", 0, 0, G_OPTION_ARG_STRING, &opt_summary_arch, N_("Only fetch summary data for ARCH"), N_("ARCH") },
   { "collection-id", 0, 0, G_OPTION_ARG_STRING, &opt_collection_id, N_("Collection ID"), N_("COLLECTION-ID") },
+  { "url-mirror", 0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_url_mirrors, N_("Additional mirror URL for this remote (can be used multiple times)"), N_("URL") },
   { "gpg-import", 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &opt_gpg_import, N_("Import GPG key from FILE (- for stdin)"), N_("FILE") },
   { "disable", 0, 0, G_OPTION_ARG_NONE, &opt_disable, N_("Disable the remote"), NULL },
   { NULL }
@@ -126,6 +130,14 @@ get_config_from_opts (FlatpakDir *dir, const char *remote_name, gboolean *change
       *changed = TRUE;
     }
 
+  if (opt_url_mirrors)
+    {
+      g_key_file_set_string_list (config, group, "xa.url-mirrors",
+                                  (const char * const *) opt_url_mirrors,
+                                  g_strv_length (opt_url_mirrors));
+      *changed = TRUE;
+    }
+
   if (opt_title)
     {
       g_key_file_set_string (config, group, "xa.title", opt_title);
@@ -168,6 +180,12 @@ get_config_from_opts (FlatpakDir *dir, const char *remote_name, gboolean *change
       *changed = TRUE;
     }
 
+  if (opt_summary_arch)
+    {
+      g_key_file_set_string (config, group, "xa.summary-arch", opt_summary_arch);
+      *changed = TRUE;
+    }
+
   if (opt_no_enumerate)
     {
       g_key_file_set_boolean (config, group, "xa.noenumerate", TRUE);
@@ -185,28 +185,25 @@ flatpak_builtin_remote_info (int argc, char **argv, GCancellable *cancellable, G
       int len;
       int rows, cols;
       int width;
-      g_autoptr(AsStore) store = as_store_new ();
-      AsApp *app = NULL;
+      g_autoptr(GVariant) compiled_appstream = NULL;
+      const char *name = NULL;
+      const char *comment = NULL;
       const char *version = NULL;
       const char *license = NULL;
 
       flatpak_get_window_size (&rows, &cols);
 
-#if AS_CHECK_VERSION (0, 6, 1)
-      as_store_set_add_flags (store, as_store_get_add_flags (store) | AS_STORE_ADD_FLAG_USE_UNIQUE_ID);
-#endif
-
-      flatpak_dir_load_appstream_store (preferred_dir, remote, parts[2], store, NULL, NULL);
-      app = as_store_find_app (store, ref);
-      if (app)
+      compiled_appstream = flatpak_dir_load_compiled_appstream (preferred_dir, remote, parts[2], NULL);
+      if (compiled_appstream != NULL &&
+          g_variant_lookup (compiled_appstream, ref, "(&s&s&s&s)",
+                            &name, &comment, &version, &license))
         {
-          const char *name = as_app_get_localized_name (app);
-          const char *comment = as_app_get_localized_comment (app);
-
           print_wrapped (MIN (cols, 80), "\n%s - %s\n", name, comment);
 
-          version = as_app_get_version (app);
-          license = as_app_get_project_license (app);
+          if (*version == 0)
+            version = NULL;
+          if (*license == 0)
+            license = NULL;
         }
 
       if (commit_v)
@@ -333,6 +330,11 @@ flatpak_builtin_remote_info (int argc, char **argv, GCancellable *cancellable, G
 
           print_aligned (len, _("History:"), "\n");
 
+          /* Walking the chain fetches one commit per round trip, so
+             speculatively grab the whole history in parallel first */
+          flatpak_dir_prefetch_remote_commit_history (preferred_dir, remote, state,
+                                                      commit, cancellable);
+
           while (p)
             {
               g_autofree char *p_parent = NULL;
@@ -371,6 +373,10 @@ flatpak_builtin_remote_info (int argc, char **argv, GCancellable *cancellable, G
       if (commit_v)
         c_v = g_variant_ref (commit_v);
 
+      if (opt_log)
+        flatpak_dir_prefetch_remote_commit_history (preferred_dir, remote, state,
+                                                    c, cancellable);
+
       do
         {
           g_autofree char *p = NULL;
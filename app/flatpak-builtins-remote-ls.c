@@ -119,6 +119,7 @@ ls_remote (GHashTable *refs_hash, const char **arches, const char *app_runtime,
   g_autofree char *match_branch = NULL;
   gboolean need_cache_data = FALSE;
   gboolean need_appstream_data = FALSE;
+  gboolean need_sparse_data = FALSE;
   int rows, cols;
 
   printer = flatpak_table_printer_new ();
@@ -144,8 +145,15 @@ ls_remote (GHashTable *refs_hash, const char **arches, const char *app_runtime,
           strcmp (columns[j].name, "description") == 0 ||
           strcmp (columns[j].name, "version") == 0)
         need_appstream_data = TRUE;
+      if (strcmp (columns[j].name, "options") == 0)
+        need_sparse_data = TRUE;
     }
 
+  /* The sparse cache is also what tells us about end-of-lifed refs,
+   * which are hidden unless --all was given */
+  if (!opt_all)
+    need_sparse_data = TRUE;
+
   g_hash_table_iter_init (&refs_iter, refs_hash);
   while (g_hash_table_iter_next (&refs_iter, &refs_key, &refs_value))
     {
@@ -154,7 +162,7 @@ ls_remote (GHashTable *refs_hash, const char **arches, const char *app_runtime,
       FlatpakDir *dir = remote_state_dir_pair->dir;
       FlatpakRemoteState *state = remote_state_dir_pair->state;
       const char *remote = state->remote_name;
-      g_autoptr(AsStore) store = NULL;
+      g_autoptr(GVariant) compiled_appstream = NULL;
       g_autoptr(GHashTable) names = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
 
       g_hash_table_iter_init (&iter, refs);
@@ -243,15 +251,7 @@ ls_remote (GHashTable *refs_hash, const char **arches, const char *app_runtime,
         }
 
       if (need_appstream_data)
-        {
-          store = as_store_new ();
-
-#if AS_CHECK_VERSION (0, 6, 1)
-          as_store_set_add_flags (store, as_store_get_add_flags (store) | AS_STORE_ADD_FLAG_USE_UNIQUE_ID);
-#endif
-
-          flatpak_dir_load_appstream_store (dir, remote, NULL, store, NULL, NULL);
-        }
+        compiled_appstream = flatpak_dir_load_compiled_appstream (dir, remote, NULL, NULL);
 
       keys = (const char **) g_hash_table_get_keys_as_array (names, &n_keys);
       g_qsort_with_data (keys, n_keys, sizeof (char *), (GCompareDataFunc) flatpak_strcmp0_ptr, NULL);
@@ -262,11 +262,14 @@ ls_remote (GHashTable *refs_hash, const char **arches, const char *app_runtime,
           guint64 installed_size;
           guint64 download_size;
           g_autofree char *runtime = NULL;
-          AsApp *app = NULL;
+          const char *app_name = NULL;
+          const char *app_comment = NULL;
+          const char *app_version = NULL;
           g_auto(GStrv) parts = NULL;
           g_autoptr(GVariant) sparse = NULL;
 
-          sparse = flatpak_remote_state_lookup_sparse_cache (state, ref, NULL);
+          if (need_sparse_data)
+            sparse = flatpak_remote_state_lookup_sparse_cache (state, ref, NULL);
 
           /* The sparse cache is optional */
           if (sparse)
@@ -293,8 +296,9 @@ ls_remote (GHashTable *refs_hash, const char **arches, const char *app_runtime,
                 runtime = g_key_file_get_string (metakey, "Application", "runtime", NULL);
             }
 
-          if (need_appstream_data)
-            app = as_store_find_app (store, ref);
+          if (need_appstream_data && compiled_appstream != NULL)
+            g_variant_lookup (compiled_appstream, ref, "(&s&s&s&s)",
+                              &app_name, &app_comment, &app_version, NULL);
 
           if (app_runtime && runtime)
             {
@@ -308,24 +312,12 @@ ls_remote (GHashTable *refs_hash, const char **arches, const char *app_runtime,
           for (j = 0; columns[j].name; j++)
             {
               if (strcmp (columns[j].name, "name") == 0)
-                {
-                  const char *name = NULL;
-
-                  if (app)
-                    name = as_app_get_localized_name (app);
-
-                  flatpak_table_printer_add_column (printer, name ? name : strrchr (parts[1], '.') + 1);
-                }
+                flatpak_table_printer_add_column (printer,
+                                                  app_name && *app_name ? app_name : strrchr (parts[1], '.') + 1);
               else if (strcmp (columns[j].name, "description") == 0)
-                {
-                  const char *comment = NULL;
-                  if (app)
-                      comment = as_app_get_localized_comment (app);
-
-                  flatpak_table_printer_add_column (printer, comment);
-                }
+                flatpak_table_printer_add_column (printer, app_comment);
               else if (strcmp (columns[j].name, "version") == 0)
-                flatpak_table_printer_add_column (printer, app ? as_app_get_version (app) : "");
+                flatpak_table_printer_add_column (printer, app_version ? app_version : "");
               else if (strcmp (columns[j].name, "ref") == 0)
                 flatpak_table_printer_add_column (printer, ref);
               else if (strcmp (columns[j].name, "application") == 0)
@@ -38,10 +38,12 @@
 
 static gboolean opt_dry_run;
 static gboolean opt_reinstall_all;
+static gboolean opt_quick;
 
 static GOptionEntry options[] = {
   { "dry-run", 0, 0, G_OPTION_ARG_NONE, &opt_dry_run, N_("Don't make any changes"), NULL },
   { "reinstall-all", 0, 0, G_OPTION_ARG_NONE, &opt_reinstall_all, N_("Reinstall all refs"), NULL },
+  { "quick", 0, 0, G_OPTION_ARG_NONE, &opt_quick, N_("Only check that refs and objects are present"), NULL },
   { NULL }
 };
 
@@ -59,6 +61,21 @@ fsck_one_object (OstreeRepo      *repo,
 {
   g_autoptr(GError) local_error = NULL;
 
+  /* In quick mode we only check that the object is there, not that its
+     content checksums correctly, which is what dominates a full pass */
+  if (opt_quick)
+    {
+      gboolean found = FALSE;
+
+      if (ostree_repo_has_object (repo, objtype, checksum, &found, NULL, &local_error) && found)
+        return FSCK_STATUS_OK;
+
+      if (!allow_missing)
+        g_printerr (_("Object missing: %s.%s\n"), checksum,
+                    ostree_object_type_to_string (objtype));
+      return FSCK_STATUS_HAS_MISSING_OBJECTS;
+    }
+
   if (!ostree_repo_fsck_object (repo, objtype, checksum, NULL, &local_error))
     {
       if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
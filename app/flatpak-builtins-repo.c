@@ -389,14 +389,351 @@ print_commits (OstreeRepo *repo,
   return TRUE;
 }
 
+typedef struct
+{
+  OstreeRepo   *repo;
+  GPtrArray    *objects;        /* GVariant (su) object names */
+  guint64      *stored_sizes;   /* On-disk size, indexed like objects */
+  guint64      *unpacked_sizes; /* Uncompressed size, content objects only */
+  gint          next;           /* Next unclaimed index, atomic */
+  GCancellable *cancellable;
+} AnalyzeScanData;
+
+/* The per-object stat/header reads dominate the scan time on big
+ * repos, and are independent, so they are claimed index-by-index by a
+ * small pool of threads */
+static gpointer
+analyze_scan_thread (gpointer user_data)
+{
+  AnalyzeScanData *data = user_data;
+  int i;
+
+  while ((i = g_atomic_int_add (&data->next, 1)) < (int) data->objects->len)
+    {
+      GVariant *key = g_ptr_array_index (data->objects, i);
+      const char *checksum;
+      OstreeObjectType objtype;
+      guint64 size = 0;
+
+      ostree_object_name_deserialize (key, &checksum, &objtype);
+
+      if (ostree_repo_query_object_storage_size (data->repo, objtype, checksum,
+                                                 &size, data->cancellable, NULL))
+        data->stored_sizes[i] = size;
+
+      if (objtype == OSTREE_OBJECT_TYPE_FILE)
+        {
+          g_autoptr(GFileInfo) finfo = NULL;
+
+          /* Only reads the object header, not the content */
+          if (ostree_repo_load_file (data->repo, checksum, NULL, &finfo, NULL,
+                                     data->cancellable, NULL) && finfo != NULL)
+            data->unpacked_sizes[i] = g_file_info_get_size (finfo);
+        }
+    }
+
+  return NULL;
+}
+
+/* Histogram buckets for content object sizes, in bytes */
+static const guint64 size_buckets[] = { 4096, 32768, 262144, 2097152, 16777216 };
+
+static int
+size_bucket (guint64 size)
+{
+  int b;
+
+  for (b = 0; b < G_N_ELEMENTS (size_buckets); b++)
+    if (size < size_buckets[b])
+      break;
+  return b;
+}
+
+static gboolean
+analyze_repo (OstreeRepo   *repo,
+              GCancellable *cancellable,
+              GError      **error)
+{
+  g_autoptr(GHashTable) objects = NULL;
+  g_autoptr(GHashTable) object_index = NULL; /* object name => index + 1 */
+  g_autoptr(GHashTable) object_nrefs = NULL; /* object name => number of refs using it */
+  g_autoptr(GHashTable) refs = NULL;
+  g_autoptr(GPtrArray) object_names = NULL;
+  g_autoptr(GPtrArray) deltas = NULL;
+  g_autofree guint64 *stored_sizes = NULL;
+  g_autofree guint64 *unpacked_sizes = NULL;
+  AnalyzeScanData scan_data = { 0 };
+  GHashTableIter iter;
+  gpointer key, value;
+  guint64 type_counts[16] = { 0 };
+  guint64 type_bytes[16] = { 0 };
+  guint64 bucket_counts[G_N_ELEMENTS (size_buckets) + 1] = { 0 };
+  guint64 bucket_bytes[G_N_ELEMENTS (size_buckets) + 1] = { 0 };
+  guint64 content_stored = 0, content_unpacked = 0;
+  guint64 poorly_compressed_count = 0, poorly_compressed_bytes = 0;
+  guint64 all_refs_bytes = 0, union_bytes = 0;
+  g_autoptr(GPtrArray) ref_names = NULL;
+  g_autoptr(GPtrArray) ref_objects = NULL; /* reachable set per ref */
+  FlatpakTablePrinter *printer;
+  int n_threads, i, b;
+
+  if (!ostree_repo_list_objects (repo, OSTREE_REPO_LIST_OBJECTS_ALL, &objects, cancellable, error))
+    return FALSE;
+
+  object_names = g_ptr_array_new_with_free_func ((GDestroyNotify) g_variant_unref);
+  g_hash_table_iter_init (&iter, objects);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_ptr_array_add (object_names, g_variant_ref (key));
+
+  stored_sizes = g_new0 (guint64, object_names->len + 1);
+  unpacked_sizes = g_new0 (guint64, object_names->len + 1);
+
+  scan_data.repo = repo;
+  scan_data.objects = object_names;
+  scan_data.stored_sizes = stored_sizes;
+  scan_data.unpacked_sizes = unpacked_sizes;
+  scan_data.cancellable = cancellable;
+
+  n_threads = MIN (g_get_num_processors (), 16);
+  {
+    g_autoptr(GPtrArray) threads = g_ptr_array_new ();
+
+    for (i = 0; i < n_threads; i++)
+      g_ptr_array_add (threads, g_thread_new ("flatpak-repo-analyze", analyze_scan_thread, &scan_data));
+
+    for (i = 0; i < threads->len; i++)
+      g_thread_join (g_ptr_array_index (threads, i));
+  }
+
+  object_index = g_hash_table_new (ostree_hash_object_name, g_variant_equal);
+  for (i = 0; i < object_names->len; i++)
+    {
+      GVariant *name = g_ptr_array_index (object_names, i);
+      const char *checksum;
+      OstreeObjectType objtype;
+      guint64 size = stored_sizes[i];
+
+      ostree_object_name_deserialize (name, &checksum, &objtype);
+
+      g_hash_table_insert (object_index, name, GUINT_TO_POINTER (i + 1));
+
+      if ((int) objtype < (int) G_N_ELEMENTS (type_counts))
+        {
+          type_counts[objtype]++;
+          type_bytes[objtype] += size;
+        }
+
+      if (objtype == OSTREE_OBJECT_TYPE_FILE)
+        {
+          b = size_bucket (size);
+          bucket_counts[b]++;
+          bucket_bytes[b] += size;
+
+          content_stored += size;
+          content_unpacked += unpacked_sizes[i];
+
+          /* Large objects that barely compressed are recompression or
+           * exclude-pattern candidates */
+          if (size >= 1024 * 1024 && unpacked_sizes[i] > 0 &&
+              size >= (unpacked_sizes[i] / 100) * 95)
+            {
+              poorly_compressed_count++;
+              poorly_compressed_bytes += size;
+            }
+        }
+    }
+
+  g_print (_("Total objects: %u\n"), object_names->len);
+  for (i = 0; i < G_N_ELEMENTS (type_counts); i++)
+    {
+      g_autofree char *size_str = NULL;
+
+      if (type_counts[i] == 0)
+        continue;
+
+      size_str = g_format_size (type_bytes[i]);
+      g_print ("  %s: %" G_GUINT64_FORMAT " (%s)\n",
+               ostree_object_type_to_string (i), type_counts[i], size_str);
+    }
+
+  if (content_unpacked > content_stored && content_unpacked > 0)
+    {
+      g_autofree char *stored_str = g_format_size (content_stored);
+      g_autofree char *unpacked_str = g_format_size (content_unpacked);
+
+      g_print (_("Content compression: %s stored for %s of content (%d%%)\n"),
+               stored_str, unpacked_str,
+               (int) ((content_stored * 100) / content_unpacked));
+    }
+
+  if (poorly_compressed_count > 0)
+    {
+      g_autofree char *poorly_str = g_format_size (poorly_compressed_bytes);
+
+      g_print (_("Poorly compressed objects (>= 1 MB, < 5%% saved): %" G_GUINT64_FORMAT " (%s)\n"),
+               poorly_compressed_count, poorly_str);
+    }
+
+  g_print (_("Content size histogram:\n"));
+  for (b = 0; b < G_N_ELEMENTS (bucket_counts); b++)
+    {
+      g_autofree char *limit_str = NULL;
+      g_autofree char *bytes_str = g_format_size (bucket_bytes[b]);
+
+      if (b < G_N_ELEMENTS (size_buckets))
+        limit_str = g_format_size (size_buckets[b]);
+      else
+        limit_str = g_format_size (size_buckets[G_N_ELEMENTS (size_buckets) - 1]);
+      g_print ("  %s %8s: %8" G_GUINT64_FORMAT " objects, %s\n",
+               b < G_N_ELEMENTS (size_buckets) ? "<" : ">=",
+               limit_str, bucket_counts[b], bytes_str);
+    }
+
+  /* Walk each ref to see how much of the content is shared between
+   * refs and which refs lack static deltas */
+  if (!ostree_repo_list_refs (repo, NULL, &refs, cancellable, error))
+    return FALSE;
+
+  if (!ostree_repo_list_static_delta_names (repo, &deltas, cancellable, error))
+    return FALSE;
+
+  ref_names = g_ptr_array_new_with_free_func (g_free);
+  ref_objects = g_ptr_array_new_with_free_func ((GDestroyNotify) g_hash_table_unref);
+  object_nrefs = g_hash_table_new (ostree_hash_object_name, g_variant_equal);
+
+  g_hash_table_iter_init (&iter, refs);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      const char *checksum = value;
+      g_autoptr(GHashTable) reachable = NULL;
+      GHashTableIter obj_iter;
+      gpointer obj_key;
+
+      if (!ostree_repo_traverse_commit (repo, checksum, 0, &reachable, cancellable, NULL))
+        continue; /* E.g. partial commits on a subpath mirror */
+
+      g_hash_table_iter_init (&obj_iter, reachable);
+      while (g_hash_table_iter_next (&obj_iter, &obj_key, NULL))
+        {
+          guint nrefs = GPOINTER_TO_UINT (g_hash_table_lookup (object_nrefs, obj_key));
+          g_hash_table_replace (object_nrefs, obj_key, GUINT_TO_POINTER (nrefs + 1));
+        }
+
+      g_ptr_array_add (ref_names, g_strdup ((const char *) key));
+      g_ptr_array_add (ref_objects, g_steal_pointer (&reachable));
+    }
+
+  printer = flatpak_table_printer_new ();
+  flatpak_table_printer_set_column_title (printer, 0, _("Ref"));
+  flatpak_table_printer_set_column_title (printer, 1, _("Objects"));
+  flatpak_table_printer_set_column_title (printer, 2, _("Size"));
+  flatpak_table_printer_set_column_title (printer, 3, _("Exclusive"));
+  flatpak_table_printer_set_column_title (printer, 4, _("Deltas"));
+
+  for (i = 0; i < ref_names->len; i++)
+    {
+      const char *ref = g_ptr_array_index (ref_names, i);
+      GHashTable *reachable = g_ptr_array_index (ref_objects, i);
+      const char *checksum = g_hash_table_lookup (refs, ref);
+      GHashTableIter obj_iter;
+      gpointer obj_key;
+      guint64 ref_bytes = 0, exclusive_bytes = 0;
+      guint64 n_objects = 0;
+      gboolean has_scratch = FALSE, has_from_parent = FALSE;
+      g_autofree char *size_str = NULL;
+      g_autofree char *exclusive_str = NULL;
+      g_autofree char *n_objects_str = NULL;
+      int j;
+
+      g_hash_table_iter_init (&obj_iter, reachable);
+      while (g_hash_table_iter_next (&obj_iter, &obj_key, NULL))
+        {
+          guint index = GPOINTER_TO_UINT (g_hash_table_lookup (object_index, obj_key));
+          guint64 size;
+
+          if (index == 0)
+            continue;
+          size = stored_sizes[index - 1];
+
+          n_objects++;
+          ref_bytes += size;
+          if (GPOINTER_TO_UINT (g_hash_table_lookup (object_nrefs, obj_key)) == 1)
+            exclusive_bytes += size;
+        }
+
+      all_refs_bytes += ref_bytes;
+
+      for (j = 0; deltas != NULL && j < deltas->len; j++)
+        {
+          const char *delta = g_ptr_array_index (deltas, j);
+
+          if (g_str_equal (delta, checksum))
+            has_scratch = TRUE;
+          else if (strchr (delta, '-') != NULL)
+            {
+              g_auto(GStrv) parts = g_strsplit (delta, "-", 0);
+
+              if (g_str_equal (parts[1], checksum))
+                has_from_parent = TRUE;
+            }
+        }
+
+      n_objects_str = g_strdup_printf ("%" G_GUINT64_FORMAT, n_objects);
+      size_str = g_format_size (ref_bytes);
+      exclusive_str = g_format_size (exclusive_bytes);
+
+      flatpak_table_printer_add_column (printer, ref);
+      flatpak_table_printer_add_decimal_column (printer, n_objects_str);
+      flatpak_table_printer_add_decimal_column (printer, size_str);
+      flatpak_table_printer_add_decimal_column (printer, exclusive_str);
+
+      flatpak_table_printer_add_column (printer, ""); /* Deltas */
+      if (has_scratch)
+        flatpak_table_printer_append_with_comma (printer, "scratch");
+      if (has_from_parent)
+        flatpak_table_printer_append_with_comma (printer, "from-parent");
+      if (!has_scratch && !has_from_parent)
+        flatpak_table_printer_append_with_comma (printer, "none");
+
+      flatpak_table_printer_finish_row (printer);
+    }
+
+  g_hash_table_iter_init (&iter, object_nrefs);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      guint index = GPOINTER_TO_UINT (g_hash_table_lookup (object_index, key));
+
+      if (index != 0)
+        union_bytes += stored_sizes[index - 1];
+    }
+
+  if (union_bytes > 0)
+    {
+      g_autofree char *all_refs_str = g_format_size (all_refs_bytes);
+      g_autofree char *union_str = g_format_size (union_bytes);
+
+      g_print (_("Duplicate content: refs sum to %s, stored once as %s (%.1fx sharing)\n"),
+               all_refs_str, union_str,
+               (double) all_refs_bytes / union_bytes);
+    }
+
+  g_print ("\n");
+  flatpak_table_printer_print (printer);
+  flatpak_table_printer_free (printer);
+
+  return TRUE;
+}
+
 static gboolean opt_info;
 static gboolean opt_branches;
+static gboolean opt_analyze;
 static gchar *opt_metadata_branch;
 static gchar *opt_commits_branch;
 
 static GOptionEntry options[] = {
   { "info", 0, 0, G_OPTION_ARG_NONE, &opt_info, N_("Print general information about the repository"), NULL },
   { "branches", 0, 0, G_OPTION_ARG_NONE, &opt_branches, N_("List the branches in the repository"), NULL },
+  { "analyze", 0, 0, G_OPTION_ARG_NONE, &opt_analyze, N_("Analyze the object store and delta coverage of the repository"), NULL },
   { "metadata", 0, 0, G_OPTION_ARG_STRING, &opt_metadata_branch, N_("Print metadata for a branch"), N_("BRANCH") },
   { "commits", 0, 0, G_OPTION_ARG_STRING, &opt_commits_branch, N_("Show commits for a branch"), N_("BRANCH") },
   { NULL }
@@ -461,7 +798,7 @@ flatpak_builtin_repo (int argc, char **argv,
       g_debug ("Using repository metadata from the summary file");
     }
 
-  if (!opt_info && !opt_branches && !opt_metadata_branch && !opt_commits_branch)
+  if (!opt_info && !opt_branches && !opt_analyze && !opt_metadata_branch && !opt_commits_branch)
     opt_info = TRUE;
 
   /* Print out the metadata. */
@@ -471,6 +808,12 @@ flatpak_builtin_repo (int argc, char **argv,
   if (opt_branches)
     print_branches (meta);
 
+  if (opt_analyze)
+    {
+      if (!analyze_repo (repo, cancellable, error))
+        return FALSE;
+    }
+
   if (opt_metadata_branch)
     print_metadata (meta, opt_metadata_branch);
 
@@ -118,6 +118,8 @@ flatpak_builtin_run (int argc, char **argv, GCancellable *cancellable, GError **
                                      &dirs, cancellable, error))
     return FALSE;
 
+  flatpak_startup_trace ("parse-options");
+
   /* Move the user dir to the front so it "wins" in case an app is in more than
    * one installation */
   if (dirs->len > 1)
@@ -260,6 +262,8 @@ flatpak_builtin_run (int argc, char **argv, GCancellable *cancellable, GError **
       g_clear_error (&local_error);
     }
 
+  flatpak_startup_trace ("find-deploy");
+
   if (!flatpak_run_app (app_deploy ? app_ref : runtime_ref,
                         app_deploy,
                         arg_context,
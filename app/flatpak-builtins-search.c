@@ -50,22 +50,123 @@ static Column all_columns[] = {
   { NULL }
 };
 
+/* Per remote we keep a compact serialized form of the searchable
+ * appstream data (id, name, description, version, branch, keywords) in
+ * a per-user cache, so that interactive searches don't have to parse
+ * each remote's full appstream XML every time. */
+
+#define SEARCH_CACHE_GVARIANT_STRING "a(ssssss)"
+#define SEARCH_CACHE_GVARIANT_FORMAT G_VARIANT_TYPE (SEARCH_CACHE_GVARIANT_STRING)
+
+typedef struct RemoteData
+{
+  FlatpakDir   *dir;
+  char         *remote_name;
+  const char   *arch;         /* borrowed, outlives the workers */
+  GCancellable *cancellable;  /* borrowed, outlives the workers */
+  GVariant     *apps;
+} RemoteData;
+
+static void
+remote_data_free (RemoteData *data)
+{
+  g_object_unref (data->dir);
+  g_free (data->remote_name);
+  if (data->apps)
+    g_variant_unref (data->apps);
+  g_free (data);
+}
+
+static GVariant *
+build_search_data_from_store (AsStore *store)
+{
+  GVariantBuilder builder;
+  GPtrArray *apps = as_store_get_apps (store);
+  guint i, j;
+
+  g_variant_builder_init (&builder, SEARCH_CACHE_GVARIANT_FORMAT);
+
+  for (i = 0; i < apps->len; ++i)
+    {
+      AsApp *app = g_ptr_array_index (apps, i);
+      GPtrArray *keywords = as_app_get_keywords (app, NULL);
+      g_autoptr(GString) keywords_str = g_string_new ("");
+      const char *branch = NULL;
+
+#if AS_CHECK_VERSION (0, 6, 1)
+      branch = as_app_get_branch (app);
+#endif
+
+      for (j = 0; keywords != NULL && j < keywords->len; ++j)
+        {
+          if (keywords_str->len > 0)
+            g_string_append_c (keywords_str, ' ');
+          g_string_append (keywords_str, (const char *) g_ptr_array_index (keywords, j));
+        }
+
+      g_variant_builder_add (&builder, "(ssssss)",
+                             as_app_get_id_filename (app) ?: "",
+                             as_app_get_localized_name (app) ?: "",
+                             as_app_get_localized_comment (app) ?: "",
+                             as_app_get_version (app) ?: "",
+                             branch ?: "",
+                             keywords_str->str);
+    }
+
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+static void
+load_remote_data (gpointer item, gpointer user_data)
+{
+  RemoteData *data = item;
+  g_autoptr(GFile) cache_file = flatpak_appstream_cache_file (data->dir, data->remote_name, data->arch, "search");
+  g_autoptr(GVariant) apps = NULL;
+  g_autoptr(GError) error = NULL;
+
+  if (cache_file != NULL)
+    apps = flatpak_appstream_cache_load (cache_file, SEARCH_CACHE_GVARIANT_FORMAT);
+
+  if (apps == NULL)
+    {
+      g_autoptr(AsStore) store = as_store_new ();
+
+#if AS_CHECK_VERSION (0, 6, 1)
+      // We want to see multiple versions/branches of same app-id's, e.g. org.gnome.Platform
+      as_store_set_add_flags (store, as_store_get_add_flags (store) | AS_STORE_ADD_FLAG_USE_UNIQUE_ID);
+#endif
+
+      flatpak_dir_load_appstream_store (data->dir, data->remote_name, data->arch, store, data->cancellable, &error);
+
+      if (error)
+        g_warning ("%s", error->message);
+
+      apps = build_search_data_from_store (store);
+      if (cache_file != NULL)
+        flatpak_appstream_cache_save (cache_file, apps);
+    }
+
+  data->apps = g_steal_pointer (&apps);
+}
+
 static GPtrArray *
-get_remote_stores (GPtrArray *dirs, const char *arch, GCancellable *cancellable)
+get_remote_data (GPtrArray *dirs, const char *arch, GCancellable *cancellable)
 {
   GError *error = NULL;
-  GPtrArray *ret = g_ptr_array_new_with_free_func (g_object_unref);
+  GPtrArray *ret = g_ptr_array_new_with_free_func ((GDestroyNotify) remote_data_free);
+  GThreadPool *pool;
   guint i, j;
 
+  if (arch == NULL)
+    arch = flatpak_get_arch ();
+
   for (i = 0; i < dirs->len; ++i)
     {
       FlatpakDir *dir = g_ptr_array_index (dirs, i);
-      g_autofree char *install_path = NULL;
       g_auto(GStrv) remotes = NULL;
 
       flatpak_log_dir_access (dir);
 
-      install_path = g_file_get_path (flatpak_dir_get_path (dir));
       remotes = flatpak_dir_list_enumerated_remotes (dir, cancellable, &error);
       if (error)
         {
@@ -78,39 +179,54 @@ get_remote_stores (GPtrArray *dirs, const char *arch, GCancellable *cancellable)
 
       for (j = 0; remotes[j]; ++j)
         {
-          g_autoptr(AsStore) store = as_store_new ();
-
-#if AS_CHECK_VERSION (0, 6, 1)
-          // We want to see multiple versions/branches of same app-id's, e.g. org.gnome.Platform
-          as_store_set_add_flags (store, as_store_get_add_flags (store) | AS_STORE_ADD_FLAG_USE_UNIQUE_ID);
-#endif
+          RemoteData *data = g_new0 (RemoteData, 1);
 
-          flatpak_dir_load_appstream_store (dir, remotes[j], arch, store, cancellable, &error);
+          data->dir = g_object_ref (dir);
+          data->remote_name = g_strdup (remotes[j]);
+          data->arch = arch;
+          data->cancellable = cancellable;
+          g_ptr_array_add (ret, data);
+        }
+    }
 
-          if (error)
-            {
-              g_warning ("%s", error->message);
-              g_clear_error (&error);
-            }
+  /* Load the per-remote data on a thread pool, so that one slow
+   * installation or remote doesn't serialize behind the others. Each
+   * worker only reads the deployed appstream files and its own AsStore,
+   * so they don't step on each other. */
+  if (ret->len > 1)
+    {
+      pool = g_thread_pool_new (load_remote_data, NULL,
+                                MIN (ret->len, g_get_num_processors ()),
+                                FALSE, NULL);
+      if (pool != NULL)
+        {
+          for (i = 0; i < ret->len; ++i)
+            g_thread_pool_push (pool, g_ptr_array_index (ret, i), NULL);
 
-          g_object_set_data_full (G_OBJECT (store), "remote-name", g_strdup (remotes[j]), g_free);
-          g_ptr_array_add (ret, g_steal_pointer (&store));
+          /* Waits for all the pushed work to finish */
+          g_thread_pool_free (pool, FALSE, TRUE);
         }
     }
-  return ret;
-}
 
-static void
-clear_app_arches (AsApp *app)
-{
-  GPtrArray *arches = as_app_get_architectures (app);
+  /* Single remote, or anything the pool failed to pick up */
+  for (i = 0; i < ret->len; ++i)
+    {
+      RemoteData *data = g_ptr_array_index (ret, i);
+
+      if (data->apps == NULL)
+        load_remote_data (data, NULL);
+    }
 
-  g_ptr_array_set_size (arches, 0);
+  return ret;
 }
 
 typedef struct MatchResult
 {
-  AsApp     *app;
+  char      *id;
+  char      *name;
+  char      *comment;
+  char      *version;
+  char      *branch;
   GPtrArray *remotes;
   guint      score;
 } MatchResult;
@@ -118,22 +234,29 @@ typedef struct MatchResult
 static void
 match_result_free (MatchResult *result)
 {
-  g_object_unref (result->app);
+  g_free (result->id);
+  g_free (result->name);
+  g_free (result->comment);
+  g_free (result->version);
+  g_free (result->branch);
   g_ptr_array_unref (result->remotes);
   g_free (result);
 }
 
 static MatchResult *
-match_result_new (AsApp *app, guint score)
+match_result_new (const char *id, const char *name, const char *comment,
+                  const char *version, const char *branch, guint score)
 {
-  MatchResult *result = g_new (MatchResult, 1);
+  MatchResult *result = g_new0 (MatchResult, 1);
 
-  result->app = g_object_ref (app);
+  result->id = g_strdup (id);
+  result->name = g_strdup (name);
+  result->comment = g_strdup (comment);
+  result->version = g_strdup (version);
+  result->branch = g_strdup (branch);
   result->remotes = g_ptr_array_new_with_free_func (g_free);
   result->score = score;
 
-  clear_app_arches (result->app);
-
   return result;
 }
 
@@ -158,78 +281,53 @@ compare_by_score (MatchResult *a, MatchResult *b, gpointer user_data)
   return (int) b->score - (int) a->score;
 }
 
-#if !AS_CHECK_VERSION (0, 6, 1)
-/* Roughly copied directly from appstream-glib */
-
-static const gchar *
-as_app_fix_unique_nullable (const gchar *tmp)
-{
-  if (tmp == NULL || tmp[0] == '\0')
-    return "*";
-  return tmp;
-}
-
-static char *
-as_app_get_unique_id (AsApp *app)
+static int
+compare_apps (MatchResult *a, MatchResult *b)
 {
-  const gchar *id_str = NULL;
-  const gchar *kind_str = NULL;
-  AsAppKind kind = as_app_get_kind (app);
-
-  if (kind != AS_APP_KIND_UNKNOWN)
-    kind_str = as_app_kind_to_string (kind);
-  id_str = as_app_get_id_no_prefix (app);
-  return g_strdup_printf ("%s/%s",
-                          as_app_fix_unique_nullable (kind_str),
-                          as_app_fix_unique_nullable (id_str));
+  /* Same app in multiple remotes (ignoring arch), show as one row with
+   * multiple remotes */
+  return strcmp (a->id, b->id) != 0 || strcmp (a->branch, b->branch) != 0;
 }
 
-static gboolean
-as_app_equal (AsApp *app1, AsApp *app2)
+static guint
+compute_score (const char *search_text,
+               const char *id,
+               const char *name,
+               const char *comment,
+               const char *keywords)
 {
-  if (app1 == app2)
-    return TRUE;
-
-  g_autofree char *app1_id = as_app_get_unique_id (app1);
-  g_autofree char *app2_id = as_app_get_unique_id (app2);
-  return strcmp (app1_id, app2_id) == 0;
-}
-#endif
-
-static int
-compare_apps (MatchResult *a, AsApp *b)
-{
-  /* For now we want to ignore arch when comparing applications
-   * It may be valuable to show runtime arches in the future though.
-   * This is a naughty hack but for our purposes totally fine.
-   */
-  clear_app_arches (b);
-
-  return !as_app_equal (a->app, b);
+  guint score = 0;
+
+  if (*name != 0 && strcasestr (name, search_text) != NULL)
+    score += 100;
+  if (*keywords != 0 && strcasestr (keywords, search_text) != NULL)
+    score += 60;
+  if (*comment != 0 && strcasestr (comment, search_text) != NULL)
+    score += 30;
+  if (score == 0 && strcasestr (id, search_text) != NULL)
+    score = 50;
+
+  return score;
 }
 
 static void
 print_app (Column *columns, MatchResult *res, FlatpakTablePrinter *printer)
 {
-  const char *version = as_app_get_version (res->app);
-  const char *id = as_app_get_id_filename (res->app);
-  const char *name = as_app_get_localized_name (res->app);
-  const char *comment = as_app_get_localized_comment (res->app);
   guint i;
 
   for (i = 0; columns[i].name; i++)
     {
       if (strcmp (columns[i].name, "name") == 0)
-        flatpak_table_printer_add_column (printer, name);
+        flatpak_table_printer_add_column (printer, res->name);
       if (strcmp (columns[i].name, "description") == 0)
-        flatpak_table_printer_add_column (printer, comment);
+        flatpak_table_printer_add_column (printer, res->comment);
       else if (strcmp (columns[i].name, "application") == 0)
-        flatpak_table_printer_add_column (printer, id);
+        flatpak_table_printer_add_column (printer, res->id);
       else if (strcmp (columns[i].name, "version") == 0)
-        flatpak_table_printer_add_column (printer, version);
+        flatpak_table_printer_add_column (printer, res->version);
 #if AS_CHECK_VERSION (0, 6, 1)
       else if (strcmp (columns[i].name, "branch") == 0)
-        flatpak_table_printer_add_column (printer, as_app_get_branch (res->app));
+        flatpak_table_printer_add_column (printer, res->branch);
 #endif
       else if (strcmp (columns[i].name, "remotes") == 0)
         {
@@ -296,42 +394,39 @@ flatpak_builtin_search (int argc, char **argv, GCancellable *cancellable, GError
   GSList *matches = NULL;
   guint j;
 
-  // We want a store for each remote so we keep the remote information
-  // as AsApp doesn't currently contain that information
-  g_autoptr(GPtrArray) remote_stores = get_remote_stores (dirs, opt_arch, cancellable);
-  for (j = 0; j < remote_stores->len; ++j)
+  // We want the data per remote so we keep the remote information
+  // which the appstream data doesn't contain
+  g_autoptr(GPtrArray) remote_data = get_remote_data (dirs, opt_arch, cancellable);
+  for (j = 0; j < remote_data->len; ++j)
     {
-      AsStore *store = g_ptr_array_index (remote_stores, j);
-      GPtrArray *apps = as_store_get_apps (store);
-      guint i;
+      RemoteData *data = g_ptr_array_index (remote_data, j);
+      GVariantIter iter;
+      const char *id, *name, *comment, *version, *branch, *keywords;
 
-      for (i = 0; i < apps->len; ++i)
+      g_variant_iter_init (&iter, data->apps);
+      while (g_variant_iter_next (&iter, "(&s&s&s&s&s&s)",
+                                  &id, &name, &comment, &version, &branch, &keywords))
         {
-          AsApp *app = g_ptr_array_index (apps, i);
-          guint score = as_app_search_matches (app, search_text);
+          guint score = compute_score (search_text, id, name, comment, keywords);
+          MatchResult *result = NULL;
+          MatchResult key = { (char *) id, NULL, NULL, NULL, (char *) branch, NULL, 0 };
+          GSList *list_entry;
+
           if (score == 0)
-            {
-              const char *app_id = as_app_get_id_filename (app);
-              if (strcasestr (app_id, search_text) != NULL)
-                score = 50;
-              else
-                continue;
-            }
+            continue;
 
           // Avoid duplicate entries, but show multiple remotes
-          GSList *list_entry = g_slist_find_custom (matches, app,
-                                                    (GCompareFunc) compare_apps);
-          MatchResult *result = NULL;
+          list_entry = g_slist_find_custom (matches, &key,
+                                            (GCompareFunc) compare_apps);
           if (list_entry != NULL)
             result = list_entry->data;
           else
             {
-              result = match_result_new (app, score);
+              result = match_result_new (id, name, comment, version, branch, score);
               matches = g_slist_insert_sorted_with_data (matches, result,
                                                          (GCompareDataFunc) compare_by_score, NULL);
             }
-          match_result_add_remote (result,
-                                   g_object_get_data (G_OBJECT (store), "remote-name"));
+          match_result_add_remote (result, data->remote_name);
         }
     }
 
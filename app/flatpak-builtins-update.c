@@ -45,6 +45,8 @@ static gboolean opt_no_deploy;
 static gboolean opt_no_related;
 static gboolean opt_no_deps;
 static gboolean opt_no_static_deltas;
+static gboolean opt_prefetch;
+static int opt_max_parallel_downloads;
 static gboolean opt_runtime;
 static gboolean opt_app;
 static gboolean opt_appstream;
@@ -60,6 +62,8 @@ static GOptionEntry options[] = {
   { "no-related", 0, 0, G_OPTION_ARG_NONE, &opt_no_related, N_("Don't update related refs"), NULL},
   { "no-deps", 0, 0, G_OPTION_ARG_NONE, &opt_no_deps, N_("Don't verify/install runtime dependencies"), NULL },
   { "no-static-deltas", 0, 0, G_OPTION_ARG_NONE, &opt_no_static_deltas, N_("Don't use static deltas"), NULL },
+  { "prefetch", 0, 0, G_OPTION_ARG_NONE, &opt_prefetch, N_("Only download updates, and only on unmetered networks"), NULL },
+  { "max-parallel-downloads", 0, 0, G_OPTION_ARG_INT, &opt_max_parallel_downloads, N_("Download up to N operations concurrently"), N_("N") },
   { "runtime", 0, 0, G_OPTION_ARG_NONE, &opt_runtime, N_("Look for runtime with the specified name"), NULL },
   { "app", 0, 0, G_OPTION_ARG_NONE, &opt_app, N_("Look for app with the specified name"), NULL },
   { "appstream", 0, 0, G_OPTION_ARG_NONE, &opt_appstream, N_("Update appstream for remote"), NULL },
@@ -103,6 +107,22 @@ flatpak_builtin_update (int           argc,
   if (opt_noninteractive)
     opt_yes = TRUE; /* Implied */
 
+  if (opt_prefetch)
+    {
+      /* A prefetch run is opportunistic background work, so skipping it
+         on a metered connection counts as success; the next scheduled
+         run catches up. The objects end up in the local repo, making a
+         later regular update deploy-only. */
+      if (g_network_monitor_get_network_metered (g_network_monitor_get_default ()))
+        {
+          if (!opt_noninteractive)
+            g_print (_("Network is metered, skipping prefetch\n"));
+          return TRUE;
+        }
+
+      opt_no_deploy = TRUE;
+    }
+
   prefs = &argv[1];
   n_prefs = argc - 1;
 
@@ -138,6 +158,8 @@ flatpak_builtin_update (int           argc,
       flatpak_transaction_set_no_pull (transaction, opt_no_pull);
       flatpak_transaction_set_no_deploy (transaction, opt_no_deploy);
       flatpak_transaction_set_disable_static_deltas (transaction, opt_no_static_deltas);
+      if (opt_max_parallel_downloads > 0)
+        flatpak_transaction_set_max_parallel_downloads (transaction, opt_max_parallel_downloads);
       flatpak_transaction_set_disable_dependencies (transaction, opt_no_deps);
       flatpak_transaction_set_disable_related (transaction, opt_no_related);
 
@@ -274,6 +296,11 @@ flatpak_builtin_update (int           argc,
       if (flatpak_transaction_is_empty (transaction))
         continue;
 
+      /* Fetch all remote summaries concurrently up front, so the
+       * resolution phase below doesn't wait on each remote in turn */
+      if (!opt_no_pull)
+        flatpak_dir_prefetch_remote_summaries (g_ptr_array_index (dirs, k), cancellable);
+
       if (!flatpak_transaction_run (transaction, cancellable, error))
         {
           if (g_error_matches (*error, FLATPAK_ERROR, FLATPAK_ERROR_ABORTED))
@@ -777,6 +777,57 @@ get_permission_tables (XdpDbusPermissionStore *store)
   return (char **) g_ptr_array_free (tables, FALSE);
 }
 
+/* Fetches the resource ID, app permissions and data of every entry of
+ * a permission store table as a single a(sa{sas}v) variant. The bulk
+ * GetAll call is used when the running permission store supports it;
+ * otherwise this falls back to a List call plus one Lookup per ID,
+ * which is much slower on large tables. */
+gboolean
+get_permission_table_entries (XdpDbusPermissionStore *store,
+                              const char             *table,
+                              GVariant              **out_entries,
+                              GCancellable           *cancellable,
+                              GError                **error)
+{
+  g_autoptr(GError) local_error = NULL;
+  g_auto(GStrv) ids = NULL;
+  GVariantBuilder builder;
+  int i;
+
+  if (xdp_dbus_permission_store_call_get_all_sync (store, table, out_entries,
+                                                   cancellable, &local_error))
+    return TRUE;
+
+  if (!g_error_matches (local_error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD))
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  if (!xdp_dbus_permission_store_call_list_sync (store, table, &ids, cancellable, error))
+    return FALSE;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(sa{sas}v)"));
+  for (i = 0; ids[i] != NULL; i++)
+    {
+      g_autoptr(GVariant) permissions = NULL;
+      g_autoptr(GVariant) data = NULL;
+
+      if (!xdp_dbus_permission_store_call_lookup_sync (store, table, ids[i],
+                                                       &permissions, &data,
+                                                       cancellable, error))
+        {
+          g_variant_builder_clear (&builder);
+          return FALSE;
+        }
+
+      g_variant_builder_add (&builder, "(s@a{sas}@v)", ids[i], permissions, data);
+    }
+
+  *out_entries = g_variant_ref_sink (g_variant_builder_end (&builder));
+  return TRUE;
+}
+
 /*** column handling ***/
 
 static gboolean
@@ -1131,6 +1182,23 @@ as_store_find_app (AsStore    *store,
  * Returns: %TRUE if the cache exists and was loaded into @store; %FALSE
  *    otherwise
  */
+static char *
+get_remote_appstream_path (FlatpakDir *self,
+                           const char *remote_name,
+                           const char *arch)
+{
+  const char *install_path = flatpak_file_get_path_cached (flatpak_dir_get_path (self));
+
+  if (flatpak_dir_get_remote_oci (self, remote_name))
+    return g_build_filename (install_path, "appstream", remote_name,
+                             arch, "appstream.xml.gz",
+                             NULL);
+  else
+    return g_build_filename (install_path, "appstream", remote_name,
+                             arch, "active", "appstream.xml.gz",
+                             NULL);
+}
+
 gboolean
 flatpak_dir_load_appstream_store (FlatpakDir   *self,
                                   const gchar  *remote_name,
@@ -1139,7 +1207,6 @@ flatpak_dir_load_appstream_store (FlatpakDir   *self,
                                   GCancellable *cancellable,
                                   GError      **error)
 {
-  const char *install_path = flatpak_file_get_path_cached (flatpak_dir_get_path (self));
   g_autoptr(GFile) appstream_file = NULL;
   g_autofree char *appstream_path = NULL;
   g_autoptr(GError) local_error = NULL;
@@ -1148,14 +1215,7 @@ flatpak_dir_load_appstream_store (FlatpakDir   *self,
   if (arch == NULL)
     arch = flatpak_get_arch ();
 
-  if (flatpak_dir_get_remote_oci (self, remote_name))
-    appstream_path = g_build_filename (install_path, "appstream", remote_name,
-                                       arch, "appstream.xml.gz",
-                                       NULL);
-  else
-    appstream_path = g_build_filename (install_path, "appstream", remote_name,
-                                       arch, "active", "appstream.xml.gz",
-                                       NULL);
+  appstream_path = get_remote_appstream_path (self, remote_name, arch);
 
   appstream_file = g_file_new_for_path (appstream_path);
   as_store_from_file (store, appstream_file, NULL, cancellable, &local_error);
@@ -1173,6 +1233,206 @@ flatpak_dir_load_appstream_store (FlatpakDir   *self,
   return success;
 }
 
+/* Per-user caches of data derived from a remote's appstream XML, so
+ * repeated commands don't have to re-parse the XML every time. A cache
+ * file is keyed by a checksum of the appstream path, remote, locale and
+ * the mtime/size of the deployed appstream file, so any appstream
+ * update or locale change misses the cache and triggers a rebuild.
+ * Entries unused for 30 days are pruned whenever a new one is saved. */
+
+#define APPSTREAM_CACHE_MAX_AGE (30LL * 24 * 60 * 60)
+
+/* Returns NULL if there is no deployed appstream file to key a cache
+ * on, in which case the caller should just work from the XML. */
+GFile *
+flatpak_appstream_cache_file (FlatpakDir *dir,
+                              const char *remote,
+                              const char *arch,
+                              const char *kind)
+{
+  g_autofree char *appstream_path = NULL;
+  g_autoptr(GFileInfo) info = NULL;
+  g_autoptr(GFile) appstream_file = NULL;
+  g_autoptr(GChecksum) checksum = NULL;
+  g_autofree char *cache_basename = NULL;
+  g_autofree char *cache_path = NULL;
+  const char * const *languages = g_get_language_names ();
+  g_autofree char *mtime = NULL;
+
+  if (arch == NULL)
+    arch = flatpak_get_arch ();
+
+  appstream_path = get_remote_appstream_path (dir, remote, arch);
+  appstream_file = g_file_new_for_path (appstream_path);
+  info = g_file_query_info (appstream_file,
+                            G_FILE_ATTRIBUTE_TIME_MODIFIED "," G_FILE_ATTRIBUTE_STANDARD_SIZE,
+                            G_FILE_QUERY_INFO_NONE, NULL, NULL);
+  if (info == NULL)
+    return NULL;
+
+  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_checksum_update (checksum, (guchar *) "1", 2); /* Cache format version */
+  g_checksum_update (checksum, (guchar *) appstream_path, strlen (appstream_path) + 1);
+  g_checksum_update (checksum, (guchar *) remote, strlen (remote) + 1);
+  g_checksum_update (checksum, (guchar *) languages[0], strlen (languages[0]) + 1);
+
+  mtime = g_strdup_printf ("%" G_GUINT64_FORMAT ".%" G_GINT64_FORMAT,
+                           g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED),
+                           g_file_info_get_size (info));
+  g_checksum_update (checksum, (guchar *) mtime, strlen (mtime) + 1);
+
+  cache_basename = g_strconcat (kind, "-", g_checksum_get_string (checksum), NULL);
+  cache_path = g_build_filename (g_get_user_cache_dir (), "flatpak", "appstream-cache",
+                                 cache_basename, NULL);
+  return g_file_new_for_path (cache_path);
+}
+
+GVariant *
+flatpak_appstream_cache_load (GFile              *cache_file,
+                              const GVariantType *type)
+{
+  g_autoptr(GMappedFile) mfile = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) cache = NULL;
+
+  mfile = g_mapped_file_new (flatpak_file_get_path_cached (cache_file), FALSE, NULL);
+  if (mfile == NULL)
+    return NULL;
+
+  bytes = g_mapped_file_get_bytes (mfile);
+  cache = g_variant_ref_sink (g_variant_new_from_bytes (type, bytes, FALSE));
+  if (!g_variant_is_normal_form (cache))
+    return NULL;
+
+  return g_steal_pointer (&cache);
+}
+
+static void
+prune_appstream_cache_dir (GFile *cache_dir)
+{
+  g_autoptr(GFileEnumerator) dir_enum = NULL;
+  g_autoptr(GFileInfo) child_info = NULL;
+  guint64 now = g_get_real_time () / G_USEC_PER_SEC;
+
+  dir_enum = g_file_enumerate_children (cache_dir,
+                                        G_FILE_ATTRIBUTE_STANDARD_NAME "," G_FILE_ATTRIBUTE_TIME_MODIFIED,
+                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                        NULL, NULL);
+  if (dir_enum == NULL)
+    return;
+
+  while ((child_info = g_file_enumerator_next_file (dir_enum, NULL, NULL)))
+    {
+      guint64 mtime = g_file_info_get_attribute_uint64 (child_info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+
+      if (mtime < now && now - mtime > APPSTREAM_CACHE_MAX_AGE)
+        {
+          g_autoptr(GFile) child = g_file_get_child (cache_dir, g_file_info_get_name (child_info));
+          g_file_delete (child, NULL, NULL);
+        }
+
+      g_clear_object (&child_info);
+    }
+}
+
+void
+flatpak_appstream_cache_save (GFile    *cache_file,
+                              GVariant *data)
+{
+  g_autoptr(GFile) cache_dir = g_file_get_parent (cache_file);
+  g_autoptr(GError) local_error = NULL;
+
+  if (!flatpak_mkdir_p (cache_dir, NULL, &local_error) ||
+      !g_file_replace_contents (cache_file,
+                                g_variant_get_data (data), g_variant_get_size (data),
+                                NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION,
+                                NULL, NULL, &local_error))
+    {
+      g_debug ("Can't save appstream cache: %s", local_error->message);
+      return;
+    }
+
+  prune_appstream_cache_dir (cache_dir);
+}
+
+/**
+ * flatpak_dir_load_compiled_appstream:
+ * @self: a #FlatpakDir
+ * @remote_name: name of the remote to load the AppStream data for
+ * @arch: (nullable): name of the architecture to load the AppStream data for,
+ *    or %NULL to use the default
+ * @cancellable: (nullable): a #GCancellable, or %NULL
+ *
+ * Load the remote's appstream data compiled down to a dictionary from
+ * flatpak ref (the default bundle id) to the (name, description,
+ * version, license) for the current locale. The compiled form is cached
+ * per user, so only the first call after an appstream update pays for
+ * the XML parsing.
+ *
+ * Returns: (transfer full): the compiled dictionary, or %NULL if there
+ *    is no appstream data
+ */
+GVariant *
+flatpak_dir_load_compiled_appstream (FlatpakDir   *self,
+                                     const gchar  *remote_name,
+                                     const gchar  *arch,
+                                     GCancellable *cancellable)
+{
+  g_autoptr(GFile) cache_file = NULL;
+  g_autoptr(GVariant) compiled = NULL;
+  g_autoptr(AsStore) store = NULL;
+  GVariantBuilder builder;
+  GPtrArray *apps;
+  guint i;
+
+  cache_file = flatpak_appstream_cache_file (self, remote_name, arch, "compiled");
+  if (cache_file != NULL)
+    {
+      compiled = flatpak_appstream_cache_load (cache_file, FLATPAK_COMPILED_APPSTREAM_GVARIANT_FORMAT);
+      if (compiled != NULL)
+        return g_steal_pointer (&compiled);
+    }
+
+  store = as_store_new ();
+
+#if AS_CHECK_VERSION (0, 6, 1)
+  as_store_set_add_flags (store, as_store_get_add_flags (store) | AS_STORE_ADD_FLAG_USE_UNIQUE_ID);
+#endif
+
+  if (!flatpak_dir_load_appstream_store (self, remote_name, arch, store, cancellable, NULL))
+    return NULL;
+
+  g_variant_builder_init (&builder, FLATPAK_COMPILED_APPSTREAM_GVARIANT_FORMAT);
+
+  apps = as_store_get_apps (store);
+  for (i = 0; i < apps->len; i++)
+    {
+      AsApp *app = g_ptr_array_index (apps, i);
+      AsBundle *bundle = as_app_get_bundle_default (app);
+
+      if (bundle == NULL ||
+#if AS_CHECK_VERSION (0, 5, 15)
+          as_bundle_get_kind (bundle) != AS_BUNDLE_KIND_FLATPAK ||
+#endif
+          as_bundle_get_id (bundle) == NULL)
+        continue;
+
+      g_variant_builder_add (&builder, "{s(ssss)}",
+                             as_bundle_get_id (bundle),
+                             as_app_get_localized_name (app) ?: "",
+                             as_app_get_localized_comment (app) ?: "",
+                             as_app_get_version (app) ?: "",
+                             as_app_get_project_license (app) ?: "");
+    }
+
+  compiled = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  if (cache_file != NULL)
+    flatpak_appstream_cache_save (cache_file, compiled);
+
+  return g_steal_pointer (&compiled);
+}
+
 
 void
 print_aligned (int len, const char *title, const char *value)
@@ -105,6 +105,11 @@ gboolean update_appstream (GPtrArray    *dirs,
                            GError      **error);
 
 char ** get_permission_tables (XdpDbusPermissionStore *store);
+gboolean get_permission_table_entries (XdpDbusPermissionStore *store,
+                                       const char             *table,
+                                       GVariant              **out_entries,
+                                       GCancellable           *cancellable,
+                                       GError                **error);
 gboolean reset_permissions_for_app (const char *app_id,
                                     GError    **error);
 
@@ -165,6 +170,24 @@ gboolean    flatpak_dir_load_appstream_store (FlatpakDir   *self,
                                               GCancellable *cancellable,
                                               GError      **error);
 
+GFile *     flatpak_appstream_cache_file (FlatpakDir *dir,
+                                          const char *remote,
+                                          const char *arch,
+                                          const char *kind);
+GVariant *  flatpak_appstream_cache_load (GFile              *cache_file,
+                                          const GVariantType *type);
+void        flatpak_appstream_cache_save (GFile    *cache_file,
+                                          GVariant *data);
+
+/* Maps flatpak ref -> (name, description, version, license) */
+#define FLATPAK_COMPILED_APPSTREAM_GVARIANT_STRING "a{s(ssss)}"
+#define FLATPAK_COMPILED_APPSTREAM_GVARIANT_FORMAT G_VARIANT_TYPE (FLATPAK_COMPILED_APPSTREAM_GVARIANT_STRING)
+
+GVariant *  flatpak_dir_load_compiled_appstream (FlatpakDir   *self,
+                                                 const gchar  *remote_name,
+                                                 const gchar  *arch,
+                                                 GCancellable *cancellable);
+
 int         cell_width (const char *text);
 const char *cell_advance (const char *text,
                           int         num);
@@ -201,7 +201,7 @@ flatpak_complete_partial_ref (FlatpakCompletion *completion,
                                            (element > 2) ? arch : only_arch,
                                            NULL, /* default arch */
                                            matched_kinds,
-                                           FIND_MATCHING_REFS_FLAGS_NONE,
+                                           FIND_MATCHING_REFS_FLAGS_CACHED,
                                            NULL, &error);
     }
   else
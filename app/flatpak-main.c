@@ -42,6 +42,7 @@ G_DEFINE_AUTOPTR_CLEANUP_FUNC (AutoPolkitSubject, g_object_unref)
 #include "flatpak-builtins.h"
 #include "flatpak-builtins-utils.h"
 #include "flatpak-utils-private.h"
+#include "flatpak-profile-private.h"
 
 static int opt_verbose;
 static gboolean opt_ostree_verbose;
@@ -53,6 +54,7 @@ static gboolean opt_list_installations;
 static gboolean opt_user;
 static gboolean opt_system;
 static char **opt_installations;
+static char *opt_profile;
 static gboolean opt_help;
 
 static gboolean is_in_complete;
@@ -153,6 +155,7 @@ opt_verbose_cb (const gchar *option_name,
 GOptionEntry global_entries[] = {
   { "verbose", 'v', G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK, &opt_verbose_cb, N_("Show debug information, -vv for more detail"), NULL },
   { "ostree-verbose", 0, 0, G_OPTION_ARG_NONE, &opt_ostree_verbose, N_("Show OSTree debug information"), NULL },
+  { "profile", 0, 0, G_OPTION_ARG_FILENAME, &opt_profile, N_("Write a per-phase timing profile in JSON format to FILE"), N_("FILE") },
   { "help", '?', G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_NONE, &opt_help, NULL, NULL },
   { NULL }
 };
@@ -327,6 +330,9 @@ flatpak_option_context_parse (GOptionContext     *context,
   if (!g_option_context_parse (context, argc, argv, error))
     return FALSE;
 
+  if (opt_profile != NULL)
+    flatpak_profile_enable (opt_profile);
+
   /* We never want verbose output in the complete case, that breaks completion */
   if (is_in_complete)
     {
@@ -591,6 +597,24 @@ uninstall_polkit_agent (gpointer *agent)
 #endif
 }
 
+static gpointer polkit_agent = NULL;
+
+/* Registering the agent means talking to the session bus, which is not
+ * worth doing for the (common, often scripted) read-only commands that
+ * never talk to the system helper. It is instead done on demand, right
+ * before the first system-helper method call of the process. */
+static void
+install_polkit_agent_once (void)
+{
+  static gsize installed = 0;
+
+  if (g_once_init_enter (&installed))
+    {
+      polkit_agent = install_polkit_agent ();
+      g_once_init_leave (&installed, 1);
+    }
+}
+
 static int
 flatpak_run (int      argc,
              char   **argv,
@@ -603,8 +627,6 @@ flatpak_run (int      argc,
   gboolean success = FALSE;
   const char *command_name = NULL;
 
-  __attribute__((cleanup (uninstall_polkit_agent))) gpointer polkit_agent = NULL;
-
   command = extract_command (&argc, argv, &command_name);
 
   if (!command->fn)
@@ -703,13 +725,15 @@ flatpak_run (int      argc,
 
   check_environment ();
 
-  polkit_agent = install_polkit_agent ();
+  flatpak_dir_set_system_helper_prepare_func (install_polkit_agent_once);
 
   if (!command->fn (argc, argv, cancellable, &error))
     goto out;
 
   success = TRUE;
 out:
+  uninstall_polkit_agent (&polkit_agent);
+
   /* Note: We allow failures with NULL error (it means don't print anything), useful when e.g. the user aborted */
   g_assert (!success || error == NULL);
 
@@ -822,6 +846,8 @@ main (int    argc,
 
   ret = flatpak_run (argc, argv, &error);
 
+  flatpak_profile_write ();
+
   if (error != NULL)
     {
       const char *prefix = "";
@@ -88,6 +88,10 @@ struct FlatpakTablePrinter
   char      *key;
   GPtrArray *current;
   int        n_columns;
+  int        n_widths;
+  int       *widths;  /* Running per-column maximums, see update_widths() */
+  int       *lwidths;
+  int       *rwidths;
 };
 
 FlatpakTablePrinter *
@@ -109,6 +113,9 @@ flatpak_table_printer_free (FlatpakTablePrinter *printer)
   g_ptr_array_free (printer->rows, TRUE);
   g_ptr_array_free (printer->current, TRUE);
   g_free (printer->key);
+  g_free (printer->widths);
+  g_free (printer->lwidths);
+  g_free (printer->rwidths);
   g_free (printer);
 }
 
@@ -302,14 +309,64 @@ flatpak_table_printer_sort (FlatpakTablePrinter *printer, GCompareFunc cmp)
   g_ptr_array_sort_with_data (printer->rows, cmp_row, cmp);
 }
 
+static void
+ensure_width_arrays (FlatpakTablePrinter *printer, int n_columns)
+{
+  int i;
+
+  if (n_columns <= printer->n_widths)
+    return;
+
+  printer->widths = g_renew (int, printer->widths, n_columns);
+  printer->lwidths = g_renew (int, printer->lwidths, n_columns);
+  printer->rwidths = g_renew (int, printer->rwidths, n_columns);
+  for (i = printer->n_widths; i < n_columns; i++)
+    {
+      printer->widths[i] = 0;
+      printer->lwidths[i] = 0;
+      printer->rwidths[i] = 0;
+    }
+  printer->n_widths = n_columns;
+}
+
+/* The column widths are maintained as cells are added, rather than by
+ * scanning all rows at print time, so that re-rendering the table (as
+ * the transaction progress display does on every update) doesn't cost
+ * a pass over the whole table. They only ever grow; shrinking them
+ * when a cell is replaced by a shorter one would make the layout jump
+ * around between renders.
+ */
+static void
+update_widths (FlatpakTablePrinter *printer, Cell *cell, int column)
+{
+  int width;
+
+  ensure_width_arrays (printer, column + 1);
+
+  if (cell->span)
+    width = 0;
+  else
+    width = cell_width (cell->text);
+  printer->widths[column] = MAX (printer->widths[column], width);
+  if (cell->align >= 0)
+    {
+      printer->lwidths[column] = MAX (printer->lwidths[column], cell->align);
+      printer->rwidths[column] = MAX (printer->rwidths[column], width - cell->align);
+    }
+}
+
 void
 flatpak_table_printer_finish_row (FlatpakTablePrinter *printer)
 {
   Row *row;
+  int i;
 
   if (printer->current->len == 0)
     return; /* Ignore empty rows */
 
+  for (i = 0; i < printer->current->len; i++)
+    update_widths (printer, g_ptr_array_index (printer->current, i), i);
+
   printer->n_columns = MAX (printer->n_columns, printer->current->len);
   row = g_new0 (Row, 1);
   row->cells = g_steal_pointer (&printer->current);
@@ -435,6 +492,20 @@ flatpak_table_printer_print_full (FlatpakTablePrinter *printer,
         col->skip = TRUE;
     }
 
+  /* Start from the running widths, leaving skipped columns at zero */
+  ensure_width_arrays (printer, printer->n_columns);
+  for (i = 0; i < printer->n_columns; i++)
+    {
+      TableColumn *col = peek_table_column (printer, i);
+
+      if (col && col->skip)
+        continue;
+
+      widths[i] = printer->widths[i];
+      lwidths[i] = printer->lwidths[i];
+      rwidths[i] = printer->rwidths[i];
+    }
+
   has_title = FALSE;
   for (i = 0; i < printer->columns->len && i < printer->n_columns; i++)
     {
@@ -450,32 +521,6 @@ flatpak_table_printer_print_full (FlatpakTablePrinter *printer,
         }
     }
 
-  for (i = 0; i < printer->rows->len; i++)
-    {
-      Row *row = g_ptr_array_index (printer->rows, i);
-
-      for (j = 0; j < row->cells->len; j++)
-        {
-          Cell *cell = g_ptr_array_index (row->cells, j);
-          TableColumn *col = peek_table_column (printer, j);
-          int width;
-
-          if (col && col->skip)
-            continue;
-
-          if (cell->span)
-            width = 0;
-          else
-            width = cell_width (cell->text);
-          widths[j] = MAX (widths[j], width);
-          if (cell->align >= 0)
-            {
-              lwidths[j] = MAX (lwidths[j], cell->align);
-              rwidths[j] = MAX (rwidths[j], width - cell->align);
-            }
-        }
-    }
-
   width = printer->n_columns - 1;
   for (i = 0; i < printer->n_columns; i++)
     width += widths[i];
@@ -719,6 +764,8 @@ set_cell (FlatpakTablePrinter *printer,
   g_free (cell->text);
   cell->text = g_strdup (text);
   cell->align = align;
+
+  update_widths (printer, cell, c);
 }
 
 void
@@ -0,0 +1,162 @@
+#!/bin/bash
+#
+# Launch latency benchmark. Installs a trivial app into a scratch
+# installation and measures time-to-first-instruction in the sandbox:
+# the wall time from just before invoking flatpak run until the app's
+# command executes and reports its own clock. Cold runs drop the page
+# cache first (needs root); warm runs reuse it. Per-phase setup times
+# come from the FLATPAK_TRACE_STARTUP span lines emitted by
+# flatpak-run.c.
+#
+# Exits nonzero if the warm mean exceeds the SLO (default 300 ms), so
+# CI can gate on launch latency. Numbers are machine specific.
+
+set -euo pipefail
+
+FLATPAK=${FLATPAK:-flatpak}
+top_srcdir=$(cd "$(dirname "$0")/.." && pwd)
+
+N_WARM=20
+N_COLD=5
+SLO_MS=300
+
+usage () {
+    sed -ne 's/^    //; /^Usage:/,/^$/p' <<EOF
+    Usage: $0 [OPTION…]
+
+      --warm N      Warm launches to average (default $N_WARM)
+      --cold N      Cold launches to average (default $N_COLD)
+      --slo-ms MS   Fail if the warm mean exceeds this (default $SLO_MS)
+
+EOF
+}
+
+while [ $# -gt 0 ]; do
+    case "$1" in
+        --warm) N_WARM=$2; shift 2 ;;
+        --cold) N_COLD=$2; shift 2 ;;
+        --slo-ms) SLO_MS=$2; shift 2 ;;
+        --help) usage; exit 0 ;;
+        *) echo "Unknown option $1" >&2; usage >&2; exit 1 ;;
+    esac
+done
+
+workdir=$(mktemp -d /var/tmp/flatpak-benchmark-XXXXXX)
+
+cleanup () {
+    rm -rf "${workdir}"
+}
+trap cleanup EXIT
+
+export FLATPAK_USER_DIR=${workdir}/user
+export FLATPAK_SYSTEM_DIR=${workdir}/system
+export FLATPAK_CONFIG_DIR=${workdir}/config
+mkdir -p "${FLATPAK_USER_DIR}" "${FLATPAK_SYSTEM_DIR}" "${FLATPAK_CONFIG_DIR}"
+
+ARCH=$(${FLATPAK} --default-arch)
+
+echo "Building benchmark runtime and app"
+(cd "${workdir}" &&
+     bash "${top_srcdir}/tests/make-test-runtime.sh" repo org.benchmark.Platform master "" date > /dev/null)
+
+appdir=${workdir}/app
+mkdir -p "${appdir}/files/bin"
+cat > "${appdir}/metadata" <<EOF
+[Application]
+name=org.benchmark.Hello
+runtime=org.benchmark.Platform/${ARCH}/master
+EOF
+# The app's job is to report, as early as possible, the time at which
+# the first sandboxed instruction ran
+cat > "${appdir}/files/bin/now.sh" <<'EOF'
+#!/bin/sh
+exec date +%s%N
+EOF
+chmod a+x "${appdir}/files/bin/now.sh"
+${FLATPAK} build-finish --command=now.sh "${appdir}" > /dev/null
+${FLATPAK} build-export --disable-fsync "${workdir}/repo" "${appdir}" master > /dev/null
+
+${FLATPAK} --user remote-add --no-gpg-verify benchmark-repo "file://${workdir}/repo"
+${FLATPAK} --user install -y --noninteractive benchmark-repo org.benchmark.Hello > /dev/null
+
+drop_caches () {
+    sync
+    echo 3 > /proc/sys/vm/drop_caches
+}
+
+can_drop_caches=false
+if [ -w /proc/sys/vm/drop_caches ]; then
+    can_drop_caches=true
+else
+    echo "Not root: skipping cold runs (cannot drop the page cache)"
+    N_COLD=0
+fi
+
+# One launch; prints the latency in microseconds, appends the
+# per-phase trace to $1
+measure_launch () {
+    local trace=$1
+    local start app_ns
+
+    start=$(date +%s%N)
+    app_ns=$(FLATPAK_TRACE_STARTUP=1 ${FLATPAK} run org.benchmark.Hello 2>> "${trace}")
+    echo $(( (app_ns - start) / 1000 ))
+}
+
+run_mode () {
+    # $1 = label, $2 = run count, $3 = drop caches first (true/false)
+    local label=$1 count=$2 cold=$3
+    local trace=${workdir}/trace-${label}
+    local times=${workdir}/times-${label}
+    local i us
+
+    : > "${trace}"
+    : > "${times}"
+    for i in $(seq "${count}"); do
+        if ${cold}; then
+            drop_caches
+        fi
+        us=$(measure_launch "${trace}")
+        echo "${us}" >> "${times}"
+    done
+
+    python3 - "${label}" "${times}" "${trace}" <<'EOF'
+import re, sys
+label, times_file, trace_file = sys.argv[1:]
+times = sorted(int(l) for l in open(times_file) if l.strip())
+mean = sum(times) / len(times)
+print("%s: %d runs, time to first instruction: min %.1f ms, mean %.1f ms, max %.1f ms"
+      % (label, len(times), times[0] / 1000, mean / 1000, times[-1] / 1000))
+phases = {}
+order = []
+for line in open(trace_file):
+    m = re.match(r"FLATPAK_TRACE_STARTUP: phase=(\S+) total_us=\d+ span_us=(\d+)", line)
+    if m:
+        phase, span = m.group(1), int(m.group(2))
+        if phase not in phases:
+            phases[phase] = []
+            order.append(phase)
+        phases[phase].append(span)
+for phase in order:
+    spans = phases[phase]
+    print("  %-20s mean %8.1f ms  max %8.1f ms"
+          % (phase, sum(spans) / len(spans) / 1000, max(spans) / 1000))
+print("MEAN_US %d" % mean)
+EOF
+}
+
+if [ "${N_COLD}" -gt 0 ]; then
+    run_mode cold "${N_COLD}" true | grep -v ^MEAN_US
+    # Leave the caches warm again for the runs below
+    ${FLATPAK} run org.benchmark.Hello > /dev/null
+fi
+
+warm_out=$(run_mode warm "${N_WARM}" false)
+echo "${warm_out}" | grep -v ^MEAN_US
+warm_mean_us=$(echo "${warm_out}" | sed -ne 's/^MEAN_US //p')
+
+if [ "$((warm_mean_us / 1000))" -gt "${SLO_MS}" ]; then
+    echo "FAIL: warm mean $((warm_mean_us / 1000)) ms exceeds the ${SLO_MS} ms SLO"
+    exit 1
+fi
+echo "OK: warm mean $((warm_mean_us / 1000)) ms within the ${SLO_MS} ms SLO"
@@ -0,0 +1,168 @@
+#!/bin/bash
+#
+# End-to-end transaction benchmark. Generates a synthetic repo of
+# configurable size/shape, serves it over local HTTP, and times
+# install and update transactions into a scratch installation,
+# breaking out resolve/pull/deploy via the global --profile option.
+#
+# Typical use, comparing parallelism or delta settings before rolling
+# them out:
+#
+#   ./benchmark-transaction.sh --refs 4 --files 2000 --file-size 8192 --runs 5
+#
+# Numbers are machine and filesystem specific; compare runs on the
+# same host only.
+
+set -euo pipefail
+
+FLATPAK=${FLATPAK:-flatpak}
+
+N_REFS=2
+N_FILES=1000
+FILE_SIZE=16384
+N_BIG_FILES=4
+BIG_FILE_SIZE=$((32 * 1024 * 1024))
+N_RUNS=3
+
+usage () {
+    sed -ne 's/^    //; /^Usage:/,/^$/p' <<EOF
+    Usage: $0 [OPTION…]
+
+      --refs N          Number of synthetic runtime refs (default $N_REFS)
+      --files N         Small files per ref (default $N_FILES)
+      --file-size BYTES Size of each small file (default $FILE_SIZE)
+      --big-files N     Big files per ref (default $N_BIG_FILES)
+      --big-size BYTES  Size of each big file (default $BIG_FILE_SIZE)
+      --runs N          Install/update iterations to average (default $N_RUNS)
+
+EOF
+}
+
+while [ $# -gt 0 ]; do
+    case "$1" in
+        --refs) N_REFS=$2; shift 2 ;;
+        --files) N_FILES=$2; shift 2 ;;
+        --file-size) FILE_SIZE=$2; shift 2 ;;
+        --big-files) N_BIG_FILES=$2; shift 2 ;;
+        --big-size) BIG_FILE_SIZE=$2; shift 2 ;;
+        --runs) N_RUNS=$2; shift 2 ;;
+        --help) usage; exit 0 ;;
+        *) echo "Unknown option $1" >&2; usage >&2; exit 1 ;;
+    esac
+done
+
+workdir=$(mktemp -d /var/tmp/flatpak-benchmark-XXXXXX)
+httpd_pid=
+
+cleanup () {
+    [ -n "${httpd_pid}" ] && kill "${httpd_pid}" 2>/dev/null || true
+    rm -rf "${workdir}"
+}
+trap cleanup EXIT
+
+# Keep everything away from the real installations
+export FLATPAK_USER_DIR=${workdir}/user
+export FLATPAK_SYSTEM_DIR=${workdir}/system
+export FLATPAK_CONFIG_DIR=${workdir}/config
+mkdir -p "${FLATPAK_USER_DIR}" "${FLATPAK_SYSTEM_DIR}" "${FLATPAK_CONFIG_DIR}"
+
+make_payload () {
+    # $1 = build dir, $2 = generation (changes a third of the files)
+    local dir=$1 generation=$2 i
+    mkdir -p "${dir}/usr/share/data" "${dir}/files"
+
+    for i in $(seq "${N_FILES}"); do
+        if [ "${generation}" = 0 ] || [ $((i % 3)) = 0 ]; then
+            head -c "${FILE_SIZE}" /dev/urandom > "${dir}/usr/share/data/small-${i}"
+        fi
+    done
+    for i in $(seq "${N_BIG_FILES}"); do
+        if [ "${generation}" = 0 ] || [ "${i}" = 1 ]; then
+            head -c "${BIG_FILE_SIZE}" /dev/urandom > "${dir}/usr/share/data/big-${i}"
+        fi
+    done
+}
+
+make_ref () {
+    # $1 = ref index, $2 = generation
+    local idx=$1 generation=$2
+    local id="org.benchmark.Payload${idx}"
+    local dir=${workdir}/build/${id}
+
+    if [ "${generation}" = 0 ]; then
+        cat > "${dir}-metadata" <<EOF
+[Runtime]
+name=${id}
+EOF
+        mkdir -p "${dir}"
+        cp "${dir}-metadata" "${dir}/metadata"
+    fi
+    make_payload "${dir}" "${generation}"
+
+    ${FLATPAK} build-export --runtime --disable-fsync --arch="$(${FLATPAK} --default-arch)" \
+               "${workdir}/repo" "${dir}" master > /dev/null
+}
+
+echo "Generating synthetic repo: ${N_REFS} refs, ${N_FILES} x ${FILE_SIZE}B + ${N_BIG_FILES} x ${BIG_FILE_SIZE}B each"
+ostree --repo="${workdir}/repo" init --mode=archive-z2
+for r in $(seq 0 $((N_REFS - 1))); do
+    make_ref "${r}" 0
+done
+${FLATPAK} build-update-repo --generate-static-deltas "${workdir}/repo" > /dev/null
+
+(cd "${workdir}/repo" && python3 -m http.server 0 --bind 127.0.0.1 > "${workdir}/httpd-out" 2>&1) &
+httpd_pid=$!
+for x in $(seq 100); do
+    port=$(sed -ne 's/.*port \([0-9]*\).*/\1/p' "${workdir}/httpd-out" | head -1)
+    [ -n "${port}" ] && break
+    sleep 0.1
+done
+[ -n "${port}" ] || { echo "Web server did not start" >&2; exit 1; }
+
+${FLATPAK} --user remote-add --no-gpg-verify benchmark-repo "http://127.0.0.1:${port}"
+
+# Pulls the named phases out of a --profile JSON report
+phase_times () {
+    python3 - "$1" <<'EOF'
+import json, sys
+from collections import defaultdict
+report = json.load(open(sys.argv[1]))
+totals = defaultdict(int)
+for span in report["phases"]:
+    totals[span["phase"]] += span["wall_us"]
+print("total %d" % report["total"]["wall_us"])
+for phase in ("resolve", "pull", "deploy"):
+    print("%s %d" % (phase, totals.get(phase, 0)))
+EOF
+}
+
+report_run () {
+    # $1 = label, $2 = profile file
+    phase_times "$2" | while read -r phase us; do
+        printf '  %-10s %-8s %8.1f ms\n' "$1" "${phase}" "$(echo "${us}" | awk '{print $1 / 1000}')"
+    done
+}
+
+for run in $(seq "${N_RUNS}"); do
+    echo "== Run ${run}/${N_RUNS}"
+
+    refs=
+    for r in $(seq 0 $((N_REFS - 1))); do
+        refs="${refs} org.benchmark.Payload${r}"
+    done
+
+    ${FLATPAK} --user --profile="${workdir}/install.json" install -y --noninteractive \
+               benchmark-repo ${refs} > /dev/null
+    report_run install "${workdir}/install.json"
+
+    # Mutate a third of the files and time the delta update
+    for r in $(seq 0 $((N_REFS - 1))); do
+        make_ref "${r}" 1
+    done
+    ${FLATPAK} build-update-repo --generate-static-deltas "${workdir}/repo" > /dev/null
+
+    ${FLATPAK} --user --profile="${workdir}/update.json" update -y --noninteractive > /dev/null
+    report_run update "${workdir}/update.json"
+
+    ${FLATPAK} --user uninstall -y --noninteractive ${refs} > /dev/null
+done
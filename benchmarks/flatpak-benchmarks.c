@@ -0,0 +1,291 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+/* Microbenchmarks for the libflatpak-common hot paths that show up in
+ * profiles of resolve and launch: ref decomposition, summary lookups,
+ * context merging and bwrap argv assembly. Reports ns/op per case;
+ * with --baseline=FILE the results are compared against a previously
+ * saved run (--save-baseline=FILE) and the exit status reflects
+ * whether any case regressed by more than 10%, so CI can gate on it.
+ * Absolute numbers are machine specific: only compare baselines
+ * recorded on the same hardware. */
+
+#include "config.h"
+
+#include <locale.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "flatpak-utils-private.h"
+#include "flatpak-context-private.h"
+#include "flatpak-bwrap-private.h"
+
+#define SYNTHETIC_N_REFS 50000
+
+static GVariant *synthetic_summary;
+static GVariant *synthetic_refs;
+static GKeyFile *context_metakey;
+
+typedef void (*BenchFunc) (void);
+
+typedef struct
+{
+  const char *name;
+  BenchFunc   func;
+} Benchmark;
+
+static void
+bench_decompose_ref (void)
+{
+  g_auto(GStrv) parts = flatpak_decompose_ref ("app/org.gnome.gedit/x86_64/stable", NULL);
+
+  g_assert (parts != NULL);
+}
+
+static void
+bench_summary_lookup_ref (void)
+{
+  g_autofree char *checksum = NULL;
+
+  if (!flatpak_summary_lookup_ref (synthetic_summary, NULL,
+                                   "app/org.benchmark.App025000/x86_64/stable",
+                                   &checksum, NULL))
+    g_assert_not_reached ();
+}
+
+static void
+bench_variant_bsearch_str (void)
+{
+  int pos;
+
+  if (!flatpak_variant_bsearch_str (synthetic_refs,
+                                    "app/org.benchmark.App049999/x86_64/stable",
+                                    &pos))
+    g_assert_not_reached ();
+}
+
+static void
+bench_context_merge (void)
+{
+  g_autoptr(FlatpakContext) app_context = flatpak_context_new ();
+  g_autoptr(FlatpakContext) overrides = flatpak_context_new ();
+
+  if (!flatpak_context_load_metadata (app_context, context_metakey, NULL) ||
+      !flatpak_context_load_metadata (overrides, context_metakey, NULL))
+    g_assert_not_reached ();
+
+  flatpak_context_merge (app_context, overrides);
+}
+
+static void
+bench_bwrap_assembly (void)
+{
+  g_autoptr(FlatpakBwrap) bwrap = flatpak_bwrap_new (NULL);
+  int i;
+
+  flatpak_bwrap_add_args (bwrap,
+                          "bwrap",
+                          "--ro-bind", "/usr", "/usr",
+                          "--dir", "/tmp",
+                          "--proc", "/proc",
+                          "--dev", "/dev",
+                          "--unshare-pid",
+                          "--die-with-parent",
+                          NULL);
+  for (i = 0; i < 32; i++)
+    {
+      g_autofree char *path = g_strdup_printf ("/app/extension-%d", i);
+
+      flatpak_bwrap_add_args (bwrap, "--ro-bind", path, path, NULL);
+    }
+  flatpak_bwrap_set_env (bwrap, "LD_LIBRARY_PATH", "/app/lib", TRUE);
+  flatpak_bwrap_finish (bwrap);
+}
+
+static Benchmark benchmarks[] = {
+  { "decompose-ref", bench_decompose_ref },
+  { "summary-lookup-ref", bench_summary_lookup_ref },
+  { "variant-bsearch-str", bench_variant_bsearch_str },
+  { "context-merge", bench_context_merge },
+  { "bwrap-assembly", bench_bwrap_assembly },
+};
+
+static void
+build_fixtures (void)
+{
+  GVariantBuilder refs_builder;
+  guchar csum[32] = { 0 };
+  const char *metadata =
+    "[Context]\n"
+    "shared=network;ipc;\n"
+    "sockets=x11;wayland;pulseaudio;session-bus;\n"
+    "devices=dri;\n"
+    "filesystems=host;xdg-documents;~/Projects;\n"
+    "[Environment]\n"
+    "GTK_THEME=Adwaita\n"
+    "MOZ_ENABLE_WAYLAND=1\n";
+  int i;
+
+  /* Matches OSTREE_SUMMARY_GVARIANT_FORMAT; the zero padded names keep
+   * the refs list sorted, as flatpak_variant_bsearch_str requires */
+  g_variant_builder_init (&refs_builder, G_VARIANT_TYPE ("a(s(taya{sv}))"));
+  for (i = 0; i < SYNTHETIC_N_REFS; i++)
+    {
+      g_autofree char *ref = g_strdup_printf ("app/org.benchmark.App%06d/x86_64/stable", i);
+
+      memcpy (csum, &i, sizeof i);
+      g_variant_builder_add (&refs_builder, "(s(t@ay@a{sv}))", ref,
+                             G_GUINT64_CONSTANT (0),
+                             g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE, csum, sizeof csum, 1),
+                             g_variant_new_array (G_VARIANT_TYPE ("{sv}"), NULL, 0));
+    }
+
+  synthetic_summary =
+    g_variant_ref_sink (g_variant_new ("(@a(s(taya{sv}))@a{sv})",
+                                       g_variant_builder_end (&refs_builder),
+                                       g_variant_new_array (G_VARIANT_TYPE ("{sv}"), NULL, 0)));
+  synthetic_refs = g_variant_get_child_value (synthetic_summary, 0);
+
+  context_metakey = g_key_file_new ();
+  if (!g_key_file_load_from_data (context_metakey, metadata, -1, G_KEY_FILE_NONE, NULL))
+    g_assert_not_reached ();
+}
+
+static double
+measure_ns_per_op (BenchFunc func)
+{
+  gint64 start, elapsed;
+  int iters = 1;
+  int i;
+
+  /* Warm up caches and lazy initialization */
+  for (i = 0; i < 16; i++)
+    func ();
+
+  /* Grow the batch until a run is long enough to time reliably */
+  for (;;)
+    {
+      start = g_get_monotonic_time ();
+      for (i = 0; i < iters; i++)
+        func ();
+      elapsed = g_get_monotonic_time () - start;
+
+      if (elapsed >= 200000 /* 200 ms */ || iters >= G_MAXINT / 4)
+        break;
+
+      iters *= 4;
+    }
+
+  return (double) elapsed * 1000.0 / iters;
+}
+
+static char *opt_baseline;
+static char *opt_save_baseline;
+
+static GOptionEntry entries[] = {
+  { "baseline", 0, 0, G_OPTION_ARG_FILENAME, &opt_baseline, "Compare results against a saved baseline", "FILE" },
+  { "save-baseline", 0, 0, G_OPTION_ARG_FILENAME, &opt_save_baseline, "Save results as a new baseline", "FILE" },
+  { NULL }
+};
+
+int
+main (int argc, char **argv)
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GHashTable) baseline = NULL;
+  g_autoptr(GString) results = g_string_new ("");
+  gboolean regressed = FALSE;
+  int i;
+
+  setlocale (LC_ALL, "");
+
+  context = g_option_context_new ("- libflatpak microbenchmarks");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+
+  if (opt_baseline != NULL)
+    {
+      g_autofree char *contents = NULL;
+      g_auto(GStrv) lines = NULL;
+
+      if (!g_file_get_contents (opt_baseline, &contents, NULL, &error))
+        {
+          g_printerr ("Failed to load baseline: %s\n", error->message);
+          return 1;
+        }
+
+      baseline = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+      lines = g_strsplit (contents, "\n", -1);
+      for (i = 0; lines[i] != NULL; i++)
+        {
+          g_auto(GStrv) fields = g_strsplit (lines[i], " ", 2);
+
+          if (fields[0] != NULL && fields[0][0] != 0 && fields[1] != NULL)
+            g_hash_table_insert (baseline, g_strdup (fields[0]), g_strdup (fields[1]));
+        }
+    }
+
+  build_fixtures ();
+
+  for (i = 0; i < (int) G_N_ELEMENTS (benchmarks); i++)
+    {
+      double ns = measure_ns_per_op (benchmarks[i].func);
+      const char *old;
+
+      g_print ("%-24s %12.1f ns/op", benchmarks[i].name, ns);
+
+      if (baseline != NULL &&
+          (old = g_hash_table_lookup (baseline, benchmarks[i].name)) != NULL)
+        {
+          double old_ns = g_ascii_strtod (old, NULL);
+
+          if (old_ns > 0)
+            {
+              double delta = (ns - old_ns) * 100.0 / old_ns;
+
+              g_print ("  %+6.1f%% vs baseline", delta);
+              if (delta > 10.0)
+                {
+                  g_print ("  REGRESSION");
+                  regressed = TRUE;
+                }
+            }
+        }
+
+      g_print ("\n");
+
+      g_string_append_printf (results, "%s %.1f\n", benchmarks[i].name, ns);
+    }
+
+  if (opt_save_baseline != NULL &&
+      !g_file_set_contents (opt_save_baseline, results->str, results->len, &error))
+    {
+      g_printerr ("Failed to save baseline: %s\n", error->message);
+      return 1;
+    }
+
+  return regressed ? 1 : 0;
+}
@@ -23,11 +23,12 @@
 
 #include <glib.h>
 
-gboolean flatpak_parse_appdata (const char  *appdata,
-                                const char  *app_id,
-                                GHashTable **names,
-                                GHashTable **comments,
-                                char       **version,
-                                char       **license);
+gboolean flatpak_parse_appdata (const char         *appdata,
+                                const char         *app_id,
+                                const char * const *locales,
+                                GHashTable        **names,
+                                GHashTable        **comments,
+                                char              **version,
+                                char              **license);
 
 #endif /* __FLATPAK_APPDATA_PRIVATE_H__ */
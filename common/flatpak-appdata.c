@@ -21,9 +21,11 @@
 #include "config.h"
 
 #include "flatpak-appdata-private.h"
+#include "flatpak-memory-private.h"
 #include "flatpak-utils-private.h"
 #include <gio/gio.h>
 #include <stdio.h>
+#include <string.h>
 
 typedef struct
 {
@@ -42,6 +44,11 @@ typedef struct
   gboolean   in_component;
   char      *lang;
   guint64    timestamp;
+
+  const char         *app_id;
+  char               *legacy_id;
+  const char * const *locales;
+  gboolean            found;
 } ParserData;
 
 static void
@@ -74,6 +81,7 @@ parser_data_free (ParserData *data)
   g_ptr_array_unref (data->components);
   g_string_free (data->text, TRUE);
   g_free (data->lang);
+  g_free (data->legacy_id);
 
   g_free (data);
 }
@@ -81,16 +89,42 @@ parser_data_free (ParserData *data)
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (ParserData, parser_data_free)
 
 static ParserData *
-parser_data_new (void)
+parser_data_new (const char         *app_id,
+                 const char * const *locales)
 {
   ParserData *data = g_new0 (ParserData, 1);
 
   data->components = g_ptr_array_new_with_free_func (component_free);
   data->text = g_string_new ("");
+  data->app_id = app_id;
+  data->legacy_id = g_strconcat (app_id, ".desktop", NULL);
+  data->locales = locales;
 
   return data;
 }
 
+static gboolean
+want_locale (ParserData *data,
+             const char *lang)
+{
+  int i;
+
+  if (data->locales == NULL)
+    return TRUE;
+
+  /* The untranslated strings are the fallback for every locale */
+  if (g_str_equal (lang, "C"))
+    return TRUE;
+
+  for (i = 0; data->locales[i] != NULL; i++)
+    {
+      if (g_str_equal (data->locales[i], lang))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
 static void
 start_element (GMarkupParseContext *context,
                const char          *element_name,
@@ -128,7 +162,12 @@ start_element (GMarkupParseContext *context,
             data->lang = g_strdup (lang);
           else
             data->lang = g_strdup ("C");
-          data->in_text = TRUE;
+
+          /* Don't bother accumulating text for locales nobody asked for */
+          if (want_locale (data, data->lang))
+            data->in_text = TRUE;
+          else
+            g_clear_pointer (&data->lang, g_free);
         }
     }
   else if (g_str_equal (element_name, "project_license"))
@@ -224,16 +263,31 @@ end_element (GMarkupParseContext *context,
     }
   else if (g_str_equal (element_name, "name"))
     {
-      g_hash_table_insert (component->names, g_steal_pointer (&data->lang), g_steal_pointer (&text));
+      if (data->lang != NULL)
+        g_hash_table_insert (component->names, g_steal_pointer (&data->lang), g_steal_pointer (&text));
     }
   else if (g_str_equal (element_name, "summary"))
     {
-      g_hash_table_insert (component->comments, g_steal_pointer (&data->lang), g_steal_pointer (&text));
+      if (data->lang != NULL)
+        g_hash_table_insert (component->comments, g_steal_pointer (&data->lang), g_steal_pointer (&text));
     }
   else if (g_str_equal (element_name, "project_license"))
     {
       component->license = g_steal_pointer (&text);
     }
+  else if (g_str_equal (element_name, "component") &&
+           component->id != NULL &&
+           (g_str_equal (component->id, data->app_id) ||
+            g_str_equal (component->id, data->legacy_id)))
+    {
+      /* We have everything we were asked for, so stop the parse here
+       * rather than wading through the remaining components. GMarkup
+       * has no way to abort other than reporting an error, so the
+       * caller checks the found flag before trusting the return value. */
+      data->found = TRUE;
+      g_set_error_literal (error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT,
+                           "found requested component");
+    }
 }
 
 static void
@@ -249,13 +303,20 @@ text (GMarkupParseContext *context,
     g_string_append_len (data->text, text, text_len);
 }
 
+/* Extracts the name, summary, version and license of the component
+ * matching @app_id. If @locales is non-%NULL, only names and summaries
+ * for the listed locales (in the g_get_language_names() sense, plus the
+ * untranslated "C" fallback) are collected; %NULL collects all locales.
+ * The parse stops as soon as the matching component has been seen.
+ */
 gboolean
-flatpak_parse_appdata (const char  *appdata_xml,
-                       const char  *app_id,
-                       GHashTable **names,
-                       GHashTable **comments,
-                       char       **version,
-                       char       **license)
+flatpak_parse_appdata (const char         *appdata_xml,
+                       const char         *app_id,
+                       const char * const *locales,
+                       GHashTable        **names,
+                       GHashTable        **comments,
+                       char              **version,
+                       char              **license)
 {
   g_autoptr(GMarkupParseContext) context = NULL;
   GMarkupParser parser = {
@@ -265,36 +326,41 @@ flatpak_parse_appdata (const char  *appdata_xml,
     NULL,
     NULL
   };
-  g_autoptr(ParserData) data = parser_data_new ();
+  g_autoptr(ParserData) data = parser_data_new (app_id, locales);
   g_autoptr(GError) error = NULL;
+  gsize appdata_len = strlen (appdata_xml);
   int i;
-  g_autofree char *legacy_id = NULL;
+
+  flatpak_memory_alloc (FLATPAK_MEMORY_APPSTREAM, appdata_len);
 
   context = g_markup_parse_context_new (&parser, G_MARKUP_TREAT_CDATA_AS_TEXT, data, NULL);
 
-  if (!g_markup_parse_context_parse (context, appdata_xml, -1, &error))
+  if (!g_markup_parse_context_parse (context, appdata_xml, -1, &error) &&
+      !data->found)
     {
       g_warning ("Failed to parse appdata: %s", error->message);
+      flatpak_memory_free (FLATPAK_MEMORY_APPSTREAM, appdata_len);
       return FALSE;
     }
 
-  legacy_id = g_strconcat (app_id, ".desktop", NULL);
-
   for (i = 0; i < data->components->len; i++)
     {
       Component *component = g_ptr_array_index (data->components, i);
 
-      if (g_str_equal (component->id, app_id) ||
-          g_str_equal (component->id, legacy_id))
+      if (component->id != NULL &&
+          (g_str_equal (component->id, app_id) ||
+           g_str_equal (component->id, data->legacy_id)))
         {
           *names = g_hash_table_ref (component->names);
           *comments = g_hash_table_ref (component->comments);
           *version = g_steal_pointer (&component->version);
           *license = g_steal_pointer (&component->license);
+          flatpak_memory_free (FLATPAK_MEMORY_APPSTREAM, appdata_len);
           return TRUE;
         }
     }
 
   g_warning ("No matching appdata for %s", app_id);
+  flatpak_memory_free (FLATPAK_MEMORY_APPSTREAM, appdata_len);
   return FALSE;
 }
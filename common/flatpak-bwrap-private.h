@@ -23,10 +23,11 @@
 
 typedef struct
 {
-  GPtrArray *argv;
-  GArray    *noinherit_fds; /* Just keep these open while the bwrap lives */
-  GArray    *fds;
-  GStrv      envp;
+  GPtrArray    *argv;      /* Strings are owned by str_arena, not the array */
+  GStringChunk *str_arena; /* Arena for the argv strings */
+  GArray       *noinherit_fds; /* Just keep these open while the bwrap lives */
+  GArray       *fds;
+  GStrv         envp;
 } FlatpakBwrap;
 
 extern char *flatpak_bwrap_empty_env[1];
@@ -56,7 +56,11 @@ flatpak_bwrap_new (char **env)
 {
   FlatpakBwrap *bwrap = g_new0 (FlatpakBwrap, 1);
 
-  bwrap->argv = g_ptr_array_new_with_free_func (g_free);
+  /* The argv strings live in a shared arena rather than being
+     individually allocated, as a full launch appends thousands of
+     them. They are freed all at once with the bwrap. */
+  bwrap->argv = g_ptr_array_new ();
+  bwrap->str_arena = g_string_chunk_new (4096);
   bwrap->noinherit_fds = g_array_new (FALSE, TRUE, sizeof (int));
   g_array_set_clear_func (bwrap->noinherit_fds, clear_fd);
   bwrap->fds = g_array_new (FALSE, TRUE, sizeof (int));
@@ -74,6 +78,7 @@ void
 flatpak_bwrap_free (FlatpakBwrap *bwrap)
 {
   g_ptr_array_unref (bwrap->argv);
+  g_string_chunk_free (bwrap->str_arena);
   g_array_unref (bwrap->noinherit_fds);
   g_array_unref (bwrap->fds);
   g_strfreev (bwrap->envp);
@@ -105,7 +110,7 @@ flatpak_bwrap_unset_env (FlatpakBwrap *bwrap,
 void
 flatpak_bwrap_add_arg (FlatpakBwrap *bwrap, const char *arg)
 {
-  g_ptr_array_add (bwrap->argv, g_strdup (arg));
+  g_ptr_array_add (bwrap->argv, g_string_chunk_insert (bwrap->str_arena, arg));
 }
 
 void
@@ -131,11 +136,29 @@ flatpak_bwrap_add_fd (FlatpakBwrap *bwrap,
 void
 flatpak_bwrap_add_arg_printf (FlatpakBwrap *bwrap, const char *format, ...)
 {
+  char buf[256];
   va_list args;
+  int len;
 
+  /* Most formatted args (fd numbers, paths) fit on the stack, so we
+     can usually format straight into the arena with no temporary
+     allocation */
   va_start (args, format);
-  g_ptr_array_add (bwrap->argv, g_strdup_vprintf (format, args));
+  len = g_vsnprintf (buf, sizeof buf, format, args);
   va_end (args);
+
+  if (len < (int) sizeof buf)
+    flatpak_bwrap_add_arg (bwrap, buf);
+  else
+    {
+      g_autofree char *arg = NULL;
+
+      va_start (args, format);
+      arg = g_strdup_vprintf (format, args);
+      va_end (args);
+
+      flatpak_bwrap_add_arg (bwrap, arg);
+    }
 }
 void
 flatpak_bwrap_add_args (FlatpakBwrap *bwrap, ...)
@@ -160,7 +183,7 @@ flatpak_bwrap_append_argsv (FlatpakBwrap *bwrap,
     len = g_strv_length (args);
 
   for (i = 0; i < len; i++)
-    g_ptr_array_add (bwrap->argv, g_strdup (args[i]));
+    g_ptr_array_add (bwrap->argv, g_string_chunk_insert (bwrap->str_arena, args[i]));
 }
 
 void
@@ -285,6 +308,7 @@ flatpak_bwrap_bundle_args (FlatpakBwrap *bwrap,
   gint i;
   gsize data_len = 0;
   int fd;
+  char fd_buf[32];
   g_auto(GLnxTmpfile) args_tmpf  = { 0, };
 
   if (end == -1)
@@ -310,15 +334,19 @@ flatpak_bwrap_bundle_args (FlatpakBwrap *bwrap,
   }
 
   flatpak_bwrap_add_fd (bwrap, fd);
+  /* The removed strings stay in the arena until the bwrap is freed */
   g_ptr_array_remove_range (bwrap->argv, start, end - start);
+
   if (one_arg)
     {
-      g_ptr_array_insert (bwrap->argv, start, g_strdup_printf ("--args=%d", fd));
+      g_snprintf (fd_buf, sizeof fd_buf, "--args=%d", fd);
+      g_ptr_array_insert (bwrap->argv, start, g_string_chunk_insert (bwrap->str_arena, fd_buf));
     }
   else
     {
-      g_ptr_array_insert (bwrap->argv, start, g_strdup ("--args"));
-      g_ptr_array_insert (bwrap->argv, start + 1, g_strdup_printf ("%d", fd));
+      g_snprintf (fd_buf, sizeof fd_buf, "%d", fd);
+      g_ptr_array_insert (bwrap->argv, start, g_string_chunk_insert (bwrap->str_arena, "--args"));
+      g_ptr_array_insert (bwrap->argv, start + 1, g_string_chunk_insert (bwrap->str_arena, fd_buf));
     }
 
   return TRUE;
@@ -62,6 +62,8 @@ struct _FlatpakChainInputStreamClass
 GType          flatpak_chain_input_stream_get_type (void) G_GNUC_CONST;
 
 FlatpakChainInputStream * flatpak_chain_input_stream_new (GPtrArray *streams);
+FlatpakChainInputStream * flatpak_chain_input_stream_new_with_buffer (GPtrArray *streams,
+                                                                      gsize      buffer_size);
 
 G_END_DECLS
 
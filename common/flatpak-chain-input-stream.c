@@ -20,11 +20,16 @@
 
 #include "config.h"
 
+#include <string.h>
+
 #include "flatpak-chain-input-stream-private.h"
 
+#define DEFAULT_BUFFER_SIZE (64 * 1024)
+
 enum {
   PROP_0,
-  PROP_STREAMS
+  PROP_STREAMS,
+  PROP_BUFFER_SIZE
 };
 
 G_DEFINE_TYPE (FlatpakChainInputStream, flatpak_chain_input_stream, G_TYPE_INPUT_STREAM)
@@ -33,6 +38,13 @@ struct _FlatpakChainInputStreamPrivate
 {
   GPtrArray *streams;
   guint      index;
+
+  /* Read-ahead buffer, so small consumer reads are served from memory
+   * and the underlying streams see large sequential reads */
+  guchar    *buffer;
+  gsize      buffer_size;
+  gsize      buffer_pos;
+  gsize      buffer_len;
 };
 
 static void     flatpak_chain_input_stream_set_property (GObject      *object,
@@ -49,6 +61,10 @@ static gssize   flatpak_chain_input_stream_read (GInputStream *stream,
                                                  gsize         count,
                                                  GCancellable *cancellable,
                                                  GError      **error);
+static gssize   flatpak_chain_input_stream_skip (GInputStream *stream,
+                                                 gsize         count,
+                                                 GCancellable *cancellable,
+                                                 GError      **error);
 static gboolean flatpak_chain_input_stream_close (GInputStream *stream,
                                                   GCancellable *cancellable,
                                                   GError      **error);
@@ -66,6 +82,7 @@ flatpak_chain_input_stream_class_init (FlatpakChainInputStreamClass *klass)
   gobject_class->finalize     = flatpak_chain_input_stream_finalize;
 
   stream_class->read_fn = flatpak_chain_input_stream_read;
+  stream_class->skip = flatpak_chain_input_stream_skip;
   stream_class->close_fn = flatpak_chain_input_stream_close;
 
   /*
@@ -80,6 +97,20 @@ flatpak_chain_input_stream_class_init (FlatpakChainInputStreamClass *klass)
                                                          G_PARAM_READWRITE |
                                                          G_PARAM_CONSTRUCT_ONLY |
                                                          G_PARAM_STATIC_STRINGS));
+
+  /*
+   * FlatpakChainInputStream:buffer-size:
+   *
+   * Size of the read-ahead buffer, 0 disables buffering.
+   */
+  g_object_class_install_property (gobject_class,
+                                   PROP_BUFFER_SIZE,
+                                   g_param_spec_uint ("buffer-size",
+                                                      "", "",
+                                                      0, G_MAXUINT, DEFAULT_BUFFER_SIZE,
+                                                      G_PARAM_READWRITE |
+                                                      G_PARAM_CONSTRUCT_ONLY |
+                                                      G_PARAM_STATIC_STRINGS));
 }
 
 static void
@@ -98,6 +129,10 @@ flatpak_chain_input_stream_set_property (GObject      *object,
       self->priv->streams = g_ptr_array_ref (g_value_get_pointer (value));
       break;
 
+    case PROP_BUFFER_SIZE:
+      self->priv->buffer_size = g_value_get_uint (value);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -120,6 +155,10 @@ flatpak_chain_input_stream_get_property (GObject    *object,
       g_value_set_pointer (value, self->priv->streams);
       break;
 
+    case PROP_BUFFER_SIZE:
+      g_value_set_uint (value, self->priv->buffer_size);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
     }
@@ -133,6 +172,7 @@ flatpak_chain_input_stream_finalize (GObject *object)
   stream = (FlatpakChainInputStream *) (object);
 
   g_ptr_array_unref (stream->priv->streams);
+  g_free (stream->priv->buffer);
 
   G_OBJECT_CLASS (flatpak_chain_input_stream_parent_class)->finalize (object);
 }
@@ -157,24 +197,32 @@ flatpak_chain_input_stream_new (GPtrArray *streams)
   return (FlatpakChainInputStream *) (stream);
 }
 
-static gssize
-flatpak_chain_input_stream_read (GInputStream *stream,
-                                 void         *buffer,
-                                 gsize         count,
-                                 GCancellable *cancellable,
-                                 GError      **error)
+FlatpakChainInputStream *
+flatpak_chain_input_stream_new_with_buffer (GPtrArray *streams,
+                                            gsize      buffer_size)
 {
-  FlatpakChainInputStream *self = (FlatpakChainInputStream *) stream;
-  GInputStream *child;
-  gssize res = -1;
+  FlatpakChainInputStream *stream;
 
-  if (g_cancellable_set_error_if_cancelled (cancellable, error))
-    return -1;
+  stream = g_object_new (FLATPAK_TYPE_CHAIN_INPUT_STREAM,
+                         "streams", streams,
+                         "buffer-size", (guint) buffer_size,
+                         NULL);
 
-  if (self->priv->index >= self->priv->streams->len)
-    return 0;
+  return (FlatpakChainInputStream *) (stream);
+}
+
+/* Reads directly from the current child, advancing to the next one at
+ * the end of each stream */
+static gssize
+flatpak_chain_input_stream_read_unbuffered (FlatpakChainInputStream *self,
+                                            void                    *buffer,
+                                            gsize                    count,
+                                            GCancellable            *cancellable,
+                                            GError                 **error)
+{
+  GInputStream *child;
+  gssize res = 0;
 
-  res = 0;
   while (res == 0 && self->priv->index < self->priv->streams->len)
     {
       child = self->priv->streams->pdata[self->priv->index];
@@ -190,6 +238,111 @@ flatpak_chain_input_stream_read (GInputStream *stream,
   return res;
 }
 
+static gssize
+flatpak_chain_input_stream_read (GInputStream *stream,
+                                 void         *buffer,
+                                 gsize         count,
+                                 GCancellable *cancellable,
+                                 GError      **error)
+{
+  FlatpakChainInputStream *self = (FlatpakChainInputStream *) stream;
+  gsize available;
+  gssize res;
+  gsize n;
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return -1;
+
+  if (self->priv->buffer_size == 0)
+    return flatpak_chain_input_stream_read_unbuffered (self, buffer, count,
+                                                       cancellable, error);
+
+  available = self->priv->buffer_len - self->priv->buffer_pos;
+  if (available == 0)
+    {
+      /* Reads at least as large as the buffer gain nothing from the
+       * extra copy */
+      if (count >= self->priv->buffer_size)
+        return flatpak_chain_input_stream_read_unbuffered (self, buffer, count,
+                                                           cancellable, error);
+
+      if (self->priv->buffer == NULL)
+        self->priv->buffer = g_malloc (self->priv->buffer_size);
+
+      res = flatpak_chain_input_stream_read_unbuffered (self,
+                                                        self->priv->buffer,
+                                                        self->priv->buffer_size,
+                                                        cancellable, error);
+      if (res <= 0)
+        return res;
+
+      self->priv->buffer_pos = 0;
+      self->priv->buffer_len = res;
+      available = res;
+    }
+
+  n = MIN (available, count);
+  memcpy (buffer, self->priv->buffer + self->priv->buffer_pos, n);
+  self->priv->buffer_pos += n;
+
+  return n;
+}
+
+static gssize
+flatpak_chain_input_stream_skip (GInputStream *stream,
+                                 gsize         count,
+                                 GCancellable *cancellable,
+                                 GError      **error)
+{
+  FlatpakChainInputStream *self = (FlatpakChainInputStream *) stream;
+  gsize available;
+  gsize total = 0;
+  gssize res;
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return -1;
+
+  /* First consume what is already buffered */
+  available = self->priv->buffer_len - self->priv->buffer_pos;
+  if (available > 0)
+    {
+      total = MIN (available, count);
+      self->priv->buffer_pos += total;
+      count -= total;
+    }
+
+  /* Then let the children skip the rest, which is cheap for seekable
+   * streams */
+  while (count > 0 && self->priv->index < self->priv->streams->len)
+    {
+      GInputStream *child = self->priv->streams->pdata[self->priv->index];
+
+      g_autoptr(GError) local_error = NULL;
+
+      res = g_input_stream_skip (child, count, cancellable, &local_error);
+      if (res < 0)
+        {
+          /* Report a partial skip, the error shows up on the next call */
+          if (total > 0)
+            return total;
+
+          g_propagate_error (error, g_steal_pointer (&local_error));
+          return -1;
+        }
+
+      if (res == 0)
+        {
+          self->priv->index++;
+          continue;
+        }
+
+      total += res;
+      count -= res;
+    }
+
+  return total;
+}
+
 static gboolean
 flatpak_chain_input_stream_close (GInputStream *stream,
                                   GCancellable *cancellable,
@@ -0,0 +1,43 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#ifndef __FLATPAK_CHECKSUM_H__
+#define __FLATPAK_CHECKSUM_H__
+
+#include <glib.h>
+
+/* A SHA-256 checksum. This is a drop-in replacement for a
+ * G_CHECKSUM_SHA256 GChecksum that uses a hardware-accelerated
+ * implementation when one is available, since verification of
+ * downloaded data is often the per-byte cpu bottleneck of a pull. */
+
+typedef struct FlatpakChecksum FlatpakChecksum;
+
+FlatpakChecksum *flatpak_checksum_new (void);
+void             flatpak_checksum_update (FlatpakChecksum *checksum,
+                                          const guchar    *data,
+                                          gssize           length);
+const char      *flatpak_checksum_get_string (FlatpakChecksum *checksum);
+void             flatpak_checksum_reset (FlatpakChecksum *checksum);
+void             flatpak_checksum_free (FlatpakChecksum *checksum);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakChecksum, flatpak_checksum_free)
+
+#endif /* __FLATPAK_CHECKSUM_H__ */
@@ -0,0 +1,152 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "flatpak-checksum-private.h"
+
+#ifdef HAVE_OPENSSL
+
+/* OpenSSL's EVP layer dispatches to vectorized SHA-256 code (SHA-NI,
+ * AVX2, NEON, ...) at run time, which is several times faster than
+ * GChecksum's portable implementation on most hardware. */
+
+#include <openssl/evp.h>
+
+struct FlatpakChecksum
+{
+  EVP_MD_CTX *ctx;
+  char        hexdigest[EVP_MAX_MD_SIZE * 2 + 1];
+  gboolean    finished;
+};
+
+FlatpakChecksum *
+flatpak_checksum_new (void)
+{
+  FlatpakChecksum *checksum = g_new0 (FlatpakChecksum, 1);
+
+  checksum->ctx = EVP_MD_CTX_new ();
+  if (checksum->ctx == NULL ||
+      !EVP_DigestInit_ex (checksum->ctx, EVP_sha256 (), NULL))
+    g_error ("Failed to initialize sha256 context");
+
+  return checksum;
+}
+
+void
+flatpak_checksum_update (FlatpakChecksum *checksum,
+                         const guchar    *data,
+                         gssize           length)
+{
+  g_assert (!checksum->finished);
+
+  if (length < 0)
+    length = strlen ((const char *) data);
+
+  EVP_DigestUpdate (checksum->ctx, data, length);
+}
+
+const char *
+flatpak_checksum_get_string (FlatpakChecksum *checksum)
+{
+  if (!checksum->finished)
+    {
+      guchar digest[EVP_MAX_MD_SIZE];
+      guint digest_len, i;
+
+      EVP_DigestFinal_ex (checksum->ctx, digest, &digest_len);
+
+      for (i = 0; i < digest_len; i++)
+        g_snprintf (checksum->hexdigest + i * 2, 3, "%02x", digest[i]);
+
+      checksum->finished = TRUE;
+    }
+
+  return checksum->hexdigest;
+}
+
+void
+flatpak_checksum_reset (FlatpakChecksum *checksum)
+{
+  if (!EVP_DigestInit_ex (checksum->ctx, EVP_sha256 (), NULL))
+    g_error ("Failed to initialize sha256 context");
+  checksum->finished = FALSE;
+}
+
+void
+flatpak_checksum_free (FlatpakChecksum *checksum)
+{
+  if (checksum == NULL)
+    return;
+
+  EVP_MD_CTX_free (checksum->ctx);
+  g_free (checksum);
+}
+
+#else /* !HAVE_OPENSSL */
+
+struct FlatpakChecksum
+{
+  GChecksum *checksum;
+};
+
+FlatpakChecksum *
+flatpak_checksum_new (void)
+{
+  FlatpakChecksum *checksum = g_new0 (FlatpakChecksum, 1);
+
+  checksum->checksum = g_checksum_new (G_CHECKSUM_SHA256);
+
+  return checksum;
+}
+
+void
+flatpak_checksum_update (FlatpakChecksum *checksum,
+                         const guchar    *data,
+                         gssize           length)
+{
+  g_checksum_update (checksum->checksum, data, length);
+}
+
+const char *
+flatpak_checksum_get_string (FlatpakChecksum *checksum)
+{
+  return g_checksum_get_string (checksum->checksum);
+}
+
+void
+flatpak_checksum_reset (FlatpakChecksum *checksum)
+{
+  g_checksum_reset (checksum->checksum);
+}
+
+void
+flatpak_checksum_free (FlatpakChecksum *checksum)
+{
+  if (checksum == NULL)
+    return;
+
+  g_checksum_free (checksum->checksum);
+  g_free (checksum);
+}
+
+#endif /* !HAVE_OPENSSL */
@@ -110,6 +110,8 @@ void           flatpak_context_add_bus_filters (FlatpakContext *context,
 
 gboolean       flatpak_context_get_needs_session_bus_proxy (FlatpakContext *context);
 gboolean       flatpak_context_get_needs_system_bus_proxy (FlatpakContext *context);
+gboolean       flatpak_context_get_session_bus_policy_is_unfiltered (FlatpakContext *context);
+gboolean       flatpak_context_get_system_bus_policy_is_unfiltered (FlatpakContext *context);
 
 void           flatpak_context_reset_permissions (FlatpakContext *context);
 void           flatpak_context_reset_non_permissions (FlatpakContext *context);
@@ -1767,6 +1767,28 @@ flatpak_context_get_needs_system_bus_proxy (FlatpakContext *context)
   return g_hash_table_size (context->system_bus_policy) > 0;
 }
 
+/* Filtering can only ever restrict, so a policy granting ownership of
+ * any name is equivalent to the unfiltered bus and proxying it would
+ * only add launch latency and message overhead. Anything weaker has to
+ * keep the proxy, since dropping it would widen what the app can reach. */
+static gboolean
+bus_policy_is_unfiltered (GHashTable *policy)
+{
+  return GPOINTER_TO_INT (g_hash_table_lookup (policy, "*")) == FLATPAK_POLICY_OWN;
+}
+
+gboolean
+flatpak_context_get_session_bus_policy_is_unfiltered (FlatpakContext *context)
+{
+  return bus_policy_is_unfiltered (context->session_bus_policy);
+}
+
+gboolean
+flatpak_context_get_system_bus_policy_is_unfiltered (FlatpakContext *context)
+{
+  return bus_policy_is_unfiltered (context->system_bus_policy);
+}
+
 gboolean
 flatpak_context_allows_features (FlatpakContext        *context,
                                  FlatpakContextFeatures features)
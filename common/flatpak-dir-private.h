@@ -26,14 +26,16 @@
 #include "libglnx/libglnx.h"
 #include <flatpak-common-types-private.h>
 #include <flatpak-context-private.h>
+#include <flatpak-summary-index-private.h>
 
 
 /* Version history:
  * The version field was added in flatpak 1.2, anything before is 0.
  *
  * Version 1 added appdata-name/summary/version/license
+ * Version 2 added sdk
  */
-#define FLATPAK_DEPLOY_VERSION_CURRENT 1
+#define FLATPAK_DEPLOY_VERSION_CURRENT 2
 #define FLATPAK_DEPLOY_VERSION_ANY 0
 
 #define FLATPAK_TYPE_DIR flatpak_dir_get_type ()
@@ -99,14 +101,17 @@ void         flatpak_related_free (FlatpakRelated *related);
    if it happened to change in the middle of the operation */
 typedef struct
 {
-  char     *remote_name;
-  char     *collection_id;
-  GVariant *summary;
-  GBytes   *summary_sig_bytes;
-  GError   *summary_fetch_error;
-  GVariant *metadata;
-  GError   *metadata_fetch_error;
-  int       refcount;
+  char                *remote_name;
+  char                *collection_id;
+  GVariant            *summary;
+  GBytes              *summary_sig_bytes;
+  FlatpakSummaryIndex *summary_index;
+  GError              *summary_fetch_error;
+  GVariant            *metadata;
+  GError              *metadata_fetch_error;
+  GVariant            *cache;        /* xa.cache extracted from metadata, lazily */
+  GVariant            *sparse_cache; /* xa.sparse-cache extracted from metadata, lazily */
+  int                  refcount;
 } FlatpakRemoteState;
 
 FlatpakRemoteState *flatpak_remote_state_ref (FlatpakRemoteState *remote_state);
@@ -308,6 +313,7 @@ typedef enum {
   FIND_MATCHING_REFS_FLAGS_NONE = 0,
   FIND_MATCHING_REFS_FLAGS_KEEP_REMOTE = (1 << 0),
   FIND_MATCHING_REFS_FLAGS_FUZZY = (1 << 1),
+  FIND_MATCHING_REFS_FLAGS_CACHED = (1 << 2),
 } FindMatchingRefsFlags;
 
 GQuark       flatpak_dir_error_quark (void);
@@ -352,6 +358,7 @@ const char *        flatpak_deploy_data_get_alt_id (GVariant *deploy_data);
 const char *        flatpak_deploy_data_get_eol (GVariant *deploy_data);
 const char *        flatpak_deploy_data_get_eol_rebase (GVariant *deploy_data);
 const char *        flatpak_deploy_data_get_runtime (GVariant *deploy_data);
+const char *        flatpak_deploy_data_get_sdk (GVariant *deploy_data);
 const char *        flatpak_deploy_data_get_appdata_name (GVariant *deploy_data);
 const char *        flatpak_deploy_data_get_appdata_summary (GVariant *deploy_data);
 const char *        flatpak_deploy_data_get_appdata_version (GVariant *deploy_data);
@@ -387,6 +394,10 @@ FlatpakDir  *flatpak_dir_get_system_by_id (const char   *id,
 gboolean    flatpak_dir_is_user (FlatpakDir *self);
 void        flatpak_dir_set_no_system_helper (FlatpakDir *self,
                                               gboolean    no_system_helper);
+gboolean    flatpak_dir_use_system_helper (FlatpakDir *self,
+                                           const char *installing_from_remote);
+typedef void (*FlatpakSystemHelperPrepareFunc) (void);
+void        flatpak_dir_set_system_helper_prepare_func (FlatpakSystemHelperPrepareFunc prepare);
 void        flatpak_dir_set_no_interaction (FlatpakDir *self,
                                             gboolean    no_interaction);
 gboolean    flatpak_dir_get_no_interaction (FlatpakDir *self);
@@ -516,6 +527,8 @@ gboolean    flatpak_dir_set_config (FlatpakDir *self,
                                     GError    **error);
 gboolean    flatpak_dir_mark_changed (FlatpakDir *self,
                                       GError    **error);
+gboolean    flatpak_dir_state_is_current (FlatpakDir *self);
+int         flatpak_dir_get_config_generation (FlatpakDir *self);
 gboolean    flatpak_dir_remove_appstream (FlatpakDir   *self,
                                           const char   *remote,
                                           GCancellable *cancellable,
@@ -602,8 +615,14 @@ gboolean    flatpak_dir_list_deployed (FlatpakDir   *self,
                                        GError      **error);
 gboolean    flatpak_dir_lock (FlatpakDir   *self,
                               GLnxLockFile *lockfile,
+                              int           operation,
                               GCancellable *cancellable,
                               GError      **error);
+gboolean    flatpak_dir_ref_lock (FlatpakDir   *self,
+                                  const char   *ref,
+                                  GLnxLockFile *lockfile,
+                                  GCancellable *cancellable,
+                                  GError      **error);
 gboolean    flatpak_dir_repo_lock (FlatpakDir   *self,
                                    GLnxLockFile *lockfile,
                                    gboolean      exclusive,
@@ -724,6 +743,13 @@ gboolean    flatpak_dir_prune (FlatpakDir   *self,
 gboolean    flatpak_dir_run_triggers (FlatpakDir   *self,
                                       GCancellable *cancellable,
                                       GError      **error);
+gboolean    flatpak_dir_maybe_run_triggers (FlatpakDir   *self,
+                                            GCancellable *cancellable,
+                                            GError      **error);
+void        flatpak_dir_defer_checkout_sync (FlatpakDir *self);
+gboolean    flatpak_dir_flush_checkout_sync (FlatpakDir   *self,
+                                             GCancellable *cancellable,
+                                             GError      **error);
 gboolean    flatpak_dir_update_summary (FlatpakDir   *self,
                                         gboolean      delete,
                                         GCancellable *cancellable,
@@ -792,6 +818,8 @@ char     **flatpak_dir_list_remotes (FlatpakDir   *self,
 char     **flatpak_dir_list_enumerated_remotes (FlatpakDir   *self,
                                                 GCancellable *cancellable,
                                                 GError      **error);
+void       flatpak_dir_prefetch_remote_summaries (FlatpakDir   *self,
+                                                  GCancellable *cancellable);
 gboolean   flatpak_dir_modify_remote (FlatpakDir   *self,
                                       const char   *remote_name,
                                       GKeyFile     *config,
@@ -817,6 +845,8 @@ char      *flatpak_dir_get_remote_collection_id (FlatpakDir *self,
                                                  const char *remote_name);
 char      *flatpak_dir_get_remote_main_ref (FlatpakDir *self,
                                             const char *remote_name);
+char      *flatpak_dir_get_remote_summary_arch (FlatpakDir *self,
+                                                const char *remote_name);
 gboolean   flatpak_dir_get_remote_oci (FlatpakDir *self,
                                        const char *remote_name);
 char      *flatpak_dir_get_remote_default_branch (FlatpakDir *self,
@@ -846,6 +876,11 @@ GVariant * flatpak_dir_fetch_remote_commit (FlatpakDir   *self,
                                             char        **out_commit,
                                             GCancellable *cancellable,
                                             GError      **error);
+void flatpak_dir_prefetch_remote_commit_history (FlatpakDir         *self,
+                                                 const char         *remote_name,
+                                                 FlatpakRemoteState *state,
+                                                 const char         *start_commit,
+                                                 GCancellable       *cancellable);
 gboolean flatpak_dir_update_remote_configuration (FlatpakDir   *self,
                                                   const char   *remote,
                                                   GCancellable *cancellable,
@@ -877,6 +912,10 @@ FlatpakRemoteState * flatpak_dir_get_remote_state_optional (FlatpakDir   *self,
                                                             const char   *remote,
                                                             GCancellable *cancellable,
                                                             GError      **error);
+FlatpakRemoteState * flatpak_dir_get_remote_state_optional_cached (FlatpakDir   *self,
+                                                                   const char   *remote,
+                                                                   GCancellable *cancellable,
+                                                                   GError      **error);
 FlatpakRemoteState * flatpak_dir_get_remote_state_local_only (FlatpakDir   *self,
                                                               const char   *remote,
                                                               GCancellable *cancellable,
@@ -919,6 +958,8 @@ typedef struct
   char *remote;
   char *ref;
   char *opt_commit;
+  FlatpakRemoteState *state; /* optional; lets the resolve be answered
+                                from the summary cache */
 
   /* out */
   char   *resolved_commit;
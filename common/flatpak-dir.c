@@ -44,6 +44,9 @@
 
 #include "flatpak-dir-private.h"
 #include "flatpak-utils-private.h"
+#include "flatpak-trace-private.h"
+#include "flatpak-profile-private.h"
+#include "flatpak-memory-private.h"
 #include "flatpak-oci-registry-private.h"
 #include "flatpak-run-private.h"
 #include "flatpak-appdata-private.h"
@@ -92,13 +95,14 @@ static gboolean flatpak_dir_mirror_oci (FlatpakDir          *self,
                                         GCancellable        *cancellable,
                                         GError             **error);
 
-static gboolean flatpak_dir_remote_fetch_summary (FlatpakDir   *self,
-                                                  const char   *name,
-                                                  gboolean      only_cached,
-                                                  GBytes      **out_summary,
-                                                  GBytes      **out_summary_sig,
-                                                  GCancellable *cancellable,
-                                                  GError      **error);
+static gboolean flatpak_dir_remote_fetch_summary (FlatpakDir           *self,
+                                                  const char           *name,
+                                                  gboolean              only_cached,
+                                                  GBytes              **out_summary,
+                                                  GBytes              **out_summary_sig,
+                                                  FlatpakSummaryIndex **out_summary_index,
+                                                  GCancellable         *cancellable,
+                                                  GError              **error);
 
 static gboolean flatpak_dir_cleanup_remote_for_url_change (FlatpakDir   *self,
                                                            const char   *remote_name,
@@ -112,6 +116,17 @@ static gboolean _flatpak_dir_fetch_remote_state_metadata_branch (FlatpakDir
                                                                  GCancellable       *cancellable,
                                                                  GError            **error);
 
+static int flatpak_dir_get_checkout_threads (FlatpakDir *self);
+
+static gboolean flatpak_dir_checkout_commit_parallel (FlatpakDir                  *self,
+                                                      OstreeRepoCheckoutAtOptions *options,
+                                                      const char                  *checkoutdirpath,
+                                                      const char                  *checksum,
+                                                      GFile                       *root,
+                                                      int                          n_threads,
+                                                      GCancellable                *cancellable,
+                                                      GError                     **error);
+
 static void ensure_soup_session (FlatpakDir *self);
 
 static void flatpak_dir_log (FlatpakDir *self,
@@ -170,7 +185,42 @@ struct FlatpakDir
 
   GHashTable      *summary_cache;
 
+  /* Result of the (possibly D-Bus backed) default-language probe, computed
+   * at most once per process; see flatpak_dir_get_default_locale_languages() */
+  char           **default_locale_languages;
+
+  /* Cached deployed ref listings, tied to the mtime of the ".changed"
+   * file which all deploys and undeploys touch */
+  GHashTable      *ref_cache;      /* kind -> char ** */
+  GHashTable      *deployed_cache; /* ref -> char ** */
+  GHashTable      *related_cache;  /* remote:ref -> RelatedCacheEntry */
+  guint64          ref_cache_stamp;
+  GFileMonitor    *changed_monitor;
+
+  /* What the state on disk looked like when the repo was opened, see
+   * flatpak_dir_state_is_current() */
+  guint64          opened_changed_stamp;
+  guint64          opened_config_stamp;
+
+  /* Bumped on every config change made through this dir, so cached
+   * reads of remote settings (see FlatpakRemote) know when to refresh */
+  int              config_generation;
+
   SoupSession     *soup_session;
+
+  /* Winner of the mirror race per remote with xa.url-mirrors set,
+   * decided at most once per process; see
+   * flatpak_dir_get_remote_fetch_url() */
+  GHashTable      *preferred_mirror;
+
+  /* Set when exports changed and the triggers haven't run yet, so
+   * batched operations can run each trigger exactly once at the end */
+  gboolean         needs_triggers;
+
+  /* Set while a batch of deploys runs with the per-checkout syncfs
+   * deferred, see flatpak_dir_defer_checkout_sync() */
+  gboolean         checkout_sync_deferred;
+  gboolean         checkout_sync_pending;
 };
 
 typedef struct
@@ -254,13 +304,18 @@ flatpak_remote_state_unref (FlatpakRemoteState *remote_state)
 
   if (remote_state->refcount == 0)
     {
+      if (remote_state->summary != NULL)
+        flatpak_memory_free (FLATPAK_MEMORY_SUMMARY, g_variant_get_size (remote_state->summary));
       g_free (remote_state->remote_name);
       g_free (remote_state->collection_id);
       g_clear_pointer (&remote_state->summary, g_variant_unref);
+      g_clear_pointer (&remote_state->summary_index, flatpak_summary_index_unref);
       g_clear_pointer (&remote_state->summary_sig_bytes, g_bytes_unref);
       g_clear_error (&remote_state->summary_fetch_error);
       g_clear_pointer (&remote_state->metadata, g_variant_unref);
       g_clear_error (&remote_state->metadata_fetch_error);
+      g_clear_pointer (&remote_state->cache, g_variant_unref);
+      g_clear_pointer (&remote_state->sparse_cache, g_variant_unref);
 
       g_free (remote_state);
     }
@@ -312,6 +367,12 @@ flatpak_remote_state_lookup_ref (FlatpakRemoteState *self,
       if (!flatpak_remote_state_ensure_summary (self, error))
         return FALSE;
 
+      /* Checksum-only lookups can be answered from the mmaped index
+       * without walking the summary variant */
+      if (out_variant == NULL && self->summary_index != NULL &&
+          flatpak_summary_index_lookup (self->summary_index, self->collection_id, ref, out_checksum))
+        return TRUE;
+
       if (!flatpak_summary_lookup_ref (self->summary, self->collection_id, ref, out_checksum, out_variant))
         {
           if (self->collection_id != NULL)
@@ -383,8 +444,7 @@ flatpak_remote_state_lookup_cache (FlatpakRemoteState *self,
                                    const char        **metadata,
                                    GError            **error)
 {
-  g_autoptr(GVariant) cache_v = NULL;
-  g_autoptr(GVariant) cache = NULL;
+  GVariant *cache;
   g_autoptr(GVariant) res = NULL;
   g_autoptr(GVariant) refdata = NULL;
   int pos;
@@ -392,15 +452,32 @@ flatpak_remote_state_lookup_cache (FlatpakRemoteState *self,
   if (!flatpak_remote_state_ensure_metadata (self, error))
     return FALSE;
 
-  cache_v = g_variant_lookup_value (self->metadata, "xa.cache", NULL);
-  if (cache_v == NULL)
+  /* The mmaped index carries the xa.cache data too, so lookups for
+   * already-indexed summaries don't need to walk the summary variant
+   * at all */
+  if (self->summary_index != NULL &&
+      flatpak_summary_index_lookup_cache (self->summary_index, ref,
+                                          installed_size, download_size, metadata))
+    return TRUE;
+
+  /* Extracting the cache from the metadata vardict is not free, so keep
+   * it around; lookups for every listed ref go through here */
+  if (self->cache == NULL)
     {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
-                   _("No flatpak cache in remote '%s' summary"), self->remote_name);
-      return FALSE;
+      g_autoptr(GVariant) cache_v = NULL;
+
+      cache_v = g_variant_lookup_value (self->metadata, "xa.cache", NULL);
+      if (cache_v == NULL)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                       _("No flatpak cache in remote '%s' summary"), self->remote_name);
+          return FALSE;
+        }
+
+      self->cache = g_variant_get_child_value (cache_v, 0);
     }
 
-  cache = g_variant_get_child_value (cache_v, 0);
+  cache = self->cache;
 
   if (!flatpak_variant_bsearch_str (cache, ref, &pos))
     {
@@ -437,16 +514,17 @@ flatpak_remote_state_lookup_sparse_cache (FlatpakRemoteState *self,
                                           const char         *ref,
                                           GError            **error)
 {
-  g_autoptr(GVariant) cache = NULL;
   int pos;
 
   if (!flatpak_remote_state_ensure_metadata (self, error))
     return FALSE;
 
-  cache = g_variant_lookup_value (self->metadata, "xa.sparse-cache", NULL);
-  if (cache != NULL && flatpak_variant_bsearch_str (cache, ref, &pos))
+  if (self->sparse_cache == NULL)
+    self->sparse_cache = g_variant_lookup_value (self->metadata, "xa.sparse-cache", NULL);
+
+  if (self->sparse_cache != NULL && flatpak_variant_bsearch_str (self->sparse_cache, ref, &pos))
     {
-      g_autoptr(GVariant) refdata = g_variant_get_child_value (cache, pos);
+      g_autoptr(GVariant) refdata = g_variant_get_child_value (self->sparse_cache, pos);
       return g_variant_get_child_value (refdata, 1);
     }
 
@@ -594,7 +672,18 @@ flatpak_load_deploy_data (GFile        *deploy_dir,
 
 
   if (flatpak_deploy_data_get_version (deploy_data) < required_version)
-    return upgrade_deploy_data (deploy_data, deploy_dir, ref);
+    {
+      GVariant *upgraded = upgrade_deploy_data (deploy_data, deploy_dir, ref);
+
+      /* Save the upgraded deploy data back, so that the appdata
+       * extraction is not redone on every load. This is best-effort,
+       * for instance a plain user can't write to a system
+       * installation. */
+      if (!flatpak_variant_save (data_file, upgraded, cancellable, NULL))
+        g_debug ("Can't save upgraded deploy data for %s", ref);
+
+      return upgraded;
+    }
 
   return g_steal_pointer (&deploy_data);
 }
@@ -1219,7 +1308,7 @@ flatpak_dir_revokefs_fuse_unmount (OstreeRepo **repo,
   return FALSE;
 }
 
-static gboolean
+gboolean
 flatpak_dir_use_system_helper (FlatpakDir *self,
                                const char *installing_from_remote)
 {
@@ -1237,6 +1326,17 @@ flatpak_dir_use_system_helper (FlatpakDir *self,
 #endif
 }
 
+static FlatpakSystemHelperPrepareFunc system_helper_prepare_func = NULL;
+
+/* Sets a function that is called before the first system-helper method call
+ * of the process. The CLI uses this to delay installing its polkit agent
+ * until a command actually needs authorization. */
+void
+flatpak_dir_set_system_helper_prepare_func (FlatpakSystemHelperPrepareFunc prepare)
+{
+  system_helper_prepare_func = prepare;
+}
+
 static GVariant *
 flatpak_dir_system_helper_call (FlatpakDir         *self,
                                 const gchar        *method_name,
@@ -1248,6 +1348,9 @@ flatpak_dir_system_helper_call (FlatpakDir         *self,
 {
   GVariant *res;
 
+  if (system_helper_prepare_func != NULL)
+    system_helper_prepare_func ();
+
   if (g_once_init_enter (&self->system_helper_bus))
     {
       const char *on_session = g_getenv ("FLATPAK_SYSTEM_HELPER_ON_SESSION");
@@ -1698,7 +1801,13 @@ flatpak_dir_finalize (GObject *object)
     g_clear_object (&self->system_helper_bus);
 
   g_clear_object (&self->soup_session);
+  g_clear_pointer (&self->preferred_mirror, g_hash_table_unref);
   g_clear_pointer (&self->summary_cache, g_hash_table_unref);
+  g_clear_pointer (&self->default_locale_languages, g_strfreev);
+  g_clear_pointer (&self->ref_cache, g_hash_table_unref);
+  g_clear_pointer (&self->deployed_cache, g_hash_table_unref);
+  g_clear_pointer (&self->related_cache, g_hash_table_unref);
+  g_clear_object (&self->changed_monitor);
 
   G_OBJECT_CLASS (flatpak_dir_parent_class)->finalize (object);
 }
@@ -1953,12 +2062,80 @@ flatpak_load_override_keyfile (const char *app_id, gboolean user, GError **error
   return g_steal_pointer (&metakey);
 }
 
+/* Parsed override files, keyed by "u:<app-id>" or "s:<app-id>" (empty
+ * app id for the global overrides). Loading a deploy parses the same
+ * global override files once per installed ref involved, so memoize
+ * the parsed FlatpakContext and validate it against the file mtime and
+ * size on each use. */
+typedef struct
+{
+  guint64         mtime;
+  guint64         size;
+  FlatpakContext *context;
+} OverrideCacheEntry;
+
+static GHashTable *override_cache;
+G_LOCK_DEFINE_STATIC (override_cache);
+
+static void
+override_cache_entry_free (OverrideCacheEntry *entry)
+{
+  flatpak_context_free (entry->context);
+  g_free (entry);
+}
+
+static char *
+override_cache_key (const char *app_id, gboolean user)
+{
+  return g_strdup_printf ("%c:%s", user ? 'u' : 's', app_id ? app_id : "");
+}
+
+static void
+override_cache_invalidate (const char *app_id, gboolean user)
+{
+  g_autofree char *key = override_cache_key (app_id, user);
+
+  G_LOCK (override_cache);
+  if (override_cache != NULL)
+    g_hash_table_remove (override_cache, key);
+  G_UNLOCK (override_cache);
+}
+
 FlatpakContext *
 flatpak_load_override_file (const char *app_id, gboolean user, GError **error)
 {
   g_autoptr(FlatpakContext) overrides = flatpak_context_new ();
   g_autoptr(GKeyFile) metakey = NULL;
   g_autoptr(GError) my_error = NULL;
+  g_autoptr(FlatpakDir) dir = NULL;
+  g_autofree char *key = override_cache_key (app_id, user);
+  g_autofree char *path = NULL;
+  OverrideCacheEntry *entry;
+  struct stat st;
+
+  dir = user ? flatpak_dir_get_user () : flatpak_dir_get_system_default ();
+  path = g_build_filename (flatpak_file_get_path_cached (dir->basedir),
+                           "overrides", app_id ? app_id : "global", NULL);
+
+  /* A missing override file is cached too, as (0, 0) */
+  if (stat (path, &st) != 0)
+    memset (&st, 0, sizeof st);
+
+  G_LOCK (override_cache);
+  if (override_cache != NULL)
+    {
+      entry = g_hash_table_lookup (override_cache, key);
+      if (entry != NULL &&
+          entry->mtime == (guint64) st.st_mtime &&
+          entry->size == (guint64) st.st_size)
+        {
+          /* Merging into a fresh context copies it */
+          flatpak_context_merge (overrides, entry->context);
+          G_UNLOCK (override_cache);
+          return g_steal_pointer (&overrides);
+        }
+    }
+  G_UNLOCK (override_cache);
 
   metakey = flatpak_load_override_keyfile (app_id, user, &my_error);
   if (metakey == NULL)
@@ -1975,6 +2152,19 @@ flatpak_load_override_file (const char *app_id, gboolean user, GError **error)
         return NULL;
     }
 
+  entry = g_new0 (OverrideCacheEntry, 1);
+  entry->mtime = st.st_mtime;
+  entry->size = st.st_size;
+  entry->context = flatpak_context_new ();
+  flatpak_context_merge (entry->context, overrides);
+
+  G_LOCK (override_cache);
+  if (override_cache == NULL)
+    override_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, (GDestroyNotify) override_cache_entry_free);
+  g_hash_table_replace (override_cache, g_strdup (key), entry);
+  G_UNLOCK (override_cache);
+
   return g_steal_pointer (&overrides);
 }
 
@@ -2010,7 +2200,11 @@ flatpak_save_override_keyfile (GKeyFile   *metakey,
       return FALSE;
     }
 
-  return g_key_file_save_to_file (metakey, filename, error);
+  if (!g_key_file_save_to_file (metakey, filename, error))
+    return FALSE;
+
+  override_cache_invalidate (app_id, user);
+  return TRUE;
 }
 
 gboolean
@@ -2042,6 +2236,7 @@ flatpak_remove_override_keyfile (const char *app_id,
       return FALSE;
     }
 
+  override_cache_invalidate (app_id, user);
   return TRUE;
 }
 
@@ -2187,9 +2382,14 @@ flatpak_dir_get_repo (FlatpakDir *self)
 }
 
 
-/* This is an exclusive per flatpak installation file lock that is taken
- * whenever any config in the directory outside the repo is to be changed. For
- * instance deployments, overrides or active commit changes.
+/* This is a per flatpak installation file lock that protects the
+ * deployments and config in the directory outside the repo.
+ *
+ * Operations that touch only the deployment of a single ref (install,
+ * update, uninstall) take this in shared mode, combined with an
+ * exclusive flatpak_dir_ref_lock() for the ref in question, so that
+ * unrelated refs can be deployed concurrently. Operations that modify
+ * installation-wide state take it in exclusive mode.
  *
  * For concurrency protection of the actual repository we rely on ostree
  * to do the right thing.
@@ -2197,12 +2397,54 @@ flatpak_dir_get_repo (FlatpakDir *self)
 gboolean
 flatpak_dir_lock (FlatpakDir   *self,
                   GLnxLockFile *lockfile,
+                  int           operation,
                   GCancellable *cancellable,
                   GError      **error)
 {
   g_autoptr(GFile) lock_file = g_file_get_child (flatpak_dir_get_path (self), "lock");
   g_autofree char *lock_path = g_file_get_path (lock_file);
 
+  return glnx_make_lock_file (AT_FDCWD, lock_path, operation, lockfile, error);
+}
+
+/* An exclusive lock for the deployment of a single ref, taken (together
+ * with a shared flatpak_dir_lock()) during install, update and
+ * uninstall. The lock files live in a flat "locks" directory, with "/"
+ * in the ref replaced by "_". This can in theory alias two different
+ * refs to the same lock file, but that only makes the locking coarser,
+ * never incorrect.
+ */
+gboolean
+flatpak_dir_ref_lock (FlatpakDir   *self,
+                      const char   *ref,
+                      GLnxLockFile *lockfile,
+                      GCancellable *cancellable,
+                      GError      **error)
+{
+  g_autoptr(GFile) locks_dir = g_file_get_child (flatpak_dir_get_path (self), "locks");
+  g_autofree char *lock_name = g_strdelimit (g_strdup (ref), "/", '_');
+  g_autoptr(GFile) lock_file = g_file_get_child (locks_dir, lock_name);
+  g_autofree char *lock_path = g_file_get_path (lock_file);
+
+  if (!flatpak_mkdir_p (locks_dir, cancellable, error))
+    return FALSE;
+
+  return glnx_make_lock_file (AT_FDCWD, lock_path, LOCK_EX, lockfile, error);
+}
+
+/* An exclusive lock serializing updates to state that is shared between
+ * refs but not covered by an exclusive flatpak_dir_lock(): the exported
+ * files merged below "exports" and the per-app "current" symlinks.
+ */
+static gboolean
+flatpak_dir_exports_lock (FlatpakDir   *self,
+                          GLnxLockFile *lockfile,
+                          GCancellable *cancellable,
+                          GError      **error)
+{
+  g_autoptr(GFile) lock_file = g_file_get_child (flatpak_dir_get_path (self), "exports-lock");
+  g_autofree char *lock_path = g_file_get_path (lock_file);
+
   return glnx_make_lock_file (AT_FDCWD, lock_path, LOCK_EX, lockfile, error);
 }
 
@@ -2340,6 +2582,12 @@ flatpak_deploy_data_get_runtime (GVariant *deploy_data)
   return flatpak_deploy_data_get_string (deploy_data, "runtime");
 }
 
+const char *
+flatpak_deploy_data_get_sdk (GVariant *deploy_data)
+{
+  return flatpak_deploy_data_get_string (deploy_data, "sdk");
+}
+
 const char *
 flatpak_deploy_data_get_appdata_name (GVariant *deploy_data)
 {
@@ -2454,7 +2702,8 @@ add_appdata_to_deploy_data (GVariantBuilder *metadata_builder,
   if (appdata_xml == NULL)
     return;
 
-  if (flatpak_parse_appdata (appdata_xml, id, &names, &comments, &version, &license))
+  /* The deploy data is shared between users, so keep all locales here */
+  if (flatpak_parse_appdata (appdata_xml, id, NULL, &names, &comments, &version, &license))
     {
       add_locale_metadata_string (metadata_builder, "appdata-name", names);
       add_locale_metadata_string (metadata_builder, "appdata-summary", comments);
@@ -2482,6 +2731,7 @@ flatpak_dir_new_deploy_data (FlatpakDir         *self,
   char *empty_subpaths[] = {NULL};
   GVariantBuilder metadata_builder;
   g_autofree char *application_runtime = NULL;
+  g_autofree char *sdk = NULL;
   const char *alt_id = NULL;
   const char *eol = NULL;
   const char *eol_rebase = NULL;
@@ -2493,6 +2743,13 @@ flatpak_dir_new_deploy_data (FlatpakDir         *self,
   application_runtime = g_key_file_get_string (metadata,
                                                FLATPAK_METADATA_GROUP_APPLICATION,
                                                FLATPAK_METADATA_KEY_RUNTIME, NULL);
+  sdk = g_key_file_get_string (metadata,
+                               FLATPAK_METADATA_GROUP_APPLICATION,
+                               FLATPAK_METADATA_KEY_SDK, NULL);
+  if (sdk == NULL)
+    sdk = g_key_file_get_string (metadata,
+                                 FLATPAK_METADATA_GROUP_RUNTIME,
+                                 FLATPAK_METADATA_KEY_SDK, NULL);
 
   g_variant_builder_init (&metadata_builder, G_VARIANT_TYPE ("a{sv}"));
   g_variant_builder_add (&metadata_builder, "{s@v}", "deploy-version",
@@ -2509,6 +2766,9 @@ flatpak_dir_new_deploy_data (FlatpakDir         *self,
   if (application_runtime)
     g_variant_builder_add (&metadata_builder, "{s@v}", "runtime",
                            g_variant_new_variant (g_variant_new_string (application_runtime)));
+  if (sdk)
+    g_variant_builder_add (&metadata_builder, "{s@v}", "sdk",
+                           g_variant_new_variant (g_variant_new_string (sdk)));
 
   if (previous_ids)
     g_variant_builder_add (&metadata_builder, "{s@v}", "previous-ids",
@@ -2558,6 +2818,31 @@ upgrade_deploy_data (GVariant *deploy_data, GFile *deploy_dir, const char *ref)
       add_appdata_to_deploy_data (&metadata_builder, deploy_dir, ref_parts[1]);
     }
 
+  if (old_version < 2)
+    {
+      g_autoptr(GFile) metadata_file = g_file_get_child (deploy_dir, "metadata");
+      g_autofree char *metadata_contents = NULL;
+      gsize metadata_size;
+      g_autoptr(GKeyFile) metakey = g_key_file_new ();
+      g_autofree char *sdk = NULL;
+
+      if (g_file_load_contents (metadata_file, NULL, &metadata_contents, &metadata_size, NULL, NULL) &&
+          g_key_file_load_from_data (metakey, metadata_contents, metadata_size, G_KEY_FILE_NONE, NULL))
+        {
+          sdk = g_key_file_get_string (metakey,
+                                       FLATPAK_METADATA_GROUP_APPLICATION,
+                                       FLATPAK_METADATA_KEY_SDK, NULL);
+          if (sdk == NULL)
+            sdk = g_key_file_get_string (metakey,
+                                         FLATPAK_METADATA_GROUP_RUNTIME,
+                                         FLATPAK_METADATA_KEY_SDK, NULL);
+        }
+
+      if (sdk != NULL)
+        g_variant_builder_add (&metadata_builder, "{s@v}", "sdk",
+                               g_variant_new_variant (g_variant_new_string (sdk)));
+    }
+
   subpaths = flatpak_deploy_data_get_subpaths (deploy_data);
   return g_variant_ref_sink (g_variant_new ("(ss^ast@a{sv})",
                                             flatpak_deploy_data_get_origin (deploy_data),
@@ -2671,6 +2956,17 @@ flatpak_dir_recreate_repo (FlatpakDir   *self,
   return res;
 }
 
+static guint64
+flatpak_dir_get_mtime_stamp (GFile *file)
+{
+  struct stat st;
+
+  if (stat (flatpak_file_get_path_cached (file), &st) != 0)
+    return 0;
+
+  return (guint64) st.st_mtim.tv_sec * G_GINT64_CONSTANT (1000000000) + st.st_mtim.tv_nsec;
+}
+
 static gboolean
 _flatpak_dir_ensure_repo (FlatpakDir   *self,
                           gboolean      allow_empty,
@@ -2837,6 +3133,14 @@ _flatpak_dir_ensure_repo (FlatpakDir   *self,
   self->repo = g_object_ref (repo);
   self->cache_dir = g_object_ref (cache_dir);
 
+  {
+    g_autoptr(GFile) changed_file = flatpak_dir_get_changed_path (self);
+    g_autoptr(GFile) config_file = g_file_get_child (repodir, "config");
+
+    self->opened_changed_stamp = flatpak_dir_get_mtime_stamp (changed_file);
+    self->opened_config_stamp = flatpak_dir_get_mtime_stamp (config_file);
+  }
+
   return TRUE;
 }
 
@@ -2880,6 +3184,21 @@ flatpak_dir_get_config (FlatpakDir *self,
   return g_key_file_get_string (config, "core", ostree_key, error);
 }
 
+static void
+flatpak_dir_bump_config_generation (FlatpakDir *self)
+{
+  g_atomic_int_inc (&self->config_generation);
+}
+
+/* A counter that changes every time this dir modifies the repo
+ * configuration (remotes and core settings), so snapshots of remote
+ * settings can be validated without re-reading the config. */
+int
+flatpak_dir_get_config_generation (FlatpakDir *self)
+{
+  return g_atomic_int_get (&self->config_generation);
+}
+
 gboolean
 flatpak_dir_set_config (FlatpakDir *self,
                         const char *key,
@@ -2912,6 +3231,7 @@ flatpak_dir_set_config (FlatpakDir *self,
                                                      NULL, error))
         return FALSE;
 
+      flatpak_dir_bump_config_generation (self);
       return TRUE;
     }
 
@@ -2926,6 +3246,8 @@ flatpak_dir_set_config (FlatpakDir *self,
   if (!ostree_repo_reload_config (self->repo, NULL, error))
     return FALSE;
 
+  flatpak_dir_bump_config_generation (self);
+
   return TRUE;
 }
 
@@ -2952,6 +3274,30 @@ flatpak_dir_mark_changed (FlatpakDir *self,
   return TRUE;
 }
 
+/* Returns %TRUE if nothing the in-memory state of @self was derived
+ * from has changed on disk since the repo was opened: the deploy tree
+ * (keyed by the ".changed" file, which all deploys and undeploys touch)
+ * and the repo config (where the remotes live). Used to tell whether
+ * dropping caches would actually pick up anything new. */
+gboolean
+flatpak_dir_state_is_current (FlatpakDir *self)
+{
+  g_autoptr(GFile) changed_file = NULL;
+  g_autoptr(GFile) config_file = NULL;
+
+  if (self->repo == NULL)
+    return FALSE;
+
+  changed_file = flatpak_dir_get_changed_path (self);
+  if (self->opened_changed_stamp == 0 ||
+      flatpak_dir_get_mtime_stamp (changed_file) != self->opened_changed_stamp)
+    return FALSE;
+
+  config_file = g_file_get_child (ostree_repo_get_path (self->repo), "config");
+  return self->opened_config_stamp != 0 &&
+         flatpak_dir_get_mtime_stamp (config_file) == self->opened_config_stamp;
+}
+
 gboolean
 flatpak_dir_remove_appstream (FlatpakDir   *self,
                               const char   *remote,
@@ -2974,6 +3320,43 @@ flatpak_dir_remove_appstream (FlatpakDir   *self,
   return TRUE;
 }
 
+typedef struct
+{
+  GFile  *src_xml; /* appstream.xml in the commit root */
+  GFile  *dest_gz; /* appstream.xml.gz in the checkout dir */
+  GError *error;
+} AppstreamCompressData;
+
+/* Recompresses the appstream XML straight out of the repo, so it can
+ * run on a worker thread while the (much more numerous) icons are
+ * checked out */
+static gpointer
+appstream_compress_thread (gpointer user_data)
+{
+  AppstreamCompressData *data = user_data;
+  g_autoptr(GZlibCompressor) compressor = NULL;
+  g_autoptr(GOutputStream) out2 = NULL;
+  g_autoptr(GFileOutputStream) out = NULL;
+  g_autoptr(GFileInputStream) in = NULL;
+
+  in = g_file_read (data->src_xml, NULL, NULL);
+  if (in == NULL) /* No appstream.xml, nothing to compress */
+    return NULL;
+
+  compressor = g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1);
+  out = g_file_replace (data->dest_gz, NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION,
+                        NULL, &data->error);
+  if (out == NULL)
+    return NULL;
+
+  out2 = g_converter_output_stream_new (G_OUTPUT_STREAM (out), G_CONVERTER (compressor));
+  g_output_stream_splice (out2, G_INPUT_STREAM (in),
+                          G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE | G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+                          NULL, &data->error);
+
+  return NULL;
+}
+
 gboolean
 flatpak_dir_deploy_appstream (FlatpakDir   *self,
                               const char   *remote,
@@ -3005,6 +3388,11 @@ flatpak_dir_deploy_appstream (FlatpakDir   *self,
   g_autofree char *tmpname = g_strdup (".active-XXXXXX");
   g_auto(GLnxLockFile) lock = { 0, };
   gboolean do_compress = FALSE;
+  g_autoptr(GFile) root = NULL;
+  AppstreamCompressData compress_data = { 0 };
+  GThread *compress_thread = NULL;
+  gboolean checkout_res;
+  int n_threads;
 
   /* Keep a shared repo lock to avoid prunes removing objects we're relying on
    * while we do the checkout. This could happen if the ref changes after we
@@ -3092,34 +3480,46 @@ flatpak_dir_deploy_appstream (FlatpakDir   *self,
   options.enable_fsync = FALSE; /* We checkout to a temp dir and sync before moving it in place */
   options.bareuseronly_dirs = TRUE; /* https://github.com/ostreedev/ostree/pull/927 */
 
-  if (!ostree_repo_checkout_at (self->repo, &options,
-                                AT_FDCWD, checkout_dir_path, new_checksum,
-                                cancellable, error))
+  if (!ostree_repo_read_commit (self->repo, new_checksum, &root, NULL, cancellable, error))
     return FALSE;
 
+  /* Recompress the XML out of the repo on a worker thread, overlapping
+   * with the checkout of the icons below */
   if (do_compress)
     {
-      g_autoptr(GFile) appstream_xml = g_file_get_child (checkout_dir, "appstream.xml");
-      g_autoptr(GFile) appstream_gz_xml = g_file_get_child (checkout_dir, "appstream.xml.gz");
-      g_autoptr(GZlibCompressor) compressor = NULL;
-      g_autoptr(GOutputStream) out2 = NULL;
-      g_autoptr(GFileOutputStream) out = NULL;
-      g_autoptr(GFileInputStream) in = NULL;
+      compress_data.src_xml = g_file_resolve_relative_path (root, "appstream.xml");
+      compress_data.dest_gz = g_file_get_child (checkout_dir, "appstream.xml.gz");
+      compress_thread = g_thread_new ("flatpak-appstream-gz",
+                                      appstream_compress_thread, &compress_data);
+    }
 
-      in = g_file_read (appstream_xml, NULL, NULL);
-      if (in)
-        {
-          compressor = g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1);
-          out = g_file_replace (appstream_gz_xml, NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION,
-                                NULL, error);
-          if (out == NULL)
-            return FALSE;
+  n_threads = flatpak_dir_get_checkout_threads (self);
+  if (n_threads > 1)
+    checkout_res = flatpak_dir_checkout_commit_parallel (self, &options,
+                                                         checkout_dir_path,
+                                                         new_checksum, root,
+                                                         n_threads,
+                                                         cancellable, error);
+  else
+    checkout_res = ostree_repo_checkout_at (self->repo, &options,
+                                            AT_FDCWD, checkout_dir_path, new_checksum,
+                                            cancellable, error);
 
-          out2 = g_converter_output_stream_new (G_OUTPUT_STREAM (out), G_CONVERTER (compressor));
-          if (g_output_stream_splice (out2, G_INPUT_STREAM (in), G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE | G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
-                                      NULL, error) < 0)
-            return FALSE;
-        }
+  if (compress_thread != NULL)
+    g_thread_join (compress_thread);
+  g_clear_object (&compress_data.src_xml);
+  g_clear_object (&compress_data.dest_gz);
+
+  if (!checkout_res)
+    {
+      g_clear_error (&compress_data.error);
+      return FALSE;
+    }
+
+  if (compress_data.error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&compress_data.error));
+      return FALSE;
     }
 
   glnx_gen_temp_name (tmpname);
@@ -3193,6 +3593,40 @@ async_result_cb (GObject      *obj,
   *result_out = g_object_ref (result);
 }
 
+static void
+repo_finder_unref (gpointer data)
+{
+  if (data != NULL)
+    g_object_unref (data);
+}
+
+/* Returns the NULL-terminated set of OstreeRepoFinders to use for P2P
+ * find operations, or NULL to use the libostree default set. The
+ * static config and mount based sources always apply, but LAN (mDNS)
+ * peer discovery is opt-in via "flatpak config --set lan-discovery
+ * true", since it makes every operation query the local network. The
+ * content fetched from LAN peers is verified exactly like that of any
+ * other mirror (collection/ref bindings and GPG signatures), so a
+ * fleet that opts in turns N identical WAN downloads into one plus
+ * N - 1 local copies without trusting the peers.
+ */
+static GPtrArray *
+flatpak_dir_get_repo_finders (FlatpakDir *self)
+{
+  GPtrArray *finders;
+  g_autofree char *value = flatpak_dir_get_config (self, "lan-discovery", NULL);
+
+  if (g_strcmp0 (value, "true") == 0)
+    return NULL; /* The libostree default set includes LAN discovery */
+
+  finders = g_ptr_array_new_with_free_func (repo_finder_unref);
+  g_ptr_array_add (finders, ostree_repo_finder_config_new ());
+  g_ptr_array_add (finders, ostree_repo_finder_mount_new (NULL));
+  g_ptr_array_add (finders, NULL);
+
+  return finders;
+}
+
 gboolean
 flatpak_dir_find_latest_rev (FlatpakDir               *self,
                              FlatpakRemoteState       *state,
@@ -3217,6 +3651,7 @@ flatpak_dir_find_latest_rev (FlatpakDir               *self,
       g_auto(OstreeRepoFinderResultv) results = NULL;
       OstreeCollectionRef collection_ref = { state->collection_id, (char *) ref };
       OstreeCollectionRef *collection_refs_to_fetch[2] = { &collection_ref, NULL };
+      g_autoptr(GPtrArray) finders = flatpak_dir_get_repo_finders (self);
       gsize i;
       g_autoptr(GMainContextPopDefault) context = NULL;
 
@@ -3235,7 +3670,7 @@ flatpak_dir_find_latest_rev (FlatpakDir               *self,
 
       ostree_repo_find_remotes_async (self->repo, (const OstreeCollectionRef * const *) collection_refs_to_fetch,
                                       find_options,
-                                      NULL /* default finders */,
+                                      finders != NULL ? (OstreeRepoFinder **) finders->pdata : NULL,
                                       NULL /* no progress reporting */,
                                       cancellable, async_result_cb, &find_result);
 
@@ -3299,6 +3734,8 @@ flatpak_dir_resolve_free (FlatpakDirResolve *resolve)
 {
   if (resolve)
     {
+      if (resolve->state)
+        flatpak_remote_state_unref (resolve->state);
       g_free (resolve->remote);
       g_free (resolve->ref);
       g_free (resolve->opt_commit);
@@ -3376,38 +3813,60 @@ resolve_p2p_update_from_commit (FlatpakDirResolve *resolve,
   g_variant_lookup (commit_metadata, OSTREE_COMMIT_META_KEY_ENDOFLIFE_REBASE, "s", &resolve->eol_rebase);
 }
 
+/* One batched find+pull pass over a set of resolves. The finds and
+ * pulls are async, so when there are multiple groups their network
+ * traffic (covering all the remotes involved) can be in flight at the
+ * same time instead of one group blocking on the other. */
+typedef struct
+{
+  FlatpakDirResolveData **datas; /* NULL terminated, not owned */
+  gboolean                with_commit_ids;
+  OstreeRepo             *child_repo;
+  GLnxLockFile            child_repo_lock;
+  FlatpakTempDir         *child_repo_tmp_dir;
+  FlatpakRepoTransaction *transaction;
+  GPtrArray              *finders; /* Must outlive the async find */
+  GAsyncResult           *find_result;
+  OstreeRepoFinderResult **results;
+  GAsyncResult           *pull_result;
+} FlatpakDirResolveGroup;
+
+static void
+flatpak_dir_resolve_group_free (FlatpakDirResolveGroup *group)
+{
+  if (group == NULL)
+    return;
+
+  g_clear_pointer (&group->results, ostree_repo_finder_result_freev);
+  g_clear_pointer (&group->finders, g_ptr_array_unref);
+  g_clear_object (&group->find_result);
+  g_clear_object (&group->pull_result);
+  flatpak_repo_transaction_cleanup (g_steal_pointer (&group->transaction));
+  g_clear_object (&group->child_repo);
+  glnx_release_lock_file (&group->child_repo_lock);
+  g_clear_pointer (&group->child_repo_tmp_dir, flatpak_temp_dir_destroy);
+  g_free (group);
+}
+
 static gboolean
-flatpak_dir_do_resolve_p2p_refs (FlatpakDir             *self,
-                                 FlatpakDirResolveData **datas,
-                                 gboolean                with_commit_ids,
-                                 GCancellable           *cancellable,
-                                 GError                **error)
+flatpak_dir_resolve_group_start_find (FlatpakDir             *self,
+                                      FlatpakDirResolveGroup *group,
+                                      GFile                  *user_cache_dir,
+                                      GCancellable           *cancellable,
+                                      GError                **error)
 {
   g_autoptr(GPtrArray) collection_refs_to_fetch = g_ptr_array_new ();
   g_autoptr(GPtrArray) commit_ids_to_fetch = NULL;
-  g_autoptr(GAsyncResult) find_result = NULL;
-  g_auto(OstreeRepoFinderResultv) results = NULL;
   g_autoptr(GVariant) find_options = NULL;
   g_auto(GVariantBuilder) find_builder = FLATPAK_VARIANT_BUILDER_INITIALIZER;
-  GVariantBuilder pull_builder;
-  g_autoptr(GVariant) pull_options = NULL;
-  g_autoptr(GAsyncResult) pull_result = NULL;
-  g_autoptr(GMainContextPopDefault) main_context = NULL;
-  g_autoptr(FlatpakRepoTransaction) transaction = NULL;
-  g_autoptr(OstreeRepo) child_repo = NULL;
-  g_auto(GLnxLockFile) child_repo_lock = { 0, };
-  g_autoptr(GFile) user_cache_dir = NULL;
-  g_autoptr(FlatpakTempDir) child_repo_tmp_dir = NULL;
   int i;
 
-  main_context = flatpak_main_context_new_default ();
-
-  if (with_commit_ids)
+  if (group->with_commit_ids)
     commit_ids_to_fetch = g_ptr_array_new ();
 
-  for (i = 0; datas[i] != NULL; i++)
+  for (i = 0; group->datas[i] != NULL; i++)
     {
-      FlatpakDirResolveData *data = datas[i];
+      FlatpakDirResolveData *data = group->datas[i];
       FlatpakDirResolve *resolve = data->resolve;
 
       g_ptr_array_add (collection_refs_to_fetch, &data->collection_ref);
@@ -3427,45 +3886,50 @@ flatpak_dir_do_resolve_p2p_refs (FlatpakDir             *self,
                                                                       commit_ids_to_fetch->len)));
   find_options = g_variant_ref_sink (g_variant_builder_end (&find_builder));
 
-  /* We create a temporary child repo in the user homedir so that we can just blow it away when we're done.
-   * This lets us always write to the directory in the system-helper case, but also lets us properly clean up
-   * the transaction state directory, as that doesn't happen on abort.   */
-  user_cache_dir = flatpak_ensure_user_cache_dir_location (error);
-  if (user_cache_dir == NULL)
-    return FALSE;
-
-  child_repo = flatpak_dir_create_child_repo (self, user_cache_dir, &child_repo_lock, NULL, error);
-  if (child_repo == NULL)
+  group->child_repo = flatpak_dir_create_child_repo (self, user_cache_dir, &group->child_repo_lock, NULL, error);
+  if (group->child_repo == NULL)
     return FALSE;
 
   /* Ensure we clean up the child repo */
-  child_repo_tmp_dir = g_object_ref (ostree_repo_get_path (child_repo));
+  group->child_repo_tmp_dir = g_object_ref (ostree_repo_get_path (group->child_repo));
 
-  ostree_repo_find_remotes_async (child_repo,
+  group->finders = flatpak_dir_get_repo_finders (self);
+
+  ostree_repo_find_remotes_async (group->child_repo,
                                   (const OstreeCollectionRef * const *) collection_refs_to_fetch->pdata,
                                   find_options,
-                                  NULL /* default finders */,
+                                  group->finders != NULL ? (OstreeRepoFinder **) group->finders->pdata : NULL,
                                   NULL /* no progress reporting */,
-                                  cancellable, async_result_cb, &find_result);
+                                  cancellable, async_result_cb, &group->find_result);
+
+  return TRUE;
+}
 
-  while (find_result == NULL)
-    g_main_context_iteration (main_context, TRUE);
+static gboolean
+flatpak_dir_resolve_group_start_pull (FlatpakDir             *self,
+                                      FlatpakDirResolveGroup *group,
+                                      GCancellable           *cancellable,
+                                      GError                **error)
+{
+  GVariantBuilder pull_builder;
+  g_autoptr(GVariant) pull_options = NULL;
+  int i;
 
-  results = ostree_repo_find_remotes_finish (child_repo, find_result, error);
-  if (results == NULL)
+  group->results = ostree_repo_find_remotes_finish (group->child_repo, group->find_result, error);
+  if (group->results == NULL)
     return FALSE;
 
   /* Drop from the results all ops that are no-op updates */
-  for (i = 0; datas[i] != NULL; i++)
+  for (i = 0; group->datas[i] != NULL; i++)
     {
-      FlatpakDirResolveData *data = datas[i];
+      FlatpakDirResolveData *data = group->datas[i];
       FlatpakDirResolve *resolve = data->resolve;
       const char *latest_rev = NULL;
 
       if (data->local_commit == NULL)
         continue;
 
-      latest_rev = find_latest_p2p_result (results, &data->collection_ref);
+      latest_rev = find_latest_p2p_result (group->results, &data->collection_ref);
       if (g_strcmp0 (latest_rev, data->local_commit) == 0)
         {
           g_autoptr(GVariant) commit_data = NULL;
@@ -3474,13 +3938,60 @@ flatpak_dir_do_resolve_p2p_refs (FlatpakDir             *self,
            * the local commit and remove from all results. This way we
            * avoid pulling this ref from all remotes. */
 
-          if (!ostree_repo_load_commit (child_repo, data->local_commit, &commit_data, NULL, NULL))
+          if (!ostree_repo_load_commit (group->child_repo, data->local_commit, &commit_data, NULL, NULL))
             return FALSE;
 
           resolve->resolved_commit = g_strdup (data->local_commit);
           resolve_p2p_update_from_commit (resolve, commit_data);
-          remove_ref_from_p2p_results (results, &data->collection_ref);
+          remove_ref_from_p2p_results (group->results, &data->collection_ref);
+        }
+    }
+
+  /* Also, refs whose found latest commit is exactly what the origin's
+   * summary lists can be resolved from the summary's xa.cache instead
+   * of fetching the commit object: the cache entry (metadata keyfile,
+   * sizes, eol) was published together with that commit by
+   * build-update-repo. When the peers serve the current commit this
+   * leaves nothing to pull at all during planning. */
+  for (i = 0; group->datas[i] != NULL; i++)
+    {
+      FlatpakDirResolveData *data = group->datas[i];
+      FlatpakDirResolve *resolve = data->resolve;
+      g_autofree char *summary_checksum = NULL;
+      g_autoptr(GVariant) sparse_cache = NULL;
+      const char *metadata = NULL;
+      const char *latest_rev;
+
+      if (resolve->resolved_commit != NULL || resolve->state == NULL)
+        continue;
+
+      latest_rev = find_latest_p2p_result (group->results, &data->collection_ref);
+      if (latest_rev == NULL)
+        continue;
+
+      if (!flatpak_remote_state_lookup_ref (resolve->state, resolve->ref,
+                                            &summary_checksum, NULL, NULL) ||
+          g_strcmp0 (summary_checksum, latest_rev) != 0)
+        continue;
+
+      if (!flatpak_remote_state_lookup_cache (resolve->state, resolve->ref,
+                                              &resolve->download_size,
+                                              &resolve->installed_size,
+                                              &metadata, NULL))
+        continue;
+
+      resolve->resolved_commit = g_strdup (latest_rev);
+      if (metadata != NULL)
+        resolve->resolved_metadata = g_bytes_new (metadata, strlen (metadata) + 1);
+
+      sparse_cache = flatpak_remote_state_lookup_sparse_cache (resolve->state, resolve->ref, NULL);
+      if (sparse_cache)
+        {
+          g_variant_lookup (sparse_cache, "eol", "s", &resolve->eol);
+          g_variant_lookup (sparse_cache, "eolr", "s", &resolve->eol_rebase);
         }
+
+      remove_ref_from_p2p_results (group->results, &data->collection_ref);
     }
 
   g_variant_builder_init (&pull_builder, G_VARIANT_TYPE ("a{sv}"));
@@ -3490,24 +4001,31 @@ flatpak_dir_do_resolve_p2p_refs (FlatpakDir             *self,
                          g_variant_new_variant (g_variant_new_boolean (TRUE)));
   pull_options = g_variant_ref_sink (g_variant_builder_end (&pull_builder));
 
-  transaction = flatpak_repo_transaction_start (child_repo, cancellable, error);
-  if (transaction == NULL)
+  group->transaction = flatpak_repo_transaction_start (group->child_repo, cancellable, error);
+  if (group->transaction == NULL)
     return FALSE;
 
-  ostree_repo_pull_from_remotes_async (child_repo, (const OstreeRepoFinderResult * const *) results,
+  ostree_repo_pull_from_remotes_async (group->child_repo, (const OstreeRepoFinderResult * const *) group->results,
                                        pull_options, NULL,
                                        cancellable, async_result_cb,
-                                       &pull_result);
+                                       &group->pull_result);
+
+  return TRUE;
+}
 
-  while (pull_result == NULL)
-    g_main_context_iteration (main_context, TRUE);
+static gboolean
+flatpak_dir_resolve_group_finish (FlatpakDir             *self,
+                                  FlatpakDirResolveGroup *group,
+                                  GError                **error)
+{
+  int i;
 
-  if (!ostree_repo_pull_from_remotes_finish (child_repo, pull_result, error))
+  if (!ostree_repo_pull_from_remotes_finish (group->child_repo, group->pull_result, error))
     return FALSE;
 
-  for (i = 0; datas[i] != NULL; i++)
+  for (i = 0; group->datas[i] != NULL; i++)
     {
-      FlatpakDirResolveData *data = datas[i];
+      FlatpakDirResolveData *data = group->datas[i];
       FlatpakDirResolve *resolve = data->resolve;
       g_autoptr(GVariant) commit_data = NULL;
       g_autofree char *refspec = NULL;
@@ -3516,10 +4034,10 @@ flatpak_dir_do_resolve_p2p_refs (FlatpakDir             *self,
         continue;
 
       refspec = g_strdup_printf ("%s:%s", resolve->remote, resolve->ref);
-      if (!ostree_repo_resolve_rev (child_repo, refspec, FALSE, &resolve->resolved_commit, error))
+      if (!ostree_repo_resolve_rev (group->child_repo, refspec, FALSE, &resolve->resolved_commit, error))
         return FALSE;
 
-      if (!ostree_repo_load_commit (child_repo, resolve->resolved_commit, &commit_data, NULL, error))
+      if (!ostree_repo_load_commit (group->child_repo, resolve->resolved_commit, &commit_data, NULL, error))
         return FALSE;
 
       resolve_p2p_update_from_commit (resolve, commit_data);
@@ -3536,6 +4054,9 @@ flatpak_dir_resolve_p2p_refs (FlatpakDir         *self,
 {
   g_autoptr(GPtrArray) latest_resolves = g_ptr_array_new_with_free_func ((GDestroyNotify) flatpak_dir_resolve_data_free);
   g_autoptr(GPtrArray) specific_resolves = g_ptr_array_new_with_free_func ((GDestroyNotify) flatpak_dir_resolve_data_free);
+  g_autoptr(GPtrArray) groups = g_ptr_array_new_with_free_func ((GDestroyNotify) flatpak_dir_resolve_group_free);
+  g_autoptr(GMainContextPopDefault) main_context = NULL;
+  g_autoptr(GFile) user_cache_dir = NULL;
   int i;
 
   for (i = 0; resolves[i] != NULL; i++)
@@ -3567,32 +4088,86 @@ flatpak_dir_resolve_p2p_refs (FlatpakDir         *self,
 
   if (specific_resolves->len > 0)
     {
+      FlatpakDirResolveGroup *group = g_new0 (FlatpakDirResolveGroup, 1);
+
       g_ptr_array_add (specific_resolves, NULL);
-      if (!flatpak_dir_do_resolve_p2p_refs (self, (FlatpakDirResolveData **) specific_resolves->pdata, TRUE,
-                                            cancellable, error))
-        return FALSE;
+      group->datas = (FlatpakDirResolveData **) specific_resolves->pdata;
+      group->with_commit_ids = TRUE;
+      g_ptr_array_add (groups, group);
     }
 
   if (latest_resolves->len > 0)
     {
+      FlatpakDirResolveGroup *group = g_new0 (FlatpakDirResolveGroup, 1);
+
       g_ptr_array_add (latest_resolves, NULL);
-      if (!flatpak_dir_do_resolve_p2p_refs (self, (FlatpakDirResolveData **) latest_resolves->pdata, FALSE,
-                                            cancellable, error))
-        return FALSE;
+      group->datas = (FlatpakDirResolveData **) latest_resolves->pdata;
+      group->with_commit_ids = FALSE;
+      g_ptr_array_add (groups, group);
     }
 
-  return TRUE;
-}
+  if (groups->len == 0)
+    return TRUE;
 
-static gboolean
-child_repo_ensure_summary (OstreeRepo         *child_repo,
-                           FlatpakRemoteState *state,
-                           GCancellable       *cancellable,
-                           GError            **error)
-{
-  if (state->collection_id != NULL)
+  main_context = flatpak_main_context_new_default ();
+
+  /* We create temporary child repos in the user homedir so that we can just blow them away when we're done.
+   * This lets us always write to the directory in the system-helper case, but also lets us properly clean up
+   * the transaction state directory, as that doesn't happen on abort.   */
+  user_cache_dir = flatpak_ensure_user_cache_dir_location (error);
+  if (user_cache_dir == NULL)
+    return FALSE;
+
+  /* Run all the groups in lockstep through the find and pull phases,
+   * so the network requests of one group overlap those of the others */
+  for (i = 0; i < groups->len; i++)
     {
-      /* Regenerate the summary in the child repo because the summary copied
+      if (!flatpak_dir_resolve_group_start_find (self, g_ptr_array_index (groups, i),
+                                                 user_cache_dir, cancellable, error))
+        return FALSE;
+    }
+
+  for (i = 0; i < groups->len; i++)
+    {
+      FlatpakDirResolveGroup *group = g_ptr_array_index (groups, i);
+
+      while (group->find_result == NULL)
+        g_main_context_iteration (main_context, TRUE);
+    }
+
+  for (i = 0; i < groups->len; i++)
+    {
+      if (!flatpak_dir_resolve_group_start_pull (self, g_ptr_array_index (groups, i),
+                                                 cancellable, error))
+        return FALSE;
+    }
+
+  for (i = 0; i < groups->len; i++)
+    {
+      FlatpakDirResolveGroup *group = g_ptr_array_index (groups, i);
+
+      while (group->pull_result == NULL)
+        g_main_context_iteration (main_context, TRUE);
+    }
+
+  for (i = 0; i < groups->len; i++)
+    {
+      if (!flatpak_dir_resolve_group_finish (self, g_ptr_array_index (groups, i), error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+child_repo_ensure_summary (OstreeRepo         *child_repo,
+                           FlatpakRemoteState *state,
+                           GCancellable       *cancellable,
+                           GError            **error)
+{
+  if (state->collection_id != NULL)
+    {
+      /* Regenerate the summary in the child repo because the summary copied
        * into the repo by flatpak_dir_pull() is reflective of the refs on the
        * remote that was pulled from, which might be a peer remote and might not
        * have the full set of refs that was pulled. It's also possible that
@@ -3828,6 +4403,45 @@ flatpak_dir_update_appstream (FlatpakDir          *self,
   if (state == NULL)
     return FALSE;
 
+  /* The pull is already incremental on the object level, but if the summary
+   * says the remote appstream commit is exactly what we have deployed we can
+   * skip the pull, checkout and re-compression entirely. */
+  if (!is_oci && state->summary != NULL)
+    {
+      g_autoptr(GFile) arch_dir = flatpak_build_file (flatpak_dir_get_path (self),
+                                                      "appstream", remote, arch, NULL);
+      g_autoptr(GFile) active_link = g_file_get_child (arch_dir, "active");
+      g_autoptr(GFileInfo) active_info = NULL;
+      const char *old_checksum = NULL;
+      g_autofree char *remote_checksum = NULL;
+
+      active_info = g_file_query_info (active_link, OSTREE_GIO_FAST_QUERYINFO,
+                                       G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                       cancellable, NULL);
+      if (active_info != NULL)
+        old_checksum = g_file_info_get_symlink_target (active_info);
+
+      if (old_checksum != NULL &&
+          (flatpak_summary_lookup_ref (state->summary, state->collection_id, new_branch, &remote_checksum, NULL) ||
+           flatpak_summary_lookup_ref (state->summary, state->collection_id, old_branch, &remote_checksum, NULL)) &&
+          strcmp (old_checksum, remote_checksum) == 0)
+        {
+          g_autoptr(GFile) checkout_dir = g_file_get_child (arch_dir, old_checksum);
+
+          if (g_file_query_exists (checkout_dir, cancellable))
+            {
+              g_autoptr(GFile) timestamp_file = g_file_get_child (arch_dir, ".timestamp");
+
+              g_debug ("Skipping appstream update for %s, deployed commit %s is current", remote, old_checksum);
+              if (!g_file_replace_contents (timestamp_file, "", 0, NULL, FALSE,
+                                            G_FILE_CREATE_REPLACE_DESTINATION, NULL, cancellable, error))
+                return FALSE;
+
+              return TRUE;
+            }
+        }
+    }
+
   if (flatpak_dir_use_system_helper (self, NULL))
     {
       g_auto(GLnxLockFile) child_repo_lock = { 0, };
@@ -4063,10 +4677,12 @@ translate_ostree_repo_pull_errors (GError **error)
 static gboolean
 repo_pull (OstreeRepo                           *self,
            const char                           *remote_name,
+           const char                           *override_url,
            const char                          **dirs_to_pull,
            const char                           *ref_to_fetch,
            const char                           *rev_to_fetch,
            const OstreeRepoFinderResult * const *results_to_fetch,
+           GPtrArray                            *finders,
            FlatpakPullFlags                      flatpak_flags,
            OstreeRepoPullFlags                   flags,
            OstreeAsyncProgress                  *progress,
@@ -4158,7 +4774,8 @@ repo_pull (OstreeRepo                           *self,
         {
           ostree_repo_find_remotes_async (self, (const OstreeCollectionRef * const *) collection_refs_to_fetch,
                                           find_options,
-                                          NULL /* default finders */, progress, cancellable,
+                                          finders != NULL ? (OstreeRepoFinder **) finders->pdata : NULL,
+                                          progress, cancellable,
                                           async_result_cb, &find_result);
 
           while (find_result == NULL)
@@ -4214,6 +4831,10 @@ repo_pull (OstreeRepo                           *self,
       g_variant_builder_add (&builder, "{s@v}", "override-commit-ids",
                              g_variant_new_variant (g_variant_new_strv ((const char * const *) revs_to_fetch, -1)));
 
+      if (override_url != NULL)
+        g_variant_builder_add (&builder, "{s@v}", "override-url",
+                               g_variant_new_variant (g_variant_new_string (override_url)));
+
       options = g_variant_ref_sink (g_variant_builder_end (&builder));
 
       if (!ostree_repo_pull_with_options (self, remote_name, options,
@@ -4253,6 +4874,80 @@ ensure_soup_session (FlatpakDir *self)
     }
 }
 
+/* Returns the base url that fetches from @remote_name should use: the
+ * configured url, unless the remote also lists mirrors in
+ * xa.url-mirrors, in which case all the urls are raced once per
+ * process and whichever delivers the first response wins. That way a
+ * degraded primary just loses the race instead of stalling every
+ * fetch, with no config changes needed. Returns %NULL if the remote
+ * has no url configured at all. */
+static char *
+flatpak_dir_get_remote_fetch_url (FlatpakDir   *self,
+                                  const char   *remote_name,
+                                  GCancellable *cancellable,
+                                  GError      **error)
+{
+  g_autofree char *url = NULL;
+  g_autofree char *group = g_strdup_printf ("remote \"%s\"", remote_name);
+  g_auto(GStrv) mirrors = NULL;
+  g_autoptr(GPtrArray) race_urls = NULL;
+  g_autoptr(GPtrArray) race_uris = NULL;
+  GKeyFile *config;
+  const char *preferred;
+  int winner;
+  guint i;
+
+  if (!ostree_repo_remote_get_url (self->repo, remote_name, &url, error))
+    return NULL;
+
+  config = ostree_repo_get_config (self->repo);
+  if (config)
+    mirrors = g_key_file_get_string_list (config, group, "xa.url-mirrors", NULL, NULL);
+
+  if (mirrors == NULL || mirrors[0] == NULL ||
+      g_str_has_prefix (url, "oci+"))
+    return g_steal_pointer (&url);
+
+  if (self->preferred_mirror != NULL)
+    {
+      preferred = g_hash_table_lookup (self->preferred_mirror, remote_name);
+      if (preferred != NULL)
+        return g_strdup (preferred);
+    }
+
+  race_urls = g_ptr_array_new_with_free_func (g_free);
+  g_ptr_array_add (race_urls, g_strdup (url));
+  for (i = 0; mirrors[i] != NULL; i++)
+    {
+      if (*mirrors[i] != 0)
+        g_ptr_array_add (race_urls, g_strdup (mirrors[i]));
+    }
+
+  ensure_soup_session (self);
+
+  /* Every ostree repo serves a small /config, race a fetch of that */
+  race_uris = g_ptr_array_new_with_free_func (g_free);
+  for (i = 0; i < race_urls->len; i++)
+    g_ptr_array_add (race_uris, g_build_filename (g_ptr_array_index (race_urls, i), "config", NULL));
+  g_ptr_array_add (race_uris, NULL);
+
+  winner = flatpak_http_race_uris (self->soup_session,
+                                   (const char * const *) race_uris->pdata,
+                                   cancellable);
+  if (winner < 0)
+    winner = 0; /* Nothing responded (offline?), stick with the configured url */
+
+  g_debug ("Using mirror %s for remote %s",
+           (char *) g_ptr_array_index (race_urls, winner), remote_name);
+
+  if (self->preferred_mirror == NULL)
+    self->preferred_mirror = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  g_hash_table_insert (self->preferred_mirror, g_strdup (remote_name),
+                       g_strdup (g_ptr_array_index (race_urls, winner)));
+
+  return g_strdup (g_ptr_array_index (race_urls, winner));
+}
+
 typedef struct
 {
   OstreeAsyncProgress *progress;
@@ -4274,9 +4969,11 @@ static gboolean
 flatpak_dir_setup_extra_data (FlatpakDir                           *self,
                               OstreeRepo                           *repo,
                               const char                           *repository,
+                              const char                           *override_url,
                               const char                           *ref,
                               const char                           *rev,
                               const OstreeRepoFinderResult * const *results,
+                              GPtrArray                            *finders,
                               FlatpakPullFlags                      flatpak_flags,
                               OstreeAsyncProgress                  *progress,
                               GCancellable                         *cancellable,
@@ -4297,10 +4994,12 @@ flatpak_dir_setup_extra_data (FlatpakDir                           *self,
        * again. Here we don't pass the progress because we don't want any
        * reports coming out of it. */
       if (!repo_pull (repo, repository,
+                      override_url,
                       NULL,
                       ref,
                       rev,
                       results,
+                      finders,
                       flatpak_flags,
                       OSTREE_REPO_PULL_FLAGS_COMMIT_ONLY,
                       NULL,
@@ -4795,7 +5494,10 @@ flatpak_dir_pull (FlatpakDir                           *self,
   gboolean ret = FALSE;
   g_autofree char *rev = NULL;
   g_autofree char *url = NULL;
+  g_autofree char *fetch_url = NULL;
+  g_autofree char *override_url = NULL;
   g_autoptr(GPtrArray) subdirs_arg = NULL;
+  g_autoptr(GPtrArray) finders = NULL;
   g_auto(OstreeRepoFinderResultv) allocated_results = NULL;
   const OstreeRepoFinderResult * const *results;
   g_auto(GLnxLockFile) lock = { 0, };
@@ -4822,6 +5524,9 @@ flatpak_dir_pull (FlatpakDir                           *self,
     return flatpak_dir_pull_oci (self, state, ref, repo, flatpak_flags,
                                  flags, progress, cancellable, error);
 
+  FLATPAK_TRACE (pull_start, state->remote_name, ref);
+  flatpak_profile_begin ("pull", ref);
+
   if (!ostree_repo_remote_get_url (self->repo,
                                    state->remote_name,
                                    &url,
@@ -4831,8 +5536,16 @@ flatpak_dir_pull (FlatpakDir                           *self,
   if (*url == 0)
     return TRUE; /* Empty url, silently disables updates */
 
+  /* If the remote lists mirrors, route the whole pull at whichever of
+     the urls is currently the fastest */
+  fetch_url = flatpak_dir_get_remote_fetch_url (self, state->remote_name, cancellable, NULL);
+  if (fetch_url != NULL && strcmp (fetch_url, url) != 0)
+    override_url = g_steal_pointer (&fetch_url);
+
   g_assert (progress != NULL);
 
+  finders = flatpak_dir_get_repo_finders (self);
+
   /* We get the rev ahead of time so that we know it for looking up e.g. extra-data
      and to make sure we're atomically using a single rev if we happen to do multiple
      pulls (e.g. with subpaths) */
@@ -4883,7 +5596,8 @@ flatpak_dir_pull (FlatpakDir                           *self,
 
           ostree_repo_find_remotes_async (self->repo, (const OstreeCollectionRef * const *) collection_refs_to_fetch,
                                           find_options,
-                                          NULL /* default finders */, progress, cancellable,
+                                          finders != NULL ? (OstreeRepoFinder **) finders->pdata : NULL,
+                                          progress, cancellable,
                                           async_result_cb, &find_result);
 
           while (find_result == NULL)
@@ -4942,7 +5656,8 @@ flatpak_dir_pull (FlatpakDir                           *self,
   /* Setup extra data information before starting to pull, so we can have precise
    * progress reports */
   if (!flatpak_dir_setup_extra_data (self, repo, state->remote_name,
-                                     ref, rev, results,
+                                     override_url,
+                                     ref, rev, results, finders,
                                      flatpak_flags,
                                      progress,
                                      cancellable,
@@ -4953,8 +5668,9 @@ flatpak_dir_pull (FlatpakDir                           *self,
   ostree_repo_resolve_rev (repo, remote_and_branch, TRUE, &current_checksum, NULL);
 
   if (!repo_pull (repo, state->remote_name,
+                  override_url,
                   subdirs_arg ? (const char **) subdirs_arg->pdata : NULL,
-                  ref, rev, results, flatpak_flags, flags,
+                  ref, rev, results, finders, flatpak_flags, flags,
                   progress,
                   cancellable, error))
     {
@@ -4996,6 +5712,9 @@ out:
   if (progress)
     ostree_async_progress_finish (progress);
 
+  FLATPAK_TRACE (pull_done, state->remote_name, ref, ret);
+  flatpak_profile_end ("pull");
+
   return ret;
 }
 
@@ -5084,6 +5803,73 @@ repo_pull_local_untrusted (FlatpakDir          *self,
   return res;
 }
 
+/* Cache of summary signatures we have already verified, so that a
+ * multi-ref transaction doesn't re-verify the same summary bytes for
+ * every ref, and the resident system helper doesn't re-verify them
+ * for every transaction. Only successful verdicts are cached, keyed
+ * on the digests of the payload and the signature plus the state of
+ * the remote's keyring, so importing a new key invalidates the
+ * verdicts for that remote. */
+static GHashTable *verified_summary_cache; /* key string => unused */
+G_LOCK_DEFINE_STATIC (verified_summary_cache);
+
+static char *
+verified_summary_cache_key (FlatpakDir *self,
+                            const char *remote_name,
+                            GBytes     *summary,
+                            GBytes     *summary_sig)
+{
+  g_autofree char *summary_digest = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, summary);
+  g_autofree char *sig_digest = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, summary_sig);
+  g_autofree char *keyring_name = g_strconcat (remote_name, ".trustedkeys.gpg", NULL);
+  g_autoptr(GFile) keyring = g_file_get_child (ostree_repo_get_path (self->repo), keyring_name);
+  struct stat st;
+
+  if (stat (flatpak_file_get_path_cached (keyring), &st) != 0)
+    memset (&st, 0, sizeof st);
+
+  return g_strdup_printf ("%s %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %s %s",
+                          remote_name, (guint64) st.st_mtime, (guint64) st.st_size,
+                          summary_digest, sig_digest);
+}
+
+static gboolean
+flatpak_dir_verify_summary (FlatpakDir   *self,
+                            const char   *remote_name,
+                            GBytes       *summary,
+                            GBytes       *summary_sig,
+                            GCancellable *cancellable,
+                            GError      **error)
+{
+  g_autofree char *key = verified_summary_cache_key (self, remote_name, summary, summary_sig);
+  g_autoptr(OstreeGpgVerifyResult) gpg_result = NULL;
+
+  G_LOCK (verified_summary_cache);
+  if (verified_summary_cache != NULL && g_hash_table_contains (verified_summary_cache, key))
+    {
+      G_UNLOCK (verified_summary_cache);
+      return TRUE;
+    }
+  G_UNLOCK (verified_summary_cache);
+
+  gpg_result = ostree_repo_verify_summary (self->repo, remote_name,
+                                           summary, summary_sig,
+                                           cancellable, error);
+  if (gpg_result == NULL)
+    return FALSE;
+
+  if (ostree_gpg_verify_result_count_valid (gpg_result) == 0)
+    return flatpak_fail_error (error, FLATPAK_ERROR_UNTRUSTED, _("GPG signatures found for remote '%s', but none are in trusted keyring"), remote_name);
+
+  G_LOCK (verified_summary_cache);
+  if (verified_summary_cache == NULL)
+    verified_summary_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_hash_table_add (verified_summary_cache, g_steal_pointer (&key));
+  G_UNLOCK (verified_summary_cache);
+
+  return TRUE;
+}
+
 gboolean
 flatpak_dir_pull_untrusted_local (FlatpakDir          *self,
                                   const char          *src_path,
@@ -5114,6 +5900,9 @@ flatpak_dir_pull_untrusted_local (FlatpakDir          *self,
   g_autoptr(GVariant) old_commit = NULL;
   g_autoptr(OstreeRepo) src_repo = NULL;
   g_autoptr(GVariant) new_commit = NULL;
+  g_autoptr(GVariant) dest_commit = NULL;
+  OstreeRepoCommitState dest_commit_state = 0;
+  gboolean already_complete = FALSE;
   g_autoptr(GVariant) extra_data_sources = NULL;
   g_autoptr(GPtrArray) subdirs_arg = NULL;
   g_auto(GLnxLockFile) lock = { 0, };
@@ -5164,20 +5953,12 @@ flatpak_dir_pull_untrusted_local (FlatpakDir          *self,
 
       summary_sig_bytes = g_bytes_new_take (summary_sig_data, summary_sig_data_size);
 
-      gpg_result = ostree_repo_verify_summary (self->repo,
-                                               remote_name,
-                                               summary_bytes,
-                                               summary_sig_bytes,
-                                               cancellable, error);
-      if (gpg_result == NULL)
+      if (!flatpak_dir_verify_summary (self, remote_name,
+                                       summary_bytes, summary_sig_bytes,
+                                       cancellable, error))
         return FALSE;
-
-      if (ostree_gpg_verify_result_count_valid (gpg_result) == 0)
-        return flatpak_fail_error (error, FLATPAK_ERROR_UNTRUSTED, _("GPG signatures found for remote '%s', but none are in trusted keyring"), remote_name);
     }
 
-  g_clear_object (&gpg_result);
-
   remote_and_branch = g_strdup_printf ("%s:%s", remote_name, ref);
   if (!ostree_repo_resolve_rev (self->repo, remote_and_branch, TRUE, &current_checksum, error))
     return FALSE;
@@ -5275,6 +6056,16 @@ flatpak_dir_pull_untrusted_local (FlatpakDir          *self,
         return flatpak_fail_error (error, FLATPAK_ERROR_DOWNGRADE, "Not allowed to downgrade %s", ref);
     }
 
+  /* If the destination repo already has the commit complete (a second
+   * installation of the same ref, a retried deploy, or an earlier
+   * sideload), the untrusted pull below would re-verify and re-copy
+   * every object only to find them all present. Just point the remote
+   * ref at the commit instead. Partial commits (from a previous subpath
+   * install) still need the pull to fill in the rest of the tree. */
+  if (ostree_repo_load_commit (self->repo, checksum, &dest_commit, &dest_commit_state, NULL) &&
+      (dest_commit_state & OSTREE_REPO_COMMIT_STATE_PARTIAL) == 0)
+    already_complete = TRUE;
+
   if (subpaths != NULL && subpaths[0] != NULL)
     {
       subdirs_arg = g_ptr_array_new_with_free_func (g_free);
@@ -5291,10 +6082,14 @@ flatpak_dir_pull_untrusted_local (FlatpakDir          *self,
 
   /* Past this we must use goto out, so we abort the transaction on error */
 
-  if (!repo_pull_local_untrusted (self, self->repo, remote_name, url,
-                                  subdirs_arg ? (const char **) subdirs_arg->pdata : NULL,
-                                  ref, checksum, progress,
-                                  cancellable, error))
+  if (already_complete)
+    {
+      ostree_repo_transaction_set_ref (self->repo, remote_name, ref, checksum);
+    }
+  else if (!repo_pull_local_untrusted (self, self->repo, remote_name, url,
+                                       subdirs_arg ? (const char **) subdirs_arg->pdata : NULL,
+                                       ref, checksum, progress,
+                                       cancellable, error))
     {
       g_prefix_error (error, _("While pulling %s from remote %s: "), ref, remote_name);
       goto out;
@@ -5453,6 +6248,103 @@ out:
   return ret;
 }
 
+/* In-memory cache of deployed ref listings, so that repeated listings
+ * (e.g. by monitoring tools polling the installed state) don't have to
+ * walk the whole deploy tree every time. The cache is valid as long as
+ * the mtime of the ".changed" file, which all deploys and undeploys
+ * touch, is unchanged. On top of that mtime check a file monitor drops
+ * the cache eagerly when another process touches the file. */
+
+G_LOCK_DEFINE_STATIC (ref_cache);
+
+/* Cached related-ref resolutions (see
+ * flatpak_dir_find_remote_related_for_metadata). These are tied to the
+ * ".changed" stamp like the listings above, because the results bake in
+ * the deploy state of the extensions; everything else they depend on is
+ * folded into the fingerprint. */
+typedef struct
+{
+  char      *fingerprint;
+  GPtrArray *related; /* FlatpakRelated */
+} RelatedCacheEntry;
+
+static void
+related_cache_entry_free (RelatedCacheEntry *entry)
+{
+  g_free (entry->fingerprint);
+  g_ptr_array_unref (entry->related);
+  g_free (entry);
+}
+
+static guint64
+flatpak_dir_get_changed_stamp (FlatpakDir *self)
+{
+  g_autoptr(GFile) changed_file = flatpak_dir_get_changed_path (self);
+
+  return flatpak_dir_get_mtime_stamp (changed_file);
+}
+
+static void
+flatpak_dir_invalidate_ref_cache (FlatpakDir *self)
+{
+  G_LOCK (ref_cache);
+  self->ref_cache_stamp = 0;
+  if (self->ref_cache)
+    g_hash_table_remove_all (self->ref_cache);
+  if (self->deployed_cache)
+    g_hash_table_remove_all (self->deployed_cache);
+  if (self->related_cache)
+    g_hash_table_remove_all (self->related_cache);
+  G_UNLOCK (ref_cache);
+}
+
+static void
+changed_monitor_changed (GFileMonitor     *monitor,
+                         GFile            *file,
+                         GFile            *other_file,
+                         GFileMonitorEvent event_type,
+                         gpointer          user_data)
+{
+  flatpak_dir_invalidate_ref_cache (user_data);
+}
+
+/* Called with the ref_cache lock held. Returns FALSE if the cache can't
+ * be used because there is no .changed file to tie its validity to. */
+static gboolean
+flatpak_dir_ensure_ref_cache (FlatpakDir *self)
+{
+  guint64 stamp = flatpak_dir_get_changed_stamp (self);
+
+  if (self->changed_monitor == NULL)
+    {
+      g_autoptr(GFile) changed_file = flatpak_dir_get_changed_path (self);
+
+      /* The monitor is best-effort (and only useful if a main context is
+       * iterated), the mtime check is what guarantees correctness */
+      self->changed_monitor = g_file_monitor_file (changed_file, G_FILE_MONITOR_NONE, NULL, NULL);
+      if (self->changed_monitor)
+        g_signal_connect (self->changed_monitor, "changed",
+                          G_CALLBACK (changed_monitor_changed), self);
+    }
+
+  if (self->ref_cache == NULL)
+    {
+      self->ref_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_strfreev);
+      self->deployed_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_strfreev);
+      self->related_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) related_cache_entry_free);
+    }
+
+  if (stamp != self->ref_cache_stamp)
+    {
+      g_hash_table_remove_all (self->ref_cache);
+      g_hash_table_remove_all (self->deployed_cache);
+      g_hash_table_remove_all (self->related_cache);
+      self->ref_cache_stamp = stamp;
+    }
+
+  return stamp != 0;
+}
+
 gboolean
 flatpak_dir_list_refs_for_name (FlatpakDir   *self,
                                 const char   *kind,
@@ -5566,6 +6458,19 @@ flatpak_dir_list_refs (FlatpakDir   *self,
   g_autoptr(GFileInfo) child_info = NULL;
   GError *temp_error = NULL;
   g_autoptr(GPtrArray) refs = NULL;
+  gboolean cacheable;
+  char **cached;
+
+  G_LOCK (ref_cache);
+  cacheable = flatpak_dir_ensure_ref_cache (self);
+  cached = g_hash_table_lookup (self->ref_cache, kind);
+  if (cached != NULL)
+    {
+      *refs_out = g_strdupv (cached);
+      G_UNLOCK (ref_cache);
+      return TRUE;
+    }
+  G_UNLOCK (ref_cache);
 
   refs = g_ptr_array_new ();
 
@@ -5620,6 +6525,13 @@ out:
       g_ptr_array_add (refs, NULL);
       *refs_out = (char **) g_ptr_array_free (refs, FALSE);
       refs = NULL;
+
+      if (cacheable)
+        {
+          G_LOCK (ref_cache);
+          g_hash_table_replace (self->ref_cache, g_strdup (kind), g_strdupv (*refs_out));
+          G_UNLOCK (ref_cache);
+        }
     }
 
   if (temp_error != NULL)
@@ -5792,6 +6704,7 @@ flatpak_dir_run_triggers (FlatpakDir   *self,
                                                         error))
         return FALSE;
 
+      self->needs_triggers = FALSE;
       return TRUE;
     }
 
@@ -5880,9 +6793,71 @@ flatpak_dir_run_triggers (FlatpakDir   *self,
 
   ret = TRUE;
 out:
+  if (ret)
+    self->needs_triggers = FALSE;
   return ret;
 }
 
+/* Runs the triggers only if some operation since the last run actually
+ * changed the exports, so a batch of operations (e.g. a transaction)
+ * can call this once at the end and each trigger runs at most once. */
+gboolean
+flatpak_dir_maybe_run_triggers (FlatpakDir   *self,
+                                GCancellable *cancellable,
+                                GError      **error)
+{
+  /* When using the system helper the exports are updated in the helper
+   * process, so we can't track them here; always run in that case (the
+   * caller is expected to batch the calls). */
+  if (!self->needs_triggers && !flatpak_dir_use_system_helper (self, NULL))
+    return TRUE;
+
+  return flatpak_dir_run_triggers (self, cancellable, error);
+}
+
+/* Each deploy normally ends with a syncfs () of the checkout before it
+ * is moved in place, which flushes the whole filesystem. When a batch
+ * of deploys (e.g. a transaction installing an app, its runtime and
+ * locale extensions) all land on the same filesystem, one sync at the
+ * end is enough, so this makes flatpak_dir_deploy () skip the
+ * per-checkout sync and just record that one is owed;
+ * flatpak_dir_flush_checkout_sync () then settles it. The trade-off is
+ * a slightly larger crash window, so single-ref operations keep the
+ * default sync-before-rename behavior. */
+void
+flatpak_dir_defer_checkout_sync (FlatpakDir *self)
+{
+  self->checkout_sync_deferred = TRUE;
+}
+
+gboolean
+flatpak_dir_flush_checkout_sync (FlatpakDir   *self,
+                                 GCancellable *cancellable,
+                                 GError      **error)
+{
+  glnx_autofd int dfd = -1;
+  g_autofree char *basedir_path = NULL;
+
+  self->checkout_sync_deferred = FALSE;
+
+  if (!self->checkout_sync_pending)
+    return TRUE;
+
+  self->checkout_sync_pending = FALSE;
+
+  basedir_path = g_file_get_path (self->basedir);
+  if (!glnx_opendirat (AT_FDCWD, basedir_path, TRUE, &dfd, error))
+    return FALSE;
+
+  if (syncfs (dfd) != 0)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 static gboolean
 read_fd (int          fd,
          struct stat *stat_buf,
@@ -6404,6 +7379,7 @@ rewrite_export_dir (const char         *app,
   gboolean exports_allowed = FALSE;
   g_auto(GStrv) allowed_prefixes = NULL;
   g_auto(GStrv) allowed_extensions = NULL;
+  g_autoptr(FlatpakNameMatcher) name_matcher = NULL;
   gboolean require_exact_match = FALSE;
 
   if (!glnx_dirfd_iterator_init_at (source_parent_fd, source_name, FALSE, &source_iter, error))
@@ -6412,6 +7388,12 @@ rewrite_export_dir (const char         *app,
   exports_allowed = flatpak_get_allowed_exports (source_path, app, context,
                                                  &allowed_extensions, &allowed_prefixes, &require_exact_match);
 
+  /* Compile the prefix patterns once, they are matched against every
+   * file in the directory (e.g. each exported icon) */
+  if (exports_allowed)
+    name_matcher = flatpak_name_matcher_new ((const char * const *) allowed_prefixes,
+                                             require_exact_match);
+
   visited_children = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 
   while (TRUE)
@@ -6477,7 +7459,7 @@ rewrite_export_dir (const char         *app,
 
           name_without_extension = g_strndup (dent->d_name, strlen (dent->d_name) - strlen (allowed_extensions[i]));
 
-          if (!flatpak_name_matches_one_wildcard_prefix (name_without_extension, (const char * const *) allowed_prefixes, require_exact_match))
+          if (!flatpak_name_matcher_matches (name_matcher, name_without_extension))
             {
               g_warning ("Non-prefixed filename %s in app %s, removing.", dent->d_name, app);
               if (unlinkat (source_iter.fd, dent->d_name, 0) != 0 && errno != ENOENT)
@@ -6590,6 +7572,7 @@ export_dir (int           source_parent_fd,
             const char   *source_relpath,
             int           destination_parent_fd,
             const char   *destination_name,
+            GPtrArray    *exported,
             GCancellable *cancellable,
             GError      **error)
 {
@@ -6647,7 +7630,7 @@ export_dir (int           source_parent_fd,
           g_autofree gchar *child_relpath = g_strconcat (source_relpath, dent->d_name, "/", NULL);
 
           if (!export_dir (source_iter.fd, dent->d_name, child_symlink_prefix, child_relpath, destination_dfd, dent->d_name,
-                           cancellable, error))
+                           exported, cancellable, error))
             goto out;
         }
       else if (S_ISREG (stbuf.st_mode))
@@ -6667,6 +7650,9 @@ export_dir (int           source_parent_fd,
               glnx_set_error_from_errno (error);
               goto out;
             }
+
+          if (exported != NULL)
+            g_ptr_array_add (exported, g_strconcat (source_relpath, dent->d_name, NULL));
         }
     }
 
@@ -6680,6 +7666,7 @@ static gboolean
 flatpak_export_dir (GFile        *source,
                     GFile        *destination,
                     const char   *symlink_prefix,
+                    GPtrArray    *exported,
                     GCancellable *cancellable,
                     GError      **error)
 {
@@ -6699,6 +7686,7 @@ flatpak_export_dir (GFile        *source,
       g_autoptr(GFile) sub_source = g_file_resolve_relative_path (source, exported_subdirs[i]);
       g_autoptr(GFile) sub_destination = g_file_resolve_relative_path (destination, exported_subdirs[i]);
       g_autofree char *sub_symlink_prefix = g_build_filename (exported_subdirs[i + 1], symlink_prefix, exported_subdirs[i], NULL);
+      g_autofree char *sub_relpath = g_strconcat (exported_subdirs[i], "/", NULL);
 
       if (!g_file_query_exists (sub_source, cancellable))
         continue;
@@ -6706,15 +7694,65 @@ flatpak_export_dir (GFile        *source,
       if (!flatpak_mkdir_p (sub_destination, cancellable, error))
         return FALSE;
 
-      if (!export_dir (AT_FDCWD, flatpak_file_get_path_cached (sub_source), sub_symlink_prefix, "",
+      if (!export_dir (AT_FDCWD, flatpak_file_get_path_cached (sub_source), sub_symlink_prefix, sub_relpath,
                        AT_FDCWD, flatpak_file_get_path_cached (sub_destination),
-                       cancellable, error))
+                       exported, cancellable, error))
         return FALSE;
     }
 
   return TRUE;
 }
 
+/* Remove the symlinks the previous deploy of @changed_app exported but
+ * the current one doesn't, as recorded in the per-app index file. Each
+ * candidate is verified to still point into @changed_app before removal,
+ * since another app exporting the same name may have replaced the link.
+ * Returns FALSE if there is no usable record and the caller needs to
+ * fall back to scanning the whole exports tree. */
+static gboolean
+remove_unexported_symlinks (GFile      *exports,
+                            const char *changed_app,
+                            const char *index_path,
+                            GPtrArray  *new_exported)
+{
+  g_autofree char *old_contents = NULL;
+  g_autofree char *app_needle = NULL;
+  g_auto(GStrv) old_files = NULL;
+  g_autoptr(GHashTable) new_set = NULL;
+  int i;
+
+  if (!g_file_get_contents (index_path, &old_contents, NULL, NULL))
+    return FALSE;
+
+  new_set = g_hash_table_new (g_str_hash, g_str_equal);
+  for (i = 0; i < new_exported->len; i++)
+    g_hash_table_add (new_set, g_ptr_array_index (new_exported, i));
+
+  app_needle = g_strdup_printf ("/app/%s/", changed_app);
+
+  old_files = g_strsplit (old_contents, "\n", -1);
+  for (i = 0; old_files[i] != NULL; i++)
+    {
+      const char *old_file = old_files[i];
+      g_autofree char *path = NULL;
+      g_autofree char *target = NULL;
+
+      if (*old_file == 0 || *old_file == '/' ||
+          strstr (old_file, "..") != NULL)
+        continue;
+
+      if (g_hash_table_contains (new_set, old_file))
+        continue;
+
+      path = g_build_filename (flatpak_file_get_path_cached (exports), old_file, NULL);
+      target = glnx_readlinkat_malloc (AT_FDCWD, path, NULL, NULL);
+      if (target != NULL && strstr (target, app_needle) != NULL)
+        unlink (path);
+    }
+
+  return TRUE;
+}
+
 gboolean
 flatpak_dir_update_exports (FlatpakDir   *self,
                             const char   *changed_app,
@@ -6723,15 +7761,25 @@ flatpak_dir_update_exports (FlatpakDir   *self,
 {
   gboolean ret = FALSE;
   g_autoptr(GFile) exports = NULL;
+  g_autoptr(GPtrArray) new_exported = NULL;
   g_autofree char *current_ref = NULL;
   g_autofree char *active_id = NULL;
   g_autofree char *symlink_prefix = NULL;
+  g_autofree char *index_basename = NULL;
+  g_autofree char *index_path = NULL;
 
   exports = flatpak_dir_get_exports_dir (self);
 
   if (!flatpak_mkdir_p (exports, cancellable, error))
     goto out;
 
+  if (changed_app)
+    {
+      new_exported = g_ptr_array_new_with_free_func (g_free);
+      index_basename = g_strdup_printf (".exported-%s", changed_app);
+      index_path = g_build_filename (flatpak_file_get_path_cached (exports), index_basename, NULL);
+    }
+
   if (changed_app &&
       (current_ref = flatpak_dir_current_ref (self, changed_app, cancellable)) &&
       (active_id = flatpak_dir_read_active (self, current_ref, cancellable)))
@@ -6748,15 +7796,47 @@ flatpak_dir_update_exports (FlatpakDir   *self,
         {
           symlink_prefix = g_build_filename ("..", "app", changed_app, "current", "active", "export", NULL);
           if (!flatpak_export_dir (export, exports,
-                                   symlink_prefix,
+                                   symlink_prefix, new_exported,
                                    cancellable,
                                    error))
             goto out;
         }
     }
 
-  if (!flatpak_remove_dangling_symlinks (exports, cancellable, error))
-    goto out;
+  if (changed_app &&
+      remove_unexported_symlinks (exports, changed_app, index_path, new_exported))
+    {
+      /* Applied just the diff against the previous exported set of
+       * @changed_app; the rest of the tree is unaffected by this change. */
+    }
+  else
+    {
+      /* No record of what was exported before (older deploy, or first
+       * install), so repair by scanning the whole tree. */
+      if (!flatpak_remove_dangling_symlinks (exports, cancellable, error))
+        goto out;
+    }
+
+  if (changed_app)
+    {
+      if (new_exported->len > 0)
+        {
+          g_autoptr(GString) new_contents = g_string_new ("");
+          int i;
+
+          g_ptr_array_sort (new_exported, flatpak_strcmp0_ptr);
+          for (i = 0; i < new_exported->len; i++)
+            g_string_append_printf (new_contents, "%s\n",
+                                    (char *) g_ptr_array_index (new_exported, i));
+
+          if (!g_file_set_contents (index_path, new_contents->str, -1, error))
+            goto out;
+        }
+      else
+        unlink (index_path);
+    }
+
+  self->needs_triggers = TRUE;
 
   ret = TRUE;
 
@@ -7034,7 +8114,7 @@ apply_extra_data (FlatpakDir   *self,
                                          FLATPAK_RUN_FLAG_NO_SYSTEM_BUS_PROXY |
                                          FLATPAK_RUN_FLAG_NO_A11Y_BUS_PROXY,
                                          id,
-                                         app_context, NULL, NULL, NULL, cancellable, error))
+                                         app_context, NULL, NULL, NULL, NULL, cancellable, error))
     return FALSE;
 
   flatpak_bwrap_add_arg (bwrap, "/app/bin/apply_extra");
@@ -7091,31 +8171,250 @@ apply_extra_data (FlatpakDir   *self,
   return TRUE;
 }
 
-/* We create a deploy ref for the currently deployed version of all refs to avoid
-   deployed commits being pruned when e.g. we pull --no-deploy. */
-static gboolean
-flatpak_dir_update_deploy_ref (FlatpakDir *self,
-                               const char *ref,
-                               const char *checksum,
-                               GError    **error)
+/* Number of worker threads used for checking out a commit during
+ * deploy, from the xa.checkout-threads installation config key. The
+ * default of 1 keeps the traditional single-threaded checkout; "auto"
+ * uses one thread per cpu. */
+static int
+flatpak_dir_get_checkout_threads (FlatpakDir *self)
 {
-  g_autofree char *deploy_ref = g_strconcat ("deploy/", ref, NULL);
+  g_autofree char *value = flatpak_dir_get_config (self, "checkout-threads", NULL);
+  int n_threads;
 
-  if (!ostree_repo_set_ref_immediate (self->repo, NULL, deploy_ref, checksum, NULL, error))
-    return FALSE;
+  if (value == NULL)
+    return 1;
 
-  return TRUE;
+  if (strcmp (value, "auto") == 0)
+    return g_get_num_processors ();
+
+  n_threads = atoi (value);
+  if (n_threads < 1)
+    return 1;
+
+  return n_threads;
 }
 
-gboolean
-flatpak_dir_deploy (FlatpakDir          *self,
-                    const char          *origin,
-                    const char          *ref,
-                    const char          *checksum_or_latest,
-                    const char * const * subpaths,
-                    const char * const * previous_ids,
-                    GCancellable        *cancellable,
-                    GError             **error)
+typedef struct
+{
+  OstreeRepo   *repo;
+  OstreeRepoCheckoutAtOptions *options;
+  const char   *checksum;
+  GCancellable *cancellable;
+  GMutex        lock;
+  GError       *error;
+} ParallelCheckoutData;
+
+typedef struct
+{
+  char *subpath;
+  char *dstpath;
+} ParallelCheckoutTask;
+
+static void
+parallel_checkout_task_free (ParallelCheckoutTask *task)
+{
+  g_free (task->subpath);
+  g_free (task->dstpath);
+  g_free (task);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (ParallelCheckoutTask, parallel_checkout_task_free)
+
+static void
+parallel_checkout_worker (gpointer task_data,
+                          gpointer user_data)
+{
+  g_autoptr(ParallelCheckoutTask) task = task_data;
+  ParallelCheckoutData *data = user_data;
+  OstreeRepoCheckoutAtOptions options;
+  g_autoptr(GError) local_error = NULL;
+  gboolean failed;
+
+  g_mutex_lock (&data->lock);
+  failed = data->error != NULL;
+  g_mutex_unlock (&data->lock);
+
+  if (failed)
+    return;
+
+  options = *data->options;
+  options.subpath = task->subpath;
+
+  if (!ostree_repo_checkout_at (data->repo, &options,
+                                AT_FDCWD, task->dstpath,
+                                data->checksum,
+                                data->cancellable, &local_error))
+    {
+      g_prefix_error (&local_error, _("While trying to checkout subpath ‘%s’: "), task->subpath);
+      g_mutex_lock (&data->lock);
+      if (data->error == NULL)
+        data->error = g_steal_pointer (&local_error);
+      g_mutex_unlock (&data->lock);
+    }
+}
+
+static void
+parallel_checkout_push_task (GThreadPool *pool,
+                             const char  *subpath,
+                             const char  *dstpath)
+{
+  ParallelCheckoutTask *task = g_new0 (ParallelCheckoutTask, 1);
+
+  task->subpath = g_strdup (subpath);
+  task->dstpath = g_strdup (dstpath);
+  g_thread_pool_push (pool, task, NULL);
+}
+
+/* Checks out @checksum into @checkoutdirpath by fanning the children of
+ * the commit root (and of its files/ subdirectory, where most of the
+ * content lives) out over a worker pool, each worker doing a regular
+ * subpath checkout. Directories above the fan-out points are created
+ * up front so the workers never race on directory creation. */
+static gboolean
+flatpak_dir_checkout_commit_parallel (FlatpakDir                  *self,
+                                      OstreeRepoCheckoutAtOptions *options,
+                                      const char                  *checkoutdirpath,
+                                      const char                  *checksum,
+                                      GFile                       *root,
+                                      int                          n_threads,
+                                      GCancellable                *cancellable,
+                                      GError                     **error)
+{
+  g_autoptr(GFileEnumerator) dir_enum = NULL;
+  ParallelCheckoutData data = { 0 };
+  GThreadPool *pool;
+  gboolean res = TRUE;
+
+  dir_enum = g_file_enumerate_children (root, "standard::name,standard::type",
+                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                        cancellable, error);
+  if (dir_enum == NULL)
+    return FALSE;
+
+  data.repo = self->repo;
+  data.options = options;
+  data.checksum = checksum;
+  data.cancellable = cancellable;
+  g_mutex_init (&data.lock);
+
+  pool = g_thread_pool_new (parallel_checkout_worker, &data, n_threads, FALSE, error);
+  if (pool == NULL)
+    {
+      g_mutex_clear (&data.lock);
+      return FALSE;
+    }
+
+  while (TRUE)
+    {
+      GFileInfo *child_info;
+      const char *name;
+
+      if (!g_file_enumerator_iterate (dir_enum, &child_info, NULL, cancellable, error))
+        {
+          res = FALSE;
+          break;
+        }
+      if (child_info == NULL)
+        break;
+
+      name = g_file_info_get_name (child_info);
+
+      if (strcmp (name, "files") == 0 &&
+          g_file_info_get_file_type (child_info) == G_FILE_TYPE_DIRECTORY)
+        {
+          /* Most of the content is under files/, so fan out one level
+           * deeper there to get reasonably even batches */
+          g_autoptr(GFile) files = g_file_get_child (root, "files");
+          g_autofree char *files_dst = g_build_filename (checkoutdirpath, "files", NULL);
+          g_autoptr(GFileEnumerator) files_enum = NULL;
+
+          if (g_mkdir_with_parents (files_dst, 0755))
+            {
+              glnx_set_error_from_errno (error);
+              res = FALSE;
+              break;
+            }
+
+          files_enum = g_file_enumerate_children (files, "standard::name",
+                                                  G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                                  cancellable, error);
+          if (files_enum == NULL)
+            {
+              res = FALSE;
+              break;
+            }
+
+          while (TRUE)
+            {
+              GFileInfo *files_child_info;
+              g_autofree char *subpath = NULL;
+              g_autofree char *dstpath = NULL;
+
+              if (!g_file_enumerator_iterate (files_enum, &files_child_info, NULL, cancellable, error))
+                {
+                  res = FALSE;
+                  break;
+                }
+              if (files_child_info == NULL)
+                break;
+
+              subpath = g_build_filename ("/files", g_file_info_get_name (files_child_info), NULL);
+              dstpath = g_build_filename (files_dst, g_file_info_get_name (files_child_info), NULL);
+              parallel_checkout_push_task (pool, subpath, dstpath);
+            }
+
+          if (!res)
+            break;
+        }
+      else
+        {
+          g_autofree char *subpath = g_strconcat ("/", name, NULL);
+          g_autofree char *dstpath = g_build_filename (checkoutdirpath, name, NULL);
+
+          parallel_checkout_push_task (pool, subpath, dstpath);
+        }
+    }
+
+  /* Waits for all queued tasks */
+  g_thread_pool_free (pool, FALSE, TRUE);
+
+  if (data.error != NULL)
+    {
+      g_clear_error (error);
+      g_propagate_error (error, g_steal_pointer (&data.error));
+      res = FALSE;
+    }
+
+  g_mutex_clear (&data.lock);
+
+  return res;
+}
+
+/* We create a deploy ref for the currently deployed version of all refs to avoid
+   deployed commits being pruned when e.g. we pull --no-deploy. */
+static gboolean
+flatpak_dir_update_deploy_ref (FlatpakDir *self,
+                               const char *ref,
+                               const char *checksum,
+                               GError    **error)
+{
+  g_autofree char *deploy_ref = g_strconcat ("deploy/", ref, NULL);
+
+  if (!ostree_repo_set_ref_immediate (self->repo, NULL, deploy_ref, checksum, NULL, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+gboolean
+flatpak_dir_deploy (FlatpakDir          *self,
+                    const char          *origin,
+                    const char          *ref,
+                    const char          *checksum_or_latest,
+                    const char * const * subpaths,
+                    const char * const * previous_ids,
+                    GCancellable        *cancellable,
+                    GError             **error)
 {
   g_autofree char *resolved_ref = NULL;
   g_autoptr(GFile) root = NULL;
@@ -7162,6 +8461,9 @@ flatpak_dir_deploy (FlatpakDir          *self,
   if (!flatpak_dir_repo_lock (self, &lock, LOCK_SH, cancellable, error))
     return FALSE;
 
+  FLATPAK_TRACE (deploy_start, ref);
+  flatpak_profile_begin ("deploy", ref);
+
   deploy_base = flatpak_dir_get_deploy_dir (self, ref);
 
   if (checksum_or_latest == NULL)
@@ -7219,7 +8521,15 @@ flatpak_dir_deploy (FlatpakDir          *self,
       return FALSE;
     }
 
-  if (!flatpak_repo_collect_sizes (self->repo, root, &installed_size, NULL, cancellable, error))
+  /* The commit normally records its installed size, which saves walking
+     every object in the tree just to recompute it. The checkout below
+     hardlinks from the object store, so on updates the new deploy
+     already shares all unchanged content with the old one; this walk
+     was the remaining per-deploy cost that scaled with the full app
+     size rather than with the update. */
+  if (g_variant_lookup (commit_metadata, "xa.installed-size", "t", &installed_size))
+    installed_size = GUINT64_FROM_BE (installed_size);
+  else if (!flatpak_repo_collect_sizes (self->repo, root, &installed_size, NULL, cancellable, error))
     return FALSE;
 
   options.mode = OSTREE_REPO_CHECKOUT_MODE_USER;
@@ -7230,10 +8540,24 @@ flatpak_dir_deploy (FlatpakDir          *self,
 
   if (subpaths == NULL || *subpaths == NULL)
     {
-      if (!ostree_repo_checkout_at (self->repo, &options,
-                                    AT_FDCWD, checkoutdirpath,
-                                    checksum,
-                                    cancellable, error))
+      int n_threads = flatpak_dir_get_checkout_threads (self);
+
+      if (n_threads > 1)
+        {
+          if (!flatpak_dir_checkout_commit_parallel (self, &options,
+                                                     checkoutdirpath,
+                                                     checksum, root,
+                                                     n_threads,
+                                                     cancellable, error))
+            {
+              g_prefix_error (error, _("While trying to checkout %s into %s: "), checksum, checkoutdirpath);
+              return FALSE;
+            }
+        }
+      else if (!ostree_repo_checkout_at (self->repo, &options,
+                                         AT_FDCWD, checkoutdirpath,
+                                         checksum,
+                                         cancellable, error))
         {
           g_prefix_error (error, _("While trying to checkout %s into %s: "), checksum, checkoutdirpath);
           return FALSE;
@@ -7523,13 +8847,21 @@ flatpak_dir_deploy (FlatpakDir          *self,
   if (!flatpak_variant_save (deploy_data_file, deploy_data, cancellable, error))
     return FALSE;
 
-  if (!glnx_opendirat (AT_FDCWD, checkoutdirpath, TRUE, &checkoutdir_dfd, error))
-    return FALSE;
-
-  if (syncfs (checkoutdir_dfd) != 0)
+  if (self->checkout_sync_deferred)
     {
-      glnx_set_error_from_errno (error);
-      return FALSE;
+      /* Settled with a single syncfs in flatpak_dir_flush_checkout_sync () */
+      self->checkout_sync_pending = TRUE;
+    }
+  else
+    {
+      if (!glnx_opendirat (AT_FDCWD, checkoutdirpath, TRUE, &checkoutdir_dfd, error))
+        return FALSE;
+
+      if (syncfs (checkoutdir_dfd) != 0)
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
     }
 
   if (!g_file_move (checkoutdir, real_checkoutdir, G_FILE_COPY_NO_FALLBACK_FOR_MOVE,
@@ -7542,6 +8874,11 @@ flatpak_dir_deploy (FlatpakDir          *self,
   if (!flatpak_dir_update_deploy_ref (self, ref, checksum, error))
     return FALSE;
 
+  flatpak_dir_invalidate_ref_cache (self);
+
+  FLATPAK_TRACE (deploy_done, ref, checksum);
+  flatpak_profile_end ("deploy");
+
   return TRUE;
 }
 
@@ -7586,6 +8923,8 @@ flatpak_dir_deploy_install (FlatpakDir   *self,
                             GError      **error)
 {
   g_auto(GLnxLockFile) lock = { 0, };
+  g_auto(GLnxLockFile) ref_lock = { 0, };
+  g_auto(GLnxLockFile) exports_lock = { 0, };
   g_autoptr(GFile) deploy_base = NULL;
   g_autoptr(GFile) old_deploy_dir = NULL;
   gboolean created_deploy_base = FALSE;
@@ -7596,10 +8935,14 @@ flatpak_dir_deploy_install (FlatpakDir   *self,
   g_autofree char *commit = NULL;
   g_autofree char *old_active = NULL;
 
-  if (!flatpak_dir_lock (self, &lock,
+  if (!flatpak_dir_lock (self, &lock, LOCK_SH,
                          cancellable, error))
     goto out;
 
+  if (!flatpak_dir_ref_lock (self, ref, &ref_lock,
+                             cancellable, error))
+    goto out;
+
   old_deploy_dir = flatpak_dir_get_if_deployed (self, ref, NULL, cancellable);
   if (old_deploy_dir != NULL)
     {
@@ -7652,11 +8995,16 @@ flatpak_dir_deploy_install (FlatpakDir   *self,
 
   if (g_str_has_prefix (ref, "app/"))
     {
+      if (!flatpak_dir_exports_lock (self, &exports_lock, cancellable, error))
+        goto out;
+
       if (!flatpak_dir_make_current_ref (self, ref, cancellable, error))
         goto out;
 
       if (!flatpak_dir_update_exports (self, ref_parts[1], cancellable, error))
         goto out;
+
+      glnx_release_lock_file (&exports_lock);
     }
 
   /* Remove old ref if the reinstalled was from a different remote */
@@ -7701,16 +9049,21 @@ flatpak_dir_deploy_update (FlatpakDir   *self,
 {
   g_autoptr(GVariant) old_deploy_data = NULL;
   g_auto(GLnxLockFile) lock = { 0, };
+  g_auto(GLnxLockFile) ref_lock = { 0, };
   g_autofree const char **old_subpaths = NULL;
   g_autofree char *old_active = NULL;
   const char *old_origin;
   g_autofree char *commit = NULL;
   g_auto(GStrv) previous_ids = NULL;
 
-  if (!flatpak_dir_lock (self, &lock,
+  if (!flatpak_dir_lock (self, &lock, LOCK_SH,
                          cancellable, error))
     return FALSE;
 
+  if (!flatpak_dir_ref_lock (self, ref, &ref_lock,
+                             cancellable, error))
+    return FALSE;
+
   old_deploy_data = flatpak_dir_get_deploy_data (self, ref, FLATPAK_DEPLOY_VERSION_ANY,
                                                  cancellable, error);
   if (old_deploy_data == NULL)
@@ -7745,8 +9098,12 @@ flatpak_dir_deploy_update (FlatpakDir   *self,
 
   if (g_str_has_prefix (ref, "app/"))
     {
+      g_auto(GLnxLockFile) exports_lock = { 0, };
       g_auto(GStrv) ref_parts = g_strsplit (ref, "/", -1);
 
+      if (!flatpak_dir_exports_lock (self, &exports_lock, cancellable, error))
+        return FALSE;
+
       if (!flatpak_dir_update_exports (self, ref_parts[1], cancellable, error))
         return FALSE;
     }
@@ -8582,6 +9939,8 @@ flatpak_dir_install_bundle (FlatpakDir   *self,
 
           if (!ostree_repo_write_config (self->repo, new_config, error))
             return FALSE;
+
+          flatpak_dir_bump_config_generation (self);
         }
     }
 
@@ -9017,6 +10376,8 @@ flatpak_dir_uninstall (FlatpakDir                 *self,
   g_autofree char *old_active = NULL;
   g_auto(GStrv) parts = NULL;
   g_auto(GLnxLockFile) lock = { 0, };
+  g_auto(GLnxLockFile) ref_lock = { 0, };
+  g_auto(GLnxLockFile) exports_lock = { 0, };
   g_autoptr(GVariant) deploy_data = NULL;
   gboolean keep_ref = flags & FLATPAK_HELPER_UNINSTALL_FLAGS_KEEP_REF;
   gboolean force_remove = flags & FLATPAK_HELPER_UNINSTALL_FLAGS_FORCE_REMOVE;
@@ -9039,10 +10400,14 @@ flatpak_dir_uninstall (FlatpakDir                 *self,
       return TRUE;
     }
 
-  if (!flatpak_dir_lock (self, &lock,
+  if (!flatpak_dir_lock (self, &lock, LOCK_SH,
                          cancellable, error))
     return FALSE;
 
+  if (!flatpak_dir_ref_lock (self, ref, &ref_lock,
+                             cancellable, error))
+    return FALSE;
+
   deploy_data = flatpak_dir_get_deploy_data (self, ref, FLATPAK_DEPLOY_VERSION_ANY,
                                              cancellable, error);
   if (deploy_data == NULL)
@@ -9093,6 +10458,9 @@ flatpak_dir_uninstall (FlatpakDir                 *self,
   is_app = g_str_has_prefix (ref, "app/");
   if (is_app)
     {
+      if (!flatpak_dir_exports_lock (self, &exports_lock, cancellable, error))
+        return FALSE;
+
       current_ref = flatpak_dir_current_ref (self, name, cancellable);
       if (g_strcmp0 (ref, current_ref) == 0)
         {
@@ -9116,6 +10484,7 @@ flatpak_dir_uninstall (FlatpakDir                 *self,
       !flatpak_dir_update_exports (self, name, cancellable, error))
     return FALSE;
 
+  glnx_release_lock_file (&exports_lock);
   glnx_release_lock_file (&lock);
 
   flatpak_dir_prune_origin_remote (self, repository);
@@ -9265,6 +10634,19 @@ flatpak_dir_list_deployed (FlatpakDir   *self,
   g_autoptr(GFile) child = NULL;
   g_autoptr(GFileInfo) child_info = NULL;
   g_autoptr(GError) my_error = NULL;
+  gboolean cacheable;
+  char **cached;
+
+  G_LOCK (ref_cache);
+  cacheable = flatpak_dir_ensure_ref_cache (self);
+  cached = g_hash_table_lookup (self->deployed_cache, ref);
+  if (cached != NULL)
+    {
+      *deployed_ids = g_strdupv (cached);
+      G_UNLOCK (ref_cache);
+      return TRUE;
+    }
+  G_UNLOCK (ref_cache);
 
   deploy_base = flatpak_dir_get_deploy_dir (self, ref);
 
@@ -9313,6 +10695,13 @@ out:
     {
       g_ptr_array_add (ids, NULL);
       *deployed_ids = (char **) g_ptr_array_free (g_steal_pointer (&ids), FALSE);
+
+      if (cacheable)
+        {
+          G_LOCK (ref_cache);
+          g_hash_table_replace (self->deployed_cache, g_strdup (ref), g_strdupv (*deployed_ids));
+          G_UNLOCK (ref_cache);
+        }
     }
 
   return ret;
@@ -9470,6 +10859,8 @@ flatpak_dir_undeploy (FlatpakDir   *self,
         g_warning ("Unable to remove old checkout: %s", tmp_error->message);
     }
 
+  flatpak_dir_invalidate_ref_cache (self);
+
   return TRUE;
 }
 
@@ -9638,6 +11029,63 @@ out:
   return ret;
 }
 
+/* Returns a stable textual dump of the current ref state, recorded in
+ * a stamp file after a successful prune; see flatpak_dir_prune() */
+static char *
+flatpak_dir_get_prune_state (FlatpakDir   *self,
+                             GCancellable *cancellable)
+{
+  g_autoptr(GHashTable) refs = NULL;
+  g_autofree const char **keys = NULL;
+  guint n_keys;
+  GString *state;
+  int i;
+
+  if (!ostree_repo_list_refs (self->repo, NULL, &refs, cancellable, NULL))
+    return NULL;
+
+  keys = (const char **) g_hash_table_get_keys_as_array (refs, &n_keys);
+  g_qsort_with_data (keys, n_keys, sizeof (char *), (GCompareDataFunc) flatpak_strcmp0_ptr, NULL);
+
+  state = g_string_new ("");
+  for (i = 0; i < n_keys; i++)
+    g_string_append_printf (state, "%s %s\n", keys[i],
+                            (const char *) g_hash_table_lookup (refs, keys[i]));
+
+  return g_string_free (state, FALSE);
+}
+
+/* TRUE if every ref recorded in @old_state still points at the same
+ * commit, i.e. only additions have happened since it was recorded */
+static gboolean
+prune_state_is_subset (const char   *old_state,
+                       FlatpakDir   *self,
+                       GCancellable *cancellable)
+{
+  g_autoptr(GHashTable) refs = NULL;
+  g_auto(GStrv) lines = NULL;
+  int i;
+
+  if (!ostree_repo_list_refs (self->repo, NULL, &refs, cancellable, NULL))
+    return FALSE;
+
+  lines = g_strsplit (old_state, "\n", -1);
+  for (i = 0; lines[i] != NULL; i++)
+    {
+      g_auto(GStrv) parts = NULL;
+
+      if (*lines[i] == 0)
+        continue;
+
+      parts = g_strsplit (lines[i], " ", 2);
+      if (parts[0] == NULL || parts[1] == NULL ||
+          g_strcmp0 (g_hash_table_lookup (refs, parts[0]), parts[1]) != 0)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
 gboolean
 flatpak_dir_prune (FlatpakDir   *self,
                    GCancellable *cancellable,
@@ -9647,6 +11095,9 @@ flatpak_dir_prune (FlatpakDir   *self,
   gint objects_total, objects_pruned;
   guint64 pruned_object_size_total;
   g_autofree char *formatted_freed_size = NULL;
+  g_autoptr(GFile) stamp_file = NULL;
+  g_autofree char *old_state = NULL;
+  g_autofree char *new_state = NULL;
   g_autoptr(GError) local_error = NULL;
   g_autoptr(GError) lock_error = NULL;
   g_auto(GLnxLockFile) lock = { 0, };
@@ -9686,6 +11137,20 @@ flatpak_dir_prune (FlatpakDir   *self,
       return FALSE;
     }
 
+  stamp_file = g_file_get_child (self->cache_dir, "prune-stamp");
+
+  /* If every ref recorded at the last successful prune still points
+     at the same commit, only additions have happened since, so
+     nothing that was reachable then can have become garbage and we
+     can skip the full reachability sweep. A moved or deleted ref, or
+     a missing stamp, forces the sweep. */
+  if (g_file_load_contents (stamp_file, cancellable, &old_state, NULL, NULL, NULL) &&
+      prune_state_is_subset (old_state, self, cancellable))
+    {
+      g_debug ("Skipping prune, no refs changed since the last prune");
+      return TRUE;
+    }
+
   g_debug ("Pruning repo");
   if (!ostree_repo_prune (self->repo,
                           OSTREE_REPO_PRUNE_FLAGS_REFS_ONLY,
@@ -9699,6 +11164,12 @@ flatpak_dir_prune (FlatpakDir   *self,
   formatted_freed_size = g_format_size_full (pruned_object_size_total, 0);
   g_debug ("Pruned %d/%d objects, size %s", objects_total, objects_pruned, formatted_freed_size);
 
+  new_state = flatpak_dir_get_prune_state (self, cancellable);
+  if (new_state != NULL &&
+      flatpak_mkdir_p (self->cache_dir, cancellable, NULL))
+    g_file_replace_contents (stamp_file, new_state, strlen (new_state), NULL, FALSE,
+                             G_FILE_CREATE_REPLACE_DESTINATION, NULL, cancellable, NULL);
+
   ret = TRUE;
 
 out:
@@ -9854,6 +11325,9 @@ G_LOCK_DEFINE_STATIC (cache);
 static void
 cached_summary_free (CachedSummary *summary)
 {
+  flatpak_memory_free (FLATPAK_MEMORY_SUMMARY,
+                       g_bytes_get_size (summary->bytes) +
+                       (summary->bytes_sig ? g_bytes_get_size (summary->bytes_sig) : 0));
   g_bytes_unref (summary->bytes);
   if (summary->bytes_sig)
     g_bytes_unref (summary->bytes_sig);
@@ -9876,6 +11350,9 @@ cached_summary_new (GBytes     *bytes,
   summary->url = g_strdup (url);
   summary->remote = g_strdup (remote);
   summary->time = g_get_monotonic_time ();
+  flatpak_memory_alloc (FLATPAK_MEMORY_SUMMARY,
+                        g_bytes_get_size (bytes) +
+                        (bytes_sig ? g_bytes_get_size (bytes_sig) : 0));
   return summary;
 }
 
@@ -9943,6 +11420,62 @@ flatpak_dir_cache_summary (FlatpakDir *self,
   G_UNLOCK (cache);
 }
 
+/* Loads the last summary (and signature, if any) we saved for @name under
+   the cache dir; see flatpak_dir_save_summary_copy. */
+static void
+flatpak_dir_load_summary_copy (FlatpakDir *self,
+                               const char *name,
+                               GBytes    **out_summary,
+                               GBytes    **out_summary_sig)
+{
+  g_autofree char *sig_name = g_strconcat (name, ".sig", NULL);
+  g_autoptr(GFile) summary_file = flatpak_build_file (self->cache_dir, "summaries", name, NULL);
+  g_autoptr(GFile) sig_file = flatpak_build_file (self->cache_dir, "summaries", sig_name, NULL);
+  g_autoptr(GMappedFile) mfile = NULL;
+  g_autoptr(GMappedFile) sig_mfile = NULL;
+
+  mfile = g_mapped_file_new (flatpak_file_get_path_cached (summary_file), FALSE, NULL);
+  if (mfile == NULL)
+    return;
+
+  sig_mfile = g_mapped_file_new (flatpak_file_get_path_cached (sig_file), FALSE, NULL);
+
+  *out_summary = g_mapped_file_get_bytes (mfile);
+  if (sig_mfile != NULL)
+    *out_summary_sig = g_mapped_file_get_bytes (sig_mfile);
+}
+
+static void
+flatpak_dir_save_summary_copy (FlatpakDir *self,
+                               const char *name,
+                               GBytes     *summary,
+                               GBytes     *summary_sig)
+{
+  g_autofree char *sig_name = g_strconcat (name, ".sig", NULL);
+  g_autoptr(GFile) summaries_dir = flatpak_build_file (self->cache_dir, "summaries", NULL);
+  g_autoptr(GFile) summary_file = g_file_get_child (summaries_dir, name);
+  g_autoptr(GFile) sig_file = g_file_get_child (summaries_dir, sig_name);
+  g_autoptr(GError) local_error = NULL;
+
+  if (g_mkdir_with_parents (flatpak_file_get_path_cached (summaries_dir), 0755) != 0)
+    return;
+
+  if (!g_file_set_contents (flatpak_file_get_path_cached (summary_file),
+                            g_bytes_get_data (summary, NULL), g_bytes_get_size (summary),
+                            &local_error))
+    {
+      g_debug ("Failed to save summary for remote %s: %s", name, local_error->message);
+      return;
+    }
+
+  if (summary_sig != NULL)
+    g_file_set_contents (flatpak_file_get_path_cached (sig_file),
+                         g_bytes_get_data (summary_sig, NULL), g_bytes_get_size (summary_sig),
+                         NULL);
+  else
+    unlink (flatpak_file_get_path_cached (sig_file));
+}
+
 gboolean
 flatpak_dir_remote_make_oci_summary (FlatpakDir   *self,
                                      const char   *remote,
@@ -10040,20 +11573,73 @@ flatpak_dir_remote_make_oci_summary (FlatpakDir   *self,
   return TRUE;
 }
 
+/* Returns the location of the binary ref index generated from the
+ * cached summary of @remote, see flatpak-summary-index.c */
+static GFile *
+flatpak_dir_get_summary_index_location (FlatpakDir *self,
+                                        const char *remote)
+{
+  g_autofree char *index_name = g_strconcat (remote, ".idx", NULL);
+
+  return flatpak_build_file (self->cache_dir, "summaries", index_name, NULL);
+}
+
+/* Ensures there is an up-to-date index for @summary on disk and returns
+ * a mapping of it. Failing to generate or open the index is not fatal,
+ * lookups just fall back to walking the summary variant. */
+static FlatpakSummaryIndex *
+flatpak_dir_ensure_summary_index (FlatpakDir   *self,
+                                  const char   *remote,
+                                  GBytes       *summary,
+                                  GCancellable *cancellable)
+{
+  g_autoptr(GFile) index_file = NULL;
+  g_autoptr(GFile) summaries_dir = NULL;
+  FlatpakSummaryIndex *index;
+  g_autoptr(GError) local_error = NULL;
+
+  /* Uris are not valid cache file names */
+  if (strchr (remote, '/') != NULL)
+    return NULL;
+
+  index_file = flatpak_dir_get_summary_index_location (self, remote);
+
+  /* Typically the index from an earlier download is still valid */
+  index = flatpak_summary_index_open (index_file, summary, NULL);
+  if (index != NULL)
+    return index;
+
+  summaries_dir = g_file_get_parent (index_file);
+  if (!flatpak_mkdir_p (summaries_dir, cancellable, &local_error) ||
+      !flatpak_summary_index_save (summary, index_file, cancellable, &local_error))
+    {
+      g_debug ("Failed to save summary index for remote %s: %s", remote, local_error->message);
+      return NULL;
+    }
+
+  index = flatpak_summary_index_open (index_file, summary, &local_error);
+  if (index == NULL)
+    g_debug ("Failed to map summary index for remote %s: %s", remote, local_error->message);
+
+  return index;
+}
+
 static gboolean
-flatpak_dir_remote_fetch_summary (FlatpakDir   *self,
-                                  const char   *name_or_uri,
-                                  gboolean      only_cached,
-                                  GBytes      **out_summary,
-                                  GBytes      **out_summary_sig,
-                                  GCancellable *cancellable,
-                                  GError      **error)
+flatpak_dir_remote_fetch_summary (FlatpakDir           *self,
+                                  const char           *name_or_uri,
+                                  gboolean              only_cached,
+                                  GBytes              **out_summary,
+                                  GBytes              **out_summary_sig,
+                                  FlatpakSummaryIndex **out_summary_index,
+                                  GCancellable         *cancellable,
+                                  GError              **error)
 {
   g_autofree char *url = NULL;
   gboolean is_local;
   g_autoptr(GError) local_error = NULL;
   g_autoptr(GBytes) summary = NULL;
   g_autoptr(GBytes) summary_sig = NULL;
+  gboolean summary_is_saved_copy = FALSE;
 
   if (!ostree_repo_remote_get_url (self->repo, name_or_uri, &url, error))
     return FALSE;
@@ -10071,13 +11657,20 @@ flatpak_dir_remote_fetch_summary (FlatpakDir   *self,
   if (!is_local)
     {
       if (flatpak_dir_lookup_cached_summary (self, out_summary, out_summary_sig, name_or_uri, url))
-        return TRUE;
+        {
+          if (out_summary_index)
+            *out_summary_index = flatpak_dir_ensure_summary_index (self, name_or_uri, *out_summary, cancellable);
+          return TRUE;
+        }
     }
 
   /* Seems ostree asserts if this is NULL */
   if (error == NULL)
     error = &local_error;
 
+  FLATPAK_TRACE (summary_fetch_start, name_or_uri, url);
+  flatpak_profile_begin ("summary-fetch", name_or_uri);
+
   if (flatpak_dir_get_remote_oci (self, name_or_uri))
     {
       if (!flatpak_dir_remote_make_oci_summary (self, name_or_uri,
@@ -10086,6 +11679,9 @@ flatpak_dir_remote_fetch_summary (FlatpakDir   *self,
                                                 cancellable,
                                                 error))
         return FALSE;
+
+      /* OCI summaries are generated and cached locally already */
+      summary_is_saved_copy = TRUE;
     }
   else
     {
@@ -10112,24 +11708,184 @@ flatpak_dir_remote_fetch_summary (FlatpakDir   *self,
           if (sig_mfile)
             summary_sig = g_mapped_file_get_bytes (sig_mfile);
         }
-      else if (!ostree_repo_remote_fetch_summary (self->repo, name_or_uri,
-                                                  &summary, &summary_sig,
-                                                  cancellable,
-                                                  error))
-        return FALSE;
+      else
+        {
+          g_autofree char *summary_arch = flatpak_dir_get_remote_summary_arch (self, name_or_uri);
+          gboolean is_http = g_str_has_prefix (url, "http:") || g_str_has_prefix (url, "https:");
+          gboolean use_shard = FALSE;
+
+          /* If the remote is configured for a single arch, use the per-arch
+           * summary shard (written by build-update-repo), falling back
+           * to the combined summary. The shards are not signed, so this only
+           * applies when the summary signature isn't verified anyway. */
+          if (summary_arch != NULL && is_http)
+            {
+              gboolean gpg_verify_summary = FALSE;
+
+              if (ostree_repo_remote_get_gpg_verify_summary (self->repo, name_or_uri, &gpg_verify_summary, NULL) &&
+                  !gpg_verify_summary)
+                use_shard = TRUE;
+            }
+
+          /* Before downloading, compare the published digest of the file we
+           * would fetch (see flatpak_repo_write_summary_digest) against the
+           * copy saved from the last fetch; unchanged summaries, the common
+           * case for periodic update checks, then cost a few bytes instead
+           * of the whole file. Servers without digest files just fall
+           * through to a normal fetch. */
+          if (is_http)
+            {
+              g_autoptr(GBytes) saved = NULL;
+              g_autoptr(GBytes) saved_sig = NULL;
+
+              flatpak_dir_load_summary_copy (self, name_or_uri, &saved, &saved_sig);
+              if (saved != NULL)
+                {
+                  g_autofree char *digest_uri = NULL;
+                  g_autoptr(GBytes) digest_bytes = NULL;
+
+                  if (use_shard)
+                    digest_uri = g_strconcat (url, "/summaries/", summary_arch, ".summary.digest", NULL);
+                  else
+                    digest_uri = g_strconcat (url, "/summary.digest", NULL);
+
+                  ensure_soup_session (self);
+                  digest_bytes = flatpak_load_http_uri (self->soup_session, digest_uri, 0,
+                                                        NULL, NULL, cancellable, NULL);
+                  if (digest_bytes != NULL)
+                    {
+                      g_autofree char *remote_digest = g_strndup (g_bytes_get_data (digest_bytes, NULL),
+                                                                  g_bytes_get_size (digest_bytes));
+                      g_autofree char *local_digest = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, saved);
+
+                      if (strcmp (g_strstrip (remote_digest), local_digest) == 0)
+                        {
+                          g_debug ("Summary for remote ‘%s’ unchanged, using saved copy", name_or_uri);
+                          summary = g_steal_pointer (&saved);
+                          summary_sig = g_steal_pointer (&saved_sig);
+                          summary_is_saved_copy = TRUE;
+                        }
+                    }
+                }
+            }
+
+          if (summary == NULL && use_shard)
+            {
+              g_autofree char *shard_uri = g_strconcat (url, "/summaries/", summary_arch, ".summary", NULL);
+              g_autoptr(GError) shard_error = NULL;
+
+              ensure_soup_session (self);
+              summary = flatpak_load_http_uri (self->soup_session, shard_uri, 0,
+                                               NULL, NULL, cancellable, &shard_error);
+              if (summary == NULL)
+                g_debug ("No %s summary shard for remote ‘%s’ (%s), using full summary",
+                         summary_arch, name_or_uri, shard_error->message);
+            }
+
+          if (summary == NULL &&
+              !ostree_repo_remote_fetch_summary (self->repo, name_or_uri,
+                                                 &summary, &summary_sig,
+                                                 cancellable,
+                                                 error))
+            return FALSE;
+        }
     }
 
-  if (summary == NULL)
-    return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Remote listing for %s not available; server has no summary file. Check the URL passed to remote-add was valid."), name_or_uri);
+  if (summary == NULL)
+    return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Remote listing for %s not available; server has no summary file. Check the URL passed to remote-add was valid."), name_or_uri);
+
+  if (!is_local && !only_cached)
+    {
+      flatpak_dir_cache_summary (self, summary, summary_sig, name_or_uri, url);
+      if (!summary_is_saved_copy)
+        flatpak_dir_save_summary_copy (self, name_or_uri, summary, summary_sig);
+    }
+
+  if (out_summary_index && !is_local)
+    *out_summary_index = flatpak_dir_ensure_summary_index (self, name_or_uri, summary, cancellable);
+
+  FLATPAK_TRACE (summary_fetch_done, name_or_uri, g_bytes_get_size (summary));
+  flatpak_profile_end ("summary-fetch");
+
+  *out_summary = g_steal_pointer (&summary);
+  if (out_summary_sig)
+    *out_summary_sig = g_steal_pointer (&summary_sig);
+
+  return TRUE;
+}
+
+typedef struct
+{
+  FlatpakDir   *dir;
+  char         *remote;
+  GCancellable *cancellable;
+} PrefetchSummaryData;
+
+static gpointer
+prefetch_summary_thread (gpointer data)
+{
+  PrefetchSummaryData *prefetch_data = data;
+  g_autoptr(GBytes) summary = NULL;
+  g_autoptr(GBytes) summary_sig = NULL;
+
+  /* This populates the in-memory summary cache as a side effect. Errors
+   * are ignored here, they will show up when the summary is actually
+   * used. */
+  flatpak_dir_remote_fetch_summary (prefetch_data->dir, prefetch_data->remote, FALSE,
+                                    &summary, &summary_sig, NULL,
+                                    prefetch_data->cancellable, NULL);
+  return NULL;
+}
+
+/* Fetch the summaries of all enumerated remotes concurrently, priming
+ * the in-memory summary cache, so that a following operation that walks
+ * the remotes one by one (like update or a transaction resolve) does
+ * not wait on the network serially for each remote. With several
+ * configured remotes the pre-download phase is then bounded by the
+ * slowest remote instead of the sum of them all.
+ */
+void
+flatpak_dir_prefetch_remote_summaries (FlatpakDir   *self,
+                                       GCancellable *cancellable)
+{
+  g_auto(GStrv) remotes = NULL;
+  g_autoptr(GPtrArray) threads = NULL;
+  g_autoptr(GPtrArray) datas = NULL;
+  int i;
+
+  if (!flatpak_dir_ensure_repo (self, cancellable, NULL))
+    return;
 
-  if (!is_local && !only_cached)
-    flatpak_dir_cache_summary (self, summary, summary_sig, name_or_uri, url);
+  remotes = flatpak_dir_list_enumerated_remotes (self, cancellable, NULL);
+  if (remotes == NULL || remotes[0] == NULL || remotes[1] == NULL)
+    return; /* Nothing to parallelize */
 
-  *out_summary = g_steal_pointer (&summary);
-  if (out_summary_sig)
-    *out_summary_sig = g_steal_pointer (&summary_sig);
+  threads = g_ptr_array_new ();
+  datas = g_ptr_array_new_with_free_func (g_free);
 
-  return TRUE;
+  for (i = 0; remotes[i] != NULL; i++)
+    {
+      PrefetchSummaryData *data;
+      GThread *thread;
+
+      /* The OCI summary generation path is not prepared to run
+       * concurrently against the same dir, leave those to the regular
+       * sequential codepath */
+      if (flatpak_dir_get_remote_oci (self, remotes[i]))
+        continue;
+
+      data = g_new0 (PrefetchSummaryData, 1);
+      data->dir = self;
+      data->remote = remotes[i];
+      data->cancellable = cancellable;
+      g_ptr_array_add (datas, data);
+
+      thread = g_thread_new ("flatpak-summary-prefetch", prefetch_summary_thread, data);
+      g_ptr_array_add (threads, thread);
+    }
+
+  for (i = 0; i < threads->len; i++)
+    g_thread_join (g_ptr_array_index (threads, i));
 }
 
 static FlatpakRemoteState *
@@ -10175,20 +11931,16 @@ _flatpak_dir_get_remote_state (FlatpakDir   *self,
       if (opt_summary_sig)
         {
           /* If specified, must be valid signature */
-          g_autoptr(OstreeGpgVerifyResult) gpg_result =
-            ostree_repo_verify_summary (self->repo,
-                                        state->remote_name,
-                                        opt_summary,
-                                        opt_summary_sig,
-                                        NULL, error);
-          if (gpg_result == NULL ||
-              !ostree_gpg_verify_result_require_valid_signature (gpg_result, error))
+          if (!flatpak_dir_verify_summary (self, state->remote_name,
+                                           opt_summary, opt_summary_sig,
+                                           NULL, error))
             return NULL;
 
           state->summary_sig_bytes = g_bytes_ref (opt_summary_sig);
         }
       state->summary = g_variant_ref_sink (g_variant_new_from_bytes (OSTREE_SUMMARY_GVARIANT_FORMAT,
                                                                      opt_summary, FALSE));
+      flatpak_memory_alloc (FLATPAK_MEMORY_SUMMARY, g_variant_get_size (state->summary));
     }
   else
     {
@@ -10197,11 +11949,13 @@ _flatpak_dir_get_remote_state (FlatpakDir   *self,
       g_autoptr(GBytes) summary_sig_bytes = NULL;
 
       if (flatpak_dir_remote_fetch_summary (self, remote_or_uri, only_cached, &summary_bytes, &summary_sig_bytes,
+                                            &state->summary_index,
                                             cancellable, &local_error))
         {
           state->summary_sig_bytes = g_steal_pointer (&summary_sig_bytes);
           state->summary = g_variant_ref_sink (g_variant_new_from_bytes (OSTREE_SUMMARY_GVARIANT_FORMAT,
                                                                          summary_bytes, FALSE));
+          flatpak_memory_alloc (FLATPAK_MEMORY_SUMMARY, g_variant_get_size (state->summary));
         }
       else
         {
@@ -10331,6 +12085,40 @@ flatpak_dir_get_remote_state_optional (FlatpakDir   *self,
 }
 
 
+/* Like flatpak_dir_get_remote_state_optional(), but answers from the
+ * summary cached on disk when there is one rather than talking to the
+ * remote. Only falls back to a regular fetch when nothing has been
+ * cached yet (for instance a freshly added remote), which also
+ * populates the cache for the next call. Used for tab completion,
+ * where going to the network on every keypress is too slow.
+ */
+FlatpakRemoteState *
+flatpak_dir_get_remote_state_optional_cached (FlatpakDir   *self,
+                                              const char   *remote,
+                                              GCancellable *cancellable,
+                                              GError      **error)
+{
+  g_autoptr(FlatpakRemoteState) state = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  state = _flatpak_dir_get_remote_state (self, remote, TRUE, FALSE, TRUE, NULL, NULL, cancellable, &local_error);
+  if (state == NULL)
+    {
+      if (!g_error_matches (local_error, FLATPAK_ERROR, FLATPAK_ERROR_NOT_CACHED))
+        {
+          g_propagate_error (error, g_steal_pointer (&local_error));
+          return NULL;
+        }
+    }
+  else if (!g_error_matches (state->summary_fetch_error, FLATPAK_ERROR, FLATPAK_ERROR_NOT_CACHED) &&
+           !g_error_matches (state->metadata_fetch_error, FLATPAK_ERROR, FLATPAK_ERROR_NOT_CACHED))
+    return g_steal_pointer (&state);
+
+  g_clear_pointer (&state, flatpak_remote_state_unref);
+
+  return flatpak_dir_get_remote_state_optional (self, remote, cancellable, error);
+}
+
 /* This doesn't do any i/o at all, just keeps track of the local details like
    remote and collection-id. Useful when doing no-pull operations */
 FlatpakRemoteState *
@@ -10526,64 +12314,75 @@ find_matching_refs (GHashTable           *refs,
   g_hash_table_iter_init (&hash_iter, refs);
   while (g_hash_table_iter_next (&hash_iter, &key, NULL))
     {
-      g_autofree char *ref = NULL;
-      g_auto(GStrv) parts = NULL;
-      gboolean is_app, is_runtime;
+      const char *ref;
+      FlatpakRefView view;
       FlatpakCollectionRef *coll_ref = key;
+      int i;
 
       /* Unprefix any remote name if needed */
-      ostree_parse_refspec (coll_ref->ref_name, NULL, &ref, NULL);
-      if (ref == NULL)
-        continue;
-
-      is_app = g_str_has_prefix (ref, "app/");
-      is_runtime = g_str_has_prefix (ref, "runtime/");
+      ref = strrchr (coll_ref->ref_name, ':');
+      if (ref != NULL)
+        ref = ref + 1;
+      else
+        ref = coll_ref->ref_name;
 
-      if ((!(kinds & FLATPAK_KINDS_APP) && is_app) ||
-          (!(kinds & FLATPAK_KINDS_RUNTIME) && is_runtime) ||
-          (!is_app && !is_runtime))
+      /* This is the loop that runs over every ref in the remote, so
+       * use the zero-copy view rather than flatpak_decompose_ref() */
+      if (!flatpak_ref_parse_view (ref, &view))
         continue;
 
-      parts = flatpak_decompose_ref (ref, NULL);
-      if (parts == NULL)
+      if ((!(kinds & FLATPAK_KINDS_APP) && view.is_app) ||
+          (!(kinds & FLATPAK_KINDS_RUNTIME) && !view.is_app))
         continue;
 
-      if ((flags & FIND_MATCHING_REFS_FLAGS_FUZZY) && !flatpak_id_has_subref_suffix (parts[1]))
+      if (flags & FIND_MATCHING_REFS_FLAGS_FUZZY)
         {
-          /* See if the given name looks similar to this ref name. The
-           * Levenshtein distance constant was chosen pretty arbitrarily. */
-          if (opt_name != NULL && strcasestr (parts[1], opt_name) == NULL &&
-              flatpak_levenshtein_distance (opt_name, parts[1]) > 2)
+          g_autofree char *id = g_strndup (view.id, view.id_len);
+
+          if (!flatpak_id_has_subref_suffix (id))
+            {
+              /* See if the given name looks similar to this ref name. The
+               * Levenshtein distance constant was chosen pretty arbitrarily. */
+              if (opt_name != NULL && strcasestr (id, opt_name) == NULL &&
+                  flatpak_levenshtein_distance (opt_name, id) > 2)
+                continue;
+            }
+          else if (opt_name != NULL && !flatpak_ref_view_has_id (&view, opt_name))
             continue;
         }
       else
         {
-          if (opt_name != NULL && strcmp (opt_name, parts[1]) != 0)
+          if (opt_name != NULL && !flatpak_ref_view_has_id (&view, opt_name))
             continue;
         }
 
-      if (!g_strv_contains (arches, parts[2]))
+      for (i = 0; arches[i] != NULL; i++)
+        {
+          if (flatpak_ref_view_has_arch (&view, arches[i]))
+            break;
+        }
+      if (arches[i] == NULL)
         continue;
 
-      if (opt_branch != NULL && strcmp (opt_branch, parts[3]) != 0)
+      if (opt_branch != NULL && strcmp (opt_branch, view.branch) != 0)
         continue;
 
       if (opt_collection_id != NULL && strcmp (opt_collection_id, coll_ref->collection_id))
         continue;
 
-      if (opt_name != NULL && strcmp (opt_name, parts[1]) == 0)
+      if (opt_name != NULL && flatpak_ref_view_has_id (&view, opt_name))
         found_exact_name_match = TRUE;
 
-      if (opt_default_arch != NULL && strcmp (opt_default_arch, parts[2]) == 0)
+      if (opt_default_arch != NULL && flatpak_ref_view_has_arch (&view, opt_default_arch))
         found_default_arch_match = TRUE;
 
-      if (opt_default_branch != NULL && strcmp (opt_default_branch, parts[3]) == 0)
+      if (opt_default_branch != NULL && strcmp (opt_default_branch, view.branch) == 0)
         found_default_branch_match = TRUE;
 
       if (flags & FIND_MATCHING_REFS_FLAGS_KEEP_REMOTE)
         g_ptr_array_add (matched_refs, g_strdup (coll_ref->ref_name));
       else
-        g_ptr_array_add (matched_refs, g_steal_pointer (&ref));
+        g_ptr_array_add (matched_refs, g_strdup (ref));
     }
 
   /* Don't show fuzzy matches if we found at least one exact name match, and
@@ -10596,17 +12395,23 @@ find_matching_refs (GHashTable           *refs,
       for (i = matched_refs->len; i > 0; i--)
         {
           const char *matched_refspec = g_ptr_array_index (matched_refs, i - 1);
-          g_auto(GStrv) matched_parts = NULL;
-          g_autofree char *matched_ref = NULL;
+          const char *matched_ref;
+          FlatpakRefView view;
+
+          matched_ref = strrchr (matched_refspec, ':');
+          if (matched_ref != NULL)
+            matched_ref = matched_ref + 1;
+          else
+            matched_ref = matched_refspec;
 
-          ostree_parse_refspec (matched_refspec, NULL, &matched_ref, NULL);
-          matched_parts = flatpak_decompose_ref (matched_ref, NULL);
+          if (!flatpak_ref_parse_view (matched_ref, &view))
+            continue;
 
-          if (found_exact_name_match && strcmp (matched_parts[1], opt_name) != 0)
+          if (found_exact_name_match && !flatpak_ref_view_has_id (&view, opt_name))
             g_ptr_array_remove_index (matched_refs, i - 1);
-          else if (found_default_arch_match && strcmp (matched_parts[2], opt_default_arch) != 0)
+          else if (found_default_arch_match && !flatpak_ref_view_has_arch (&view, opt_default_arch))
             g_ptr_array_remove_index (matched_refs, i - 1);
-          else if (found_default_branch_match && strcmp (matched_parts[3], opt_default_branch) != 0)
+          else if (found_default_branch_match && strcmp (view.branch, opt_default_branch) != 0)
             g_ptr_array_remove_index (matched_refs, i - 1);
         }
     }
@@ -10716,7 +12521,10 @@ flatpak_dir_find_remote_refs (FlatpakDir           *self,
   g_autoptr(FlatpakRemoteState) state = NULL;
   GPtrArray *matched_refs;
 
-  state = flatpak_dir_get_remote_state_optional (self, remote, cancellable, error);
+  if (flags & FIND_MATCHING_REFS_FLAGS_CACHED)
+    state = flatpak_dir_get_remote_state_optional_cached (self, remote, cancellable, error);
+  else
+    state = flatpak_dir_get_remote_state_optional (self, remote, cancellable, error);
   if (state == NULL)
     return NULL;
 
@@ -11395,6 +13203,19 @@ flatpak_dir_get_remote_main_ref (FlatpakDir *self,
   return NULL;
 }
 
+char *
+flatpak_dir_get_remote_summary_arch (FlatpakDir *self,
+                                     const char *remote_name)
+{
+  GKeyFile *config = flatpak_dir_get_repo_config (self);
+  g_autofree char *group = get_group (remote_name);
+
+  if (config)
+    return g_key_file_get_string (config, group, "xa.summary-arch", NULL);
+
+  return NULL;
+}
+
 char *
 flatpak_dir_get_remote_default_branch (FlatpakDir *self,
                                        const char *remote_name)
@@ -12220,6 +14041,8 @@ flatpak_dir_remove_remote (FlatpakDir   *self,
   if (!flatpak_dir_mark_changed (self, error))
     return FALSE;
 
+  flatpak_dir_bump_config_generation (self);
+
   flatpak_dir_log (self, "remove remote",
                    remote_name, NULL, NULL, NULL, url,
                    "Removed remote %s", remote_name);
@@ -12314,6 +14137,7 @@ flatpak_dir_modify_remote (FlatpakDir   *self,
                                                             cancellable, error))
         return FALSE;
 
+      flatpak_dir_bump_config_generation (self);
       return TRUE;
     }
 
@@ -12374,6 +14198,8 @@ flatpak_dir_modify_remote (FlatpakDir   *self,
   if (!flatpak_dir_mark_changed (self, error))
     return FALSE;
 
+  flatpak_dir_bump_config_generation (self);
+
   if (has_remote)
     flatpak_dir_log (self, "modify remote", remote_name, NULL, NULL, NULL, url,
                      "Modified remote %s to %s", remote_name, url);
@@ -12615,6 +14441,29 @@ flatpak_dir_update_remote_configuration_for_state (FlatpakDir         *self,
   g_autoptr(GPtrArray) updated_params = NULL;
   GVariantIter iter;
   g_autoptr(GBytes) gpg_keys = NULL;
+  g_autofree char *summary_hash = NULL;
+
+  /* The summary is what the metadata above is extracted from, so if it is
+     unchanged since the last run there is nothing new to process and we can
+     skip the whole pass, including any config writes. */
+  if (remote_state->summary != NULL)
+    {
+      g_autoptr(GBytes) summary_bytes = g_variant_get_data_as_bytes (remote_state->summary);
+      GKeyFile *repo_config = flatpak_dir_get_repo_config (self);
+      g_autofree char *group = get_group (remote_state->remote_name);
+      g_autofree char *old_summary_hash = NULL;
+
+      summary_hash = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, summary_bytes);
+      if (repo_config != NULL)
+        old_summary_hash = g_key_file_get_string (repo_config, group, "xa.summary-hash", NULL);
+
+      if (g_strcmp0 (summary_hash, old_summary_hash) == 0)
+        {
+          if (has_changed_out)
+            *has_changed_out = FALSE;
+          return TRUE;
+        }
+    }
 
   updated_params = g_ptr_array_new_with_free_func (g_free);
 
@@ -12719,11 +14568,20 @@ flatpak_dir_update_remote_configuration_for_state (FlatpakDir         *self,
       if (has_changed_out)
         *has_changed_out = has_changed;
 
-      if (dry_run || !has_changed)
+      if (dry_run)
         return TRUE;
 
-      /* Update the local remote configuration with the updated info. */
-      if (!flatpak_dir_modify_remote (self, remote_state->remote_name, config, gpg_keys, cancellable, error))
+      /* Record the digest of the summary we processed, so that future runs
+         can skip the pass entirely until something new is published. */
+      if (summary_hash != NULL)
+        g_key_file_set_string (config, group, "xa.summary-hash", summary_hash);
+      else if (!has_changed)
+        return TRUE;
+
+      /* Update the local remote configuration with the updated info. The gpg
+         keys are only imported when they actually changed. */
+      if (!flatpak_dir_modify_remote (self, remote_state->remote_name, config,
+                                      has_changed ? gpg_keys : NULL, cancellable, error))
         return FALSE;
     }
 
@@ -12821,6 +14679,116 @@ flatpak_dir_update_remote_configuration (FlatpakDir   *self,
 }
 
 
+static GFile *
+flatpak_remote_object_get_cache_file (const char *checksum,
+                                      const char *type)
+{
+  g_autoptr(GFile) base_dir = g_file_new_for_path (g_get_user_cache_dir ());
+  g_autofree char *relpath = NULL;
+
+  relpath = g_strdup_printf ("flatpak/remote-objects/%.2s/%s.%s",
+                             checksum, checksum + 2, type);
+  return g_file_resolve_relative_path (base_dir, relpath);
+}
+
+/* Checks that the contents of @bytes match @checksum. This only holds for
+ * metadata objects like commits, where the object checksum is the sha256 of
+ * the raw object data. */
+static gboolean
+flatpak_remote_object_verify (GBytes     *bytes,
+                              const char *checksum)
+{
+  g_autofree char *actual_checksum = NULL;
+
+  actual_checksum = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, bytes);
+  return strcmp (actual_checksum, checksum) == 0;
+}
+
+/* Compact in-memory table of the object ids present in the on-disk
+ * remote-object cache, so that filtering a large set of candidate
+ * objects costs one directory scan instead of a stat per object.
+ * Entries are only ever added (the cache is append-only apart from
+ * corruption recovery), so a stale table at worst re-requests an
+ * object some other process cached meanwhile. */
+static GHashTable *remote_object_table; /* "checksum.type" => unused */
+static gboolean remote_object_table_loaded = FALSE;
+G_LOCK_DEFINE_STATIC (remote_object_table);
+
+/* Called with the remote_object_table lock held */
+static void
+remote_object_table_load (void)
+{
+  g_autofree char *base_path = g_build_filename (g_get_user_cache_dir (),
+                                                 "flatpak", "remote-objects", NULL);
+  g_auto(GLnxDirFdIterator) iter = { 0 };
+  struct dirent *dent;
+
+  remote_object_table = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  remote_object_table_loaded = TRUE;
+
+  if (!glnx_dirfd_iterator_init_at (AT_FDCWD, base_path, FALSE, &iter, NULL))
+    return;
+
+  while (TRUE)
+    {
+      g_auto(GLnxDirFdIterator) sub_iter = { 0 };
+      struct dirent *sub_dent;
+
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&iter, &dent, NULL, NULL))
+        break;
+
+      if (dent == NULL)
+        break;
+
+      if (dent->d_type != DT_DIR || strlen (dent->d_name) != 2)
+        continue;
+
+      if (!glnx_dirfd_iterator_init_at (iter.fd, dent->d_name, FALSE, &sub_iter, NULL))
+        continue;
+
+      while (TRUE)
+        {
+          if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&sub_iter, &sub_dent, NULL, NULL))
+            break;
+
+          if (sub_dent == NULL)
+            break;
+
+          if (sub_dent->d_type != DT_REG)
+            continue;
+
+          g_hash_table_add (remote_object_table,
+                            g_strconcat (dent->d_name, sub_dent->d_name, NULL));
+        }
+    }
+}
+
+static gboolean
+remote_object_table_contains (const char *checksum,
+                              const char *type)
+{
+  g_autofree char *key = g_strdup_printf ("%s.%s", checksum, type);
+  gboolean found;
+
+  G_LOCK (remote_object_table);
+  if (!remote_object_table_loaded)
+    remote_object_table_load ();
+  found = g_hash_table_contains (remote_object_table, key);
+  G_UNLOCK (remote_object_table);
+
+  return found;
+}
+
+static void
+remote_object_table_add (const char *checksum,
+                         const char *type)
+{
+  G_LOCK (remote_object_table);
+  if (remote_object_table_loaded)
+    g_hash_table_add (remote_object_table, g_strdup_printf ("%s.%s", checksum, type));
+  G_UNLOCK (remote_object_table);
+}
+
 static GBytes *
 flatpak_dir_fetch_remote_object (FlatpakDir   *self,
                                  const char   *remote_name,
@@ -12833,9 +14801,29 @@ flatpak_dir_fetch_remote_object (FlatpakDir   *self,
   g_autofree char *object_url = NULL;
   g_autofree char *part1 = NULL;
   g_autofree char *part2 = NULL;
+  g_autofree char *cached_data = NULL;
+  gsize cached_len;
+  g_autoptr(GFile) cache_file = NULL;
   g_autoptr(GBytes) bytes = NULL;
 
-  if (!ostree_repo_remote_get_url (self->repo, remote_name, &base_url, error))
+  /* Objects are immutable and content-addressed, so a cached copy that
+     matches the checksum is as good as a fresh download. */
+  cache_file = flatpak_remote_object_get_cache_file (checksum, type);
+  if (remote_object_table_contains (checksum, type) &&
+      g_file_get_contents (flatpak_file_get_path_cached (cache_file),
+                           &cached_data, &cached_len, NULL))
+    {
+      bytes = g_bytes_new_take (g_steal_pointer (&cached_data), cached_len);
+      if (flatpak_remote_object_verify (bytes, checksum))
+        return g_steal_pointer (&bytes);
+
+      /* Corrupted cache entry, refetch */
+      g_clear_pointer (&bytes, g_bytes_unref);
+      unlink (flatpak_file_get_path_cached (cache_file));
+    }
+
+  base_url = flatpak_dir_get_remote_fetch_url (self, remote_name, cancellable, error);
+  if (base_url == NULL)
     return NULL;
 
   ensure_soup_session (self);
@@ -12851,9 +14839,170 @@ flatpak_dir_fetch_remote_object (FlatpakDir   *self,
   if (bytes == NULL)
     return NULL;
 
+  if (flatpak_remote_object_verify (bytes, checksum))
+    {
+      g_autoptr(GFile) cache_dir = g_file_get_parent (cache_file);
+      g_autoptr(GError) cache_error = NULL;
+
+      if (g_mkdir_with_parents (flatpak_file_get_path_cached (cache_dir), 0755) != 0 ||
+          !g_file_set_contents (flatpak_file_get_path_cached (cache_file),
+                                g_bytes_get_data (bytes, NULL), g_bytes_get_size (bytes),
+                                &cache_error))
+        g_debug ("Failed to cache remote object %s.%s: %s", checksum, type,
+                 cache_error != NULL ? cache_error->message : g_strerror (errno));
+      else
+        remote_object_table_add (checksum, type);
+    }
+
   return g_steal_pointer (&bytes);
 }
 
+/* Best-effort parallel prefetch of metadata objects into the cache
+ * that flatpak_dir_fetch_remote_object() answers from. Results are
+ * verified against their checksum before being cached, so a bad guess
+ * at worst costs a wasted request; anything missing afterwards is
+ * fetched (with proper error reporting) by the regular path. */
+static void
+flatpak_dir_prefetch_remote_objects (FlatpakDir   *self,
+                                     const char   *remote_name,
+                                     GPtrArray    *checksums,
+                                     const char   *type,
+                                     GCancellable *cancellable)
+{
+  g_autofree char *base_url = NULL;
+  g_autoptr(GPtrArray) uris = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GHashTable) checksum_for_uri = NULL;
+  g_autoptr(GHashTable) results = NULL;
+  GHashTableIter iter;
+  gpointer key, value;
+  int i;
+
+  base_url = flatpak_dir_get_remote_fetch_url (self, remote_name, cancellable, NULL);
+  if (base_url == NULL)
+    return;
+
+  ensure_soup_session (self);
+
+  checksum_for_uri = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  for (i = 0; i < checksums->len; i++)
+    {
+      const char *checksum = g_ptr_array_index (checksums, i);
+      g_autofree char *part1 = NULL;
+      g_autofree char *part2 = NULL;
+      char *object_url;
+
+      if (remote_object_table_contains (checksum, type))
+        continue;
+
+      part1 = g_strndup (checksum, 2);
+      part2 = g_strdup_printf ("%s.%s", checksum + 2, type);
+
+      object_url = g_build_filename (base_url, "objects", part1, part2, NULL);
+      g_hash_table_insert (checksum_for_uri, g_strdup (object_url), g_strdup (checksum));
+      g_ptr_array_add (uris, object_url);
+    }
+
+  if (uris->len == 0)
+    return;
+
+  g_ptr_array_add (uris, NULL);
+  results = flatpak_load_http_uris (self->soup_session,
+                                    (const char * const *) uris->pdata,
+                                    0, cancellable);
+
+  g_hash_table_iter_init (&iter, results);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      const char *checksum = g_hash_table_lookup (checksum_for_uri, key);
+      GBytes *bytes = value;
+      g_autoptr(GFile) cache_file = NULL;
+      g_autoptr(GFile) cache_dir = NULL;
+
+      if (checksum == NULL || !flatpak_remote_object_verify (bytes, checksum))
+        continue;
+
+      cache_file = flatpak_remote_object_get_cache_file (checksum, type);
+      cache_dir = g_file_get_parent (cache_file);
+
+      if (g_mkdir_with_parents (flatpak_file_get_path_cached (cache_dir), 0755) != 0 ||
+          !g_file_set_contents (flatpak_file_get_path_cached (cache_file),
+                                g_bytes_get_data (bytes, NULL), g_bytes_get_size (bytes),
+                                NULL))
+        g_debug ("Failed to cache prefetched object %s.%s", checksum, type);
+      else
+        remote_object_table_add (checksum, type);
+    }
+}
+
+#define MAX_COMMIT_HISTORY_PREFETCH 64
+
+/* Speculatively fetches the commit objects making up @start_commit's
+ * parent chain, in parallel, so that a subsequent walk of the history
+ * is answered from the local object cache instead of taking one round
+ * trip per commit. The chain itself can only be discovered one commit
+ * at a time, but the static delta names published in the summary give
+ * away the parent relation for every pair of commits the remote
+ * generated a delta between, which in practice covers recent history.
+ * A wrong or incomplete guess is harmless: the walk follows the
+ * verified parent pointers in the commits themselves and falls back to
+ * fetching one commit at a time for anything missed here. */
+void
+flatpak_dir_prefetch_remote_commit_history (FlatpakDir         *self,
+                                            const char         *remote_name,
+                                            FlatpakRemoteState *state,
+                                            const char         *start_commit,
+                                            GCancellable       *cancellable)
+{
+  g_autoptr(GHashTable) parent_of = NULL;
+  g_autoptr(GVariant) extensions = NULL;
+  g_autoptr(GVariant) deltas = NULL;
+  g_autoptr(GPtrArray) candidates = g_ptr_array_new_with_free_func (g_free);
+  GVariantIter deltas_iter;
+  const char *delta_name;
+  const char *commit;
+
+  if (state == NULL || state->summary == NULL || start_commit == NULL)
+    return;
+
+  extensions = g_variant_get_child_value (state->summary, 1);
+  deltas = g_variant_lookup_value (extensions, "ostree.static-deltas",
+                                   G_VARIANT_TYPE ("a{sv}"));
+  if (deltas == NULL)
+    return;
+
+  parent_of = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  g_variant_iter_init (&deltas_iter, deltas);
+  while (g_variant_iter_loop (&deltas_iter, "{&s@v}", &delta_name, NULL))
+    {
+      /* Delta names are either "from-to" or just "to", with 64
+         character hex checksums. Only "from-to" tells us anything. */
+      if (strlen (delta_name) != 64 + 1 + 64 || delta_name[64] != '-')
+        continue;
+
+      g_hash_table_insert (parent_of,
+                           g_strdup (delta_name + 64 + 1),
+                           g_strndup (delta_name, 64));
+    }
+
+  commit = start_commit;
+  while (candidates->len < MAX_COMMIT_HISTORY_PREFETCH)
+    {
+      const char *commit_parent = g_hash_table_lookup (parent_of, commit);
+
+      if (commit_parent == NULL)
+        break;
+
+      g_ptr_array_add (candidates, g_strdup (commit_parent));
+      commit = commit_parent;
+    }
+
+  if (candidates->len > 0)
+    flatpak_dir_prefetch_remote_objects (self, remote_name, candidates, "commit",
+                                         cancellable);
+}
+
 GVariant *
 flatpak_dir_fetch_remote_commit (FlatpakDir   *self,
                                  const char   *remote_name,
@@ -12932,6 +15081,34 @@ flatpak_related_free (FlatpakRelated *self)
   g_free (self);
 }
 
+static FlatpakRelated *
+flatpak_related_dup (FlatpakRelated *self)
+{
+  FlatpakRelated *rel = g_new0 (FlatpakRelated, 1);
+
+  rel->collection_id = g_strdup (self->collection_id);
+  rel->ref = g_strdup (self->ref);
+  rel->commit = g_strdup (self->commit);
+  rel->subpaths = g_strdupv (self->subpaths);
+  rel->download = self->download;
+  rel->delete = self->delete;
+  rel->auto_prune = self->auto_prune;
+
+  return rel;
+}
+
+static GPtrArray *
+flatpak_related_array_dup (GPtrArray *related)
+{
+  GPtrArray *res = g_ptr_array_new_with_free_func ((GDestroyNotify) flatpak_related_free);
+  int i;
+
+  for (i = 0; i < related->len; i++)
+    g_ptr_array_add (res, flatpak_related_dup (g_ptr_array_index (related, i)));
+
+  return res;
+}
+
 static void
 add_related (FlatpakDir *self,
              GPtrArray  *related,
@@ -13031,6 +15208,8 @@ flatpak_dir_find_remote_related_for_metadata (FlatpakDir         *self,
   g_autoptr(GPtrArray) related = g_ptr_array_new_with_free_func ((GDestroyNotify) flatpak_related_free);
   g_autofree char *url = NULL;
   g_auto(GStrv) groups = NULL;
+  g_autofree char *cache_key = NULL;
+  g_autofree char *fingerprint = NULL;
 
   parts = flatpak_decompose_ref (ref, error);
   if (parts == NULL)
@@ -13045,6 +15224,48 @@ flatpak_dir_find_remote_related_for_metadata (FlatpakDir         *self,
   if (*url == 0)
     return g_steal_pointer (&related);  /* Empty url, silently disables updates */
 
+  /* The related set is recomputed for every transaction and every
+   * app-info poll, but it is a pure function of the app metadata, the
+   * summary (which the extension refs resolve against), the configured
+   * languages and the deploy state (which decides the download/delete
+   * flags and the merged subpaths). The deploy state is covered by the
+   * ".changed" stamp the cache is tied to; the other inputs are folded
+   * into a fingerprint here, so a match means the cached result is
+   * still what we would compute below. */
+  if (state->summary_index != NULL)
+    {
+      g_autofree char *metadata_data = g_key_file_to_data (metakey, NULL, NULL);
+      g_auto(GStrv) languages = flatpak_dir_get_locale_languages (self);
+      g_autoptr(GChecksum) fp = g_checksum_new (G_CHECKSUM_SHA256);
+      int j;
+
+      g_checksum_update (fp, (guchar *) metadata_data, strlen (metadata_data));
+      g_checksum_update (fp, (guchar *) flatpak_summary_index_get_summary_digest (state->summary_index), 64);
+      if (state->collection_id)
+        g_checksum_update (fp, (guchar *) state->collection_id, strlen (state->collection_id));
+      for (j = 0; languages[j] != NULL; j++)
+        g_checksum_update (fp, (guchar *) languages[j], strlen (languages[j]) + 1);
+
+      fingerprint = g_strdup (g_checksum_get_string (fp));
+      cache_key = g_strdup_printf ("%s:%s", state->remote_name, ref);
+
+      G_LOCK (ref_cache);
+      if (flatpak_dir_ensure_ref_cache (self))
+        {
+          RelatedCacheEntry *entry = g_hash_table_lookup (self->related_cache, cache_key);
+
+          if (entry != NULL && strcmp (entry->fingerprint, fingerprint) == 0)
+            {
+              GPtrArray *cached = flatpak_related_array_dup (entry->related);
+              G_UNLOCK (ref_cache);
+              return cached;
+            }
+        }
+      else
+        g_clear_pointer (&cache_key, g_free);
+      G_UNLOCK (ref_cache);
+    }
+
   groups = g_key_file_get_groups (metakey, NULL);
   for (i = 0; groups[i] != NULL; i++)
     {
@@ -13137,9 +15358,64 @@ flatpak_dir_find_remote_related_for_metadata (FlatpakDir         *self,
         }
     }
 
+  if (cache_key != NULL)
+    {
+      RelatedCacheEntry *entry = g_new0 (RelatedCacheEntry, 1);
+
+      entry->fingerprint = g_strdup (fingerprint);
+      entry->related = flatpak_related_array_dup (related);
+
+      G_LOCK (ref_cache);
+      if (flatpak_dir_ensure_ref_cache (self))
+        g_hash_table_replace (self->related_cache, g_steal_pointer (&cache_key), entry);
+      else
+        related_cache_entry_free (entry);
+      G_UNLOCK (ref_cache);
+    }
+
   return g_steal_pointer (&related);
 }
 
+/* Process-wide cache of metadata keyfiles parsed out of commit objects,
+ * keyed by commit checksum. Commits are immutable, so entries never go
+ * stale and each commit's metadata is parsed at most once per process.
+ * The returned keyfile is shared between callers, so it must be treated
+ * as read-only. */
+static GHashTable *commit_metakey_cache; /* commit checksum -> GKeyFile */
+G_LOCK_DEFINE_STATIC (commit_metakey_cache);
+
+static GKeyFile *
+flatpak_parse_commit_metakey_cached (const char *checksum,
+                                     const char *metadata_contents)
+{
+  GKeyFile *metakey;
+
+  G_LOCK (commit_metakey_cache);
+  if (commit_metakey_cache == NULL)
+    commit_metakey_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                  g_free, (GDestroyNotify) g_key_file_unref);
+  metakey = g_hash_table_lookup (commit_metakey_cache, checksum);
+  if (metakey != NULL)
+    metakey = g_key_file_ref (metakey);
+  G_UNLOCK (commit_metakey_cache);
+
+  if (metakey != NULL)
+    return metakey;
+
+  metakey = g_key_file_new ();
+  if (!g_key_file_load_from_data (metakey, metadata_contents, -1, 0, NULL))
+    {
+      g_key_file_unref (metakey);
+      return NULL;
+    }
+
+  G_LOCK (commit_metakey_cache);
+  g_hash_table_replace (commit_metakey_cache, g_strdup (checksum), g_key_file_ref (metakey));
+  G_UNLOCK (commit_metakey_cache);
+
+  return metakey;
+}
+
 
 GPtrArray *
 flatpak_dir_find_remote_related (FlatpakDir         *self,
@@ -13149,7 +15425,7 @@ flatpak_dir_find_remote_related (FlatpakDir         *self,
                                  GError            **error)
 {
   const char *metadata = NULL;
-  g_autoptr(GKeyFile) metakey = g_key_file_new ();
+  g_autoptr(GKeyFile) metakey = NULL;
   g_auto(GStrv) parts = NULL;
   g_autoptr(GPtrArray) related = NULL;
   g_autofree char *url = NULL;
@@ -13169,8 +15445,25 @@ flatpak_dir_find_remote_related (FlatpakDir         *self,
 
   if (flatpak_remote_state_lookup_cache (state, ref,
                                          NULL, NULL, &metadata,
-                                         NULL) &&
-      g_key_file_load_from_data (metakey, metadata, -1, 0, NULL))
+                                         NULL))
+    {
+      g_autofree char *checksum = NULL;
+
+      /* The metadata and the checksum come from the same pinned state,
+         so the parsed form can be shared via the commit-keyed cache */
+      if (flatpak_remote_state_lookup_ref (state, ref, &checksum, NULL, NULL) &&
+          checksum != NULL)
+        metakey = flatpak_parse_commit_metakey_cached (checksum, metadata);
+
+      if (metakey == NULL)
+        {
+          metakey = g_key_file_new ();
+          if (!g_key_file_load_from_data (metakey, metadata, -1, 0, NULL))
+            g_clear_pointer (&metakey, g_key_file_unref);
+        }
+    }
+
+  if (metakey != NULL)
     related = flatpak_dir_find_remote_related_for_metadata (self, state, ref, metakey, cancellable, error);
   else
     related = g_ptr_array_new_with_free_func ((GDestroyNotify) flatpak_related_free);
@@ -13359,7 +15652,7 @@ flatpak_dir_find_local_related (FlatpakDir   *self,
   g_autoptr(GFile) deploy_dir = NULL;
   g_autoptr(GFile) metadata = NULL;
   g_autofree char *metadata_contents = NULL;
-  g_autoptr(GKeyFile) metakey = g_key_file_new ();
+  g_autoptr(GKeyFile) metakey = NULL;
   g_autoptr(GPtrArray) related = NULL;
 
   if (!flatpak_dir_ensure_repo (self, cancellable, error))
@@ -13392,11 +15685,19 @@ flatpak_dir_find_local_related (FlatpakDir   *self,
           g_variant_lookup (commit_metadata, "xa.metadata", "s", &metadata_contents);
           if (metadata_contents == NULL)
             g_debug ("No xa.metadata in local commit %s ref %s", checksum, ref);
+          else
+            metakey = flatpak_parse_commit_metakey_cached (checksum, metadata_contents);
         }
     }
 
-  if (metadata_contents &&
-      g_key_file_load_from_data (metakey, metadata_contents, -1, 0, NULL))
+  if (metakey == NULL && metadata_contents != NULL)
+    {
+      metakey = g_key_file_new ();
+      if (!g_key_file_load_from_data (metakey, metadata_contents, -1, 0, NULL))
+        g_clear_pointer (&metakey, g_key_file_unref);
+    }
+
+  if (metakey != NULL)
     related = flatpak_dir_find_local_related_for_metadata (self, ref, remote_name, metakey, cancellable, error);
   else
     related = g_ptr_array_new_with_free_func ((GDestroyNotify) flatpak_related_free);
@@ -13551,8 +15852,8 @@ sort_strv (char **strv)
   return strv;
 }
 
-char **
-flatpak_dir_get_default_locale_languages (FlatpakDir *self)
+static char **
+flatpak_dir_get_default_locale_languages_uncached (FlatpakDir *self)
 {
   g_autoptr(GPtrArray) langs = g_ptr_array_new_with_free_func (g_free);
   g_autoptr(GDBusProxy) localed_proxy = NULL;
@@ -13582,6 +15883,20 @@ flatpak_dir_get_default_locale_languages (FlatpakDir *self)
   return (char **) g_ptr_array_free (g_steal_pointer (&langs), FALSE);
 }
 
+char **
+flatpak_dir_get_default_locale_languages (FlatpakDir *self)
+{
+  /* The languages are resolved via D-Bus (localed and AccountsService) for
+     system installations, which is too expensive to redo for every ref in a
+     transaction, so compute them at most once per process. An explicit
+     xa.languages configuration is read separately on every call (see
+     flatpak_dir_get_locale_languages), so it is not affected by this. */
+  if (self->default_locale_languages == NULL)
+    self->default_locale_languages = flatpak_dir_get_default_locale_languages_uncached (self);
+
+  return g_strdupv (self->default_locale_languages);
+}
+
 char **
 flatpak_dir_get_locale_languages (FlatpakDir *self)
 {
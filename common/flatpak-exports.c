@@ -89,12 +89,27 @@ typedef struct
   gint  mode;
 } ExportedPath;
 
+typedef struct
+{
+  gboolean is_symlink;
+  char    *resolved; /* NULL if not a symlink, or unresolvable */
+} LinkCacheEntry;
+
 struct _FlatpakExports
 {
   GHashTable           *hash;
+  GPtrArray            *sorted;     /* lazily built sorted view of @hash, see exports_get_sorted() */
+  GHashTable           *link_cache; /* path => LinkCacheEntry, see exports_link_cache_lookup() */
   FlatpakFilesystemMode host_fs;
 };
 
+static void
+link_cache_entry_free (LinkCacheEntry *entry)
+{
+  g_free (entry->resolved);
+  g_free (entry);
+}
+
 static void
 exported_path_free (ExportedPath *exported_path)
 {
@@ -114,29 +129,63 @@ flatpak_exports_new (void)
 void
 flatpak_exports_free (FlatpakExports *exports)
 {
+  if (exports->sorted)
+    g_ptr_array_unref (exports->sorted);
+  if (exports->link_cache)
+    g_hash_table_destroy (exports->link_cache);
   g_hash_table_destroy (exports->hash);
   g_free (exports);
 }
 
+static gint
+compare_eps (gconstpointer a,
+             gconstpointer b)
+{
+  const ExportedPath *ep_a = *(const ExportedPath **) a;
+  const ExportedPath *ep_b = *(const ExportedPath **) b;
+
+  return g_strcmp0 (ep_a->path, ep_b->path);
+}
+
+/* The exported paths sorted by path, so shorter (i.e. parents) are
+   first. This is built once and reused until the set is modified, as
+   visibility lookups happen many times per launch (once per forwarded
+   file, and recursively while resolving symlinks). */
+static GPtrArray *
+exports_get_sorted (FlatpakExports *exports)
+{
+  if (exports->sorted == NULL)
+    {
+      GHashTableIter iter;
+      gpointer value;
+
+      exports->sorted = g_ptr_array_new ();
+
+      g_hash_table_iter_init (&iter, exports->hash);
+      while (g_hash_table_iter_next (&iter, NULL, &value))
+        g_ptr_array_add (exports->sorted, value);
+
+      g_ptr_array_sort (exports->sorted, compare_eps);
+    }
+
+  return exports->sorted;
+}
+
 /* Returns TRUE if the location of this export
    is not visible due to parents being exported */
 static gboolean
-path_parent_is_mapped (const char **keys,
-                       guint        n_keys,
-                       GHashTable  *hash_table,
-                       const char  *path)
+path_parent_is_mapped (GPtrArray  *sorted,
+                       const char *path)
 {
   guint i;
   gboolean is_mapped = FALSE;
 
-  /* The keys are sorted so shorter (i.e. parents) are first */
-  for (i = 0; i < n_keys; i++)
+  for (i = 0; i < sorted->len; i++)
     {
-      const char *mounted_path = keys[i];
-      ExportedPath *ep = g_hash_table_lookup (hash_table, mounted_path);
+      ExportedPath *ep = g_ptr_array_index (sorted, i);
 
-      if (flatpak_has_path_prefix (path, mounted_path) &&
-          (strcmp (path, mounted_path) != 0))
+      if (flatpak_has_path_prefix (path, ep->path) &&
+          (strcmp (path, ep->path) != 0))
         {
           /* FAKE_MODE_DIR has same mapped value as parent */
           if (ep->mode == FAKE_MODE_DIR)
@@ -150,30 +199,26 @@ path_parent_is_mapped (const char **keys,
 }
 
 static gboolean
-path_is_mapped (const char **keys,
-                guint        n_keys,
-                GHashTable  *hash_table,
-                const char  *path,
-                gboolean    *is_readonly_out)
+path_is_mapped (GPtrArray  *sorted,
+                const char *path,
+                gboolean   *is_readonly_out)
 {
   guint i;
   gboolean is_mapped = FALSE;
   gboolean is_readonly = FALSE;
 
-  /* The keys are sorted so shorter (i.e. parents) are first */
-  for (i = 0; i < n_keys; i++)
+  for (i = 0; i < sorted->len; i++)
     {
-      const char *mounted_path = keys[i];
-      ExportedPath *ep = g_hash_table_lookup (hash_table, mounted_path);
+      ExportedPath *ep = g_ptr_array_index (sorted, i);
 
-      if (flatpak_has_path_prefix (path, mounted_path))
+      if (flatpak_has_path_prefix (path, ep->path))
         {
           /* FAKE_MODE_DIR has same mapped value as parent */
           if (ep->mode == FAKE_MODE_DIR)
             continue;
 
           if (ep->mode == FAKE_MODE_SYMLINK)
-            is_mapped = strcmp (path, mounted_path) == 0;
+            is_mapped = strcmp (path, ep->path) == 0;
           else
             is_mapped = ep->mode != FAKE_MODE_TMPFS;
 
@@ -188,13 +233,6 @@ path_is_mapped (const char **keys,
   return is_mapped;
 }
 
-static gint
-compare_eps (const ExportedPath *a,
-             const ExportedPath *b)
-{
-  return g_strcmp0 (a->path, b->path);
-}
-
 /* This differs from g_file_test (path, G_FILE_TEST_IS_DIR) which
    returns true if the path is a symlink to a dir */
 static gboolean
@@ -223,24 +261,17 @@ void
 flatpak_exports_append_bwrap_args (FlatpakExports *exports,
                                    FlatpakBwrap   *bwrap)
 {
-  guint n_keys;
-  g_autofree const char **keys = (const char **) g_hash_table_get_keys_as_array (exports->hash, &n_keys);
-  g_autoptr(GList) eps = NULL;
-  GList *l;
-
-  eps = g_hash_table_get_values (exports->hash);
-  eps = g_list_sort (eps, (GCompareFunc) compare_eps);
-
-  g_qsort_with_data (keys, n_keys, sizeof (char *), (GCompareDataFunc) flatpak_strcmp0_ptr, NULL);
+  GPtrArray *sorted = exports_get_sorted (exports);
+  guint i;
 
-  for (l = eps; l != NULL; l = l->next)
+  for (i = 0; i < sorted->len; i++)
     {
-      ExportedPath *ep = l->data;
+      ExportedPath *ep = g_ptr_array_index (sorted, i);
       const char *path = ep->path;
 
       if (ep->mode == FAKE_MODE_SYMLINK)
         {
-          if (!path_parent_is_mapped (keys, n_keys, exports->hash, path))
+          if (!path_parent_is_mapped (sorted, path))
             {
               g_autofree char *resolved = flatpak_resolve_link (path, NULL);
               if (resolved)
@@ -257,7 +288,7 @@ flatpak_exports_append_bwrap_args (FlatpakExports *exports,
              is a pre-existing dir we can mount the path on. */
           if (path_is_dir (path))
             {
-              if (!path_parent_is_mapped (keys, n_keys, exports->hash, path))
+              if (!path_parent_is_mapped (sorted, path))
                 /* If the parent is not mapped, it will be a tmpfs, no need to mount another one */
                 flatpak_bwrap_add_args (bwrap, "--dir", path, NULL);
               else
@@ -295,8 +326,7 @@ FlatpakFilesystemMode
 flatpak_exports_path_get_mode (FlatpakExports *exports,
                                const char     *path)
 {
-  guint n_keys;
-  g_autofree const char **keys = (const char **) g_hash_table_get_keys_as_array (exports->hash, &n_keys);
+  GPtrArray *sorted = exports_get_sorted (exports);
   g_autofree char *canonical = NULL;
   gboolean is_readonly = FALSE;
   g_auto(GStrv) parts = NULL;
@@ -304,8 +334,6 @@ flatpak_exports_path_get_mode (FlatpakExports *exports,
   g_autoptr(GString) path_builder = g_string_new ("");
   struct stat st;
 
-  g_qsort_with_data (keys, n_keys, sizeof (char *), (GCompareDataFunc) flatpak_strcmp0_ptr, NULL);
-
   path = canonical = flatpak_canonicalize_filename (path);
 
   parts = g_strsplit (path + 1, "/", -1);
@@ -321,7 +349,7 @@ flatpak_exports_path_get_mode (FlatpakExports *exports,
       g_string_append (path_builder, "/");
       g_string_append (path_builder, parts[i]);
 
-      if (path_is_mapped (keys, n_keys, exports->hash, path_builder->str, &is_readonly))
+      if (path_is_mapped (sorted, path_builder->str, &is_readonly))
         {
           if (lstat (path_builder->str, &st) != 0)
             {
@@ -404,6 +432,9 @@ do_export_path (FlatpakExports *exports,
     ep->mode = mode;
 
   g_hash_table_replace (exports->hash, ep->path, ep);
+
+  /* The sorted view is stale now */
+  g_clear_pointer (&exports->sorted, g_ptr_array_unref);
 }
 
 /* AUTOFS mounts are tricky, as using them as a source in a bind mount
@@ -476,6 +507,87 @@ check_if_autofs_works (const char *path)
   return TRUE;
 }
 
+/* Each probe forks and can block for the full 200 msec timeout, so on
+ * automount-heavy hosts re-probing the same paths dominates launch
+ * time. Remember the results for the life of the process, revalidated
+ * against /proc/self/mountinfo, whose content changes whenever the
+ * mount table does. Rereading that file is a single cheap read compared
+ * to a forked probe. */
+G_LOCK_DEFINE_STATIC (autofs_results);
+static GHashTable *autofs_results; /* path => GINT_TO_POINTER (works) */
+static char *autofs_mountinfo_checksum;
+
+static gboolean
+check_if_autofs_works_cached (const char *path)
+{
+  g_autofree char *contents = NULL;
+  g_autofree char *checksum = NULL;
+  gpointer cached;
+  gboolean works;
+  gsize len;
+
+  if (!g_file_get_contents ("/proc/self/mountinfo", &contents, &len, NULL))
+    return check_if_autofs_works (path);
+
+  checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA256, contents, len);
+
+  G_LOCK (autofs_results);
+
+  if (autofs_results == NULL)
+    autofs_results = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  if (g_strcmp0 (autofs_mountinfo_checksum, checksum) != 0)
+    {
+      /* The mount table changed, so all cached results are suspect */
+      g_hash_table_remove_all (autofs_results);
+      g_free (autofs_mountinfo_checksum);
+      autofs_mountinfo_checksum = g_steal_pointer (&checksum);
+    }
+
+  if (g_hash_table_lookup_extended (autofs_results, path, NULL, &cached))
+    works = GPOINTER_TO_INT (cached);
+  else
+    {
+      works = check_if_autofs_works (path);
+      g_hash_table_insert (autofs_results, g_strdup (path), GINT_TO_POINTER (works));
+    }
+
+  G_UNLOCK (autofs_results);
+
+  return works;
+}
+
+/* Memoized lstat + readlink for the per-component symlink walk below.
+ * The exposed paths in an export set largely share their leading
+ * components, so without this we re-check the same prefixes once per
+ * exposed path. The cache lives as long as the FlatpakExports, which
+ * is only populated before the sandbox launches, so it can't go stale
+ * while in use. */
+static const LinkCacheEntry *
+exports_link_cache_lookup (FlatpakExports *exports,
+                           const char     *path)
+{
+  LinkCacheEntry *entry;
+
+  if (exports->link_cache == NULL)
+    exports->link_cache =
+      g_hash_table_new_full (g_str_hash, g_str_equal,
+                             g_free, (GDestroyNotify) link_cache_entry_free);
+
+  entry = g_hash_table_lookup (exports->link_cache, path);
+  if (entry == NULL)
+    {
+      entry = g_new0 (LinkCacheEntry, 1);
+      entry->is_symlink = path_is_symlink (path);
+      if (entry->is_symlink)
+        entry->resolved = flatpak_resolve_link (path, NULL);
+
+      g_hash_table_insert (exports->link_cache, g_strdup (path), entry);
+    }
+
+  return entry;
+}
+
 /* We use level to avoid infinite recursion */
 static gboolean
 _exports_path_expose (FlatpakExports *exports,
@@ -484,6 +596,7 @@ _exports_path_expose (FlatpakExports *exports,
                       int             level)
 {
   g_autofree char *canonical = NULL;
+  const LinkCacheEntry *entry;
   struct stat st;
   struct statfs stfs;
   char *slash;
@@ -523,7 +636,7 @@ _exports_path_expose (FlatpakExports *exports,
 
   if (stfs.f_type == AUTOFS_SUPER_MAGIC)
     {
-      if (!check_if_autofs_works (path))
+      if (!check_if_autofs_works_cached (path))
         {
           g_debug ("ignoring blocking autofs path %s", path);
           return FALSE;
@@ -553,17 +666,17 @@ _exports_path_expose (FlatpakExports *exports,
       if (slash)
         *slash = 0;
 
-      if (path_is_symlink (path) && !never_export_as_symlink (path))
+      entry = exports_link_cache_lookup (exports, path);
+      if (entry->is_symlink && !never_export_as_symlink (path))
         {
-          g_autofree char *resolved = flatpak_resolve_link (path, NULL);
           g_autofree char *new_target = NULL;
 
-          if (resolved)
+          if (entry->resolved)
             {
               if (slash)
-                new_target = g_build_filename (resolved, slash + 1, NULL);
+                new_target = g_build_filename (entry->resolved, slash + 1, NULL);
               else
-                new_target = g_strdup (resolved);
+                new_target = g_strdup (entry->resolved);
 
               if (_exports_path_expose (exports, mode, new_target, level + 1))
                 {
@@ -209,6 +209,25 @@ flatpak_get_supported_arches (void)
   return (const char * const *) flatpak_get_arches ();
 }
 
+typedef struct
+{
+  FlatpakDir          *dir;         /* not owned */
+  GCancellable        *cancellable; /* not owned */
+  FlatpakInstallation *installation;
+  GError              *error;
+} NewInstallationData;
+
+static gpointer
+new_installation_thread (gpointer data)
+{
+  NewInstallationData *install_data = data;
+
+  install_data->installation = flatpak_installation_new_for_dir (install_data->dir,
+                                                                 install_data->cancellable,
+                                                                 &install_data->error);
+  return NULL;
+}
+
 /**
  * flatpak_get_system_installations:
  * @cancellable: (nullable): a #GCancellable
@@ -228,6 +247,8 @@ flatpak_get_system_installations (GCancellable *cancellable,
 {
   g_autoptr(GPtrArray) system_dirs = NULL;
   g_autoptr(GPtrArray) installs = NULL;
+  g_autofree NewInstallationData *datas = NULL;
+  g_autofree GThread **threads = NULL;
   GPtrArray *ret = NULL;
   int i;
 
@@ -235,22 +256,38 @@ flatpak_get_system_installations (GCancellable *cancellable,
   if (system_dirs == NULL)
     goto out;
 
+  /* Setting up an installation opens its repo, which does blocking i/o
+   * against the installation dir and can be slow for remote mounts, so
+   * set up all the installations concurrently rather than letting one
+   * slow dir stall the rest. */
+  datas = g_new0 (NewInstallationData, system_dirs->len);
+  threads = g_new0 (GThread *, system_dirs->len);
+  for (i = 0; i < system_dirs->len; i++)
+    {
+      datas[i].dir = g_ptr_array_index (system_dirs, i);
+      datas[i].cancellable = cancellable;
+
+      if (system_dirs->len > 1)
+        threads[i] = g_thread_new ("flatpak-installation", new_installation_thread, &datas[i]);
+      else
+        new_installation_thread (&datas[i]);
+    }
+
   installs = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
   for (i = 0; i < system_dirs->len; i++)
     {
       g_autoptr(GError) local_error = NULL;
-      FlatpakDir *install_dir = g_ptr_array_index (system_dirs, i);
-      g_autoptr(FlatpakInstallation) installation = NULL;
-
-      installation = flatpak_installation_new_for_dir (install_dir,
-                                                       cancellable,
-                                                       &local_error);
-      if (installation != NULL)
-        g_ptr_array_add (installs, g_steal_pointer (&installation));
+
+      if (threads[i] != NULL)
+        g_thread_join (threads[i]);
+
+      local_error = g_steal_pointer (&datas[i].error);
+      if (datas[i].installation != NULL)
+        g_ptr_array_add (installs, g_steal_pointer (&datas[i].installation));
       else
         {
           /* Warn about the problem and continue without listing this installation. */
-          g_autofree char *dir_name = flatpak_dir_get_name (install_dir);
+          g_autofree char *dir_name = flatpak_dir_get_name (datas[i].dir);
           g_warning ("Unable to create FlatpakInstallation for %s: %s",
                      dir_name, local_error->message);
         }
@@ -450,7 +487,18 @@ flatpak_installation_drop_caches (FlatpakInstallation *self,
   G_LOCK (dir);
 
   old = priv->dir_unlocked;
-  clone = flatpak_dir_clone (priv->dir_unlocked);
+
+  /* Consumers call this defensively (some on a timer), so if nothing on
+   * disk changed since the repo was opened there is nothing new to pick
+   * up, and we can keep the current state instead of re-scanning
+   * everything from cold */
+  if (flatpak_dir_state_is_current (old))
+    {
+      G_UNLOCK (dir);
+      return TRUE;
+    }
+
+  clone = flatpak_dir_clone (old);
 
   if (flatpak_dir_maybe_ensure_repo (clone, cancellable, error))
     {
@@ -711,10 +759,12 @@ flatpak_installation_launch_full (FlatpakInstallation *self,
 
 
 static FlatpakInstalledRef *
-get_ref (FlatpakDir   *dir,
-         const char   *full_ref,
-         GCancellable *cancellable,
-         GError      **error)
+get_ref_full (FlatpakDir   *dir,
+              const char   *full_ref,
+              GHashTable   *repo_refs,    /* refspec → checksum, or %NULL */
+              GHashTable   *current_refs, /* set of current app refs, or %NULL */
+              GCancellable *cancellable,
+              GError      **error)
 {
   g_auto(GStrv) parts = NULL;
   const char *origin = NULL;
@@ -749,13 +799,34 @@ get_ref (FlatpakDir   *dir,
 
   if (strcmp (parts[0], "app") == 0)
     {
-      g_autofree char *current =
-        flatpak_dir_current_ref (dir, parts[1], cancellable);
-      if (current && strcmp (full_ref, current) == 0)
-        is_current = TRUE;
+      if (current_refs != NULL)
+        is_current = g_hash_table_contains (current_refs, full_ref);
+      else
+        {
+          g_autofree char *current =
+            flatpak_dir_current_ref (dir, parts[1], cancellable);
+          if (current && strcmp (full_ref, current) == 0)
+            is_current = TRUE;
+        }
     }
 
-  latest_commit = flatpak_dir_read_latest (dir, origin, full_ref, &latest_alt_id, NULL, NULL);
+  if (repo_refs != NULL)
+    {
+      g_autofree char *refspec = g_strdup_printf ("%s:%s", origin, full_ref);
+      const char *latest = g_hash_table_lookup (repo_refs, refspec);
+
+      /* If the deployed commit is also the latest one we already have its
+       * alt-id from the deploy data, so we can skip loading the commit */
+      if (latest != NULL && strcmp (latest, commit) == 0)
+        {
+          latest_commit = g_strdup (latest);
+          latest_alt_id = g_strdup (alt_id);
+        }
+      else if (latest != NULL)
+        latest_commit = flatpak_dir_read_latest (dir, origin, full_ref, &latest_alt_id, NULL, NULL);
+    }
+  else
+    latest_commit = flatpak_dir_read_latest (dir, origin, full_ref, &latest_alt_id, NULL, NULL);
 
   return flatpak_installed_ref_new (full_ref,
                                     alt_id ? alt_id : commit,
@@ -772,6 +843,61 @@ get_ref (FlatpakDir   *dir,
                                     flatpak_deploy_data_get_appdata_license (deploy_data));
 }
 
+static FlatpakInstalledRef *
+get_ref (FlatpakDir   *dir,
+         const char   *full_ref,
+         GCancellable *cancellable,
+         GError      **error)
+{
+  return get_ref_full (dir, full_ref, NULL, NULL, cancellable, error);
+}
+
+/* When listing all the installed refs we do the repo-wide parts of
+ * get_ref_full() once up front rather than once per ref: one pass over
+ * the refs in the repo, and one pass over the per-app current links. */
+static GHashTable *
+list_repo_refs (FlatpakDir   *dir,
+                GCancellable *cancellable)
+{
+  OstreeRepo *repo = flatpak_dir_get_repo (dir);
+  g_autoptr(GHashTable) refspecs = NULL;
+
+  if (repo == NULL ||
+      !ostree_repo_list_refs (repo, NULL, &refspecs, cancellable, NULL))
+    return NULL;
+
+  return g_steal_pointer (&refspecs);
+}
+
+static GHashTable *
+list_current_refs (FlatpakDir   *dir,
+                   GCancellable *cancellable)
+{
+  g_autoptr(GHashTable) current_refs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autoptr(GFile) base = NULL;
+  g_autoptr(GFileEnumerator) dir_enum = NULL;
+
+  base = g_file_get_child (flatpak_dir_get_path (dir), "app");
+  dir_enum = g_file_enumerate_children (base, G_FILE_ATTRIBUTE_STANDARD_NAME,
+                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                        cancellable, NULL);
+  while (dir_enum != NULL)
+    {
+      GFileInfo *child_info;
+      g_autofree char *current = NULL;
+
+      if (!g_file_enumerator_iterate (dir_enum, &child_info, NULL, cancellable, NULL) ||
+          child_info == NULL)
+        break;
+
+      current = flatpak_dir_current_ref (dir, g_file_info_get_name (child_info), cancellable);
+      if (current != NULL)
+        g_hash_table_add (current_refs, g_steal_pointer (&current));
+    }
+
+  return g_steal_pointer (&current_refs);
+}
+
 /**
  * flatpak_installation_get_installed_ref:
  * @self: a #FlatpakInstallation
@@ -886,9 +1012,14 @@ flatpak_installation_list_installed_refs (FlatpakInstallation *self,
   g_autoptr(FlatpakDir) dir = flatpak_installation_get_dir_maybe_no_repo (self);
   g_auto(GStrv) raw_refs_app = NULL;
   g_auto(GStrv) raw_refs_runtime = NULL;
+  g_autoptr(GHashTable) repo_refs = NULL;
+  g_autoptr(GHashTable) current_refs = NULL;
   g_autoptr(GPtrArray) refs = g_ptr_array_new_with_free_func (g_object_unref);
   int i;
 
+  repo_refs = list_repo_refs (dir, cancellable);
+  current_refs = list_current_refs (dir, cancellable);
+
   if (!flatpak_dir_list_refs (dir,
                               "app",
                               &raw_refs_app,
@@ -898,7 +1029,8 @@ flatpak_installation_list_installed_refs (FlatpakInstallation *self,
   for (i = 0; raw_refs_app[i] != NULL; i++)
     {
       g_autoptr(GError) local_error = NULL;
-      FlatpakInstalledRef *ref = get_ref (dir, raw_refs_app[i], cancellable, &local_error);
+      FlatpakInstalledRef *ref = get_ref_full (dir, raw_refs_app[i], repo_refs, current_refs,
+                                               cancellable, &local_error);
       if (ref != NULL)
         g_ptr_array_add (refs, ref);
       else
@@ -914,7 +1046,8 @@ flatpak_installation_list_installed_refs (FlatpakInstallation *self,
   for (i = 0; raw_refs_runtime[i] != NULL; i++)
     {
       g_autoptr(GError) local_error = NULL;
-      FlatpakInstalledRef *ref = get_ref (dir, raw_refs_runtime[i], cancellable, &local_error);
+      FlatpakInstalledRef *ref = get_ref_full (dir, raw_refs_runtime[i], repo_refs, current_refs,
+                                               cancellable, &local_error);
       if (ref != NULL)
         g_ptr_array_add (refs, ref);
       else
@@ -944,9 +1077,15 @@ flatpak_installation_list_installed_refs_by_kind (FlatpakInstallation *self,
 {
   g_autoptr(FlatpakDir) dir = flatpak_installation_get_dir_maybe_no_repo (self);
   g_auto(GStrv) raw_refs = NULL;
+  g_autoptr(GHashTable) repo_refs = NULL;
+  g_autoptr(GHashTable) current_refs = NULL;
   g_autoptr(GPtrArray) refs = g_ptr_array_new_with_free_func (g_object_unref);
   int i;
 
+  repo_refs = list_repo_refs (dir, cancellable);
+  if (kind == FLATPAK_REF_KIND_APP)
+    current_refs = list_current_refs (dir, cancellable);
+
   if (!flatpak_dir_list_refs (dir,
                               kind == FLATPAK_REF_KIND_APP ? "app" : "runtime",
                               &raw_refs,
@@ -956,7 +1095,8 @@ flatpak_installation_list_installed_refs_by_kind (FlatpakInstallation *self,
   for (i = 0; raw_refs[i] != NULL; i++)
     {
       g_autoptr(GError) local_error = NULL;
-      FlatpakInstalledRef *ref = get_ref (dir, raw_refs[i], cancellable, &local_error);
+      FlatpakInstalledRef *ref = get_ref_full (dir, raw_refs[i], repo_refs, current_refs,
+                                               cancellable, &local_error);
       if (ref != NULL)
         g_ptr_array_add (refs, ref);
       else
@@ -997,85 +1137,91 @@ flatpak_installation_list_installed_refs_for_update (FlatpakInstallation *self,
 {
   g_autoptr(GPtrArray) updates = NULL; /* (element-type FlatpakInstalledRef) */
   g_autoptr(GPtrArray) installed = NULL; /* (element-type FlatpakInstalledRef) */
-  g_autoptr(GPtrArray) remotes = NULL; /* (element-type FlatpakRemote) */
-  g_autoptr(GHashTable) remote_commits = NULL; /* (element-type utf8 utf8) */
+  g_autoptr(GHashTable) refs_by_remote = NULL; /* (element-type utf8 GPtrArray) */
+  GHashTableIter iter;
+  gpointer key, value;
   int i, j;
   g_autoptr(FlatpakDir) dir = NULL;
   g_auto(OstreeRepoFinderResultv) results = NULL;
   g_autoptr(GAsyncResult) result = NULL;
   g_autoptr(GPtrArray) collection_refs = NULL; /* (element-type OstreeCollectionRef) */
 
-  remote_commits = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  installed = flatpak_installation_list_installed_refs (self, cancellable, error);
+  if (installed == NULL)
+    return NULL;
 
-  remotes = flatpak_installation_list_remotes (self, cancellable, error);
-  if (remotes == NULL)
+  dir = flatpak_installation_get_dir (self, error);
+  if (dir == NULL)
     return NULL;
 
-  for (i = 0; i < remotes->len; i++)
+  /* Group the installed refs by origin so that each remote summary is
+   * consulted only once, and only for remotes we actually have something
+   * installed from */
+  refs_by_remote = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                          (GDestroyNotify) g_ptr_array_unref);
+
+  for (i = 0; i < installed->len; i++)
+    {
+      FlatpakInstalledRef *installed_ref = g_ptr_array_index (installed, i);
+      const char *remote_name = flatpak_installed_ref_get_origin (installed_ref);
+      GPtrArray *group = g_hash_table_lookup (refs_by_remote, remote_name);
+
+      if (group == NULL)
+        {
+          group = g_ptr_array_new ();
+          g_hash_table_insert (refs_by_remote, g_strdup (remote_name), group);
+        }
+
+      g_ptr_array_add (group, installed_ref);
+    }
+
+  updates = g_ptr_array_new_with_free_func (g_object_unref);
+
+  g_hash_table_iter_init (&iter, refs_by_remote);
+  while (g_hash_table_iter_next (&iter, &key, &value))
     {
-      FlatpakRemote *remote = g_ptr_array_index (remotes, i);
-      g_autoptr(GPtrArray) refs = NULL;
+      const char *remote_name = key;
+      GPtrArray *group = value;
+      g_autoptr(FlatpakRemoteState) state = NULL;
       g_autoptr(GError) local_error = NULL;
       g_autofree char *collection_id = NULL;
-      const char *remote_name = flatpak_remote_get_name (remote);
 
-      if (flatpak_remote_get_disabled (remote))
+      if (flatpak_dir_get_remote_disabled (dir, remote_name))
         continue;
 
       /* Remotes with collection IDs will be handled separately below */
-      collection_id = flatpak_remote_get_collection_id (remote);
+      collection_id = flatpak_dir_get_remote_collection_id (dir, remote_name);
       if (collection_id != NULL)
         continue;
 
       /* We ignore errors here. we don't want one remote to fail us */
-      refs = flatpak_installation_list_remote_refs_sync (self,
-                                                         remote_name,
-                                                         cancellable, &local_error);
-      if (refs != NULL)
-        {
-          for (j = 0; j < refs->len; j++)
-            {
-              FlatpakRemoteRef *remote_ref = g_ptr_array_index (refs, j);
-              g_autofree char *full_ref = flatpak_ref_format_ref (FLATPAK_REF (remote_ref));
-              g_autofree char *key = g_strdup_printf ("%s:%s", remote_name, full_ref);
-
-              g_hash_table_insert (remote_commits, g_steal_pointer (&key),
-                                   g_strdup (flatpak_ref_get_commit (FLATPAK_REF (remote_ref))));
-            }
-        }
-      else
+      state = flatpak_dir_get_remote_state (dir, remote_name, FALSE, cancellable, &local_error);
+      if (state == NULL)
         {
           g_debug ("Update: Failed to read remote %s: %s",
-                   flatpak_remote_get_name (remote),
-                   local_error->message);
+                   remote_name, local_error->message);
+          continue;
         }
-    }
-
-  installed = flatpak_installation_list_installed_refs (self, cancellable, error);
-  if (installed == NULL)
-    return NULL;
-
-  updates = g_ptr_array_new_with_free_func (g_object_unref);
 
-  for (i = 0; i < installed->len; i++)
-    {
-      FlatpakInstalledRef *installed_ref = g_ptr_array_index (installed, i);
-      const char *remote_name = flatpak_installed_ref_get_origin (installed_ref);
-      g_autofree char *full_ref = flatpak_ref_format_ref (FLATPAK_REF (installed_ref));
-      g_autofree char *key = g_strdup_printf ("%s:%s", remote_name, full_ref);
-      const char *remote_commit = g_hash_table_lookup (remote_commits, key);
-      const char *local_commit = flatpak_installed_ref_get_latest_commit (installed_ref);
-
-      /* Note: local_commit may be NULL here */
-      if (remote_commit != NULL &&
-          g_strcmp0 (remote_commit, local_commit) != 0)
-        g_ptr_array_add (updates, g_object_ref (installed_ref));
+      for (j = 0; j < group->len; j++)
+        {
+          FlatpakInstalledRef *installed_ref = g_ptr_array_index (group, j);
+          g_autofree char *full_ref = flatpak_ref_format_ref (FLATPAK_REF (installed_ref));
+          g_autofree char *remote_commit = NULL;
+          const char *local_commit = flatpak_installed_ref_get_latest_commit (installed_ref);
+
+          /* Checksum-only lookups are answered from the mmaped summary
+           * index, so this doesn't walk the summary for each ref */
+          if (!flatpak_remote_state_lookup_ref (state, full_ref, &remote_commit, NULL, NULL))
+            continue; /* Not in this remote, so no update from it */
+
+          /* Note: local_commit may be NULL here */
+          if (remote_commit != NULL &&
+              g_strcmp0 (remote_commit, local_commit) != 0)
+            g_ptr_array_add (updates, g_object_ref (installed_ref));
+        }
     }
 
-  dir = flatpak_installation_get_dir (self, error);
-  if (dir == NULL)
-    return NULL;
-
   collection_refs = g_ptr_array_new ();
 
   for (i = 0; i < installed->len; i++)
@@ -1748,7 +1894,7 @@ flatpak_installation_install_bundle (FlatpakInstallation    *self,
     return NULL;
 
   if (g_str_has_prefix (ref, "app"))
-    flatpak_dir_run_triggers (dir_clone, cancellable, NULL);
+    flatpak_dir_maybe_run_triggers (dir_clone, cancellable, NULL);
 
   result = get_ref (dir, ref, cancellable, error);
   if (result == NULL)
@@ -1903,7 +2049,7 @@ flatpak_installation_install_full (FlatpakInstallation    *self,
 
   if (!(flags & FLATPAK_INSTALL_FLAGS_NO_TRIGGERS) &&
       g_str_has_prefix (ref, "app"))
-    flatpak_dir_run_triggers (dir_clone, cancellable, NULL);
+    flatpak_dir_maybe_run_triggers (dir_clone, cancellable, NULL);
 
   /* Note that if the caller sets FLATPAK_INSTALL_FLAGS_NO_DEPLOY we must
    * always return an error, as explained above. Otherwise get_ref will
@@ -2076,7 +2222,7 @@ flatpak_installation_update_full (FlatpakInstallation    *self,
 
   if (!(flags & FLATPAK_UPDATE_FLAGS_NO_TRIGGERS) &&
       g_str_has_prefix (ref, "app"))
-    flatpak_dir_run_triggers (dir_clone, cancellable, NULL);
+    flatpak_dir_maybe_run_triggers (dir_clone, cancellable, NULL);
 
   result = get_ref (dir, ref, cancellable, error);
   if (result == NULL)
@@ -2224,7 +2370,7 @@ flatpak_installation_uninstall_full (FlatpakInstallation    *self,
 
   if (!(flags & FLATPAK_UNINSTALL_FLAGS_NO_TRIGGERS) &&
       g_str_has_prefix (ref, "app"))
-    flatpak_dir_run_triggers (dir_clone, cancellable, NULL);
+    flatpak_dir_maybe_run_triggers (dir_clone, cancellable, NULL);
 
   if (!(flags & FLATPAK_UNINSTALL_FLAGS_NO_PRUNE))
     flatpak_dir_prune (dir_clone, cancellable, NULL);
@@ -2367,11 +2513,45 @@ flatpak_installation_list_remote_refs_sync_full (FlatpakInstallation *self,
                                                  FlatpakQueryFlags    flags,
                                                  GCancellable        *cancellable,
                                                  GError             **error)
+{
+  return flatpak_installation_list_remote_refs_filtered (self, remote_or_uri, flags,
+                                                         NULL, NULL, cancellable, error);
+}
+
+/**
+ * flatpak_installation_list_remote_refs_filtered:
+ * @self: a #FlatpakInstallation
+ * @remote_or_uri: the name or URI of the remote
+ * @flags: set of #FlatpakQueryFlags, including which kinds to match
+ * @arch: (nullable): only match refs for this architecture
+ * @name_prefix: (nullable): only match refs whose name starts with this
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for a #GError
+ *
+ * Lists the applications and runtimes in a remote that match the given
+ * filters. Unlike flatpak_installation_list_remote_refs_sync(), refs
+ * that don't match are never instantiated, which makes a difference
+ * when only a small part of a big remote is wanted.
+ *
+ * Returns: (transfer container) (element-type FlatpakRemoteRef): a GPtrArray of
+ *   #FlatpakRemoteRef instances matching the filters
+ *
+ * Since: 1.4
+ */
+GPtrArray *
+flatpak_installation_list_remote_refs_filtered (FlatpakInstallation *self,
+                                                const char          *remote_or_uri,
+                                                FlatpakQueryFlags    flags,
+                                                const char          *arch,
+                                                const char          *name_prefix,
+                                                GCancellable        *cancellable,
+                                                GError             **error)
 {
   g_autoptr(FlatpakDir) dir = NULL;
   g_autoptr(GPtrArray) refs = g_ptr_array_new_with_free_func (g_object_unref);
   g_autoptr(FlatpakRemoteState) state = NULL;
   g_autoptr(GHashTable) ht = NULL;
+  gsize name_prefix_len = name_prefix ? strlen (name_prefix) : 0;
   GHashTableIter iter;
   gpointer key;
   gpointer value;
@@ -2394,6 +2574,26 @@ flatpak_installation_list_remote_refs_sync_full (FlatpakInstallation *self,
       FlatpakRemoteRef *ref;
       FlatpakCollectionRef *coll_ref = key;
       const gchar *ref_commit = value;
+      FlatpakRefView view;
+
+      /* Match against the unparsed ref, so non-matches are skipped
+       * before any decomposing or object construction happens */
+      if (!flatpak_ref_parse_view (coll_ref->ref_name, &view))
+        continue;
+
+      if ((flags & FLATPAK_QUERY_FLAGS_ONLY_APPS) && !view.is_app)
+        continue;
+
+      if ((flags & FLATPAK_QUERY_FLAGS_ONLY_RUNTIMES) && view.is_app)
+        continue;
+
+      if (arch != NULL && !flatpak_ref_view_has_arch (&view, arch))
+        continue;
+
+      if (name_prefix != NULL &&
+          (view.id_len < name_prefix_len ||
+           strncmp (view.id, name_prefix, name_prefix_len) != 0))
+        continue;
 
       ref = flatpak_remote_ref_new (coll_ref, ref_commit, remote_or_uri, state);
 
@@ -2984,56 +3184,45 @@ flatpak_installation_list_unused_refs (FlatpakInstallation *self,
   for (i = 0; app_refs[i] != NULL; i++)
     {
       const char *ref = app_refs[i];
-      g_autoptr(FlatpakDeploy) deploy = NULL;
-      g_autofree char *origin = NULL;
-      g_autofree char *runtime = NULL;
-      g_autofree char *sdk = NULL;
-      g_autoptr(GKeyFile) metakey = NULL;
+      g_autoptr(GVariant) deploy_data = NULL;
+      const char *runtime;
+      const char *sdk;
       g_auto(GStrv) parts = g_strsplit (ref, "/", -1);
 
       if (arch != NULL && strcmp (parts[2], arch) != 0)
         continue;
 
-      deploy = flatpak_dir_load_deployed (dir, ref, NULL, NULL, NULL);
-      if (deploy == NULL)
+      /* The deploy data records the runtime and sdk dependencies at deploy
+       * time (upgrading old deployments on first load), so we don't have to
+       * parse the metadata of every installed app here */
+      deploy_data = flatpak_dir_get_deploy_data (dir, ref, FLATPAK_DEPLOY_VERSION_CURRENT, NULL, NULL);
+      if (deploy_data == NULL)
         continue;
 
-      origin = flatpak_dir_get_origin (dir, ref, NULL, NULL);
-      if (origin == NULL)
-        continue;
-
-      find_used_refs (dir, used_refs, ref, origin);
+      find_used_refs (dir, used_refs, ref, flatpak_deploy_data_get_origin (deploy_data));
 
-      metakey = flatpak_deploy_get_metadata (deploy);
-      runtime = g_key_file_get_string (metakey, "Application", "runtime", NULL);
+      runtime = flatpak_deploy_data_get_runtime (deploy_data);
       if (runtime)
-        g_hash_table_add (used_runtimes, g_steal_pointer (&runtime));
+        g_hash_table_add (used_runtimes, g_strdup (runtime));
 
-      sdk = g_key_file_get_string (metakey, "Application", "sdk", NULL);
+      sdk = flatpak_deploy_data_get_sdk (deploy_data);
       if (sdk)
-        g_hash_table_add (used_runtimes, g_steal_pointer (&sdk));
+        g_hash_table_add (used_runtimes, g_strdup (sdk));
     }
 
   GLNX_HASH_TABLE_FOREACH (used_runtimes, const char *, runtime)
   {
     g_autofree char *runtime_ref = g_strconcat ("runtime/", runtime, NULL);
-    g_autoptr(FlatpakDeploy) deploy = NULL;
-    g_autofree char *origin = NULL;
-    g_autofree char *sdk = NULL;
-    g_autoptr(GKeyFile) metakey = NULL;
-
-    deploy = flatpak_dir_load_deployed (dir, runtime_ref, NULL, NULL, NULL);
-    if (deploy == NULL)
-      continue;
+    g_autoptr(GVariant) deploy_data = NULL;
+    const char *sdk;
 
-    origin = flatpak_dir_get_origin (dir, runtime_ref, NULL, NULL);
-    if (origin == NULL)
+    deploy_data = flatpak_dir_get_deploy_data (dir, runtime_ref, FLATPAK_DEPLOY_VERSION_CURRENT, NULL, NULL);
+    if (deploy_data == NULL)
       continue;
 
-    find_used_refs (dir, used_refs, runtime_ref, origin);
+    find_used_refs (dir, used_refs, runtime_ref, flatpak_deploy_data_get_origin (deploy_data));
 
-    metakey = flatpak_deploy_get_metadata (deploy);
-    sdk = g_key_file_get_string (metakey, "Runtime", "sdk", NULL);
+    sdk = flatpak_deploy_data_get_sdk (deploy_data);
     if (sdk)
       {
         g_autofree char *sdk_ref = g_strconcat ("runtime/", sdk, NULL);
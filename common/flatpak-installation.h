@@ -127,14 +127,18 @@ typedef enum {
  * @FLATPAK_QUERY_FLAGS_ONLY_CACHED: Don't do any network i/o, but only return cached data.
  * This can return stale data, or a #FLATPAK_ERROR_NOT_CACHED error, however it is a
  * lot more efficient if you're doing many requests.
+ * @FLATPAK_QUERY_FLAGS_ONLY_APPS: Only match applications.
+ * @FLATPAK_QUERY_FLAGS_ONLY_RUNTIMES: Only match runtimes.
  *
  * Flags to alter the behavior of e.g flatpak_installation_list_remote_refs_full().
  *
  * Since: 1.3.3
  */
 typedef enum {
-  FLATPAK_QUERY_FLAGS_NONE        = 0,
-  FLATPAK_QUERY_FLAGS_ONLY_CACHED = (1 << 0),
+  FLATPAK_QUERY_FLAGS_NONE          = 0,
+  FLATPAK_QUERY_FLAGS_ONLY_CACHED   = (1 << 0),
+  FLATPAK_QUERY_FLAGS_ONLY_APPS     = (1 << 1),
+  FLATPAK_QUERY_FLAGS_ONLY_RUNTIMES = (1 << 2),
 } FlatpakQueryFlags;
 
 /**
@@ -390,6 +394,13 @@ FLATPAK_EXTERN GPtrArray    *    flatpak_installation_list_remote_refs_sync_full
                                                                                   FlatpakQueryFlags    flags,
                                                                                   GCancellable        *cancellable,
                                                                                   GError             **error);
+FLATPAK_EXTERN GPtrArray    *    flatpak_installation_list_remote_refs_filtered (FlatpakInstallation *self,
+                                                                                 const char          *remote_or_uri,
+                                                                                 FlatpakQueryFlags    flags,
+                                                                                 const char          *arch,
+                                                                                 const char          *name_prefix,
+                                                                                 GCancellable        *cancellable,
+                                                                                 GError             **error);
 FLATPAK_EXTERN FlatpakRemoteRef  *flatpak_installation_fetch_remote_ref_sync (FlatpakInstallation *self,
                                                                               const char          *remote_name,
                                                                               FlatpakRefKind       kind,
@@ -53,6 +53,7 @@ struct _FlatpakInstalledRefPrivate
   char    *appdata_summary;
   char    *appdata_version;
   char    *appdata_license;
+  GBytes  *appdata_bytes; /* Loaded lazily, see load_appdata() */
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE (FlatpakInstalledRef, flatpak_installed_ref, FLATPAK_TYPE_REF)
@@ -90,6 +91,7 @@ flatpak_installed_ref_finalize (GObject *object)
   g_free (priv->appdata_summary);
   g_free (priv->appdata_version);
   g_free (priv->appdata_license);
+  g_clear_pointer (&priv->appdata_bytes, g_bytes_unref);
 
   G_OBJECT_CLASS (flatpak_installed_ref_parent_class)->finalize (object);
 }
@@ -496,13 +498,21 @@ flatpak_installed_ref_load_appdata (FlatpakInstalledRef *self,
       return NULL;
     }
 
+  /* The deploy dir is immutable once deployed, so we can keep the bytes
+   * around and hand out references instead of re-reading the file every
+   * time someone asks */
+  if (priv->appdata_bytes != NULL)
+    return g_bytes_ref (priv->appdata_bytes);
+
   appdata_name = g_strconcat (flatpak_ref_get_name (FLATPAK_REF (self)), ".xml.gz", NULL);
   path = g_build_filename (priv->deploy_dir, "files/share/app-info/xmls", appdata_name, NULL);
 
   if (!g_file_get_contents (path, &data, &length, error))
     return NULL;
 
-  return g_bytes_new_take (data, length);
+  priv->appdata_bytes = g_bytes_new_take (data, length);
+
+  return g_bytes_ref (priv->appdata_bytes);
 }
 
 /**
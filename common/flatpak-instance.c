@@ -55,6 +55,7 @@ struct _FlatpakInstancePrivate
   char     *id;
   char     *dir;
 
+  gboolean  info_loaded;
   GKeyFile *info;
   char     *app;
   char     *arch;
@@ -134,11 +135,14 @@ flatpak_instance_get_id (FlatpakInstance *self)
  *
  * Since: 1.1
  */
+static void ensure_info (FlatpakInstance *self);
+
 const char *
 flatpak_instance_get_app (FlatpakInstance *self)
 {
   FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
 
+  ensure_info (self);
   return priv->app;
 }
 
@@ -157,6 +161,7 @@ flatpak_instance_get_arch (FlatpakInstance *self)
 {
   FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
 
+  ensure_info (self);
   return priv->arch;
 }
 
@@ -175,6 +180,7 @@ flatpak_instance_get_branch (FlatpakInstance *self)
 {
   FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
 
+  ensure_info (self);
   return priv->branch;
 }
 
@@ -193,6 +199,7 @@ flatpak_instance_get_commit (FlatpakInstance *self)
 {
   FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
 
+  ensure_info (self);
   return priv->commit;
 }
 
@@ -211,6 +218,7 @@ flatpak_instance_get_runtime (FlatpakInstance *self)
 {
   FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
 
+  ensure_info (self);
   return priv->runtime;
 }
 
@@ -229,6 +237,7 @@ flatpak_instance_get_runtime_commit (FlatpakInstance *self)
 {
   FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
 
+  ensure_info (self);
   return priv->runtime_commit;
 }
 
@@ -301,6 +310,7 @@ flatpak_instance_get_info (FlatpakInstance *self)
 {
   FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
 
+  ensure_info (self);
   return priv->info;
 }
 
@@ -379,17 +389,18 @@ get_pid (const char *dir)
   return (int) g_ascii_strtoll (contents, NULL, 10);
 }
 
-FlatpakInstance *
-flatpak_instance_new (const char *dir)
+/* Load and parse the info keyfile on first use, so that simply
+ * enumerating the instances (e.g. to check liveness) doesn't pay for
+ * parsing every instance's info file and bwrapinfo.json. */
+static void
+ensure_info (FlatpakInstance *self)
 {
-  FlatpakInstance *self = g_object_new (flatpak_instance_get_type (), NULL);
   FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
 
-  priv->dir = g_strdup (dir);
-  priv->id = g_path_get_basename (dir);
+  if (priv->info_loaded)
+    return;
 
-  priv->pid = get_pid (priv->dir);
-  priv->child_pid = get_child_pid (priv->dir);
+  priv->info_loaded = TRUE;
   priv->info = get_instance_info (priv->dir);
 
   if (priv->info)
@@ -416,6 +427,20 @@ flatpak_instance_new (const char *dir)
       priv->runtime_commit = g_key_file_get_string (priv->info,
                                                     FLATPAK_METADATA_GROUP_INSTANCE, FLATPAK_METADATA_KEY_RUNTIME_COMMIT, NULL);
     }
+}
+
+FlatpakInstance *
+flatpak_instance_new (const char *dir)
+{
+  FlatpakInstance *self = g_object_new (flatpak_instance_get_type (), NULL);
+  FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
+
+  priv->dir = g_strdup (dir);
+  priv->id = g_path_get_basename (dir);
+
+  priv->pid = get_pid (priv->dir);
+  /* The info keyfile and the child pid (which needs a JSON parse of
+     bwrapinfo.json) are loaded lazily by their getters */
 
   return self;
 }
@@ -510,3 +535,334 @@ flatpak_instance_is_running (FlatpakInstance *self)
 
   return FALSE;
 }
+
+/* A FlatpakInstanceMonitor turns the per-instance directories under
+ * $XDG_RUNTIME_DIR/.flatpak into push-style lifecycle events, so that
+ * monitoring tools don't need to rescan the directory on a timer.
+ *
+ * An instance counts as started once its pid file has been written,
+ * and as exited once the write lock on its .ref file has been dropped
+ * (bubblewrap holds that lock for as long as the sandbox is alive, so
+ * its release is observable as a close-write event on the file). */
+
+typedef struct
+{
+  FlatpakInstanceMonitor *monitor; /* not owned, owns us */
+  char                   *id;
+  char                   *dir;
+  FlatpakInstance        *instance;
+  GFileMonitor           *dir_monitor;
+  gboolean                started_emitted;
+  guint                   recheck_id;
+} InstanceWatch;
+
+typedef struct _FlatpakInstanceMonitorPrivate FlatpakInstanceMonitorPrivate;
+
+struct _FlatpakInstanceMonitorPrivate
+{
+  GFileMonitor *base_monitor;
+  GHashTable   *watches; /* instance id -> InstanceWatch */
+};
+
+G_DEFINE_TYPE_WITH_PRIVATE (FlatpakInstanceMonitor, flatpak_instance_monitor, G_TYPE_OBJECT)
+
+enum {
+  INSTANCE_STARTED,
+  INSTANCE_EXITED,
+  LAST_SIGNAL
+};
+
+static guint monitor_signals[LAST_SIGNAL] = { 0 };
+
+static void
+instance_watch_free (InstanceWatch *watch)
+{
+  if (watch->recheck_id != 0)
+    g_source_remove (watch->recheck_id);
+  g_clear_object (&watch->dir_monitor);
+  g_clear_object (&watch->instance);
+  g_free (watch->id);
+  g_free (watch->dir);
+  g_free (watch);
+}
+
+static void
+flatpak_instance_monitor_finalize (GObject *object)
+{
+  FlatpakInstanceMonitor *self = FLATPAK_INSTANCE_MONITOR (object);
+  FlatpakInstanceMonitorPrivate *priv = flatpak_instance_monitor_get_instance_private (self);
+
+  g_clear_object (&priv->base_monitor);
+  g_clear_pointer (&priv->watches, g_hash_table_unref);
+
+  G_OBJECT_CLASS (flatpak_instance_monitor_parent_class)->finalize (object);
+}
+
+static void
+flatpak_instance_monitor_class_init (FlatpakInstanceMonitorClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = flatpak_instance_monitor_finalize;
+
+  /**
+   * FlatpakInstanceMonitor::instance-started:
+   * @monitor: the #FlatpakInstanceMonitor
+   * @instance: the #FlatpakInstance that started
+   *
+   * Emitted when a new sandbox has been launched.
+   *
+   * Since: 1.4
+   */
+  monitor_signals[INSTANCE_STARTED] =
+    g_signal_new ("instance-started",
+                  G_OBJECT_CLASS_TYPE (object_class),
+                  G_SIGNAL_RUN_LAST,
+                  0, NULL, NULL, NULL,
+                  G_TYPE_NONE, 1, FLATPAK_TYPE_INSTANCE);
+
+  /**
+   * FlatpakInstanceMonitor::instance-exited:
+   * @monitor: the #FlatpakInstanceMonitor
+   * @instance: the #FlatpakInstance that exited
+   *
+   * Emitted when a sandbox has gone away. The processes in the
+   * instance are no longer running, but the getters on @instance
+   * still return the recorded information.
+   *
+   * Since: 1.4
+   */
+  monitor_signals[INSTANCE_EXITED] =
+    g_signal_new ("instance-exited",
+                  G_OBJECT_CLASS_TYPE (object_class),
+                  G_SIGNAL_RUN_LAST,
+                  0, NULL, NULL, NULL,
+                  G_TYPE_NONE, 1, FLATPAK_TYPE_INSTANCE);
+}
+
+static void
+flatpak_instance_monitor_init (FlatpakInstanceMonitor *self)
+{
+  FlatpakInstanceMonitorPrivate *priv = flatpak_instance_monitor_get_instance_private (self);
+
+  priv->watches = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                         NULL, (GDestroyNotify) instance_watch_free);
+}
+
+static void
+instance_watch_emit_started (InstanceWatch *watch)
+{
+  if (watch->started_emitted)
+    return;
+
+  watch->started_emitted = TRUE;
+  if (watch->instance == NULL)
+    watch->instance = flatpak_instance_new_for_id (watch->id);
+
+  g_signal_emit (watch->monitor, monitor_signals[INSTANCE_STARTED], 0, watch->instance);
+}
+
+static void
+instance_watch_emit_exited (InstanceWatch *watch)
+{
+  FlatpakInstanceMonitor *self = watch->monitor;
+  FlatpakInstanceMonitorPrivate *priv = flatpak_instance_monitor_get_instance_private (self);
+  g_autoptr(FlatpakInstance) instance = NULL;
+
+  if (watch->instance)
+    instance = g_object_ref (watch->instance);
+
+  g_hash_table_remove (priv->watches, watch->id);
+
+  if (instance)
+    g_signal_emit (self, monitor_signals[INSTANCE_EXITED], 0, instance);
+}
+
+static void instance_watch_maybe_exited (InstanceWatch *watch);
+
+static gboolean
+instance_watch_recheck_cb (gpointer user_data)
+{
+  InstanceWatch *watch = user_data;
+
+  watch->recheck_id = 0;
+  instance_watch_maybe_exited (watch);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+instance_watch_maybe_exited (InstanceWatch *watch)
+{
+  g_autofree char *ref_file = g_build_filename (watch->dir, ".ref", NULL);
+  struct stat statbuf;
+  struct flock l = {
+    .l_type = F_WRLCK,
+    .l_whence = SEEK_SET,
+    .l_start = 0,
+    .l_len = 0
+  };
+  glnx_autofd int lock_fd = open (ref_file, O_RDWR | O_CLOEXEC);
+
+  if (lock_fd == -1)
+    {
+      instance_watch_emit_exited (watch);
+      return;
+    }
+
+  if (fstat (lock_fd, &statbuf) != 0 ||
+      fcntl (lock_fd, F_GETLK, &l) != 0 ||
+      l.l_type != F_UNLCK)
+    return; /* Still locked, so still alive */
+
+  /* Same grace period as the gc in flatpak_instance_get_all(): just
+     after creation the lock may not have been taken yet, see
+     flatpak_run_allocate_id(). Recheck once the window has passed. */
+  if (statbuf.st_mtime + 3 >= time (NULL))
+    {
+      if (watch->recheck_id == 0)
+        watch->recheck_id = g_timeout_add_seconds (4, instance_watch_recheck_cb, watch);
+      return;
+    }
+
+  instance_watch_emit_exited (watch);
+}
+
+static void
+instance_watch_dir_changed (GFileMonitor      *monitor,
+                            GFile             *file,
+                            GFile             *other_file,
+                            GFileMonitorEvent  event_type,
+                            gpointer           user_data)
+{
+  InstanceWatch *watch = user_data;
+  g_autofree char *name = g_file_get_basename (file);
+
+  if (strcmp (name, "pid") == 0 &&
+      (event_type == G_FILE_MONITOR_EVENT_CREATED ||
+       event_type == G_FILE_MONITOR_EVENT_CHANGED ||
+       event_type == G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT))
+    instance_watch_emit_started (watch);
+  else if (strcmp (name, ".ref") == 0 &&
+           (event_type == G_FILE_MONITOR_EVENT_CHANGED ||
+            event_type == G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT ||
+            event_type == G_FILE_MONITOR_EVENT_DELETED))
+    instance_watch_maybe_exited (watch);
+}
+
+static void
+instance_monitor_add_watch (FlatpakInstanceMonitor *self,
+                            const char             *id,
+                            gboolean                preexisting)
+{
+  FlatpakInstanceMonitorPrivate *priv = flatpak_instance_monitor_get_instance_private (self);
+  g_autoptr(GFile) dir_file = NULL;
+  g_autofree char *pid_file = NULL;
+  InstanceWatch *watch;
+
+  if (g_hash_table_contains (priv->watches, id))
+    return;
+
+  watch = g_new0 (InstanceWatch, 1);
+  watch->monitor = self;
+  watch->id = g_strdup (id);
+  watch->dir = g_build_filename (g_get_user_runtime_dir (), ".flatpak", id, NULL);
+
+  dir_file = g_file_new_for_path (watch->dir);
+  watch->dir_monitor = g_file_monitor_directory (dir_file, G_FILE_MONITOR_NONE, NULL, NULL);
+  if (watch->dir_monitor)
+    g_signal_connect (watch->dir_monitor, "changed",
+                      G_CALLBACK (instance_watch_dir_changed), watch);
+
+  g_hash_table_insert (priv->watches, watch->id, watch);
+
+  if (preexisting)
+    {
+      /* Already running when the monitor was created; don't report a
+         start, but do track it so we report the exit */
+      watch->started_emitted = TRUE;
+      watch->instance = flatpak_instance_new_for_id (id);
+      return;
+    }
+
+  /* The pid file may have been written before our watch was set up */
+  pid_file = g_build_filename (watch->dir, "pid", NULL);
+  if (g_file_test (pid_file, G_FILE_TEST_EXISTS))
+    instance_watch_emit_started (watch);
+}
+
+static void
+instance_monitor_base_changed (GFileMonitor      *monitor,
+                               GFile             *file,
+                               GFile             *other_file,
+                               GFileMonitorEvent  event_type,
+                               gpointer           user_data)
+{
+  FlatpakInstanceMonitor *self = user_data;
+  FlatpakInstanceMonitorPrivate *priv = flatpak_instance_monitor_get_instance_private (self);
+  g_autofree char *name = g_file_get_basename (file);
+
+  if (event_type == G_FILE_MONITOR_EVENT_CREATED)
+    instance_monitor_add_watch (self, name, FALSE);
+  else if (event_type == G_FILE_MONITOR_EVENT_DELETED)
+    {
+      InstanceWatch *watch = g_hash_table_lookup (priv->watches, name);
+
+      if (watch != NULL)
+        instance_watch_emit_exited (watch);
+    }
+}
+
+/**
+ * flatpak_instance_monitor_new:
+ * @error: return location for a #GError
+ *
+ * Creates a monitor that reports sandbox lifecycle changes as they
+ * happen, instead of requiring the caller to poll
+ * flatpak_instance_get_all() on a timer.
+ *
+ * The #FlatpakInstanceMonitor::instance-started signal is emitted when
+ * a new sandbox is launched, and #FlatpakInstanceMonitor::instance-exited
+ * when a sandbox goes away. Sandboxes that are already running when the
+ * monitor is created don't get a start signal, but their exits are
+ * reported; use flatpak_instance_get_all() to enumerate them.
+ *
+ * The signals are emitted in the thread-default main context of the
+ * thread calling this function.
+ *
+ * Returns: (transfer full): a new #FlatpakInstanceMonitor, or %NULL on error
+ *
+ * Since: 1.4
+ */
+FlatpakInstanceMonitor *
+flatpak_instance_monitor_new (GError **error)
+{
+  g_autoptr(FlatpakInstanceMonitor) self = g_object_new (FLATPAK_TYPE_INSTANCE_MONITOR, NULL);
+  FlatpakInstanceMonitorPrivate *priv = flatpak_instance_monitor_get_instance_private (self);
+  g_autofree char *base_dir = NULL;
+  g_autoptr(GFile) base_file = NULL;
+  g_autoptr(GPtrArray) existing = NULL;
+  int i;
+
+  base_dir = g_build_filename (g_get_user_runtime_dir (), ".flatpak", NULL);
+  if (g_mkdir_with_parents (base_dir, 0755) != 0)
+    return glnx_null_throw_errno_prefix (error, "Can't create %s", base_dir);
+
+  base_file = g_file_new_for_path (base_dir);
+  priv->base_monitor = g_file_monitor_directory (base_file, G_FILE_MONITOR_NONE, NULL, error);
+  if (priv->base_monitor == NULL)
+    return NULL;
+
+  g_signal_connect (priv->base_monitor, "changed",
+                    G_CALLBACK (instance_monitor_base_changed), self);
+
+  /* Track what is already running, so exits are reported for those too */
+  existing = flatpak_instance_get_all ();
+  for (i = 0; i < existing->len; i++)
+    {
+      FlatpakInstance *instance = g_ptr_array_index (existing, i);
+      instance_monitor_add_watch (self, flatpak_instance_get_id (instance), TRUE);
+    }
+
+  return g_steal_pointer (&self);
+}
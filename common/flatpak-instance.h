@@ -65,4 +65,28 @@ FLATPAK_EXTERN GKeyFile *   flatpak_instance_get_info (FlatpakInstance *self);
 
 FLATPAK_EXTERN gboolean     flatpak_instance_is_running (FlatpakInstance *self);
 
+typedef struct _FlatpakInstanceMonitor FlatpakInstanceMonitor;
+
+#define FLATPAK_TYPE_INSTANCE_MONITOR flatpak_instance_monitor_get_type ()
+#define FLATPAK_INSTANCE_MONITOR(obj) (G_TYPE_CHECK_INSTANCE_CAST ((obj), FLATPAK_TYPE_INSTANCE_MONITOR, FlatpakInstanceMonitor))
+#define FLATPAK_IS_INSTANCE_MONITOR(obj) (G_TYPE_CHECK_INSTANCE_TYPE ((obj), FLATPAK_TYPE_INSTANCE_MONITOR))
+
+FLATPAK_EXTERN GType flatpak_instance_monitor_get_type (void);
+
+struct _FlatpakInstanceMonitor
+{
+  GObject parent;
+};
+
+typedef struct
+{
+  GObjectClass parent_class;
+} FlatpakInstanceMonitorClass;
+
+#ifdef G_DEFINE_AUTOPTR_CLEANUP_FUNC
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakInstanceMonitor, g_object_unref)
+#endif
+
+FLATPAK_EXTERN FlatpakInstanceMonitor *flatpak_instance_monitor_new (GError **error);
+
 #endif /* __FLATPAK_INSTANCE_H__ */
@@ -104,6 +104,16 @@ JsonNode   *flatpak_json_to_node (FlatpakJson *self);
 FlatpakJson *flatpak_json_from_bytes (GBytes  *bytes,
                                       GType    type,
                                       GError **error);
+
+/* Returns TRUE to stop the parse after this array element */
+typedef gboolean (*FlatpakJsonStopFunc) (gpointer element,
+                                         gpointer user_data);
+
+FlatpakJson *flatpak_json_from_bytes_partial (GBytes              *bytes,
+                                              GType                type,
+                                              FlatpakJsonStopFunc  stop,
+                                              gpointer             user_data,
+                                              GError             **error);
 FlatpakJson *flatpak_json_from_stream (GInputStream *stream,
                                        GType         type,
                                        GCancellable *cancellable,
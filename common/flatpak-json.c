@@ -22,6 +22,7 @@
 #include "string.h"
 
 #include "flatpak-json-private.h"
+#include "flatpak-memory-private.h"
 #include "flatpak-utils-private.h"
 #include "libglnx.h"
 
@@ -30,6 +31,11 @@ G_DEFINE_TYPE (FlatpakJson, flatpak_json, G_TYPE_OBJECT);
 static void
 flatpak_json_finalize (GObject *object)
 {
+  GTypeQuery query;
+
+  g_type_query (G_OBJECT_TYPE (object), &query);
+  flatpak_memory_free (FLATPAK_MEMORY_JSON_OCI, query.instance_size);
+
   G_OBJECT_CLASS (flatpak_json_parent_class)->finalize (object);
 }
 
@@ -44,6 +50,13 @@ flatpak_json_class_init (FlatpakJsonClass *klass)
 static void
 flatpak_json_init (FlatpakJson *self)
 {
+  GTypeQuery query;
+
+  /* The subclass structs hold the parsed OCI json trees, so account
+   * them to the json-oci subsystem (the out-of-line strings they point
+   * at are not included) */
+  g_type_query (G_OBJECT_TYPE (self), &query);
+  flatpak_memory_alloc (FLATPAK_MEMORY_JSON_OCI, query.instance_size);
 }
 
 static gboolean
@@ -350,262 +363,1138 @@ flatpak_json_from_node (JsonNode *node, GType type, GError **error)
   return g_steal_pointer (&json);
 }
 
-FlatpakJson *
-flatpak_json_from_bytes (GBytes  *bytes,
-                         GType    type,
-                         GError **error)
-{
-  g_autoptr(JsonParser) parser = NULL;
-  JsonNode *root = NULL;
+/* A streaming demarshaller that deserializes JSON text directly into
+ * the FlatpakJsonProp-described structs, without first materializing a
+ * json-glib node tree. For large documents like OCI registry indexes
+ * this avoids allocating hundreds of thousands of nodes that are
+ * immediately thrown away again, and it allows stopping the parse
+ * early once the caller has seen what it was looking for. */
 
-  parser = json_parser_new ();
-  if (!json_parser_load_from_data (parser,
-                                   g_bytes_get_data (bytes, NULL),
-                                   g_bytes_get_size (bytes),
-                                   error))
-    return NULL;
+#define JSON_LEXER_MAX_DEPTH 128
 
-  root = json_parser_get_root (parser);
+typedef struct
+{
+  const char          *data;
+  const char          *end;
+  const char          *p;
+  gboolean             stopped;
+  FlatpakJsonStopFunc  stop;
+  gpointer             stop_data;
+} JsonLexer;
+
+typedef struct
+{
+  const FlatpakJsonProp *prop;
+  gpointer               dest;
+  gboolean               seen;
+} JsonPropTarget;
 
-  return flatpak_json_from_node (root, type, error);
+static gboolean
+lexer_fail (JsonLexer  *lexer,
+            GError    **error,
+            const char *message)
+{
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+               "%s at offset %" G_GSIZE_FORMAT,
+               message, (gsize) (lexer->p - lexer->data));
+  return FALSE;
 }
 
-FlatpakJson *
-flatpak_json_from_stream (GInputStream *stream,
-                          GType         type,
-                          GCancellable *cancellable,
-                          GError      **error)
+static void
+lexer_skip_ws (JsonLexer *lexer)
 {
-  g_autoptr(JsonParser) parser = NULL;
-  JsonNode *root = NULL;
+  while (lexer->p < lexer->end &&
+         (*lexer->p == ' ' || *lexer->p == '\t' ||
+          *lexer->p == '\n' || *lexer->p == '\r'))
+    lexer->p++;
+}
 
-  parser = json_parser_new ();
-  if (!json_parser_load_from_stream (parser,
-                                     stream,
-                                     cancellable,
-                                     error))
-    return NULL;
+static gboolean
+lexer_expect (JsonLexer  *lexer,
+              char        c,
+              GError    **error)
+{
+  lexer_skip_ws (lexer);
+  if (lexer->p >= lexer->end || *lexer->p != c)
+    {
+      g_autofree char *msg = g_strdup_printf ("Expected '%c'", c);
+      return lexer_fail (lexer, error, msg);
+    }
+  lexer->p++;
+  return TRUE;
+}
 
-  root = json_parser_get_root (parser);
+static gboolean
+lexer_match_keyword (JsonLexer  *lexer,
+                     const char *keyword,
+                     GError    **error)
+{
+  gsize len = strlen (keyword);
 
-  return flatpak_json_from_node (root, type, error);
+  if (lexer->p + len > lexer->end ||
+      strncmp (lexer->p, keyword, len) != 0)
+    return lexer_fail (lexer, error, "Unexpected character");
+
+  lexer->p += len;
+  return TRUE;
 }
 
-static JsonNode *
-marshal (JsonObject          *parent,
-         const char          *name,
-         gpointer             src,
-         FlatpakJsonPropType  type,
-         gpointer             type_data,
-         FlatpakJsonPropFlags flags)
+static gboolean
+lexer_parse_hex4 (JsonLexer  *lexer,
+                  gunichar   *out,
+                  GError    **error)
 {
-  JsonNode *retval = NULL;
-
-  switch (type)
-    {
-    case FLATPAK_JSON_PROP_TYPE_STRING:
-      {
-        const char *str = *(const char **) src;
-        if (str != NULL)
-          retval = json_node_init_string (json_node_alloc (), str);
-        break;
-      }
+  gunichar value = 0;
+  int i;
 
-    case FLATPAK_JSON_PROP_TYPE_INT64:
-      {
-        retval = json_node_init_int (json_node_alloc (), *(gint64 *) src);
-        break;
-      }
+  if (lexer->p + 4 > lexer->end)
+    return lexer_fail (lexer, error, "Unterminated string");
 
-    case FLATPAK_JSON_PROP_TYPE_BOOL:
-      {
-        gboolean val = *(gboolean *) src;
-        if (val)
-          retval = json_node_init_boolean (json_node_alloc (), val);
-        break;
-      }
+  for (i = 0; i < 4; i++)
+    {
+      int digit = g_ascii_xdigit_value (*lexer->p);
 
-    case FLATPAK_JSON_PROP_TYPE_STRV:
-      {
-        char **strv = *(char ***) src;
-        int i;
-        JsonArray *array;
+      if (digit < 0)
+        return lexer_fail (lexer, error, "Invalid \\u escape");
 
-        if (strv != NULL && strv[0] != NULL)
-          {
-            array = json_array_sized_new (g_strv_length (strv));
-            for (i = 0; strv[i] != NULL; i++)
-              {
-                JsonNode *str = json_node_new (JSON_NODE_VALUE);
+      value = value * 16 + digit;
+      lexer->p++;
+    }
 
-                json_node_set_string (str, strv[i]);
-                json_array_add_element (array, str);
-              }
+  *out = value;
+  return TRUE;
+}
 
-            retval = json_node_init_array (json_node_alloc (), array);
-            json_array_unref (array);
-          }
-        break;
-      }
+/* Parses a string token, resolving escapes. If @out is NULL the string
+ * is validated and skipped without building the result. */
+static gboolean
+lexer_parse_string (JsonLexer  *lexer,
+                    char      **out,
+                    GError    **error)
+{
+  g_autoptr(GString) str = NULL;
 
-    case FLATPAK_JSON_PROP_TYPE_PARENT:
-    case FLATPAK_JSON_PROP_TYPE_STRUCT:
-      {
-        FlatpakJsonProp *struct_props = type_data;
-        JsonObject *obj;
-        int i;
-        gboolean empty = TRUE;
+  if (!lexer_expect (lexer, '"', error))
+    return FALSE;
 
-        if (type == FLATPAK_JSON_PROP_TYPE_PARENT)
-          obj = parent;
-        else
-          obj = json_object_new ();
+  if (out)
+    str = g_string_new ("");
 
-        for (i = 0; struct_props[i].name != NULL; i++)
-          {
-            JsonNode *val = marshal (obj, struct_props[i].name,
-                                     G_STRUCT_MEMBER_P (src, struct_props[i].offset),
-                                     struct_props[i].type, struct_props[i].type_data, struct_props[i].flags);
+  while (TRUE)
+    {
+      char c;
 
-            if (val == NULL)
-              continue;
+      if (lexer->p >= lexer->end)
+        return lexer_fail (lexer, error, "Unterminated string");
 
-            empty = FALSE;
-            json_object_set_member (obj, struct_props[i].name, val);
-          }
+      c = *lexer->p++;
 
-        if (type != FLATPAK_JSON_PROP_TYPE_PARENT)
-          {
-            if (!empty || (flags & FLATPAK_JSON_PROP_FLAGS_OPTIONAL) == 0)
-              {
-                retval = json_node_new (JSON_NODE_OBJECT);
-                json_node_take_object (retval, obj);
-              }
-            else
-              json_object_unref (obj);
-          }
+      if (c == '"')
         break;
-      }
 
-    case FLATPAK_JSON_PROP_TYPE_STRUCTV:
-      {
-        FlatpakJsonProp *struct_props = type_data;
-        gpointer *structv = *(gpointer **) src;
-        int i, j;
-        JsonArray *array;
+      if ((guchar) c < 0x20)
+        return lexer_fail (lexer, error, "Invalid control character in string");
 
-        if (structv != NULL && structv[0] != NULL)
-          {
-            array = json_array_new ();
-            for (j = 0; structv[j] != NULL; j++)
+      if (c == '\\')
+        {
+          char esc;
+
+          if (lexer->p >= lexer->end)
+            return lexer_fail (lexer, error, "Unterminated string");
+
+          esc = *lexer->p++;
+          switch (esc)
+            {
+            case '"':
+            case '\\':
+            case '/':
+              if (str)
+                g_string_append_c (str, esc);
+              break;
+
+            case 'b':
+              if (str)
+                g_string_append_c (str, '\b');
+              break;
+
+            case 'f':
+              if (str)
+                g_string_append_c (str, '\f');
+              break;
+
+            case 'n':
+              if (str)
+                g_string_append_c (str, '\n');
+              break;
+
+            case 'r':
+              if (str)
+                g_string_append_c (str, '\r');
+              break;
+
+            case 't':
+              if (str)
+                g_string_append_c (str, '\t');
+              break;
+
+            case 'u':
               {
-                JsonObject *obj = json_object_new ();
-                JsonNode *node;
+                gunichar uc;
 
-                for (i = 0; struct_props[i].name != NULL; i++)
+                if (!lexer_parse_hex4 (lexer, &uc, error))
+                  return FALSE;
+
+                if (uc >= 0xd800 && uc <= 0xdbff)
                   {
-                    JsonNode *val = marshal (obj, struct_props[i].name,
-                                             G_STRUCT_MEMBER_P (structv[j], struct_props[i].offset),
-                                             struct_props[i].type, struct_props[i].type_data, struct_props[i].flags);
+                    gunichar low;
 
-                    if (val == NULL)
-                      continue;
+                    if (lexer->p + 2 > lexer->end ||
+                        lexer->p[0] != '\\' || lexer->p[1] != 'u')
+                      return lexer_fail (lexer, error, "Missing low surrogate in string");
+                    lexer->p += 2;
 
-                    json_object_set_member (obj, struct_props[i].name, val);
+                    if (!lexer_parse_hex4 (lexer, &low, error))
+                      return FALSE;
+
+                    if (low < 0xdc00 || low > 0xdfff)
+                      return lexer_fail (lexer, error, "Invalid surrogate pair in string");
+
+                    uc = 0x10000 + ((uc - 0xd800) << 10) + (low - 0xdc00);
                   }
+                else if (uc >= 0xdc00 && uc <= 0xdfff)
+                  return lexer_fail (lexer, error, "Invalid surrogate pair in string");
 
-                node = json_node_new (JSON_NODE_OBJECT);
-                json_node_take_object (node, obj);
-                json_array_add_element (array, node);
+                if (str)
+                  g_string_append_unichar (str, uc);
+                break;
               }
 
-            retval = json_node_init_array (json_node_alloc (), array);
-            json_array_unref (array);
-          }
+            default:
+              return lexer_fail (lexer, error, "Invalid escape in string");
+            }
+        }
+      else if (str)
+        g_string_append_c (str, c);
+    }
+
+  if (out)
+    *out = g_string_free (g_steal_pointer (&str), FALSE);
+
+  return TRUE;
+}
+
+static gboolean
+lexer_parse_number (JsonLexer  *lexer,
+                    gboolean   *is_integer,
+                    gint64     *int_value,
+                    GError    **error)
+{
+  char buf[64];
+  gsize len = 0;
+  gboolean integer = TRUE;
+  gboolean seen_digit = FALSE;
+
+  while (lexer->p < lexer->end)
+    {
+      char c = *lexer->p;
 
+      if (g_ascii_isdigit (c))
+        seen_digit = TRUE;
+      else if (c == '.' || c == 'e' || c == 'E')
+        integer = FALSE;
+      else if (c != '-' && c != '+')
         break;
-      }
 
-    case FLATPAK_JSON_PROP_TYPE_STRMAP:
-      {
-        GHashTable *map = *(GHashTable **) src;
+      if (len + 1 < sizeof (buf))
+        buf[len++] = c;
+      lexer->p++;
+    }
 
-        if (map != NULL && g_hash_table_size (map) > 0)
-          {
-            GHashTableIter iter;
-            gpointer _key, _value;
-            JsonObject *object;
+  if (!seen_digit)
+    return lexer_fail (lexer, error, "Invalid number");
 
-            object = json_object_new ();
+  buf[len] = 0;
 
-            g_hash_table_iter_init (&iter, map);
-            while (g_hash_table_iter_next (&iter, &_key, &_value))
-              {
-                const char *key = _key;
-                const char *value = _value;
-                JsonNode *str = json_node_new (JSON_NODE_VALUE);
+  *is_integer = integer;
+  if (integer)
+    *int_value = g_ascii_strtoll (buf, NULL, 10);
 
-                json_node_set_string (str, value);
-                json_object_set_member (object, key, str);
-              }
+  return TRUE;
+}
 
-            retval = json_node_init_object (json_node_alloc (), object);
-            json_object_unref (object);
-          }
-        break;
-      }
+/* Steps to the next member of an object. Returns the member name in
+ * @name_out, positioned just after the ':', or NULL when the closing
+ * brace has been reached. */
+static gboolean
+lexer_next_member (JsonLexer  *lexer,
+                   gboolean   *first,
+                   char      **name_out,
+                   GError    **error)
+{
+  *name_out = NULL;
 
-    case FLATPAK_JSON_PROP_TYPE_BOOLMAP:
-      {
-        char **map = *(char ***) src;
+  if (*first)
+    {
+      if (!lexer_expect (lexer, '{', error))
+        return FALSE;
+      *first = FALSE;
 
-        if (map != NULL && map[0] != NULL)
-          {
-            JsonObject *object;
-            int i;
+      lexer_skip_ws (lexer);
+      if (lexer->p < lexer->end && *lexer->p == '}')
+        {
+          lexer->p++;
+          return TRUE;
+        }
+    }
+  else
+    {
+      lexer_skip_ws (lexer);
+      if (lexer->p >= lexer->end)
+        return lexer_fail (lexer, error, "Unexpected end of input");
 
-            object = json_object_new ();
+      if (*lexer->p == '}')
+        {
+          lexer->p++;
+          return TRUE;
+        }
 
-            for (i = 0; map[i] != NULL; i++)
-              {
-                const char *element = map[i];
-                JsonObject *empty_o = json_object_new ();
-                JsonNode *empty = json_node_init_object (json_node_alloc (), empty_o);
-                json_object_unref (empty_o);
+      if (*lexer->p != ',')
+        return lexer_fail (lexer, error, "Expected ',' or '}'");
+      lexer->p++;
+    }
 
-                json_object_set_member (object, element, empty);
-              }
+  lexer_skip_ws (lexer);
+  if (lexer->p >= lexer->end || *lexer->p != '"')
+    return lexer_fail (lexer, error, "Expected member name");
 
-            retval = json_node_init_object (json_node_alloc (), object);
-            json_object_unref (object);
-          }
-        break;
-      }
+  if (!lexer_parse_string (lexer, name_out, error))
+    return FALSE;
 
-    default:
-      g_assert_not_reached ();
+  if (!lexer_expect (lexer, ':', error))
+    {
+      g_clear_pointer (name_out, g_free);
+      return FALSE;
     }
 
-  return retval;
+  return TRUE;
 }
 
-static void
-marshal_props_for_class (FlatpakJson      *self,
-                         FlatpakJsonClass *class,
-                         JsonObject       *obj)
+/* Steps to the next element of an array, setting @done when the
+ * closing bracket has been reached. */
+static gboolean
+lexer_next_element (JsonLexer  *lexer,
+                    gboolean   *first,
+                    gboolean   *done,
+                    GError    **error)
 {
-  FlatpakJsonProp *props = NULL;
-  int i;
-  gpointer parent_class;
+  *done = FALSE;
 
-  parent_class = g_type_class_peek_parent (class);
-
-  if (FLATPAK_JSON_CLASS (parent_class)->props != NULL)
-    marshal_props_for_class (self,
-                             FLATPAK_JSON_CLASS (parent_class),
-                             obj);
+  if (*first)
+    {
+      if (!lexer_expect (lexer, '[', error))
+        return FALSE;
+      *first = FALSE;
 
-  props = FLATPAK_JSON_CLASS (class)->props;
+      lexer_skip_ws (lexer);
+      if (lexer->p < lexer->end && *lexer->p == ']')
+        {
+          lexer->p++;
+          *done = TRUE;
+        }
+      return TRUE;
+    }
+
+  lexer_skip_ws (lexer);
+  if (lexer->p >= lexer->end)
+    return lexer_fail (lexer, error, "Unexpected end of input");
+
+  if (*lexer->p == ']')
+    {
+      lexer->p++;
+      *done = TRUE;
+      return TRUE;
+    }
+
+  if (*lexer->p != ',')
+    return lexer_fail (lexer, error, "Expected ',' or ']'");
+  lexer->p++;
+
+  return TRUE;
+}
+
+static gboolean
+lexer_skip_value (JsonLexer  *lexer,
+                  int         depth,
+                  GError    **error)
+{
+  gboolean is_integer;
+  gint64 int_value;
+
+  if (depth > JSON_LEXER_MAX_DEPTH)
+    return lexer_fail (lexer, error, "Too deeply nested");
+
+  lexer_skip_ws (lexer);
+  if (lexer->p >= lexer->end)
+    return lexer_fail (lexer, error, "Unexpected end of input");
+
+  switch (*lexer->p)
+    {
+    case '"':
+      return lexer_parse_string (lexer, NULL, error);
+
+    case '{':
+      {
+        gboolean first = TRUE;
+
+        while (TRUE)
+          {
+            g_autofree char *name = NULL;
+
+            if (!lexer_next_member (lexer, &first, &name, error))
+              return FALSE;
+            if (name == NULL)
+              return TRUE;
+
+            if (!lexer_skip_value (lexer, depth + 1, error))
+              return FALSE;
+          }
+      }
+
+    case '[':
+      {
+        gboolean first = TRUE;
+        gboolean done;
+
+        while (TRUE)
+          {
+            if (!lexer_next_element (lexer, &first, &done, error))
+              return FALSE;
+            if (done)
+              return TRUE;
+
+            if (!lexer_skip_value (lexer, depth + 1, error))
+              return FALSE;
+          }
+      }
+
+    case 't':
+      return lexer_match_keyword (lexer, "true", error);
+
+    case 'f':
+      return lexer_match_keyword (lexer, "false", error);
+
+    case 'n':
+      return lexer_match_keyword (lexer, "null", error);
+
+    default:
+      return lexer_parse_number (lexer, &is_integer, &int_value, error);
+    }
+}
+
+static void
+collect_prop_targets (const FlatpakJsonProp *props,
+                      gpointer               dest,
+                      GArray                *targets)
+{
+  int i;
+
+  for (i = 0; props[i].name != NULL; i++)
+    {
+      /* Parent props describe members of the same JSON object, just
+         demarshalled into an embedded struct */
+      if (props[i].type == FLATPAK_JSON_PROP_TYPE_PARENT)
+        collect_prop_targets (props[i].type_data,
+                              G_STRUCT_MEMBER_P (dest, props[i].offset),
+                              targets);
+      else
+        {
+          JsonPropTarget target = { &props[i], G_STRUCT_MEMBER_P (dest, props[i].offset), FALSE };
+          g_array_append_val (targets, target);
+        }
+    }
+}
+
+static gboolean lexer_parse_value_into (JsonLexer             *lexer,
+                                        gpointer               dest,
+                                        const FlatpakJsonProp *prop,
+                                        int                    depth,
+                                        GError               **error);
+
+static gboolean
+lexer_parse_object_into (JsonLexer  *lexer,
+                         GArray     *targets,
+                         gboolean    strict,
+                         int         depth,
+                         GError    **error)
+{
+  gboolean first = TRUE;
+  guint i;
+
+  if (depth > JSON_LEXER_MAX_DEPTH)
+    return lexer_fail (lexer, error, "Too deeply nested");
+
+  while (TRUE)
+    {
+      g_autofree char *name = NULL;
+      JsonPropTarget *target = NULL;
+
+      if (!lexer_next_member (lexer, &first, &name, error))
+        return FALSE;
+      if (name == NULL)
+        break;
+
+      for (i = 0; i < targets->len; i++)
+        {
+          JsonPropTarget *t = &g_array_index (targets, JsonPropTarget, i);
+
+          if (strcmp (t->prop->name, name) == 0)
+            {
+              target = t;
+              break;
+            }
+        }
+
+      if (target != NULL)
+        {
+          target->seen = TRUE;
+          if (!lexer_parse_value_into (lexer, target->dest, target->prop, depth + 1, error))
+            return FALSE;
+
+          if (lexer->stopped)
+            return TRUE;
+        }
+      else if (strict)
+        return flatpak_fail (error, "Unknown property named %s", name);
+      else if (!lexer_skip_value (lexer, depth + 1, error))
+        return FALSE;
+    }
+
+  for (i = 0; i < targets->len; i++)
+    {
+      JsonPropTarget *t = &g_array_index (targets, JsonPropTarget, i);
+
+      if ((t->prop->flags & FLATPAK_JSON_PROP_FLAGS_MANDATORY) != 0 && !t->seen)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "No value for mandatory property %s", t->prop->name);
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+static gboolean
+lexer_parse_struct (JsonLexer             *lexer,
+                    gpointer               dest,
+                    const FlatpakJsonProp *struct_props,
+                    int                    depth,
+                    GError               **error)
+{
+  g_autoptr(GArray) targets = g_array_new (FALSE, FALSE, sizeof (JsonPropTarget));
+  gboolean strict = (struct_props->flags & FLATPAK_JSON_PROP_FLAGS_STRICT) != 0;
+
+  collect_prop_targets (struct_props, dest, targets);
+
+  return lexer_parse_object_into (lexer, targets, strict, depth, error);
+}
+
+static gboolean
+lexer_parse_value_into (JsonLexer             *lexer,
+                        gpointer               dest,
+                        const FlatpakJsonProp *prop,
+                        int                    depth,
+                        GError               **error)
+{
+  if (depth > JSON_LEXER_MAX_DEPTH)
+    return lexer_fail (lexer, error, "Too deeply nested");
+
+  lexer_skip_ws (lexer);
+  if (lexer->p >= lexer->end)
+    return lexer_fail (lexer, error, "Unexpected end of input");
+
+  /* null leaves the field untouched, like the node based path */
+  if (*lexer->p == 'n')
+    return lexer_match_keyword (lexer, "null", error);
+
+  switch (prop->type)
+    {
+    case FLATPAK_JSON_PROP_TYPE_STRING:
+      {
+        g_autofree char *str = NULL;
+
+        if (*lexer->p != '"')
+          {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         "Expecting string for property %s", prop->name);
+            return FALSE;
+          }
+
+        if (!lexer_parse_string (lexer, &str, error))
+          return FALSE;
+
+        g_free (*(char **) dest);
+        *(char **) dest = g_steal_pointer (&str);
+        break;
+      }
+
+    case FLATPAK_JSON_PROP_TYPE_INT64:
+      {
+        gboolean is_integer;
+        gint64 int_value;
+
+        if ((*lexer->p != '-' && !g_ascii_isdigit (*lexer->p)) ||
+            !lexer_parse_number (lexer, &is_integer, &int_value, error))
+          {
+            g_clear_error (error);
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         "Expecting int64 for property %s", prop->name);
+            return FALSE;
+          }
+
+        if (!is_integer)
+          {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         "Expecting int64 for property %s", prop->name);
+            return FALSE;
+          }
+
+        *(gint64 *) dest = int_value;
+        break;
+      }
+
+    case FLATPAK_JSON_PROP_TYPE_BOOL:
+      if (*lexer->p == 't')
+        {
+          if (!lexer_match_keyword (lexer, "true", error))
+            return FALSE;
+          *(gboolean *) dest = TRUE;
+        }
+      else if (*lexer->p == 'f')
+        {
+          if (!lexer_match_keyword (lexer, "false", error))
+            return FALSE;
+          *(gboolean *) dest = FALSE;
+        }
+      else
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Expecting bool for property %s", prop->name);
+          return FALSE;
+        }
+      break;
+
+    case FLATPAK_JSON_PROP_TYPE_STRV:
+      {
+        g_autoptr(GPtrArray) str_array = g_ptr_array_new_with_free_func (g_free);
+        gboolean first = TRUE;
+        gboolean done;
+
+        if (*lexer->p != '[')
+          {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         "Expecting array for property %s", prop->name);
+            return FALSE;
+          }
+
+        while (TRUE)
+          {
+            if (!lexer_next_element (lexer, &first, &done, error))
+              return FALSE;
+            if (done)
+              break;
+
+            lexer_skip_ws (lexer);
+            if (lexer->p < lexer->end && *lexer->p == '"')
+              {
+                char *str;
+
+                if (!lexer_parse_string (lexer, &str, error))
+                  return FALSE;
+                g_ptr_array_add (str_array, str);
+              }
+            else
+              {
+                /* Non-string elements are ignored, like the node based path */
+                if (!lexer_skip_value (lexer, depth + 1, error))
+                  return FALSE;
+              }
+          }
+
+        g_ptr_array_add (str_array, NULL);
+        g_strfreev (*(char ***) dest);
+        *(char ***) dest = (char **) g_ptr_array_free (g_steal_pointer (&str_array), FALSE);
+        break;
+      }
+
+    case FLATPAK_JSON_PROP_TYPE_STRUCT:
+      if (*lexer->p != '{')
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Expecting object for property %s", prop->name);
+          return FALSE;
+        }
+      return lexer_parse_struct (lexer, dest, prop->type_data, depth + 1, error);
+
+    case FLATPAK_JSON_PROP_TYPE_STRUCTV:
+      {
+        g_autoptr(GPtrArray) obj_array = g_ptr_array_new ();
+        gboolean first = TRUE;
+        gboolean done;
+        gboolean res = TRUE;
+
+        if (*lexer->p != '[')
+          {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         "Expecting array for property %s", prop->name);
+            return FALSE;
+          }
+
+        while (TRUE)
+          {
+            gpointer new_element;
+
+            if (!lexer_next_element (lexer, &first, &done, error))
+              {
+                res = FALSE;
+                break;
+              }
+            if (done)
+              break;
+
+            lexer_skip_ws (lexer);
+            if (lexer->p >= lexer->end || *lexer->p != '{')
+              {
+                g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Expecting object elemen for property %s", prop->name);
+                res = FALSE;
+                break;
+              }
+
+            new_element = g_malloc0 ((gsize) prop->type_data2);
+            g_ptr_array_add (obj_array, new_element);
+
+            if (!lexer_parse_struct (lexer, new_element, prop->type_data, depth + 1, error))
+              {
+                res = FALSE;
+                break;
+              }
+
+            if (lexer->stop != NULL && !lexer->stopped &&
+                lexer->stop (new_element, lexer->stop_data))
+              lexer->stopped = TRUE;
+
+            if (lexer->stopped)
+              break;
+          }
+
+        /* NULL terminate */
+        g_ptr_array_add (obj_array, NULL);
+
+        /* We always set the array, even if it is partial, because we don't know how
+           to free what we demarshalled so far */
+        *(gpointer *) dest = (gpointer *) g_ptr_array_free (g_steal_pointer (&obj_array), FALSE);
+        return res;
+      }
+
+    case FLATPAK_JSON_PROP_TYPE_STRMAP:
+      {
+        g_autoptr(GHashTable) h = NULL;
+        gboolean first = TRUE;
+
+        if (*lexer->p != '{')
+          {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         "Expecting object for property %s", prop->name);
+            return FALSE;
+          }
+
+        h = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+        while (TRUE)
+          {
+            g_autofree char *member_name = NULL;
+            char *val_str;
+
+            if (!lexer_next_member (lexer, &first, &member_name, error))
+              return FALSE;
+            if (member_name == NULL)
+              break;
+
+            lexer_skip_ws (lexer);
+            if (lexer->p >= lexer->end || *lexer->p != '"')
+              {
+                g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Wrong type for string member %s", member_name);
+                return FALSE;
+              }
+
+            if (!lexer_parse_string (lexer, &val_str, error))
+              return FALSE;
+
+            g_hash_table_insert (h, g_steal_pointer (&member_name), val_str);
+          }
+
+        if (*(GHashTable **) dest)
+          g_hash_table_unref (*(GHashTable **) dest);
+        *(GHashTable **) dest = g_steal_pointer (&h);
+        break;
+      }
+
+    case FLATPAK_JSON_PROP_TYPE_BOOLMAP:
+      {
+        g_autoptr(GPtrArray) res = g_ptr_array_new_with_free_func (g_free);
+        gboolean first = TRUE;
+
+        if (*lexer->p != '{')
+          {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         "Expecting object for property %s", prop->name);
+            return FALSE;
+          }
+
+        while (TRUE)
+          {
+            g_autofree char *member_name = NULL;
+
+            if (!lexer_next_member (lexer, &first, &member_name, error))
+              return FALSE;
+            if (member_name == NULL)
+              break;
+
+            g_ptr_array_add (res, g_steal_pointer (&member_name));
+
+            if (!lexer_skip_value (lexer, depth + 1, error))
+              return FALSE;
+          }
+
+        g_ptr_array_add (res, NULL);
+
+        g_strfreev (*(char ***) dest);
+        *(char ***) dest = (char **) g_ptr_array_free (g_steal_pointer (&res), FALSE);
+        break;
+      }
+
+    default:
+      g_assert_not_reached ();
+    }
+
+  return TRUE;
+}
+
+static FlatpakJson *
+flatpak_json_from_data (const char          *data,
+                        gsize                len,
+                        GType                type,
+                        FlatpakJsonStopFunc  stop,
+                        gpointer             stop_data,
+                        GError             **error)
+{
+  g_autoptr(FlatpakJson) json = NULL;
+  g_autoptr(GArray) targets = g_array_new (FALSE, FALSE, sizeof (JsonPropTarget));
+  JsonLexer lexer = { data, data + len, data, FALSE, stop, stop_data };
+  gpointer class;
+
+  /* Skip a byte order mark, like json-glib does */
+  if (len >= 3 && memcmp (data, "\xef\xbb\xbf", 3) == 0)
+    lexer.p += 3;
+
+  lexer_skip_ws (&lexer);
+  if (lexer.p >= lexer.end || *lexer.p != '{')
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Expecting a JSON object");
+      return NULL;
+    }
+
+  json = g_object_new (type, NULL);
+
+  class = FLATPAK_JSON_GET_CLASS (json);
+  while (FLATPAK_JSON_CLASS (class)->props != NULL)
+    {
+      collect_prop_targets (FLATPAK_JSON_CLASS (class)->props, json, targets);
+      class = g_type_class_peek_parent (class);
+    }
+
+  if (!lexer_parse_object_into (&lexer, targets, FALSE, 0, error))
+    return NULL;
+
+  if (!lexer.stopped)
+    {
+      lexer_skip_ws (&lexer);
+      if (lexer.p != lexer.end)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Unexpected data after JSON object");
+          return NULL;
+        }
+    }
+
+  return g_steal_pointer (&json);
+}
+
+FlatpakJson *
+flatpak_json_from_bytes (GBytes  *bytes,
+                         GType    type,
+                         GError **error)
+{
+  return flatpak_json_from_data (g_bytes_get_data (bytes, NULL),
+                                 g_bytes_get_size (bytes),
+                                 type, NULL, NULL, error);
+}
+
+/* Like flatpak_json_from_bytes, but calls @stop for each demarshalled
+ * array-of-struct element and abandons the rest of the parse once it
+ * returns TRUE. The result then only contains the elements seen so far
+ * and the remainder of the document is neither read nor validated. */
+FlatpakJson *
+flatpak_json_from_bytes_partial (GBytes              *bytes,
+                                 GType                type,
+                                 FlatpakJsonStopFunc  stop,
+                                 gpointer             user_data,
+                                 GError             **error)
+{
+  return flatpak_json_from_data (g_bytes_get_data (bytes, NULL),
+                                 g_bytes_get_size (bytes),
+                                 type, stop, user_data, error);
+}
+
+FlatpakJson *
+flatpak_json_from_stream (GInputStream *stream,
+                          GType         type,
+                          GCancellable *cancellable,
+                          GError      **error)
+{
+  g_autoptr(JsonParser) parser = NULL;
+  JsonNode *root = NULL;
+
+  parser = json_parser_new ();
+  if (!json_parser_load_from_stream (parser,
+                                     stream,
+                                     cancellable,
+                                     error))
+    return NULL;
+
+  root = json_parser_get_root (parser);
+
+  return flatpak_json_from_node (root, type, error);
+}
+
+static JsonNode *
+marshal (JsonObject          *parent,
+         const char          *name,
+         gpointer             src,
+         FlatpakJsonPropType  type,
+         gpointer             type_data,
+         FlatpakJsonPropFlags flags)
+{
+  JsonNode *retval = NULL;
+
+  switch (type)
+    {
+    case FLATPAK_JSON_PROP_TYPE_STRING:
+      {
+        const char *str = *(const char **) src;
+        if (str != NULL)
+          retval = json_node_init_string (json_node_alloc (), str);
+        break;
+      }
+
+    case FLATPAK_JSON_PROP_TYPE_INT64:
+      {
+        retval = json_node_init_int (json_node_alloc (), *(gint64 *) src);
+        break;
+      }
+
+    case FLATPAK_JSON_PROP_TYPE_BOOL:
+      {
+        gboolean val = *(gboolean *) src;
+        if (val)
+          retval = json_node_init_boolean (json_node_alloc (), val);
+        break;
+      }
+
+    case FLATPAK_JSON_PROP_TYPE_STRV:
+      {
+        char **strv = *(char ***) src;
+        int i;
+        JsonArray *array;
+
+        if (strv != NULL && strv[0] != NULL)
+          {
+            array = json_array_sized_new (g_strv_length (strv));
+            for (i = 0; strv[i] != NULL; i++)
+              {
+                JsonNode *str = json_node_new (JSON_NODE_VALUE);
+
+                json_node_set_string (str, strv[i]);
+                json_array_add_element (array, str);
+              }
+
+            retval = json_node_init_array (json_node_alloc (), array);
+            json_array_unref (array);
+          }
+        break;
+      }
+
+    case FLATPAK_JSON_PROP_TYPE_PARENT:
+    case FLATPAK_JSON_PROP_TYPE_STRUCT:
+      {
+        FlatpakJsonProp *struct_props = type_data;
+        JsonObject *obj;
+        int i;
+        gboolean empty = TRUE;
+
+        if (type == FLATPAK_JSON_PROP_TYPE_PARENT)
+          obj = parent;
+        else
+          obj = json_object_new ();
+
+        for (i = 0; struct_props[i].name != NULL; i++)
+          {
+            JsonNode *val = marshal (obj, struct_props[i].name,
+                                     G_STRUCT_MEMBER_P (src, struct_props[i].offset),
+                                     struct_props[i].type, struct_props[i].type_data, struct_props[i].flags);
+
+            if (val == NULL)
+              continue;
+
+            empty = FALSE;
+            json_object_set_member (obj, struct_props[i].name, val);
+          }
+
+        if (type != FLATPAK_JSON_PROP_TYPE_PARENT)
+          {
+            if (!empty || (flags & FLATPAK_JSON_PROP_FLAGS_OPTIONAL) == 0)
+              {
+                retval = json_node_new (JSON_NODE_OBJECT);
+                json_node_take_object (retval, obj);
+              }
+            else
+              json_object_unref (obj);
+          }
+        break;
+      }
+
+    case FLATPAK_JSON_PROP_TYPE_STRUCTV:
+      {
+        FlatpakJsonProp *struct_props = type_data;
+        gpointer *structv = *(gpointer **) src;
+        int i, j;
+        JsonArray *array;
+
+        if (structv != NULL && structv[0] != NULL)
+          {
+            array = json_array_new ();
+            for (j = 0; structv[j] != NULL; j++)
+              {
+                JsonObject *obj = json_object_new ();
+                JsonNode *node;
+
+                for (i = 0; struct_props[i].name != NULL; i++)
+                  {
+                    JsonNode *val = marshal (obj, struct_props[i].name,
+                                             G_STRUCT_MEMBER_P (structv[j], struct_props[i].offset),
+                                             struct_props[i].type, struct_props[i].type_data, struct_props[i].flags);
+
+                    if (val == NULL)
+                      continue;
+
+                    json_object_set_member (obj, struct_props[i].name, val);
+                  }
+
+                node = json_node_new (JSON_NODE_OBJECT);
+                json_node_take_object (node, obj);
+                json_array_add_element (array, node);
+              }
+
+            retval = json_node_init_array (json_node_alloc (), array);
+            json_array_unref (array);
+          }
+
+        break;
+      }
+
+    case FLATPAK_JSON_PROP_TYPE_STRMAP:
+      {
+        GHashTable *map = *(GHashTable **) src;
+
+        if (map != NULL && g_hash_table_size (map) > 0)
+          {
+            GHashTableIter iter;
+            gpointer _key, _value;
+            JsonObject *object;
+
+            object = json_object_new ();
+
+            g_hash_table_iter_init (&iter, map);
+            while (g_hash_table_iter_next (&iter, &_key, &_value))
+              {
+                const char *key = _key;
+                const char *value = _value;
+                JsonNode *str = json_node_new (JSON_NODE_VALUE);
+
+                json_node_set_string (str, value);
+                json_object_set_member (object, key, str);
+              }
+
+            retval = json_node_init_object (json_node_alloc (), object);
+            json_object_unref (object);
+          }
+        break;
+      }
+
+    case FLATPAK_JSON_PROP_TYPE_BOOLMAP:
+      {
+        char **map = *(char ***) src;
+
+        if (map != NULL && map[0] != NULL)
+          {
+            JsonObject *object;
+            int i;
+
+            object = json_object_new ();
+
+            for (i = 0; map[i] != NULL; i++)
+              {
+                const char *element = map[i];
+                JsonObject *empty_o = json_object_new ();
+                JsonNode *empty = json_node_init_object (json_node_alloc (), empty_o);
+                json_object_unref (empty_o);
+
+                json_object_set_member (object, element, empty);
+              }
+
+            retval = json_node_init_object (json_node_alloc (), object);
+            json_object_unref (object);
+          }
+        break;
+      }
+
+    default:
+      g_assert_not_reached ();
+    }
+
+  return retval;
+}
+
+static void
+marshal_props_for_class (FlatpakJson      *self,
+                         FlatpakJsonClass *class,
+                         JsonObject       *obj)
+{
+  FlatpakJsonProp *props = NULL;
+  int i;
+  gpointer parent_class;
+
+  parent_class = g_type_class_peek_parent (class);
+
+  if (FLATPAK_JSON_CLASS (parent_class)->props != NULL)
+    marshal_props_for_class (self,
+                             FLATPAK_JSON_CLASS (parent_class),
+                             obj);
+
+  props = FLATPAK_JSON_CLASS (class)->props;
   for (i = 0; props[i].name != NULL; i++)
     {
       JsonNode *val = marshal (obj, props[i].name,
@@ -640,19 +1529,340 @@ flatpak_json_to_node (FlatpakJson *self)
   return retval;
 }
 
+/* Direct serialization driven by the same prop tables, writing the
+ * JSON text straight into a string instead of first building a
+ * JsonNode tree for JsonGenerator to walk. This matters when
+ * serializing many manifests in a row, e.g. while mirroring a
+ * registry. The output keeps the pretty-printed layout the generator
+ * used to produce. */
+
+static void
+json_append_escaped (GString *str, const char *s)
+{
+  g_string_append_c (str, '"');
+  for (; *s != 0; s++)
+    {
+      guchar c = *s;
+
+      switch (c)
+        {
+        case '"':
+          g_string_append (str, "\\\"");
+          break;
+
+        case '\\':
+          g_string_append (str, "\\\\");
+          break;
+
+        case '\b':
+          g_string_append (str, "\\b");
+          break;
+
+        case '\f':
+          g_string_append (str, "\\f");
+          break;
+
+        case '\n':
+          g_string_append (str, "\\n");
+          break;
+
+        case '\r':
+          g_string_append (str, "\\r");
+          break;
+
+        case '\t':
+          g_string_append (str, "\\t");
+          break;
+
+        default:
+          if (c < 0x20)
+            g_string_append_printf (str, "\\u%04x", c);
+          else
+            g_string_append_c (str, c);
+        }
+    }
+  g_string_append_c (str, '"');
+}
+
+static void
+json_append_indent (GString *str, int indent)
+{
+  int i;
+
+  for (i = 0; i < indent; i++)
+    g_string_append_c (str, ' ');
+}
+
+static gboolean struct_is_empty (gpointer               src,
+                                 const FlatpakJsonProp *props);
+
+/* Whether the member would be omitted from the output, mirroring the
+ * cases where marshal() returns no node */
+static gboolean
+prop_is_empty (gpointer               src,
+               const FlatpakJsonProp *prop)
+{
+  switch (prop->type)
+    {
+    case FLATPAK_JSON_PROP_TYPE_STRING:
+      return *(char **) src == NULL;
+
+    case FLATPAK_JSON_PROP_TYPE_INT64:
+      return FALSE;
+
+    case FLATPAK_JSON_PROP_TYPE_BOOL:
+      return !*(gboolean *) src;
+
+    case FLATPAK_JSON_PROP_TYPE_STRV:
+    case FLATPAK_JSON_PROP_TYPE_BOOLMAP:
+      {
+        char **strv = *(char ***) src;
+        return strv == NULL || strv[0] == NULL;
+      }
+
+    case FLATPAK_JSON_PROP_TYPE_STRUCTV:
+      {
+        gpointer *structv = *(gpointer **) src;
+        return structv == NULL || structv[0] == NULL;
+      }
+
+    case FLATPAK_JSON_PROP_TYPE_STRMAP:
+      {
+        GHashTable *map = *(GHashTable **) src;
+        return map == NULL || g_hash_table_size (map) == 0;
+      }
+
+    case FLATPAK_JSON_PROP_TYPE_PARENT:
+      return struct_is_empty (src, prop->type_data);
+
+    case FLATPAK_JSON_PROP_TYPE_STRUCT:
+      if (!struct_is_empty (src, prop->type_data))
+        return FALSE;
+      return (prop->flags & FLATPAK_JSON_PROP_FLAGS_OPTIONAL) != 0;
+
+    default:
+      g_assert_not_reached ();
+    }
+}
+
+static gboolean
+struct_is_empty (gpointer               src,
+                 const FlatpakJsonProp *props)
+{
+  int i;
+
+  for (i = 0; props[i].name != NULL; i++)
+    {
+      if (!prop_is_empty (G_STRUCT_MEMBER_P (src, props[i].offset), &props[i]))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void marshal_struct_to_string (GString               *str,
+                                      gpointer               src,
+                                      const FlatpakJsonProp *props,
+                                      int                    indent,
+                                      gboolean              *first);
+
+static void
+marshal_value_to_string (GString               *str,
+                         gpointer               src,
+                         const FlatpakJsonProp *prop,
+                         int                    indent)
+{
+  switch (prop->type)
+    {
+    case FLATPAK_JSON_PROP_TYPE_STRING:
+      json_append_escaped (str, *(const char **) src);
+      break;
+
+    case FLATPAK_JSON_PROP_TYPE_INT64:
+      g_string_append_printf (str, "%" G_GINT64_FORMAT, *(gint64 *) src);
+      break;
+
+    case FLATPAK_JSON_PROP_TYPE_BOOL:
+      g_string_append (str, *(gboolean *) src ? "true" : "false");
+      break;
+
+    case FLATPAK_JSON_PROP_TYPE_STRV:
+      {
+        char **strv = *(char ***) src;
+        int i;
+
+        g_string_append_c (str, '[');
+        for (i = 0; strv[i] != NULL; i++)
+          {
+            if (i > 0)
+              g_string_append_c (str, ',');
+            g_string_append_c (str, '\n');
+            json_append_indent (str, indent + 2);
+            json_append_escaped (str, strv[i]);
+          }
+        g_string_append_c (str, '\n');
+        json_append_indent (str, indent);
+        g_string_append_c (str, ']');
+        break;
+      }
+
+    case FLATPAK_JSON_PROP_TYPE_STRUCT:
+      {
+        gboolean first = TRUE;
+
+        g_string_append_c (str, '{');
+        marshal_struct_to_string (str, src, prop->type_data, indent + 2, &first);
+        if (!first)
+          {
+            g_string_append_c (str, '\n');
+            json_append_indent (str, indent);
+          }
+        g_string_append_c (str, '}');
+        break;
+      }
+
+    case FLATPAK_JSON_PROP_TYPE_STRUCTV:
+      {
+        gpointer *structv = *(gpointer **) src;
+        int j;
+
+        g_string_append_c (str, '[');
+        for (j = 0; structv[j] != NULL; j++)
+          {
+            gboolean first = TRUE;
+
+            if (j > 0)
+              g_string_append_c (str, ',');
+            g_string_append_c (str, '\n');
+            json_append_indent (str, indent + 2);
+            g_string_append_c (str, '{');
+            marshal_struct_to_string (str, structv[j], prop->type_data, indent + 4, &first);
+            if (!first)
+              {
+                g_string_append_c (str, '\n');
+                json_append_indent (str, indent + 2);
+              }
+            g_string_append_c (str, '}');
+          }
+        g_string_append_c (str, '\n');
+        json_append_indent (str, indent);
+        g_string_append_c (str, ']');
+        break;
+      }
+
+    case FLATPAK_JSON_PROP_TYPE_STRMAP:
+      {
+        GHashTable *map = *(GHashTable **) src;
+        GHashTableIter iter;
+        gpointer key, value;
+        gboolean first = TRUE;
+
+        g_string_append_c (str, '{');
+        g_hash_table_iter_init (&iter, map);
+        while (g_hash_table_iter_next (&iter, &key, &value))
+          {
+            if (!first)
+              g_string_append_c (str, ',');
+            g_string_append_c (str, '\n');
+            json_append_indent (str, indent + 2);
+            json_append_escaped (str, key);
+            g_string_append (str, " : ");
+            json_append_escaped (str, value);
+            first = FALSE;
+          }
+        g_string_append_c (str, '\n');
+        json_append_indent (str, indent);
+        g_string_append_c (str, '}');
+        break;
+      }
+
+    case FLATPAK_JSON_PROP_TYPE_BOOLMAP:
+      {
+        char **map = *(char ***) src;
+        int i;
+
+        g_string_append_c (str, '{');
+        for (i = 0; map[i] != NULL; i++)
+          {
+            if (i > 0)
+              g_string_append_c (str, ',');
+            g_string_append_c (str, '\n');
+            json_append_indent (str, indent + 2);
+            json_append_escaped (str, map[i]);
+            g_string_append (str, " : {}");
+          }
+        g_string_append_c (str, '\n');
+        json_append_indent (str, indent);
+        g_string_append_c (str, '}');
+        break;
+      }
+
+    default:
+      g_assert_not_reached ();
+    }
+}
+
+static void
+marshal_struct_to_string (GString               *str,
+                          gpointer               src,
+                          const FlatpakJsonProp *props,
+                          int                    indent,
+                          gboolean              *first)
+{
+  int i;
+
+  for (i = 0; props[i].name != NULL; i++)
+    {
+      gpointer member = G_STRUCT_MEMBER_P (src, props[i].offset);
+
+      if (props[i].type == FLATPAK_JSON_PROP_TYPE_PARENT)
+        {
+          marshal_struct_to_string (str, member, props[i].type_data, indent, first);
+          continue;
+        }
+
+      if (prop_is_empty (member, &props[i]))
+        continue;
+
+      if (!*first)
+        g_string_append_c (str, ',');
+      g_string_append_c (str, '\n');
+      json_append_indent (str, indent);
+      json_append_escaped (str, props[i].name);
+      g_string_append (str, " : ");
+      marshal_value_to_string (str, member, &props[i], indent);
+      *first = FALSE;
+    }
+}
+
+static void
+marshal_class_to_string (FlatpakJson      *self,
+                         FlatpakJsonClass *class,
+                         GString          *str,
+                         gboolean         *first)
+{
+  gpointer parent_class = g_type_class_peek_parent (class);
+
+  if (FLATPAK_JSON_CLASS (parent_class)->props != NULL)
+    marshal_class_to_string (self,
+                             FLATPAK_JSON_CLASS (parent_class),
+                             str, first);
+
+  marshal_struct_to_string (str, self, class->props, 2, first);
+}
+
 GBytes *
 flatpak_json_to_bytes (FlatpakJson *self)
 {
-  g_autoptr(JsonNode) node = NULL;
-  g_autoptr(JsonGenerator) generator = NULL;
-  char *str;
-
-  node = flatpak_json_to_node (FLATPAK_JSON (self));
+  GString *str = g_string_new ("{");
+  gboolean first = TRUE;
+  gsize len;
 
-  generator = json_generator_new ();
-  json_generator_set_pretty (generator, TRUE);
-  json_generator_set_root (generator, node);
+  marshal_class_to_string (self, FLATPAK_JSON_GET_CLASS (self), str, &first);
+  if (!first)
+    g_string_append_c (str, '\n');
+  g_string_append_c (str, '}');
 
-  str = json_generator_to_data (generator, NULL);
-  return g_bytes_new_take (str, strlen (str));
+  len = str->len;
+  return g_bytes_new_take (g_string_free (str, FALSE), len);
 }
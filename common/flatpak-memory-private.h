@@ -0,0 +1,50 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#ifndef __FLATPAK_MEMORY_H__
+#define __FLATPAK_MEMORY_H__
+
+#include <glib.h>
+
+/* Lightweight per-subsystem memory accounting, so that a resident
+ * memory regression can be attributed (is it cached summaries,
+ * appstream data, parsed OCI json or transaction state?) without a
+ * heap profiler run. The known-large allocation sites pair
+ * flatpak_memory_alloc()/flatpak_memory_free() calls around the data
+ * they hold; counters are a few atomic-ish additions under a lock, so
+ * the accounting is always on. Set FLATPAK_MEM_STATS to get the
+ * report dumped to stderr at exit. */
+
+typedef enum {
+  FLATPAK_MEMORY_SUMMARY,
+  FLATPAK_MEMORY_APPSTREAM,
+  FLATPAK_MEMORY_JSON_OCI,
+  FLATPAK_MEMORY_TRANSACTION,
+  FLATPAK_MEMORY_REMOTE_REF,
+  FLATPAK_MEMORY_LAST,
+} FlatpakMemorySubsystem;
+
+void  flatpak_memory_alloc  (FlatpakMemorySubsystem subsystem,
+                             gint64                 bytes);
+void  flatpak_memory_free   (FlatpakMemorySubsystem subsystem,
+                             gint64                 bytes);
+char *flatpak_memory_report (void);
+
+#endif /* __FLATPAK_MEMORY_H__ */
@@ -0,0 +1,127 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "flatpak-memory-private.h"
+
+typedef struct
+{
+  gint64 live_bytes;
+  gint64 peak_bytes;
+  gint64 total_bytes;
+  gint64 live_count;
+  gint64 total_count;
+} MemoryCounter;
+
+static const char *subsystem_names[FLATPAK_MEMORY_LAST] = {
+  "summary",
+  "appstream",
+  "json-oci",
+  "transaction",
+  "remote-ref",
+};
+
+static MemoryCounter counters[FLATPAK_MEMORY_LAST];
+G_LOCK_DEFINE_STATIC (memory);
+
+static void
+dump_at_exit (void)
+{
+  g_autofree char *report = flatpak_memory_report ();
+
+  g_printerr ("%s", report);
+}
+
+static void
+maybe_register_dump (void)
+{
+  static gsize registered = 0;
+
+  if (g_once_init_enter (&registered))
+    {
+      if (g_getenv ("FLATPAK_MEM_STATS") != NULL)
+        atexit (dump_at_exit);
+      g_once_init_leave (&registered, 1);
+    }
+}
+
+void
+flatpak_memory_alloc (FlatpakMemorySubsystem subsystem,
+                      gint64                 bytes)
+{
+  MemoryCounter *counter = &counters[subsystem];
+
+  maybe_register_dump ();
+
+  G_LOCK (memory);
+  counter->live_bytes += bytes;
+  counter->total_bytes += bytes;
+  counter->live_count += 1;
+  counter->total_count += 1;
+  if (counter->live_bytes > counter->peak_bytes)
+    counter->peak_bytes = counter->live_bytes;
+  G_UNLOCK (memory);
+}
+
+void
+flatpak_memory_free (FlatpakMemorySubsystem subsystem,
+                     gint64                 bytes)
+{
+  MemoryCounter *counter = &counters[subsystem];
+
+  G_LOCK (memory);
+  counter->live_bytes -= bytes;
+  counter->live_count -= 1;
+  G_UNLOCK (memory);
+}
+
+/* One line per subsystem plus a process total, machine greppable */
+char *
+flatpak_memory_report (void)
+{
+  GString *s = g_string_new ("");
+  struct rusage ru;
+  int i;
+
+  G_LOCK (memory);
+  for (i = 0; i < FLATPAK_MEMORY_LAST; i++)
+    {
+      MemoryCounter *counter = &counters[i];
+
+      g_string_append_printf (s,
+                              "FLATPAK_MEM_STATS: subsystem=%s live_bytes=%" G_GINT64_FORMAT
+                              " peak_bytes=%" G_GINT64_FORMAT " total_bytes=%" G_GINT64_FORMAT
+                              " live_count=%" G_GINT64_FORMAT " total_count=%" G_GINT64_FORMAT "\n",
+                              subsystem_names[i],
+                              counter->live_bytes, counter->peak_bytes, counter->total_bytes,
+                              counter->live_count, counter->total_count);
+    }
+  G_UNLOCK (memory);
+
+  getrusage (RUSAGE_SELF, &ru);
+  g_string_append_printf (s, "FLATPAK_MEM_STATS: max_rss_kb=%ld\n", ru.ru_maxrss);
+
+  return g_string_free (s, FALSE);
+}
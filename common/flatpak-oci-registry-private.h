@@ -61,9 +61,17 @@ FlatpakOciRegistry  *  flatpak_oci_registry_new (const char           *uri,
                                                  GCancellable         * cancellable,
                                                  GError              **error);
 const char          *  flatpak_oci_registry_get_uri (FlatpakOciRegistry *self);
+gboolean               flatpak_oci_registry_is_local (FlatpakOciRegistry *self);
+FlatpakOciRegistry  *  flatpak_oci_registry_clone (FlatpakOciRegistry   *self,
+                                                   GCancellable         *cancellable,
+                                                   GError              **error);
 FlatpakOciIndex     *  flatpak_oci_registry_load_index (FlatpakOciRegistry *self,
                                                         GCancellable       *cancellable,
                                                         GError            **error);
+FlatpakOciIndex     *  flatpak_oci_registry_load_index_for_ref (FlatpakOciRegistry *self,
+                                                                const char         *ref,
+                                                                GCancellable       *cancellable,
+                                                                GError            **error);
 gboolean               flatpak_oci_registry_save_index (FlatpakOciRegistry *self,
                                                         FlatpakOciIndex    *index,
                                                         GCancellable       *cancellable,
@@ -105,9 +113,18 @@ FlatpakOciVersioned *  flatpak_oci_registry_load_versioned (FlatpakOciRegistry *
                                                             gsize              *out_size,
                                                             GCancellable       *cancellable,
                                                             GError            **error);
-FlatpakOciLayerWriter *flatpak_oci_registry_write_layer (FlatpakOciRegistry *self,
-                                                         GCancellable       *cancellable,
-                                                         GError            **error);
+typedef enum {
+  FLATPAK_OCI_LAYER_COMPRESSION_GZIP,
+  FLATPAK_OCI_LAYER_COMPRESSION_ZSTD,
+} FlatpakOciLayerCompression;
+
+FlatpakOciLayerCompression flatpak_oci_layer_compression_from_string (const char *str,
+                                                                      GError    **error);
+
+FlatpakOciLayerWriter *flatpak_oci_registry_write_layer (FlatpakOciRegistry        *self,
+                                                         FlatpakOciLayerCompression compression,
+                                                         GCancellable              *cancellable,
+                                                         GError                   **error);
 
 struct archive *flatpak_oci_layer_writer_get_archive (FlatpakOciLayerWriter *self);
 gboolean        flatpak_oci_layer_writer_close (FlatpakOciLayerWriter *self,
@@ -116,10 +133,10 @@ gboolean        flatpak_oci_layer_writer_close (FlatpakOciLayerWriter *self,
                                                 GCancellable          *cancellable,
                                                 GError               **error);
 
-gboolean flatpak_archive_read_open_fd_with_checksum (struct archive *a,
-                                                     int             fd,
-                                                     GChecksum      *checksum,
-                                                     GError        **error);
+gboolean flatpak_archive_read_open_fd_with_checksum (struct archive  *a,
+                                                     int              fd,
+                                                     FlatpakChecksum *checksum,
+                                                     GError         **error);
 
 GBytes *flatpak_oci_sign_data (GBytes       *data,
                                const gchar **okey_ids,
@@ -20,6 +20,8 @@
 
 #include "config.h"
 
+#include <sys/ioctl.h>
+
 #include <glib/gi18n-lib.h>
 #include <gio/gunixoutputstream.h>
 #include <gio/gunixinputstream.h>
@@ -30,6 +32,7 @@
 #include <libsoup/soup.h>
 #include "flatpak-oci-registry-private.h"
 #include "flatpak-utils-private.h"
+#include "flatpak-zstd-compressor-private.h"
 
 G_DEFINE_QUARK (flatpak_oci_error, flatpak_oci_error)
 
@@ -227,6 +230,26 @@ flatpak_oci_registry_new (const char   *uri,
   return oci_registry;
 }
 
+gboolean
+flatpak_oci_registry_is_local (FlatpakOciRegistry *self)
+{
+  return self->dfd != -1;
+}
+
+/* Creates a private copy of the registry, for use in a worker thread.
+ * The soup session is not thread-safe, so each thread downloading
+ * blobs concurrently needs its own connection state. The tmp dirfd is
+ * shared, so the clone must not outlive @self. */
+FlatpakOciRegistry *
+flatpak_oci_registry_clone (FlatpakOciRegistry *self,
+                            GCancellable       *cancellable,
+                            GError            **error)
+{
+  g_assert (self->valid);
+
+  return flatpak_oci_registry_new (self->uri, FALSE, self->tmp_dfd, cancellable, error);
+}
+
 static int
 local_open_file (int           dfd,
                  const char   *subpath,
@@ -306,8 +329,11 @@ remote_load_file (SoupSession  *soup_session,
     }
 
   uri_s = soup_uri_to_string (uri, FALSE);
+  /* These are small metadata files (index.json, manifests, configs),
+   * so keep them in the shared http cache and revalidate instead of
+   * re-downloading on every enumeration */
   bytes = flatpak_load_http_uri (soup_session,
-                                 uri_s, FLATPAK_HTTP_FLAGS_ACCEPT_OCI,
+                                 uri_s, FLATPAK_HTTP_FLAGS_ACCEPT_OCI | FLATPAK_HTTP_FLAGS_CACHE,
                                  NULL, NULL,
                                  cancellable, error);
   if (bytes == NULL)
@@ -385,6 +411,53 @@ verify_oci_version (GBytes *oci_layout_bytes, gboolean *not_json, GCancellable *
   return TRUE;
 }
 
+/* Process-wide cache of validated oci-layout files, keyed by registry
+ * uri plus the layout file's mtime, so that repeatedly constructing a
+ * registry for the same local dir doesn't re-read and re-parse the
+ * layout every time. The layout practically never changes once written,
+ * and if it does the mtime part of the key no longer matches. */
+static GHashTable *validated_layout_cache; /* key string => unused */
+G_LOCK_DEFINE_STATIC (validated_layout_cache);
+
+static char *
+validated_layout_cache_key (const char *uri,
+                            int         dfd)
+{
+  struct stat st;
+
+  if (fstatat (dfd, "oci-layout", &st, 0) != 0)
+    return NULL;
+
+  return g_strdup_printf ("%s %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT,
+                          uri,
+                          (guint64) st.st_mtim.tv_sec * G_GINT64_CONSTANT (1000000000) + st.st_mtim.tv_nsec,
+                          (guint64) st.st_size);
+}
+
+static gboolean
+validated_layout_cache_lookup (const char *key)
+{
+  gboolean found;
+
+  G_LOCK (validated_layout_cache);
+  found = key != NULL &&
+          validated_layout_cache != NULL &&
+          g_hash_table_contains (validated_layout_cache, key);
+  G_UNLOCK (validated_layout_cache);
+
+  return found;
+}
+
+static void
+validated_layout_cache_add (char *key)
+{
+  G_LOCK (validated_layout_cache);
+  if (validated_layout_cache == NULL)
+    validated_layout_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_hash_table_add (validated_layout_cache, key);
+  G_UNLOCK (validated_layout_cache);
+}
+
 static gboolean
 flatpak_oci_registry_ensure_local (FlatpakOciRegistry *self,
                                    gboolean            for_write,
@@ -396,6 +469,7 @@ flatpak_oci_registry_ensure_local (FlatpakOciRegistry *self,
   int dfd;
   g_autoptr(GError) local_error = NULL;
   g_autoptr(GBytes) oci_layout_bytes = NULL;
+  g_autofree char *cache_key = NULL;
   gboolean not_json;
 
   if (self->dfd != -1)
@@ -432,6 +506,18 @@ flatpak_oci_registry_ensure_local (FlatpakOciRegistry *self,
         return FALSE;
     }
 
+  if (!for_write)
+    {
+      cache_key = validated_layout_cache_key (self->uri, dfd);
+      if (validated_layout_cache_lookup (cache_key))
+        {
+          if (self->dfd == -1 && local_dfd != -1)
+            self->dfd = glnx_steal_fd (&local_dfd);
+
+          return TRUE;
+        }
+    }
+
   oci_layout_bytes = local_load_file (dfd, "oci-layout", cancellable, &local_error);
   if (oci_layout_bytes == NULL)
     {
@@ -456,6 +542,8 @@ flatpak_oci_registry_ensure_local (FlatpakOciRegistry *self,
     }
   else if (!verify_oci_version (oci_layout_bytes, &not_json, cancellable, error))
     return FALSE;
+  else if (cache_key != NULL)
+    validated_layout_cache_add (g_steal_pointer (&cache_key));
 
   if (self->dfd == -1 && local_dfd != -1)
     self->dfd = glnx_steal_fd (&local_dfd);
@@ -544,6 +632,40 @@ flatpak_oci_registry_load_index (FlatpakOciRegistry *self,
   return (FlatpakOciIndex *) flatpak_json_from_bytes (bytes, FLATPAK_TYPE_OCI_INDEX, error);
 }
 
+static gboolean
+index_stop_at_ref (gpointer element,
+                   gpointer user_data)
+{
+  const char *ref = user_data;
+  const char *m_ref = flatpak_oci_manifest_descriptor_get_ref (element);
+
+  return m_ref != NULL && strcmp (m_ref, ref) == 0;
+}
+
+/* Like flatpak_oci_registry_load_index, but stops parsing once the
+ * manifest for @ref has been seen, so looking up a single image in a
+ * large index doesn't have to deserialize all the others. The returned
+ * index is only guaranteed to contain the manifests up to and
+ * including @ref, if present. */
+FlatpakOciIndex *
+flatpak_oci_registry_load_index_for_ref (FlatpakOciRegistry *self,
+                                         const char         *ref,
+                                         GCancellable       *cancellable,
+                                         GError            **error)
+{
+  g_autoptr(GBytes) bytes = NULL;
+
+  g_assert (self->valid);
+
+  bytes = flatpak_oci_registry_load_file (self, "index.json", cancellable, error);
+  if (bytes == NULL)
+    return NULL;
+
+  return (FlatpakOciIndex *) flatpak_json_from_bytes_partial (bytes, FLATPAK_TYPE_OCI_INDEX,
+                                                              index_stop_at_ref, (gpointer) ref,
+                                                              error);
+}
+
 gboolean
 flatpak_oci_registry_save_index (FlatpakOciRegistry *self,
                                  FlatpakOciIndex    *index,
@@ -566,13 +688,13 @@ flatpak_oci_registry_save_index (FlatpakOciRegistry *self,
 }
 
 static gboolean
-write_update_checksum (GOutputStream *out,
-                       gconstpointer  data,
-                       gsize          len,
-                       gsize         *out_bytes_written,
-                       GChecksum     *checksum,
-                       GCancellable  *cancellable,
-                       GError       **error)
+write_update_checksum (GOutputStream   *out,
+                       gconstpointer    data,
+                       gsize            len,
+                       gsize           *out_bytes_written,
+                       FlatpakChecksum *checksum,
+                       GCancellable    *cancellable,
+                       GError         **error)
 {
   if (out)
     {
@@ -586,17 +708,17 @@ write_update_checksum (GOutputStream *out,
     }
 
   if (checksum)
-    g_checksum_update (checksum, data, len);
+    flatpak_checksum_update (checksum, data, len);
 
   return TRUE;
 }
 
 static gboolean
-splice_update_checksum (GOutputStream *out,
-                        GInputStream  *in,
-                        GChecksum     *checksum,
-                        GCancellable  *cancellable,
-                        GError       **error)
+splice_update_checksum (GOutputStream   *out,
+                        GInputStream    *in,
+                        FlatpakChecksum *checksum,
+                        GCancellable    *cancellable,
+                        GError         **error)
 {
   g_return_val_if_fail (out != NULL || checksum != NULL, FALSE);
 
@@ -668,15 +790,15 @@ get_digest_subpath (FlatpakOciRegistry *self,
 static char *
 checksum_fd (int fd, GCancellable *cancellable, GError **error)
 {
-  g_autoptr(GChecksum) checksum = NULL;
+  g_autoptr(FlatpakChecksum) checksum = NULL;
   g_autoptr(GInputStream) in = g_unix_input_stream_new (fd, FALSE);
 
-  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  checksum = flatpak_checksum_new ();
 
   if (!splice_update_checksum (NULL, in, checksum, cancellable, error))
     return NULL;
 
-  return g_strdup (g_checksum_get_string (checksum));
+  return g_strdup (flatpak_checksum_get_string (checksum));
 }
 
 int
@@ -710,10 +832,17 @@ flatpak_oci_registry_download_blob (FlatpakOciRegistry    *self,
       g_autoptr(SoupURI) uri = NULL;
       g_autofree char *uri_s = NULL;
       g_autofree char *checksum = NULL;
-      g_autofree char *tmpfile_name = g_strdup_printf ("oci-layer-XXXXXX");
+      g_autofree char *part_name = NULL;
       g_autoptr(GOutputStream) out_stream = NULL;
+      struct stat stbuf;
+      guint64 resume_offset = 0;
+      gboolean range_ignored = FALSE;
 
-      /* remote case, download and verify */
+      /* Remote case: download and verify. Partial downloads are kept
+       * around under a name derived from the digest, so an interrupted
+       * pull can be resumed with a Range request instead of restarting
+       * from byte zero. The file is only unlinked once the digest has
+       * been verified. */
 
       uri = soup_uri_new_with_base (self->base_uri, subpath);
       if (uri == NULL)
@@ -725,43 +854,78 @@ flatpak_oci_registry_download_blob (FlatpakOciRegistry    *self,
 
       uri_s = soup_uri_to_string (uri, FALSE);
 
-      if (!flatpak_open_in_tmpdir_at (self->tmp_dfd, 0600, tmpfile_name,
-                                      &out_stream, cancellable, error))
-        return -1;
-
-      fd = local_open_file (self->tmp_dfd, tmpfile_name, NULL, cancellable, error);
-      (void) unlinkat (self->tmp_dfd, tmpfile_name, 0);
+      part_name = g_strdup_printf ("oci-blob-%s.part", digest + strlen ("sha256:"));
 
+      fd = TEMP_FAILURE_RETRY (openat (self->tmp_dfd, part_name,
+                                       O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600));
       if (fd == -1)
-        return -1;
+        {
+          glnx_throw_errno_prefix (error, "openat(%s)", part_name);
+          return -1;
+        }
 
-      if (!flatpak_download_http_uri (self->soup_session, uri_s,
-                                      FLATPAK_HTTP_FLAGS_ACCEPT_OCI,
-                                      out_stream,
-                                      progress_cb, user_data,
-                                      cancellable, error))
-        return -1;
+      if (fstat (fd, &stbuf) == 0 && stbuf.st_size > 0)
+        {
+          resume_offset = stbuf.st_size;
+          lseek (fd, resume_offset, SEEK_SET);
+          g_debug ("Resuming blob %s from byte %" G_GUINT64_FORMAT, digest, resume_offset);
+        }
+
+      out_stream = g_unix_output_stream_new (fd, FALSE);
+
+      if (!flatpak_download_http_uri_resume (self->soup_session, uri_s,
+                                             FLATPAK_HTTP_FLAGS_ACCEPT_OCI,
+                                             out_stream,
+                                             resume_offset, &range_ignored,
+                                             progress_cb, user_data,
+                                             cancellable, error))
+        {
+          if (!range_ignored)
+            return -1; /* Keep the partial file for the next attempt */
+
+          /* Server won't serve the range, restart from scratch */
+          if (ftruncate (fd, 0) != 0 || lseek (fd, 0, SEEK_SET) != 0)
+            {
+              glnx_throw_errno_prefix (error, "ftruncate(%s)", part_name);
+              return -1;
+            }
+
+          if (!flatpak_download_http_uri (self->soup_session, uri_s,
+                                          FLATPAK_HTTP_FLAGS_ACCEPT_OCI,
+                                          out_stream,
+                                          progress_cb, user_data,
+                                          cancellable, error))
+            return -1;
+        }
 
       if (!g_output_stream_close (out_stream, cancellable, error))
         return -1;
 
+      lseek (fd, 0, SEEK_SET);
       checksum = checksum_fd (fd, cancellable, error);
       if (checksum == NULL)
         return -1;
 
       if (strcmp (checksum, digest + strlen ("sha256:")) != 0)
         {
+          /* The partial data is corrupt, don't try to resume from it */
+          (void) unlinkat (self->tmp_dfd, part_name, 0);
           g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
                        "Checksum digest did not match (%s != %s)", digest, checksum);
           return -1;
         }
 
+      (void) unlinkat (self->tmp_dfd, part_name, 0);
       lseek (fd, 0, SEEK_SET);
     }
 
   return glnx_steal_fd (&fd);
 }
 
+#ifndef FICLONE
+#define FICLONE _IOW (0x94, 9, int)
+#endif
+
 gboolean
 flatpak_oci_registry_mirror_blob (FlatpakOciRegistry    *self,
                                   FlatpakOciRegistry    *source_registry,
@@ -814,7 +978,11 @@ flatpak_oci_registry_mirror_blob (FlatpakOciRegistry    *self,
       if (src_fd == -1)
         return FALSE;
 
-      if (glnx_regfile_copy_bytes (src_fd, tmpf.fd, (off_t) -1) < 0)
+      /* Try to clone the extents first, so same-filesystem mirrors share
+       * the data instead of copying it. glnx_regfile_copy_bytes () uses
+       * copy_file_range/sendfile, covering the cross-filesystem case. */
+      if (ioctl (tmpf.fd, FICLONE, src_fd) != 0 &&
+          glnx_regfile_copy_bytes (src_fd, tmpf.fd, (off_t) -1) < 0)
         return glnx_throw_errno_prefix (error, "copyfile");
     }
   else
@@ -865,6 +1033,45 @@ flatpak_oci_registry_mirror_blob (FlatpakOciRegistry    *self,
   return TRUE;
 }
 
+/* Process-wide cache of manifest blobs from remote registries, keyed
+ * by digest. Manifests are content-addressed and verified against the
+ * digest on load, so once seen they can never change; caching them
+ * means resolving many refs against the same registry costs at most
+ * one fetch per distinct manifest per process, instead of a round trip
+ * per ref. Only manifests are cached: they are small, while configs
+ * and layers are larger and loaded at most once per operation. */
+static GHashTable *manifest_blob_cache; /* digest => GBytes */
+G_LOCK_DEFINE_STATIC (manifest_blob_cache);
+
+static GBytes *
+manifest_blob_cache_lookup (const char *digest)
+{
+  GBytes *bytes = NULL;
+
+  G_LOCK (manifest_blob_cache);
+  if (manifest_blob_cache != NULL)
+    {
+      bytes = g_hash_table_lookup (manifest_blob_cache, digest);
+      if (bytes != NULL)
+        g_bytes_ref (bytes);
+    }
+  G_UNLOCK (manifest_blob_cache);
+
+  return bytes;
+}
+
+static void
+manifest_blob_cache_add (const char *digest,
+                         GBytes     *bytes)
+{
+  G_LOCK (manifest_blob_cache);
+  if (manifest_blob_cache == NULL)
+    manifest_blob_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                 g_free, (GDestroyNotify) g_bytes_unref);
+  g_hash_table_replace (manifest_blob_cache, g_strdup (digest), g_bytes_ref (bytes));
+  G_UNLOCK (manifest_blob_cache);
+}
+
 GBytes *
 flatpak_oci_registry_load_blob (FlatpakOciRegistry *self,
                                 const char         *repository,
@@ -876,9 +1083,19 @@ flatpak_oci_registry_load_blob (FlatpakOciRegistry *self,
   g_autofree char *subpath = NULL;
   g_autoptr(GBytes) bytes = NULL;
   g_autofree char *json_checksum = NULL;
+  gboolean use_cache;
 
   g_assert (self->valid);
 
+  use_cache = manifest && self->dfd == -1;
+
+  if (use_cache)
+    {
+      bytes = manifest_blob_cache_lookup (digest);
+      if (bytes != NULL)
+        return g_steal_pointer (&bytes);
+    }
+
   subpath = get_digest_subpath (self, repository, manifest, digest, error);
   if (subpath == NULL)
     return NULL;
@@ -896,6 +1113,9 @@ flatpak_oci_registry_load_blob (FlatpakOciRegistry *self,
       return NULL;
     }
 
+  if (use_cache)
+    manifest_blob_cache_add (digest, bytes);
+
   return g_steal_pointer (&bytes);
 }
 
@@ -963,10 +1183,11 @@ struct FlatpakOciLayerWriter
 
   FlatpakOciRegistry *registry;
 
-  GChecksum          *uncompressed_checksum;
-  GChecksum          *compressed_checksum;
+  FlatpakChecksum    *uncompressed_checksum;
+  FlatpakChecksum    *compressed_checksum;
   struct archive     *archive;
-  GZlibCompressor    *compressor;
+  GConverter         *compressor;
+  const char         *mediatype;
   guint64             uncompressed_size;
   guint64             compressed_size;
   GLnxTmpfile         tmpf;
@@ -993,8 +1214,8 @@ flatpak_oci_layer_writer_reset (FlatpakOciLayerWriter *self)
 {
   glnx_tmpfile_clear (&self->tmpf);
 
-  g_checksum_reset (self->uncompressed_checksum);
-  g_checksum_reset (self->compressed_checksum);
+  flatpak_checksum_reset (self->uncompressed_checksum);
+  flatpak_checksum_reset (self->compressed_checksum);
 
   if (self->archive)
     {
@@ -1013,8 +1234,8 @@ flatpak_oci_layer_writer_finalize (GObject *object)
 
   flatpak_oci_layer_writer_reset (self);
 
-  g_checksum_free (self->compressed_checksum);
-  g_checksum_free (self->uncompressed_checksum);
+  flatpak_checksum_free (self->compressed_checksum);
+  flatpak_checksum_free (self->uncompressed_checksum);
   glnx_tmpfile_clear (&self->tmpf);
 
   g_clear_object (&self->registry);
@@ -1033,8 +1254,8 @@ flatpak_oci_layer_writer_class_init (FlatpakOciLayerWriterClass *klass)
 static void
 flatpak_oci_layer_writer_init (FlatpakOciLayerWriter *self)
 {
-  self->uncompressed_checksum = g_checksum_new (G_CHECKSUM_SHA256);
-  self->compressed_checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  self->uncompressed_checksum = flatpak_checksum_new ();
+  self->compressed_checksum = flatpak_checksum_new ();
 }
 
 static int
@@ -1065,7 +1286,7 @@ flatpak_oci_layer_writer_compress (FlatpakOciLayerWriter *self,
 
   do
     {
-      res = g_converter_convert (G_CONVERTER (self->compressor),
+      res = g_converter_convert (self->compressor,
                                  buffer, length,
                                  compressed_buffer, sizeof (compressed_buffer),
                                  flags, &bytes_read, &bytes_written,
@@ -1076,8 +1297,8 @@ flatpak_oci_layer_writer_compress (FlatpakOciLayerWriter *self,
           return -1;
         }
 
-      g_checksum_update (self->uncompressed_checksum, buffer, bytes_read);
-      g_checksum_update (self->compressed_checksum, compressed_buffer, bytes_written);
+      flatpak_checksum_update (self->uncompressed_checksum, buffer, bytes_read);
+      flatpak_checksum_update (self->compressed_checksum, compressed_buffer, bytes_written);
       self->uncompressed_size += bytes_read;
       self->compressed_size += bytes_written;
 
@@ -1132,13 +1353,31 @@ flatpak_oci_layer_writer_close_cb (struct archive *archive,
   return ARCHIVE_OK;
 }
 
+FlatpakOciLayerCompression
+flatpak_oci_layer_compression_from_string (const char *str,
+                                           GError    **error)
+{
+  if (str == NULL || strcmp (str, "gzip") == 0)
+    return FLATPAK_OCI_LAYER_COMPRESSION_GZIP;
+
+  if (strcmp (str, "zstd") == 0)
+    return FLATPAK_OCI_LAYER_COMPRESSION_ZSTD;
+
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+               "Unknown layer compression format %s", str);
+  return FLATPAK_OCI_LAYER_COMPRESSION_GZIP;
+}
+
 FlatpakOciLayerWriter *
-flatpak_oci_registry_write_layer (FlatpakOciRegistry *self,
-                                  GCancellable       *cancellable,
-                                  GError            **error)
+flatpak_oci_registry_write_layer (FlatpakOciRegistry        *self,
+                                  FlatpakOciLayerCompression compression,
+                                  GCancellable              *cancellable,
+                                  GError                   **error)
 {
   g_autoptr(FlatpakOciLayerWriter) oci_layer_writer = NULL;
   g_autoptr(FlatpakAutoArchiveWrite) a = NULL;
+  g_autoptr(GConverter) compressor = NULL;
+  const char *mediatype;
   g_auto(GLnxTmpfile) tmpf = { 0 };
 
   g_assert (self->valid);
@@ -1150,6 +1389,26 @@ flatpak_oci_registry_write_layer (FlatpakOciRegistry *self,
       return NULL;
     }
 
+  switch (compression)
+    {
+    case FLATPAK_OCI_LAYER_COMPRESSION_ZSTD:
+#ifdef HAVE_ZSTD
+      compressor = G_CONVERTER (flatpak_zstd_compressor_new (0));
+      mediatype = FLATPAK_OCI_MEDIA_TYPE_IMAGE_LAYER_ZSTD;
+      break;
+#else
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Flatpak was built without zstd support");
+      return NULL;
+#endif
+
+    case FLATPAK_OCI_LAYER_COMPRESSION_GZIP:
+    default:
+      compressor = G_CONVERTER (g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1));
+      mediatype = FLATPAK_OCI_MEDIA_TYPE_IMAGE_LAYER;
+      break;
+    }
+
   oci_layer_writer = g_object_new (FLATPAK_TYPE_OCI_LAYER_WRITER, NULL);
   oci_layer_writer->registry = g_object_ref (self);
 
@@ -1189,7 +1448,8 @@ flatpak_oci_registry_write_layer (FlatpakOciRegistry *self,
   /* Transfer ownership of the tmpfile */
   oci_layer_writer->tmpf = tmpf;
   tmpf.initialized = 0;
-  oci_layer_writer->compressor = g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1);
+  oci_layer_writer->compressor = g_steal_pointer (&compressor);
+  oci_layer_writer->mediatype = mediatype;
 
   return g_steal_pointer (&oci_layer_writer);
 }
@@ -1207,7 +1467,7 @@ flatpak_oci_layer_writer_close (FlatpakOciLayerWriter *self,
     return propagate_libarchive_error (error, self->archive);
 
   path = g_strdup_printf ("blobs/sha256/%s",
-                          g_checksum_get_string (self->compressed_checksum));
+                          flatpak_checksum_get_string (self->compressed_checksum));
 
   if (!glnx_link_tmpfile_at (&self->tmpf,
                              GLNX_LINK_TMPFILE_REPLACE,
@@ -1217,12 +1477,12 @@ flatpak_oci_layer_writer_close (FlatpakOciLayerWriter *self,
     return FALSE;
 
   if (uncompressed_digest_out != NULL)
-    *uncompressed_digest_out = g_strdup_printf ("sha256:%s", g_checksum_get_string (self->uncompressed_checksum));
+    *uncompressed_digest_out = g_strdup_printf ("sha256:%s", flatpak_checksum_get_string (self->uncompressed_checksum));
   if (res_out != NULL)
     {
-      g_autofree char *digest = g_strdup_printf ("sha256:%s", g_checksum_get_string (self->compressed_checksum));
+      g_autofree char *digest = g_strdup_printf ("sha256:%s", flatpak_checksum_get_string (self->compressed_checksum));
 
-      *res_out = flatpak_oci_descriptor_new (FLATPAK_OCI_MEDIA_TYPE_IMAGE_LAYER, digest, self->compressed_size);
+      *res_out = flatpak_oci_descriptor_new (self->mediatype, digest, self->compressed_size);
     }
 
   return TRUE;
@@ -1236,9 +1496,9 @@ flatpak_oci_layer_writer_get_archive (FlatpakOciLayerWriter *self)
 
 typedef struct
 {
-  int        fd;
-  GChecksum *checksum;
-  char       buffer[16 * 1024];
+  int              fd;
+  FlatpakChecksum *checksum;
+  char             buffer[16 * 1024];
 } FlatpakArchiveReadWithChecksum;
 
 static int
@@ -1265,7 +1525,7 @@ checksum_read_cb (struct archive *a, void *user_data, const void **buff)
       return -1;
     }
 
-  g_checksum_update (data->checksum, (guchar *) data->buffer, bytes_read);
+  flatpak_checksum_update (data->checksum, (guchar *) data->buffer, bytes_read);
 
   return bytes_read;
 }
@@ -1295,10 +1555,10 @@ checksum_close_cb (struct archive *a, void *user_data)
 }
 
 gboolean
-flatpak_archive_read_open_fd_with_checksum (struct archive *a,
-                                            int             fd,
-                                            GChecksum      *checksum,
-                                            GError        **error)
+flatpak_archive_read_open_fd_with_checksum (struct archive  *a,
+                                            int              fd,
+                                            FlatpakChecksum *checksum,
+                                            GError         **error)
 {
   FlatpakArchiveReadWithChecksum *data = g_new0 (FlatpakArchiveReadWithChecksum, 1);
 
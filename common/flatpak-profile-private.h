@@ -0,0 +1,42 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#ifndef __FLATPAK_PROFILE_H__
+#define __FLATPAK_PROFILE_H__
+
+#include <glib.h>
+
+/* Built-in per-phase profiling, enabled with the global --profile=FILE
+ * option. Phase boundaries in the hot paths are bracketed with
+ * flatpak_profile_begin()/flatpak_profile_end(); for each phase the
+ * wall and cpu time spent and the block I/O issued (from getrusage)
+ * are recorded, and on exit a machine readable JSON report is written
+ * to FILE, so timings of install/update/run can be compared across
+ * flatpak versions automatically. When not enabled all calls are
+ * cheap no-ops. */
+
+void flatpak_profile_enable (const char *file);
+void flatpak_profile_begin  (const char *phase,
+                             const char *detail);
+void flatpak_profile_end    (const char *phase);
+void flatpak_profile_mark   (const char *name);
+void flatpak_profile_write  (void);
+
+#endif /* __FLATPAK_PROFILE_H__ */
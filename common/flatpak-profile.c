@@ -0,0 +1,267 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "flatpak-profile-private.h"
+
+typedef struct
+{
+  char  *phase;
+  char  *detail;
+  gint64 start_wall;
+  gint64 wall_us;
+  gint64 cpu_us;
+  gint64 read_bytes;
+  gint64 write_bytes;
+} ProfileSpan;
+
+typedef struct
+{
+  char  *name;
+  gint64 wall_us;
+} ProfileMark;
+
+static char *profile_file = NULL;
+static gint64 profile_start_wall;
+static gint64 profile_start_cpu;
+static GPtrArray *profile_spans = NULL; /* Finished, in completion order */
+static GPtrArray *profile_stack = NULL; /* Begun but not yet ended */
+static GPtrArray *profile_marks = NULL;
+
+/* The pull code runs worker threads, so all state is under a lock */
+G_LOCK_DEFINE_STATIC (profile);
+
+static gint64
+timeval_to_us (const struct timeval *tv)
+{
+  return (gint64) tv->tv_sec * G_USEC_PER_SEC + tv->tv_usec;
+}
+
+static void
+rusage_snapshot (gint64 *cpu_us, gint64 *read_bytes, gint64 *write_bytes)
+{
+  struct rusage ru;
+
+  getrusage (RUSAGE_SELF, &ru);
+  *cpu_us = timeval_to_us (&ru.ru_utime) + timeval_to_us (&ru.ru_stime);
+  /* ru_inblock/ru_oublock count 512 byte blocks */
+  *read_bytes = ru.ru_inblock * 512;
+  *write_bytes = ru.ru_oublock * 512;
+}
+
+static void
+profile_span_free (ProfileSpan *span)
+{
+  g_free (span->phase);
+  g_free (span->detail);
+  g_free (span);
+}
+
+static void
+profile_mark_free (ProfileMark *mark)
+{
+  g_free (mark->name);
+  g_free (mark);
+}
+
+void
+flatpak_profile_enable (const char *file)
+{
+  gint64 read_bytes, write_bytes;
+
+  G_LOCK (profile);
+  if (profile_file == NULL)
+    {
+      profile_file = g_strdup (file);
+      profile_start_wall = g_get_monotonic_time ();
+      rusage_snapshot (&profile_start_cpu, &read_bytes, &write_bytes);
+      profile_spans = g_ptr_array_new_with_free_func ((GDestroyNotify) profile_span_free);
+      profile_stack = g_ptr_array_new ();
+      profile_marks = g_ptr_array_new_with_free_func ((GDestroyNotify) profile_mark_free);
+    }
+  G_UNLOCK (profile);
+}
+
+void
+flatpak_profile_begin (const char *phase,
+                       const char *detail)
+{
+  ProfileSpan *span;
+  gint64 read_bytes, write_bytes;
+
+  if (profile_file == NULL)
+    return;
+
+  span = g_new0 (ProfileSpan, 1);
+  span->phase = g_strdup (phase);
+  span->detail = g_strdup (detail);
+  span->start_wall = g_get_monotonic_time ();
+  rusage_snapshot (&span->cpu_us, &read_bytes, &write_bytes);
+  span->read_bytes = read_bytes;
+  span->write_bytes = write_bytes;
+
+  G_LOCK (profile);
+  g_ptr_array_add (profile_stack, span);
+  G_UNLOCK (profile);
+}
+
+void
+flatpak_profile_end (const char *phase)
+{
+  ProfileSpan *span = NULL;
+  gint64 cpu_us, read_bytes, write_bytes;
+  int i;
+
+  if (profile_file == NULL)
+    return;
+
+  G_LOCK (profile);
+  /* The innermost span of this phase; an unmatched end (e.g. after an
+   * error cut a phase short) is silently ignored */
+  for (i = profile_stack->len - 1; i >= 0; i--)
+    {
+      ProfileSpan *candidate = g_ptr_array_index (profile_stack, i);
+      if (strcmp (candidate->phase, phase) == 0)
+        {
+          span = candidate;
+          g_ptr_array_remove_index (profile_stack, i);
+          break;
+        }
+    }
+  G_UNLOCK (profile);
+
+  if (span == NULL)
+    return;
+
+  rusage_snapshot (&cpu_us, &read_bytes, &write_bytes);
+  span->wall_us = g_get_monotonic_time () - span->start_wall;
+  span->cpu_us = cpu_us - span->cpu_us;
+  span->read_bytes = read_bytes - span->read_bytes;
+  span->write_bytes = write_bytes - span->write_bytes;
+
+  G_LOCK (profile);
+  g_ptr_array_add (profile_spans, span);
+  G_UNLOCK (profile);
+}
+
+void
+flatpak_profile_mark (const char *name)
+{
+  ProfileMark *mark;
+
+  if (profile_file == NULL)
+    return;
+
+  mark = g_new0 (ProfileMark, 1);
+  mark->name = g_strdup (name);
+  mark->wall_us = g_get_monotonic_time () - profile_start_wall;
+
+  G_LOCK (profile);
+  g_ptr_array_add (profile_marks, mark);
+  G_UNLOCK (profile);
+}
+
+static void
+append_json_string (GString *s, const char *str)
+{
+  const char *p;
+
+  g_string_append_c (s, '"');
+  for (p = str; *p != 0; p++)
+    {
+      if (*p == '"' || *p == '\\')
+        g_string_append_c (s, '\\');
+      g_string_append_c (s, *p);
+    }
+  g_string_append_c (s, '"');
+}
+
+void
+flatpak_profile_write (void)
+{
+  g_autoptr(GString) s = NULL;
+  g_autoptr(GError) error = NULL;
+  struct rusage ru;
+  gint64 cpu_us, read_bytes, write_bytes;
+  int i;
+
+  if (profile_file == NULL)
+    return;
+
+  getrusage (RUSAGE_SELF, &ru);
+  rusage_snapshot (&cpu_us, &read_bytes, &write_bytes);
+
+  s = g_string_new ("{\n");
+
+  g_string_append_printf (s,
+                          "  \"total\": { \"wall_us\": %" G_GINT64_FORMAT ", \"cpu_us\": %" G_GINT64_FORMAT
+                          ", \"read_bytes\": %" G_GINT64_FORMAT ", \"write_bytes\": %" G_GINT64_FORMAT
+                          ", \"max_rss_kb\": %ld, \"ctx_switches\": %ld, \"page_faults\": %ld },\n",
+                          g_get_monotonic_time () - profile_start_wall,
+                          cpu_us - profile_start_cpu,
+                          read_bytes, write_bytes,
+                          ru.ru_maxrss,
+                          ru.ru_nvcsw + ru.ru_nivcsw,
+                          ru.ru_majflt + ru.ru_minflt);
+
+  g_string_append (s, "  \"phases\": [\n");
+  for (i = 0; i < profile_spans->len; i++)
+    {
+      ProfileSpan *span = g_ptr_array_index (profile_spans, i);
+
+      g_string_append (s, "    { \"phase\": ");
+      append_json_string (s, span->phase);
+      if (span->detail != NULL)
+        {
+          g_string_append (s, ", \"detail\": ");
+          append_json_string (s, span->detail);
+        }
+      g_string_append_printf (s,
+                              ", \"start_us\": %" G_GINT64_FORMAT ", \"wall_us\": %" G_GINT64_FORMAT
+                              ", \"cpu_us\": %" G_GINT64_FORMAT ", \"read_bytes\": %" G_GINT64_FORMAT
+                              ", \"write_bytes\": %" G_GINT64_FORMAT " }%s\n",
+                              span->start_wall - profile_start_wall,
+                              span->wall_us, span->cpu_us,
+                              span->read_bytes, span->write_bytes,
+                              i + 1 < profile_spans->len ? "," : "");
+    }
+  g_string_append (s, "  ],\n");
+
+  g_string_append (s, "  \"marks\": [\n");
+  for (i = 0; i < profile_marks->len; i++)
+    {
+      ProfileMark *mark = g_ptr_array_index (profile_marks, i);
+
+      g_string_append (s, "    { \"name\": ");
+      append_json_string (s, mark->name);
+      g_string_append_printf (s, ", \"wall_us\": %" G_GINT64_FORMAT " }%s\n",
+                              mark->wall_us,
+                              i + 1 < profile_marks->len ? "," : "");
+    }
+  g_string_append (s, "  ]\n}\n");
+
+  if (!g_file_set_contents (profile_file, s->str, s->len, &error))
+    g_printerr ("Failed to write profile to %s: %s\n", profile_file, error->message);
+}
@@ -23,6 +23,7 @@
 #include <string.h>
 
 #include "flatpak-utils-private.h"
+#include "flatpak-memory-private.h"
 #include "flatpak-remote-ref-private.h"
 #include "flatpak-remote-ref.h"
 #include "flatpak-enum-types.h"
@@ -66,6 +67,10 @@ flatpak_remote_ref_finalize (GObject *object)
   FlatpakRemoteRef *self = FLATPAK_REMOTE_REF (object);
   FlatpakRemoteRefPrivate *priv = flatpak_remote_ref_get_instance_private (self);
 
+  flatpak_memory_free (FLATPAK_MEMORY_REMOTE_REF, sizeof (FlatpakRemoteRefPrivate));
+  if (priv->metadata)
+    flatpak_memory_free (FLATPAK_MEMORY_REMOTE_REF, g_bytes_get_size (priv->metadata));
+
   g_free (priv->remote_name);
   g_free (priv->eol);
   g_free (priv->eol_rebase);
@@ -99,8 +104,12 @@ flatpak_remote_ref_set_property (GObject      *object,
       break;
 
     case PROP_METADATA:
+      if (priv->metadata)
+        flatpak_memory_free (FLATPAK_MEMORY_REMOTE_REF, g_bytes_get_size (priv->metadata));
       g_clear_pointer (&priv->metadata, g_bytes_unref);
       priv->metadata = g_value_get_boxed (value) ? g_bytes_ref (g_value_get_boxed (value)) : NULL;
+      if (priv->metadata)
+        flatpak_memory_alloc (FLATPAK_MEMORY_REMOTE_REF, g_bytes_get_size (priv->metadata));
       break;
 
     case PROP_EOL:
@@ -216,6 +225,9 @@ flatpak_remote_ref_class_init (FlatpakRemoteRefClass *klass)
 static void
 flatpak_remote_ref_init (FlatpakRemoteRef *self)
 {
+  /* One of these is created per ref listed on a remote, which adds up
+   * for storefront-style listings of big remotes */
+  flatpak_memory_alloc (FLATPAK_MEMORY_REMOTE_REF, sizeof (FlatpakRemoteRefPrivate));
 }
 
 /**
@@ -90,6 +90,13 @@ struct _FlatpakRemotePrivate
   guint             local_homepage_set       : 1;
 
   GBytes           *local_gpg_key;
+
+  /* Snapshot of the settings read from the dir's config, valid while
+   * the dir's config generation matches, see ensure_config_snapshot() */
+  gboolean          snapshot_valid;
+  int               snapshot_generation;
+  char             *snapshot_url;
+  char             *snapshot_collection_id;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE (FlatpakRemote, flatpak_remote, G_TYPE_OBJECT)
@@ -119,6 +126,9 @@ flatpak_remote_finalize (GObject *object)
   g_free (priv->local_default_branch);
   g_free (priv->local_main_ref);
 
+  g_free (priv->snapshot_url);
+  g_free (priv->snapshot_collection_id);
+
   G_OBJECT_CLASS (flatpak_remote_parent_class)->finalize (object);
 }
 
@@ -300,6 +310,34 @@ flatpak_remote_get_appstream_timestamp (FlatpakRemote *self,
                                        subdir);
 }
 
+/* Read the settings that get queried over and over (by update loops
+ * etc) out of the config in one go, and keep them until the dir reports
+ * that the configuration changed. */
+static void
+ensure_config_snapshot (FlatpakRemote *self)
+{
+  FlatpakRemotePrivate *priv = flatpak_remote_get_instance_private (self);
+  int generation = flatpak_dir_get_config_generation (priv->dir);
+  OstreeRepo *repo;
+  char *url = NULL;
+
+  if (priv->snapshot_valid && priv->snapshot_generation == generation)
+    return;
+
+  g_clear_pointer (&priv->snapshot_url, g_free);
+  g_clear_pointer (&priv->snapshot_collection_id, g_free);
+
+  repo = flatpak_dir_get_repo (priv->dir);
+  if (repo != NULL &&
+      ostree_repo_remote_get_url (repo, priv->name, &url, NULL))
+    priv->snapshot_url = url;
+
+  priv->snapshot_collection_id = flatpak_dir_get_remote_collection_id (priv->dir, priv->name);
+
+  priv->snapshot_generation = generation;
+  priv->snapshot_valid = TRUE;
+}
+
 /**
  * flatpak_remote_get_url:
  * @self: a #FlatpakRemote
@@ -312,16 +350,14 @@ char *
 flatpak_remote_get_url (FlatpakRemote *self)
 {
   FlatpakRemotePrivate *priv = flatpak_remote_get_instance_private (self);
-  char *url;
 
   if (priv->local_url_set)
     return g_strdup (priv->local_url);
 
   if (priv->dir)
     {
-      OstreeRepo *repo = flatpak_dir_get_repo (priv->dir);
-      if (ostree_repo_remote_get_url (repo, priv->name, &url, NULL))
-        return url;
+      ensure_config_snapshot (self);
+      return g_strdup (priv->snapshot_url);
     }
 
   return NULL;
@@ -366,7 +402,10 @@ flatpak_remote_get_collection_id (FlatpakRemote *self)
     return g_strdup (priv->local_collection_id);
 
   if (priv->dir)
-    return flatpak_dir_get_remote_collection_id (priv->dir, priv->name);
+    {
+      ensure_config_snapshot (self);
+      return g_strdup (priv->snapshot_collection_id);
+    }
 
   return NULL;
 }
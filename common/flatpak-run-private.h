@@ -123,6 +123,7 @@ gboolean flatpak_run_add_environment_args (FlatpakBwrap    *bwrap,
                                            GFile           *app_id_dir,
                                            GPtrArray       *previous_app_id_dirs,
                                            FlatpakExports **exports_out,
+                                           int             *proxy_sync_fd_out,
                                            GCancellable    *cancellable,
                                            GError         **error);
 char **  flatpak_run_get_minimal_env (gboolean devel,
@@ -197,29 +197,22 @@ flatpak_run_add_x11_args (FlatpakBwrap *bwrap,
       flatpak_bwrap_set_env (bwrap, "DISPLAY", ":99.0", TRUE);
 
 #ifdef ENABLE_XAUTH
-      g_auto(GLnxTmpfile) xauth_tmpf  = { 0, };
+      g_autofree char *xauth_data = NULL;
+      size_t xauth_size = 0;
+      FILE *output = open_memstream (&xauth_data, &xauth_size);
 
-      if (glnx_open_anonymous_tmpfile (O_RDWR | O_CLOEXEC, &xauth_tmpf, NULL))
+      if (output != NULL)
         {
-          FILE *output = fdopen (xauth_tmpf.fd, "wb");
-          if (output != NULL)
+          write_xauth (d, output);
+          if (fclose (output) == 0)
             {
-              /* fd is now owned by output, steal it from the tmpfile */
-              int tmp_fd = dup (glnx_steal_fd (&xauth_tmpf.fd));
-              if (tmp_fd != -1)
-                {
-                  g_autofree char *dest = g_strdup_printf ("/run/user/%d/Xauthority", getuid ());
-
-                  write_xauth (d, output);
-                  flatpak_bwrap_add_args_data_fd (bwrap, "--ro-bind-data", tmp_fd, dest);
-
-                  flatpak_bwrap_set_env (bwrap, "XAUTHORITY", dest, TRUE);
-                }
+              g_autofree char *dest = g_strdup_printf ("/run/user/%d/Xauthority", getuid ());
 
-              fclose (output);
-
-              if (tmp_fd != -1)
-                lseek (tmp_fd, 0, SEEK_SET);
+              /* The sandbox gets the filtered auth data from a sealed memfd,
+                 so no temporary file hits the disk */
+              if (flatpak_bwrap_add_args_data (bwrap, "xauthority",
+                                               xauth_data, xauth_size, dest, NULL))
+                flatpak_bwrap_set_env (bwrap, "XAUTHORITY", dest, TRUE);
             }
         }
 #endif
@@ -380,6 +373,7 @@ flatpak_run_get_pulseaudio_server (void)
   const char * pulse_clientconfig;
   char *pulse_server;
   g_autofree char *pulse_user_config = NULL;
+  g_autofree char *cached = NULL;
 
   pulse_server = g_strdup (g_getenv ("PULSE_SERVER"));
   if (pulse_server)
@@ -389,16 +383,21 @@ flatpak_run_get_pulseaudio_server (void)
   if (pulse_clientconfig)
     return flatpak_run_get_pulseaudio_server_user_config (pulse_clientconfig);
 
+  /* The config files are stable within a session, so parse them only
+   * once per boot; "" records that no default-server was configured */
+  cached = flatpak_host_probe_cache_lookup ("pulseaudio-server");
+  if (cached != NULL)
+    return *cached != '\0' ? g_steal_pointer (&cached) : NULL;
+
   pulse_user_config = g_build_filename (g_get_user_config_dir (), "pulse/client.conf", NULL);
   pulse_server = flatpak_run_get_pulseaudio_server_user_config (pulse_user_config);
-  if (pulse_server)
-    return pulse_server;
+  if (pulse_server == NULL)
+    pulse_server = flatpak_run_get_pulseaudio_server_user_config ("/etc/pulse/client.conf");
 
-  pulse_server = flatpak_run_get_pulseaudio_server_user_config ("/etc/pulse/client.conf");
-  if (pulse_server)
-    return pulse_server;
+  flatpak_host_probe_cache_store ("pulseaudio-server",
+                                  pulse_server ? pulse_server : "");
 
-  return NULL;
+  return pulse_server;
 }
 
 static char *
@@ -514,6 +513,11 @@ flatpak_run_add_system_dbus_args (FlatpakBwrap   *app_bwrap,
   g_autofree char *dbus_system_socket = NULL;
 
   unrestricted = (context->sockets & FLATPAK_CONTEXT_SOCKET_SYSTEM_BUS) != 0;
+  if (!unrestricted && flatpak_context_get_system_bus_policy_is_unfiltered (context))
+    {
+      g_debug ("Skipping system-dbus proxy, policy is equivalent to unfiltered");
+      unrestricted = TRUE;
+    }
   if (unrestricted)
     g_debug ("Allowing system-dbus access");
 
@@ -577,6 +581,11 @@ flatpak_run_add_session_dbus_args (FlatpakBwrap   *app_bwrap,
   g_autofree char *sandbox_dbus_address = g_strdup_printf ("unix:path=/run/user/%d/bus", getuid ());
 
   unrestricted = (context->sockets & FLATPAK_CONTEXT_SOCKET_SESSION_BUS) != 0;
+  if (!unrestricted && flatpak_context_get_session_bus_policy_is_unfiltered (context))
+    {
+      g_debug ("Skipping session-dbus proxy, policy is equivalent to unfiltered");
+      unrestricted = TRUE;
+    }
 
   if (dbus_address != NULL)
     {
@@ -798,13 +807,34 @@ add_bwrap_wrapper (FlatpakBwrap *bwrap,
   return TRUE;
 }
 
+static gboolean
+wait_for_dbus_proxy (int      sync_fd,
+                     GError **error)
+{
+  char x;
+
+  /* Sync with proxy, i.e. wait until its listening on the sockets */
+  if (read (sync_fd, &x, 1) != 1)
+    {
+      g_set_error_literal (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                           _("Failed to sync with dbus proxy"));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* If @sync_fd_out is NULL this waits for the proxy to be ready before
+   returning; otherwise the proxy starts up in parallel and the caller
+   must pass *sync_fd_out to wait_for_dbus_proxy() before launching the
+   app. The fd is owned by @app_bwrap either way. */
 static gboolean
 start_dbus_proxy (FlatpakBwrap *app_bwrap,
                   FlatpakBwrap *proxy_arg_bwrap,
                   const char   *app_info_path,
+                  int          *sync_fd_out,
                   GError      **error)
 {
-  char x = 'x';
   const char *proxy;
   g_autofree char *commandline = NULL;
   g_autoptr(FlatpakBwrap) proxy_bwrap = NULL;
@@ -859,13 +889,10 @@ start_dbus_proxy (FlatpakBwrap *app_bwrap,
                       NULL, error))
     return FALSE;
 
-  /* Sync with proxy, i.e. wait until its listening on the sockets */
-  if (read (sync_fds[0], &x, 1) != 1)
-    {
-      g_set_error_literal (error, G_IO_ERROR, g_io_error_from_errno (errno),
-                           _("Failed to sync with dbus proxy"));
-      return FALSE;
-    }
+  if (sync_fd_out != NULL)
+    *sync_fd_out = sync_fds[0];
+  else if (!wait_for_dbus_proxy (sync_fds[0], error))
+    return FALSE;
 
   return TRUE;
 }
@@ -880,6 +907,236 @@ flatpak_extension_compare_by_path (gconstpointer _a,
   return g_strcmp0 (a->directory, b->directory);
 }
 
+/* How long an unused entry in one of the shared per-user cache dirs
+ * (ld.so caches, extension plans) survives. The entries are keyed by
+ * checksums of their inputs, so a stale entry can never be reused
+ * wrongly, it just wastes disk. */
+#define SHARED_CACHE_MAX_AGE (30LL * 24 * 60 * 60)
+
+static void
+prune_shared_cache_dir (GFile *cache_dir)
+{
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  time_t now = time (NULL);
+
+  if (!glnx_dirfd_iterator_init_at (AT_FDCWD, flatpak_file_get_path_cached (cache_dir),
+                                    FALSE, &dfd_iter, NULL))
+    return;
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+      struct stat stbuf;
+
+      if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, NULL, NULL) || dent == NULL)
+        break;
+
+      if (fstatat (dfd_iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) != 0 ||
+          !S_ISREG (stbuf.st_mode))
+        continue;
+
+      if (stbuf.st_mtime + SHARED_CACHE_MAX_AGE < now)
+        (void) unlinkat (dfd_iter.fd, dent->d_name, 0);
+    }
+}
+
+/* An extension plan is the cached result of resolving the extension
+ * points of an app or runtime against the locally deployed refs: the
+ * bwrap arguments, the ld.so.conf.d snippets and the LD_LIBRARY_PATH
+ * entries that flatpak_run_add_extension_args() would compute. The
+ * resolve stats its way across every installation on each launch, so
+ * we serialize the result keyed by a checksum of everything that went
+ * into it and just replay it on later launches of the same app. */
+
+/* as - bwrap arguments
+ * a(ss) - (path, contents) of files to create in the sandbox
+ * s - LD_LIBRARY_PATH entries (not yet merged with the environment)
+ * s - used extensions, as reported via extensions_out
+ */
+#define EXTENSION_PLAN_GVARIANT_STRING "(asa(ss)ss)"
+#define EXTENSION_PLAN_GVARIANT_FORMAT G_VARIANT_TYPE (EXTENSION_PLAN_GVARIANT_STRING)
+
+static void
+checksum_file_mtime (GChecksum  *checksum,
+                               const char *path)
+{
+  struct stat stbuf;
+
+  g_checksum_update (checksum, (guchar *) path, strlen (path) + 1);
+  if (stat (path, &stbuf) == 0)
+    {
+      g_autofree char *mtime = g_strdup_printf ("%" G_GINT64_FORMAT ".%ld",
+                                                (gint64) stbuf.st_mtim.tv_sec,
+                                                stbuf.st_mtim.tv_nsec);
+      g_checksum_update (checksum, (guchar *) mtime, strlen (mtime) + 1);
+    }
+  else
+    g_checksum_update (checksum, (guchar *) "missing", strlen ("missing") + 1);
+}
+
+static void
+extension_plan_checksum_base_dir (GChecksum *checksum,
+                                  GFile     *base_dir)
+{
+  g_autoptr(GFile) changed = g_file_get_child (base_dir, ".changed");
+  g_autoptr(GFile) unmaintained = g_file_get_child (base_dir, "extension");
+
+  /* Deploys and undeploys touch .changed, and the extension dir mtime
+   * covers unmaintained extensions appearing or disappearing. */
+  checksum_file_mtime (checksum, flatpak_file_get_path_cached (changed));
+  checksum_file_mtime (checksum, flatpak_file_get_path_cached (unmaintained));
+}
+
+static char *
+calculate_extension_plan_checksum (GKeyFile   *metakey,
+                                   const char *full_ref,
+                                   gboolean    use_ld_so_cache)
+{
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_autofree char *metadata = g_key_file_to_data (metakey, NULL, NULL);
+  g_autoptr(GFile) user_base_dir = flatpak_get_user_base_dir_location ();
+  GPtrArray *system_base_dirs;
+  const char *current_desktop = g_getenv ("XDG_CURRENT_DESKTOP");
+  const char *gtk_theme = flatpak_get_gtk_theme ();
+  const char **gl_drivers = flatpak_get_gl_drivers ();
+  int i;
+
+  system_base_dirs = flatpak_get_system_base_dir_locations (NULL, NULL);
+  if (system_base_dirs == NULL || metadata == NULL)
+    return NULL; /* Can't tell what a resolve would look at, don't cache */
+
+  g_checksum_update (checksum, (guchar *) "1", 2); /* plan format version */
+  g_checksum_update (checksum, (guchar *) full_ref, strlen (full_ref) + 1);
+  g_checksum_update (checksum, (guchar *) (use_ld_so_cache ? "ld-cache" : "ld-path"), -1);
+  g_checksum_update (checksum, (guchar *) metadata, strlen (metadata) + 1);
+
+  /* These feed the enable-if conditions of the extension points */
+  if (current_desktop != NULL)
+    g_checksum_update (checksum, (guchar *) current_desktop, strlen (current_desktop) + 1);
+  g_checksum_update (checksum, (guchar *) gtk_theme, strlen (gtk_theme) + 1);
+  for (i = 0; gl_drivers[i] != NULL; i++)
+    g_checksum_update (checksum, (guchar *) gl_drivers[i], strlen (gl_drivers[i]) + 1);
+
+  extension_plan_checksum_base_dir (checksum, user_base_dir);
+  for (i = 0; i < system_base_dirs->len; i++)
+    extension_plan_checksum_base_dir (checksum, g_ptr_array_index (system_base_dirs, i));
+
+  return g_strdup (g_checksum_get_string (checksum));
+}
+
+static GVariant *
+load_cache_file (GFile              *cache_file,
+                 const GVariantType *type)
+{
+  g_autoptr(GMappedFile) mfile = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) data = NULL;
+
+  mfile = g_mapped_file_new (flatpak_file_get_path_cached (cache_file), FALSE, NULL);
+  if (mfile == NULL)
+    return NULL;
+
+  bytes = g_mapped_file_get_bytes (mfile);
+  data = g_variant_take_ref (g_variant_new_from_bytes (type, bytes, FALSE));
+  if (!g_variant_is_normal_form (data))
+    return NULL;
+
+  /* Mark the entry as recently used so it survives pruning */
+  (void) utimensat (AT_FDCWD, flatpak_file_get_path_cached (cache_file), NULL, 0);
+
+  return g_steal_pointer (&data);
+}
+
+static void
+save_cache_file (GFile    *cache_file,
+                 GVariant *data)
+{
+  g_autoptr(GFile) cache_dir = g_file_get_parent (cache_file);
+  g_autoptr(GError) local_error = NULL;
+
+  if (!flatpak_mkdir_p (cache_dir, NULL, &local_error) ||
+      !g_file_replace_contents (cache_file,
+                                g_variant_get_data (data),
+                                g_variant_get_size (data),
+                                NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION,
+                                NULL, NULL, &local_error))
+    {
+      g_debug ("Failed to save %s: %s",
+               flatpak_file_get_path_cached (cache_file), local_error->message);
+      return;
+    }
+
+  prune_shared_cache_dir (cache_dir);
+}
+
+static void
+plan_add_args (GVariantBuilder *argv_builder,
+               ...)
+{
+  va_list args;
+  const char *arg;
+
+  va_start (args, argv_builder);
+  while ((arg = va_arg (args, const char *)) != NULL)
+    g_variant_builder_add (argv_builder, "s", arg);
+  va_end (args);
+}
+
+static gboolean
+apply_extension_plan (FlatpakBwrap *bwrap,
+                      GVariant     *plan,
+                      gboolean      is_app,
+                      char        **extensions_out,
+                      GError      **error)
+{
+  g_autofree const char **argv = NULL;
+  g_autoptr(GVariantIter) data_iter = NULL;
+  const char *ld_library_path;
+  const char *extensions;
+  const char *conf_path, *conf_contents;
+  int i;
+
+  g_variant_get (plan, "(^a&sa(ss)&s&s)",
+                 &argv, &data_iter, &ld_library_path, &extensions);
+
+  for (i = 0; argv[i] != NULL; i++)
+    flatpak_bwrap_add_arg (bwrap, argv[i]);
+
+  while (g_variant_iter_next (data_iter, "(&s&s)", &conf_path, &conf_contents))
+    {
+      if (!flatpak_bwrap_add_args_data (bwrap, "ld-so-conf",
+                                        conf_contents, -1, conf_path, error))
+        return FALSE;
+    }
+
+  if (*ld_library_path != 0)
+    {
+      g_autoptr(GString) full_ld_library_path = g_string_new (ld_library_path);
+      const gchar *old_ld_path = g_environ_getenv (bwrap->envp, "LD_LIBRARY_PATH");
+
+      if (old_ld_path != NULL && *old_ld_path != 0)
+        {
+          if (is_app)
+            {
+              g_string_append (full_ld_library_path, ":");
+              g_string_append (full_ld_library_path, old_ld_path);
+            }
+          else
+            {
+              g_string_prepend (full_ld_library_path, ":");
+              g_string_prepend (full_ld_library_path, old_ld_path);
+            }
+        }
+
+      flatpak_bwrap_set_env (bwrap, "LD_LIBRARY_PATH", full_ld_library_path->str, TRUE);
+    }
+
+  if (extensions_out)
+    *extensions_out = g_strdup (extensions);
+
+  return TRUE;
+}
+
 gboolean
 flatpak_run_add_extension_args (FlatpakBwrap *bwrap,
                                 GKeyFile     *metakey,
@@ -899,6 +1156,11 @@ flatpak_run_add_extension_args (FlatpakBwrap *bwrap,
     g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
   g_autoptr(GHashTable) created_symlink =
     g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autofree char *plan_checksum = NULL;
+  g_autoptr(GFile) plan_file = NULL;
+  g_autoptr(GVariant) plan = NULL;
+  GVariantBuilder argv_builder, data_builder;
+  gboolean plan_cacheable = TRUE;
 
   parts = g_strsplit (full_ref, "/", 0);
   if (g_strv_length (parts) != 4)
@@ -906,6 +1168,21 @@ flatpak_run_add_extension_args (FlatpakBwrap *bwrap,
 
   is_app = strcmp (parts[0], "app") == 0;
 
+  plan_checksum = calculate_extension_plan_checksum (metakey, full_ref, use_ld_so_cache);
+  if (plan_checksum != NULL)
+    {
+      g_autoptr(GFile) cache_base_dir = g_file_new_for_path (g_get_user_cache_dir ());
+      g_autofree char *plan_rel = g_build_filename ("flatpak", "extension-plan", plan_checksum, NULL);
+
+      plan_file = g_file_resolve_relative_path (cache_base_dir, plan_rel);
+      plan = load_cache_file (plan_file, EXTENSION_PLAN_GVARIANT_FORMAT);
+      if (plan != NULL)
+        return apply_extension_plan (bwrap, plan, is_app, extensions_out, error);
+    }
+
+  g_variant_builder_init (&argv_builder, G_VARIANT_TYPE ("as"));
+  g_variant_builder_init (&data_builder, G_VARIANT_TYPE ("a(ss)"));
+
   extensions = flatpak_list_extensions (metakey,
                                         parts[2], parts[3]);
 
@@ -928,21 +1205,21 @@ flatpak_run_add_extension_args (FlatpakBwrap *bwrap,
 
           if (g_hash_table_lookup (mounted_tmpfs, parent) == NULL)
             {
-              flatpak_bwrap_add_args (bwrap,
-                                      "--tmpfs", parent,
-                                      NULL);
+              plan_add_args (&argv_builder,
+                             "--tmpfs", parent,
+                             NULL);
               g_hash_table_insert (mounted_tmpfs, g_steal_pointer (&parent), "mounted");
             }
         }
 
-      flatpak_bwrap_add_args (bwrap,
-                              "--ro-bind", ext->files_path, full_directory,
-                              NULL);
+      plan_add_args (&argv_builder,
+                     "--ro-bind", ext->files_path, full_directory,
+                     NULL);
 
       if (g_file_test (real_ref, G_FILE_TEST_EXISTS))
-        flatpak_bwrap_add_args (bwrap,
-                                "--lock-file", ref,
-                                NULL);
+        plan_add_args (&argv_builder,
+                       "--lock-file", ref,
+                       NULL);
     }
 
   g_list_free (path_sorted_extensions);
@@ -956,6 +1233,11 @@ flatpak_run_add_extension_args (FlatpakBwrap *bwrap,
       g_autofree char *full_directory = g_build_filename (directory, ext->subdir_suffix, NULL);
       int i;
 
+      /* Local or unmaintained content can change without any of the
+       * inputs of the plan checksum changing, so never cache it */
+      if (ext->is_unmaintained || ext->commit == NULL)
+        plan_cacheable = FALSE;
+
       if (used_extensions->len > 0)
         g_string_append (used_extensions, ";");
       g_string_append (used_extensions, ext->installed_id);
@@ -976,9 +1258,8 @@ flatpak_run_add_extension_args (FlatpakBwrap *bwrap,
               g_autofree char *ld_so_conf_file = g_strdup_printf ("%s-%03d-%s.conf", parts[0], ++count, ext->installed_id);
               g_autofree char *ld_so_conf_file_path = g_build_filename ("/run/flatpak/ld.so.conf.d", ld_so_conf_file, NULL);
 
-              if (!flatpak_bwrap_add_args_data (bwrap, "ld-so-conf",
-                                                contents, -1, ld_so_conf_file_path, error))
-                return FALSE;
+              g_variant_builder_add (&data_builder, "(ss)",
+                                     ld_so_conf_file_path, contents);
             }
           else
             {
@@ -1005,9 +1286,9 @@ flatpak_run_add_extension_args (FlatpakBwrap *bwrap,
                   if (g_hash_table_lookup (created_symlink, symlink_path) == NULL)
                     {
                       g_autofree char *symlink = g_build_filename (directory, ext->merge_dirs[i], dent->d_name, NULL);
-                      flatpak_bwrap_add_args (bwrap,
-                                              "--symlink", symlink, symlink_path,
-                                              NULL);
+                      plan_add_args (&argv_builder,
+                                     "--symlink", symlink, symlink_path,
+                                     NULL);
                       g_hash_table_insert (created_symlink, g_steal_pointer (&symlink_path), "created");
                     }
                 }
@@ -1017,31 +1298,15 @@ flatpak_run_add_extension_args (FlatpakBwrap *bwrap,
 
   g_list_free_full (extensions, (GDestroyNotify) flatpak_extension_free);
 
-  if (ld_library_path->len != 0)
-    {
-      const gchar *old_ld_path = g_environ_getenv (bwrap->envp, "LD_LIBRARY_PATH");
+  plan = g_variant_ref_sink (g_variant_new (EXTENSION_PLAN_GVARIANT_STRING,
+                                            &argv_builder, &data_builder,
+                                            ld_library_path->str,
+                                            used_extensions->str));
 
-      if (old_ld_path != NULL && *old_ld_path != 0)
-        {
-          if (is_app)
-            {
-              g_string_append (ld_library_path, ":");
-              g_string_append (ld_library_path, old_ld_path);
-            }
-          else
-            {
-              g_string_prepend (ld_library_path, ":");
-              g_string_prepend (ld_library_path, old_ld_path);
-            }
-        }
-
-      flatpak_bwrap_set_env (bwrap, "LD_LIBRARY_PATH", ld_library_path->str, TRUE);
-    }
-
-  if (extensions_out)
-    *extensions_out = g_string_free (g_steal_pointer (&used_extensions), FALSE);
+  if (plan_cacheable && plan_file != NULL)
+    save_cache_file (plan_file, plan);
 
-  return TRUE;
+  return apply_extension_plan (bwrap, plan, is_app, extensions_out, error);
 }
 
 gboolean
@@ -1053,6 +1318,7 @@ flatpak_run_add_environment_args (FlatpakBwrap    *bwrap,
                                   GFile           *app_id_dir,
                                   GPtrArray       *previous_app_id_dirs,
                                   FlatpakExports **exports_out,
+                                  int             *proxy_sync_fd_out,
                                   GCancellable    *cancellable,
                                   GError         **error)
 {
@@ -1200,7 +1466,7 @@ flatpak_run_add_environment_args (FlatpakBwrap    *bwrap,
     }
 
   if (!flatpak_bwrap_is_empty (proxy_arg_bwrap) &&
-      !start_dbus_proxy (bwrap, proxy_arg_bwrap, app_info_path, error))
+      !start_dbus_proxy (bwrap, proxy_arg_bwrap, app_info_path, proxy_sync_fd_out, error))
     return FALSE;
 
   if (exports_out)
@@ -1449,24 +1715,6 @@ flatpak_ensure_data_dir (GFile        *app_id_dir,
   return TRUE;
 }
 
-struct JobData
-{
-  char      *job;
-  GMainLoop *main_loop;
-};
-
-static void
-job_removed_cb (SystemdManager *manager,
-                guint32         id,
-                char           *job,
-                char           *unit,
-                char           *result,
-                struct JobData *data)
-{
-  if (strcmp (job, data->job) == 0)
-    g_main_loop_quit (data->main_loop);
-}
-
 gboolean
 flatpak_run_in_transient_unit (const char *appid, GError **error)
 {
@@ -1480,8 +1728,6 @@ flatpak_run_in_transient_unit (const char *appid, GError **error)
   GVariant *properties = NULL;
   GVariant *aux = NULL;
   guint32 pid;
-  GMainLoop *main_loop = NULL;
-  struct JobData data;
   gboolean res = FALSE;
   g_autoptr(GMainContextPopDefault) main_context = NULL;
 
@@ -1492,7 +1738,6 @@ flatpak_run_in_transient_unit (const char *appid, GError **error)
                                _("No systemd user session available, cgroups not available"));
 
   main_context = flatpak_main_context_new_default ();
-  main_loop = g_main_loop_new (main_context, FALSE);
 
   address = g_strconcat ("unix:path=", path, NULL);
 
@@ -1504,7 +1749,8 @@ flatpak_run_in_transient_unit (const char *appid, GError **error)
     goto out;
 
   manager = systemd_manager_proxy_new_sync (conn,
-                                            G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES,
+                                            G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES |
+                                            G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS,
                                             NULL,
                                             "/org/freedesktop/systemd1",
                                             NULL, error);
@@ -1526,6 +1772,12 @@ flatpak_run_in_transient_unit (const char *appid, GError **error)
 
   aux = g_variant_new_array (G_VARIANT_TYPE ("(sa(sv))"), NULL, 0);
 
+  /* We don't wait for the start job to finish: once systemd has
+   * accepted the request the scope will be created, and since it is
+   * our own pid that gets migrated, the eventual exec of bwrap ends
+   * up in the scope no matter when the migration happens. Waiting for
+   * the job used to cost a noticeable chunk of launch time on a busy
+   * session. */
   if (!systemd_manager_call_start_transient_unit_sync (manager,
                                                        name,
                                                        "fail",
@@ -1536,17 +1788,9 @@ flatpak_run_in_transient_unit (const char *appid, GError **error)
                                                        error))
     goto out;
 
-  data.job = job;
-  data.main_loop = main_loop;
-  g_signal_connect (manager, "job-removed", G_CALLBACK (job_removed_cb), &data);
-
-  g_main_loop_run (main_loop);
-
   res = TRUE;
 
 out:
-  if (main_loop)
-    g_main_loop_unref (main_loop);
   if (manager)
     g_object_unref (manager);
 
@@ -1687,17 +1931,33 @@ flatpak_app_compute_permissions (GKeyFile *app_metadata,
   return g_steal_pointer (&app_context);
 }
 
+/* How often to scan for unused instance dirs. Scanning takes a lock
+ * per instance dir, which showed up as launch jitter in sessions with
+ * many concurrent apps, so we amortize it over multiple launches; a
+ * stale dir just wastes a bit of space until the next scan. */
+#define INSTANCE_GC_INTERVAL 60
+
 static void
 flatpak_run_gc_ids (void)
 {
   g_autofree char *base_dir = g_build_filename (g_get_user_runtime_dir (), ".flatpak", NULL);
   g_auto(GLnxDirFdIterator) iter = { 0 };
   struct dirent *dent;
+  struct stat stamp_buf;
+  glnx_autofd int stamp_fd = -1;
 
   /* Clean up unused instances */
   if (!glnx_dirfd_iterator_init_at (AT_FDCWD, base_dir, FALSE, &iter, NULL))
     return;
 
+  if (fstatat (iter.fd, ".gc-stamp", &stamp_buf, 0) == 0 &&
+      stamp_buf.st_mtime + INSTANCE_GC_INTERVAL > time (NULL))
+    return;
+
+  stamp_fd = openat (iter.fd, ".gc-stamp", O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+  if (stamp_fd != -1)
+    (void) futimens (stamp_fd, NULL);
+
   while (TRUE)
     {
       if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&iter, &dent, NULL, NULL))
@@ -1737,18 +1997,51 @@ flatpak_run_allocate_id (int *lock_fd_out)
 {
   g_autofree char *user_runtime_dir = flatpak_get_real_xdg_runtime_dir ();
   g_autofree char *base_dir = g_build_filename (user_runtime_dir, ".flatpak", NULL);
+  g_autofree char *counter_file = g_build_filename (base_dir, ".counter", NULL);
+  glnx_autofd int counter_fd = -1;
+  gboolean have_counter = FALSE;
+  guint64 counter = 0;
+  char counter_buf[32] = { 0 };
   int count;
 
   g_mkdir_with_parents (base_dir, 0755);
 
   flatpak_run_gc_ids ();
 
+  /* The counter makes the normal case O(1) in the number of existing
+   * instances: we hold a write lock on the counter file while bumping
+   * it, so concurrent launches each see a fresh value and the mkdir
+   * below succeeds on the first attempt. If anything goes wrong with
+   * the counter we fall back to random ids; either way the mkdir is
+   * what guarantees uniqueness. The lock is dropped when counter_fd
+   * is closed on return. */
+  counter_fd = open (counter_file, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (counter_fd != -1)
+    {
+      struct flock l = {
+        .l_type = F_WRLCK,
+        .l_whence = SEEK_SET,
+        .l_start = 0,
+        .l_len = 0
+      };
+
+      if (fcntl (counter_fd, F_SETLKW, &l) == 0)
+        {
+          if (pread (counter_fd, counter_buf, sizeof (counter_buf) - 1, 0) > 0)
+            counter = g_ascii_strtoull (counter_buf, NULL, 10);
+          have_counter = TRUE;
+        }
+    }
+
   for (count = 0; count < 1000; count++)
     {
       g_autofree char *instance_id = NULL;
       g_autofree char *instance_dir = NULL;
 
-      instance_id = g_strdup_printf ("%u", g_random_int ());
+      if (have_counter)
+        instance_id = g_strdup_printf ("%" G_GUINT64_FORMAT, ++counter);
+      else
+        instance_id = g_strdup_printf ("%u", g_random_int ());
 
       instance_dir = g_build_filename (base_dir, instance_id, NULL);
 
@@ -1774,6 +2067,14 @@ flatpak_run_allocate_id (int *lock_fd_out)
              We work around that by only gc:ing "old" .ref files */
           if (lock_fd != -1 && fcntl (lock_fd, F_SETLK, &l) == 0)
             {
+              if (have_counter)
+                {
+                  int len = g_snprintf (counter_buf, sizeof (counter_buf),
+                                        "%" G_GUINT64_FORMAT "\n", counter);
+                  if (pwrite (counter_fd, counter_buf, len, 0) == len)
+                    (void) ftruncate (counter_fd, len);
+                }
+
               *lock_fd_out = glnx_steal_fd (&lock_fd);
               g_debug ("Allocated instance id %s", instance_id);
               return g_steal_pointer (&instance_id);
@@ -1890,6 +2191,59 @@ path_is_similar (const char *path1, const char *path2)
   return TRUE;
 }
 
+/* s - converted defaults keyfile data
+ * s - converted user values keyfile data
+ * s - lock list
+ */
+#define DCONF_DATA_GVARIANT_STRING "(sss)"
+#define DCONF_DATA_GVARIANT_FORMAT G_VARIANT_TYPE (DCONF_DATA_GVARIANT_STRING)
+
+/* The conversion result only changes when the dconf databases (or the
+ * set of paths we read from them) change, so key the cache by the
+ * mtimes of the database files: the user database and the compiled
+ * system databases that the default profile reads. */
+static char *
+calculate_dconf_data_checksum (const char  *app_id,
+                               const char **paths,
+                               const char  *migrate_path)
+{
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_autofree char *user_db = g_build_filename (g_get_user_config_dir (), "dconf", "user", NULL);
+  g_auto(GLnxDirFdIterator) db_iter = { 0 };
+  g_autoptr(GPtrArray) db_names = g_ptr_array_new_with_free_func (g_free);
+  struct dirent *dent;
+  int i;
+
+  g_checksum_update (checksum, (guchar *) "1", 2); /* cache format version */
+  g_checksum_update (checksum, (guchar *) app_id, strlen (app_id) + 1);
+  if (migrate_path)
+    g_checksum_update (checksum, (guchar *) migrate_path, strlen (migrate_path) + 1);
+  for (i = 0; paths != NULL && paths[i] != NULL; i++)
+    g_checksum_update (checksum, (guchar *) paths[i], strlen (paths[i]) + 1);
+
+  checksum_file_mtime (checksum, user_db);
+  checksum_file_mtime (checksum, "/etc/dconf/profile/user");
+  checksum_file_mtime (checksum, "/etc/dconf/db");
+
+  if (glnx_dirfd_iterator_init_at (AT_FDCWD, "/etc/dconf/db", FALSE, &db_iter, NULL))
+    {
+      while (glnx_dirfd_iterator_next_dent (&db_iter, &dent, NULL, NULL) && dent != NULL)
+        g_ptr_array_add (db_names, g_strdup (dent->d_name));
+
+      /* Sort for a stable checksum, readdir order is arbitrary */
+      g_ptr_array_sort (db_names, flatpak_strcmp0_ptr);
+
+      for (i = 0; i < db_names->len; i++)
+        {
+          g_autofree char *db_path = g_build_filename ("/etc/dconf/db", g_ptr_array_index (db_names, i), NULL);
+
+          checksum_file_mtime (checksum, db_path);
+        }
+    }
+
+  return g_strdup (g_checksum_get_string (checksum));
+}
+
 #endif /* HAVE_DCONF */
 
 static void
@@ -1906,6 +2260,8 @@ get_dconf_data (const char  *app_id,
 #ifdef HAVE_DCONF
   DConfClient *client = NULL;
   g_autofree char *prefix = NULL;
+  g_autofree char *cache_checksum = NULL;
+  g_autoptr(GFile) cache_file = NULL;
 #endif
   g_autoptr(GKeyFile) defaults_data = NULL;
   g_autoptr(GKeyFile) values_data = NULL;
@@ -1917,6 +2273,25 @@ get_dconf_data (const char  *app_id,
 
 #ifdef HAVE_DCONF
 
+  cache_checksum = calculate_dconf_data_checksum (app_id, paths, migrate_path);
+  if (cache_checksum != NULL)
+    {
+      g_autofree char *cache_path = g_build_filename (g_get_user_cache_dir (), "flatpak",
+                                                      "dconf", cache_checksum, NULL);
+      g_autoptr(GVariant) cached = NULL;
+
+      cache_file = g_file_new_for_path (cache_path);
+      cached = load_cache_file (cache_file, DCONF_DATA_GVARIANT_FORMAT);
+      if (cached != NULL)
+        {
+          g_variant_get (cached, DCONF_DATA_GVARIANT_STRING, defaults, values, locks);
+          *defaults_size = strlen (*defaults);
+          *values_size = strlen (*values);
+          *locks_size = strlen (*locks);
+          return;
+        }
+    }
+
   client = dconf_client_new ();
 
   prefix = dconf_path_for_app_id (app_id);
@@ -1971,6 +2346,15 @@ get_dconf_data (const char  *app_id,
 
 #ifdef HAVE_DCONF
   g_object_unref (client);
+
+  if (cache_file != NULL)
+    {
+      g_autoptr(GVariant) cached =
+        g_variant_ref_sink (g_variant_new (DCONF_DATA_GVARIANT_STRING,
+                                           *defaults, *values, *locks));
+
+      save_cache_file (cache_file, cached);
+    }
 #endif
 }
 
@@ -2547,6 +2931,43 @@ setup_seccomp (FlatpakBwrap   *bwrap,
   int last_allowed_family;
   int i, r;
   g_auto(GLnxTmpfile) seccomp_tmpf  = { 0, };
+  FlatpakRunFlags filter_flags = run_flags & (FLATPAK_RUN_FLAG_MULTIARCH |
+                                              FLATPAK_RUN_FLAG_DEVEL |
+                                              FLATPAK_RUN_FLAG_CANBUS |
+                                              FLATPAK_RUN_FLAG_BLUETOOTH);
+  const struct scmp_version *scmp_ver = seccomp_version ();
+  g_autofree char *bpf_cache_path = NULL;
+  glnx_autofd int bpf_cache_fd = -1;
+
+  /* The compiled filter only depends on the target arch, the allowed
+   * personality and the sandbox feature flags, so cache the exported
+   * bpf keyed by those (plus the flatpak version, since the syscall
+   * blocklists above are baked into the binary and grow over time, and
+   * the libseccomp version, since the output can change between
+   * versions) and reuse it on later launches instead of recompiling
+   * the same program every time. */
+  if (scmp_ver != NULL)
+    {
+      g_autofree char *bpf_cache_name =
+        g_strdup_printf ("%s-%s-%lx-%x-%u.%u.%u.bpf",
+                         PACKAGE_VERSION,
+                         arch ? arch : "default", allowed_personality,
+                         (guint) filter_flags,
+                         scmp_ver->major, scmp_ver->minor, scmp_ver->micro);
+
+      bpf_cache_path = g_build_filename (g_get_user_cache_dir (), "flatpak",
+                                         "seccomp", bpf_cache_name, NULL);
+      bpf_cache_fd = open (bpf_cache_path, O_RDONLY | O_CLOEXEC);
+      if (bpf_cache_fd != -1)
+        {
+          /* Mark the filter as recently used so it survives pruning */
+          (void) utimensat (AT_FDCWD, bpf_cache_path, NULL, 0);
+
+          flatpak_bwrap_add_args_data_fd (bwrap,
+                                          "--seccomp", glnx_steal_fd (&bpf_cache_fd), NULL);
+          return TRUE;
+        }
+    }
 
   seccomp = seccomp_init (SCMP_ACT_ALLOW);
   if (!seccomp)
@@ -2666,6 +3087,34 @@ setup_seccomp (FlatpakBwrap   *bwrap,
 
   lseek (seccomp_tmpf.fd, 0, SEEK_SET);
 
+  if (bpf_cache_path != NULL)
+    {
+      g_autofree char *bpf_cache_dir = g_path_get_dirname (bpf_cache_path);
+      g_autoptr(GBytes) bpf = NULL;
+      g_autoptr(GError) local_error = NULL;
+
+      bpf = glnx_fd_readall_bytes (seccomp_tmpf.fd, NULL, &local_error);
+      if (bpf == NULL ||
+          g_mkdir_with_parents (bpf_cache_dir, 0755) != 0 ||
+          !glnx_file_replace_contents_at (AT_FDCWD, bpf_cache_path,
+                                          g_bytes_get_data (bpf, NULL),
+                                          g_bytes_get_size (bpf),
+                                          GLNX_FILE_REPLACE_NODATASYNC,
+                                          NULL, &local_error))
+        {
+          g_debug ("Failed to cache seccomp filter: %s",
+                   local_error ? local_error->message : g_strerror (errno));
+        }
+      else
+        {
+          g_autoptr(GFile) cache_dir_file = g_file_new_for_path (bpf_cache_dir);
+
+          prune_shared_cache_dir (cache_dir_file);
+        }
+
+      lseek (seccomp_tmpf.fd, 0, SEEK_SET);
+    }
+
   flatpak_bwrap_add_args_data_fd (bwrap,
                                   "--seccomp", glnx_steal_fd (&seccomp_tmpf.fd), NULL);
 
@@ -3105,7 +3554,13 @@ regenerate_ld_cache (GPtrArray    *base_argv_array,
   ld_so_cache = g_file_get_child (ld_so_dir, checksum);
   ld_so_fd = open (flatpak_file_get_path_cached (ld_so_cache), O_RDONLY);
   if (ld_so_fd >= 0)
-    return glnx_steal_fd (&ld_so_fd);
+    {
+      /* In the shared cache dir the entries are pruned by last use,
+       * so mark the reuse */
+      if (app_id_dir == NULL)
+        (void) utimensat (AT_FDCWD, flatpak_file_get_path_cached (ld_so_cache), NULL, 0);
+      return glnx_steal_fd (&ld_so_fd);
+    }
 
   g_debug ("Regenerating ld.so.cache %s", flatpak_file_get_path_cached (ld_so_cache));
 
@@ -3181,8 +3636,12 @@ regenerate_ld_cache (GPtrArray    *base_argv_array,
 
   if (app_id_dir == NULL)
     {
-      /* For runs without an app id dir we always regenerate the ld.so.cache */
-      unlink (flatpak_file_get_path_cached (ld_so_cache));
+      /* Runs without an app id dir (runtime shells, sandboxed builds)
+       * share a checksum-keyed cache dir. The checksum covers the
+       * app/runtime commits and the extension set, so deploy changes
+       * simply key a new entry; entries that have not been used for a
+       * while are pruned here, off the reuse fast path. */
+      prune_shared_cache_dir (ld_so_dir);
     }
   else
     {
@@ -3245,6 +3704,7 @@ flatpak_run_app (const char     *app_ref,
   g_autofree char *runtime_extensions = NULL;
   g_autofree char *checksum = NULL;
   int ld_so_fd = -1;
+  int proxy_sync_fd = -1;
   g_autoptr(GFile) runtime_ld_so_conf = NULL;
   gboolean generate_ld_so_conf = TRUE;
   gboolean use_ld_so_cache = TRUE;
@@ -3256,6 +3716,8 @@ flatpak_run_app (const char     *app_ref,
   if (app_ref_parts == NULL)
     return FALSE;
 
+  flatpak_startup_trace ("run-app-start");
+
   bwrap = flatpak_bwrap_new (NULL);
   flatpak_bwrap_add_arg (bwrap, flatpak_get_bwrap ());
 
@@ -3446,6 +3908,8 @@ flatpak_run_app (const char     *app_ref,
         app_id_dir = g_object_ref (real_app_id_dir);
     }
 
+  flatpak_startup_trace ("resolve-deploys");
+
   flatpak_run_apply_env_default (bwrap, use_ld_so_cache);
   flatpak_run_apply_env_vars (bwrap, app_context);
   flatpak_run_apply_env_prompt (bwrap, app_ref_parts[1]);
@@ -3478,6 +3942,8 @@ flatpak_run_app (const char     *app_ref,
   if (!flatpak_run_add_extension_args (bwrap, runtime_metakey, runtime_ref, use_ld_so_cache, &runtime_extensions, cancellable, error))
     return FALSE;
 
+  flatpak_startup_trace ("add-extension-args");
+
   runtime_ld_so_conf = g_file_resolve_relative_path (runtime_files, "etc/ld.so.conf");
   if (lstat (flatpak_file_get_path_cached (runtime_ld_so_conf), &s) == 0)
     generate_ld_so_conf = S_ISREG (s.st_mode) && s.st_size == 0;
@@ -3498,6 +3964,8 @@ flatpak_run_app (const char     *app_ref,
       if (ld_so_fd == -1)
         return FALSE;
       flatpak_bwrap_add_fd (bwrap, ld_so_fd);
+
+      flatpak_startup_trace ("ld-so-cache");
     }
 
   flags |= flatpak_context_get_run_flags (app_context);
@@ -3528,17 +3996,23 @@ flatpak_run_app (const char     *app_ref,
                                       &app_info_path, &instance_id_host_dir, error))
     return FALSE;
 
+  flatpak_startup_trace ("add-app-info-args");
+
   if (!flatpak_run_add_dconf_args (bwrap, app_ref_parts[1], metakey, error))
     return FALSE;
 
+  flatpak_startup_trace ("add-dconf-args");
+
   if (!sandboxed && !(flags & FLATPAK_RUN_FLAG_NO_DOCUMENTS_PORTAL))
     add_document_portal_args (bwrap, app_ref_parts[1], &doc_mount_path);
 
   if (!flatpak_run_add_environment_args (bwrap, app_info_path, flags,
                                          app_ref_parts[1], app_context, app_id_dir, previous_app_id_dirs,
-                                         &exports, cancellable, error))
+                                         &exports, &proxy_sync_fd, cancellable, error))
     return FALSE;
 
+  flatpak_startup_trace ("add-environment-args");
+
   flatpak_run_add_journal_args (bwrap);
   add_font_path_args (bwrap);
   add_icon_path_args (bwrap);
@@ -3586,6 +4060,15 @@ flatpak_run_app (const char     *app_ref,
   commandline = flatpak_quote_argv ((const char **) bwrap->argv->pdata, -1);
   g_debug ("Running '%s'", commandline);
 
+  /* The dbus proxy has been starting up in parallel with the argv
+     assembly above; don't hand the sockets to the app before it
+     listens on them. */
+  if (proxy_sync_fd != -1 &&
+      !wait_for_dbus_proxy (proxy_sync_fd, error))
+    return FALSE;
+
+  flatpak_startup_trace ("exec-bwrap");
+
   if ((flags & FLATPAK_RUN_FLAG_BACKGROUND) != 0)
     {
       GPid child_pid;
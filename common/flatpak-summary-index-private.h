@@ -0,0 +1,54 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FLATPAK_SUMMARY_INDEX_PRIVATE_H__
+#define __FLATPAK_SUMMARY_INDEX_PRIVATE_H__
+
+#include <gio/gio.h>
+
+/* A FlatpakSummaryIndex is a small binary file generated from a remote
+ * summary when it is downloaded. It contains a sorted table of all the
+ * refs in the summary with their commit checksums, so that individual
+ * ref lookups can be answered with a binary search over a shared
+ * read-only mapping instead of re-parsing the summary GVariant in every
+ * process. */
+
+typedef struct FlatpakSummaryIndex FlatpakSummaryIndex;
+
+gboolean             flatpak_summary_index_save (GBytes       *summary_bytes,
+                                                 GFile        *file,
+                                                 GCancellable *cancellable,
+                                                 GError      **error);
+FlatpakSummaryIndex *flatpak_summary_index_open (GFile        *file,
+                                                 GBytes       *summary_bytes,
+                                                 GError      **error);
+FlatpakSummaryIndex *flatpak_summary_index_ref (FlatpakSummaryIndex *index);
+void                 flatpak_summary_index_unref (FlatpakSummaryIndex *index);
+gboolean             flatpak_summary_index_lookup (FlatpakSummaryIndex *index,
+                                                   const char          *collection_id,
+                                                   const char          *ref,
+                                                   char               **out_checksum);
+gboolean             flatpak_summary_index_lookup_cache (FlatpakSummaryIndex *index,
+                                                         const char          *ref,
+                                                         guint64             *out_installed_size,
+                                                         guint64             *out_download_size,
+                                                         const char         **out_metadata);
+const char          *flatpak_summary_index_get_summary_digest (FlatpakSummaryIndex *index);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakSummaryIndex, flatpak_summary_index_unref)
+
+#endif /* __FLATPAK_SUMMARY_INDEX_PRIVATE_H__ */
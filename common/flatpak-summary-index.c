@@ -0,0 +1,427 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <ostree.h>
+
+#include "flatpak-summary-index-private.h"
+#include "flatpak-utils-private.h"
+
+/* The index file layout is:
+ *
+ *   FlatpakSummaryIndexHeader
+ *   n_refs * FlatpakSummaryIndexEntry   (sorted by key)
+ *   string table of nul-terminated keys
+ *
+ * The key is the ref name, or for refs from the collection map
+ * "collection-id\nref". All integers are little endian, and entries are
+ * fixed size so that a lookup never has to touch more than O(log n)
+ * pages of the mapping. The header embeds the sha256 of the summary the
+ * index was generated from, which is how readers detect a stale index.
+ *
+ * Version 2 additionally stores the xa.cache data for each ref
+ * (installed size, download size and the metadata contents, the latter
+ * in the string table), making the index a complete resolution cache:
+ * resolving a ref to a commit plus its sizes and metadata only needs
+ * the shared mapping, and only the first process after a summary change
+ * pays for generating it.
+ */
+
+#define FLATPAK_SUMMARY_INDEX_MAGIC "FPsumIdx"
+#define FLATPAK_SUMMARY_INDEX_VERSION 2
+
+/* In FlatpakSummaryIndexEntry.data_offset, means the summary had no
+ * xa.cache entry for this ref */
+#define NO_CACHE_DATA G_MAXUINT32
+
+typedef struct
+{
+  char    magic[8];
+  guint32 version;
+  guint32 n_refs;
+  char    summary_digest[64];
+} FlatpakSummaryIndexHeader;
+
+typedef struct
+{
+  guint32 key_offset;
+  guint32 data_offset; /* of the metadata contents, or NO_CACHE_DATA */
+  guint64 installed_size;
+  guint64 download_size;
+  char    checksum[64];
+} FlatpakSummaryIndexEntry;
+
+struct FlatpakSummaryIndex
+{
+  int          refcount;
+  GMappedFile *mfile;
+  const FlatpakSummaryIndexEntry *entries;
+  const char  *string_table;
+  gsize        string_table_len;
+  guint32      n_refs;
+};
+
+typedef struct
+{
+  char    *key;
+  char    *checksum;
+  char    *metadata;
+  guint64  installed_size;
+  guint64  download_size;
+  gboolean has_cache_data;
+} IndexRef;
+
+static void
+index_ref_free (IndexRef *ref)
+{
+  g_free (ref->key);
+  g_free (ref->checksum);
+  g_free (ref->metadata);
+  g_free (ref);
+}
+
+static int
+compare_index_refs (gconstpointer a, gconstpointer b)
+{
+  const IndexRef *ref_a = *(IndexRef **) a;
+  const IndexRef *ref_b = *(IndexRef **) b;
+
+  return strcmp (ref_a->key, ref_b->key);
+}
+
+static void
+collect_refs_from_list (GPtrArray  *refs,
+                        GVariant   *ref_list,
+                        const char *collection_id,
+                        GVariant   *cache)
+{
+  gsize n, i;
+
+  n = g_variant_n_children (ref_list);
+  for (i = 0; i < n; i++)
+    {
+      g_autoptr(GVariant) child = g_variant_get_child_value (ref_list, i);
+      g_autoptr(GVariant) commit_csum_v = NULL;
+      const char *ref_name;
+      g_autofree char *checksum = NULL;
+      IndexRef *ref;
+      int pos;
+
+      g_variant_get_child (child, 0, "&s", &ref_name);
+      g_variant_get_child (child, 1, "(t@ay@a{sv})", NULL, &commit_csum_v, NULL);
+
+      if (!ostree_validate_structureof_csum_v (commit_csum_v, NULL))
+        continue;
+
+      checksum = ostree_checksum_from_bytes_v (commit_csum_v);
+
+      ref = g_new0 (IndexRef, 1);
+      if (collection_id != NULL)
+        ref->key = g_strconcat (collection_id, "\n", ref_name, NULL);
+      else
+        ref->key = g_strdup (ref_name);
+      ref->checksum = g_steal_pointer (&checksum);
+
+      if (cache != NULL && flatpak_variant_bsearch_str (cache, ref_name, &pos))
+        {
+          g_autoptr(GVariant) refdata = g_variant_get_child_value (cache, pos);
+          g_autoptr(GVariant) res = g_variant_get_child_value (refdata, 1);
+          const char *metadata = NULL;
+          guint64 v;
+
+          g_variant_get_child (res, 0, "t", &v);
+          ref->installed_size = GUINT64_FROM_BE (v);
+          g_variant_get_child (res, 1, "t", &v);
+          ref->download_size = GUINT64_FROM_BE (v);
+          g_variant_get_child (res, 2, "&s", &metadata);
+          ref->metadata = g_strdup (metadata);
+          ref->has_cache_data = TRUE;
+        }
+
+      g_ptr_array_add (refs, ref);
+    }
+}
+
+gboolean
+flatpak_summary_index_save (GBytes       *summary_bytes,
+                            GFile        *file,
+                            GCancellable *cancellable,
+                            GError      **error)
+{
+  g_autoptr(GVariant) summary = NULL;
+  g_autoptr(GVariant) ref_list = NULL;
+  g_autoptr(GVariant) metadata = NULL;
+  g_autoptr(GVariant) collection_map = NULL;
+  g_autoptr(GVariant) cache_v = NULL;
+  g_autoptr(GVariant) cache = NULL;
+  g_autoptr(GPtrArray) refs = g_ptr_array_new_with_free_func ((GDestroyNotify) index_ref_free);
+  g_autofree char *summary_digest = NULL;
+  g_autoptr(GString) string_table = g_string_new (NULL);
+  g_autoptr(GByteArray) data = g_byte_array_new ();
+  FlatpakSummaryIndexHeader header = { FLATPAK_SUMMARY_INDEX_MAGIC };
+  gsize i;
+
+  summary = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (OSTREE_SUMMARY_GVARIANT_STRING),
+                                                          summary_bytes, FALSE));
+
+  metadata = g_variant_get_child_value (summary, 1);
+
+  cache_v = g_variant_lookup_value (metadata, "xa.cache", NULL);
+  if (cache_v != NULL)
+    cache = g_variant_get_child_value (cache_v, 0);
+
+  ref_list = g_variant_get_child_value (summary, 0);
+  collect_refs_from_list (refs, ref_list, NULL, cache);
+
+  collection_map = g_variant_lookup_value (metadata, "ostree.summary.collection-map",
+                                           G_VARIANT_TYPE ("a{sa(s(taya{sv}))}"));
+  if (collection_map != NULL)
+    {
+      GVariantIter iter;
+      const char *collection_id;
+      GVariant *collection_refs;
+
+      g_variant_iter_init (&iter, collection_map);
+      while (g_variant_iter_loop (&iter, "{&s@a(s(taya{sv}))}", &collection_id, &collection_refs))
+        collect_refs_from_list (refs, collection_refs, collection_id, cache);
+    }
+
+  g_ptr_array_sort (refs, compare_index_refs);
+
+  summary_digest = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, summary_bytes);
+
+  header.version = GUINT32_TO_LE (FLATPAK_SUMMARY_INDEX_VERSION);
+  header.n_refs = GUINT32_TO_LE ((guint32) refs->len);
+  memcpy (header.summary_digest, summary_digest, 64);
+  g_byte_array_append (data, (guint8 *) &header, sizeof header);
+
+  for (i = 0; i < refs->len; i++)
+    {
+      IndexRef *ref = g_ptr_array_index (refs, i);
+      FlatpakSummaryIndexEntry entry = { 0 };
+
+      entry.key_offset = GUINT32_TO_LE ((guint32) string_table->len);
+      g_string_append_len (string_table, ref->key, strlen (ref->key) + 1);
+
+      if (ref->has_cache_data)
+        {
+          entry.data_offset = GUINT32_TO_LE ((guint32) string_table->len);
+          entry.installed_size = GUINT64_TO_LE (ref->installed_size);
+          entry.download_size = GUINT64_TO_LE (ref->download_size);
+          g_string_append_len (string_table, ref->metadata, strlen (ref->metadata) + 1);
+        }
+      else
+        entry.data_offset = GUINT32_TO_LE (NO_CACHE_DATA);
+
+      memcpy (entry.checksum, ref->checksum, strlen (ref->checksum));
+      g_byte_array_append (data, (guint8 *) &entry, sizeof entry);
+    }
+
+  g_byte_array_append (data, (guint8 *) string_table->str, string_table->len);
+
+  return g_file_replace_contents (file, (char *) data->data, data->len,
+                                  NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION,
+                                  NULL, cancellable, error);
+}
+
+FlatpakSummaryIndex *
+flatpak_summary_index_open (GFile   *file,
+                            GBytes  *summary_bytes,
+                            GError **error)
+{
+  g_autoptr(GMappedFile) mfile = NULL;
+  g_autofree char *summary_digest = NULL;
+  const FlatpakSummaryIndexHeader *header;
+  FlatpakSummaryIndex *index;
+  const char *contents;
+  gsize len, entries_len;
+  guint32 n_refs;
+
+  mfile = g_mapped_file_new (flatpak_file_get_path_cached (file), FALSE, error);
+  if (mfile == NULL)
+    return NULL;
+
+  contents = g_mapped_file_get_contents (mfile);
+  len = g_mapped_file_get_length (mfile);
+
+  if (len < sizeof (FlatpakSummaryIndexHeader))
+    {
+      flatpak_fail (error, "Summary index too small");
+      return NULL;
+    }
+
+  header = (const FlatpakSummaryIndexHeader *) contents;
+  if (memcmp (header->magic, FLATPAK_SUMMARY_INDEX_MAGIC, 8) != 0 ||
+      GUINT32_FROM_LE (header->version) != FLATPAK_SUMMARY_INDEX_VERSION)
+    {
+      flatpak_fail (error, "Invalid summary index header");
+      return NULL;
+    }
+
+  summary_digest = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, summary_bytes);
+  if (memcmp (header->summary_digest, summary_digest, 64) != 0)
+    {
+      flatpak_fail (error, "Summary index is out of date");
+      return NULL;
+    }
+
+  n_refs = GUINT32_FROM_LE (header->n_refs);
+  entries_len = (gsize) n_refs * sizeof (FlatpakSummaryIndexEntry);
+  if (entries_len > len - sizeof (FlatpakSummaryIndexHeader))
+    {
+      flatpak_fail (error, "Summary index truncated");
+      return NULL;
+    }
+
+  index = g_new0 (FlatpakSummaryIndex, 1);
+  index->refcount = 1;
+  index->mfile = g_steal_pointer (&mfile);
+  index->entries = (const FlatpakSummaryIndexEntry *) (contents + sizeof (FlatpakSummaryIndexHeader));
+  index->string_table = contents + sizeof (FlatpakSummaryIndexHeader) + entries_len;
+  index->string_table_len = len - sizeof (FlatpakSummaryIndexHeader) - entries_len;
+  index->n_refs = n_refs;
+
+  return index;
+}
+
+FlatpakSummaryIndex *
+flatpak_summary_index_ref (FlatpakSummaryIndex *index)
+{
+  g_assert (index->refcount > 0);
+  index->refcount++;
+  return index;
+}
+
+void
+flatpak_summary_index_unref (FlatpakSummaryIndex *index)
+{
+  g_assert (index->refcount > 0);
+  index->refcount--;
+
+  if (index->refcount == 0)
+    {
+      g_mapped_file_unref (index->mfile);
+      g_free (index);
+    }
+}
+
+/* Looks up the key at @entry, returning NULL if its offset points
+ * outside the string table (i.e. the index file is corrupt). */
+static const char *
+summary_index_get_key (FlatpakSummaryIndex            *index,
+                       const FlatpakSummaryIndexEntry *entry)
+{
+  guint32 key_offset = GUINT32_FROM_LE (entry->key_offset);
+
+  if (key_offset >= index->string_table_len)
+    return NULL;
+
+  return index->string_table + key_offset;
+}
+
+static const FlatpakSummaryIndexEntry *
+summary_index_find_entry (FlatpakSummaryIndex *index,
+                          const char          *collection_id,
+                          const char          *ref)
+{
+  g_autofree char *key = NULL;
+  guint32 lo = 0, hi = index->n_refs;
+
+  if (collection_id != NULL)
+    key = g_strconcat (collection_id, "\n", ref, NULL);
+  else
+    key = g_strdup (ref);
+
+  while (lo < hi)
+    {
+      guint32 mid = lo + (hi - lo) / 2;
+      const FlatpakSummaryIndexEntry *entry = &index->entries[mid];
+      const char *entry_key = summary_index_get_key (index, entry);
+      int cmp;
+
+      if (entry_key == NULL)
+        return NULL;
+
+      cmp = strcmp (key, entry_key);
+      if (cmp == 0)
+        return entry;
+      else if (cmp < 0)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+
+  return NULL;
+}
+
+gboolean
+flatpak_summary_index_lookup (FlatpakSummaryIndex *index,
+                              const char          *collection_id,
+                              const char          *ref,
+                              char               **out_checksum)
+{
+  const FlatpakSummaryIndexEntry *entry = summary_index_find_entry (index, collection_id, ref);
+
+  if (entry == NULL)
+    return FALSE;
+
+  if (out_checksum)
+    *out_checksum = g_strndup (entry->checksum, 64);
+  return TRUE;
+}
+
+gboolean
+flatpak_summary_index_lookup_cache (FlatpakSummaryIndex *index,
+                                    const char          *ref,
+                                    guint64             *out_installed_size,
+                                    guint64             *out_download_size,
+                                    const char         **out_metadata)
+{
+  const FlatpakSummaryIndexEntry *entry = summary_index_find_entry (index, NULL, ref);
+  guint32 data_offset;
+
+  if (entry == NULL)
+    return FALSE;
+
+  data_offset = GUINT32_FROM_LE (entry->data_offset);
+  if (data_offset == NO_CACHE_DATA || data_offset >= index->string_table_len)
+    return FALSE;
+
+  if (out_installed_size)
+    *out_installed_size = GUINT64_FROM_LE (entry->installed_size);
+  if (out_download_size)
+    *out_download_size = GUINT64_FROM_LE (entry->download_size);
+  if (out_metadata)
+    *out_metadata = index->string_table + data_offset;
+
+  return TRUE;
+}
+
+/* The sha256 of the summary this index was generated from, as 64 hex
+ * characters (not NUL terminated), borrowed from the mapping. Useful as
+ * a compact stand-in for the summary contents in cache keys. */
+const char *
+flatpak_summary_index_get_summary_digest (FlatpakSummaryIndex *index)
+{
+  const FlatpakSummaryIndexHeader *header =
+    (const FlatpakSummaryIndexHeader *) g_mapped_file_get_contents (index->mfile);
+
+  return header->summary_digest;
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#ifndef __FLATPAK_TRACE_H__
+#define __FLATPAK_TRACE_H__
+
+/* Static userspace tracepoints (USDT) under the "flatpak" provider,
+ * placed at the phase boundaries of the pull, deploy and launch hot
+ * paths. When sys/sdt.h is available each probe compiles to a single
+ * nop that tools like perf, bpftrace and sysprof can attach to on a
+ * stock installed binary; without it the probes compile to nothing.
+ * Probe names and arguments are part of the tooling interface, so
+ * treat them like ABI when changing them. */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define FLATPAK_TRACE(probe, ...) STAP_PROBEV (flatpak, probe, ## __VA_ARGS__)
+#else
+#define FLATPAK_TRACE(probe, ...) do { } while (0)
+#endif
+
+#endif /* __FLATPAK_TRACE_H__ */
@@ -27,6 +27,9 @@
 #include "flatpak-transaction-private.h"
 #include "flatpak-installation-private.h"
 #include "flatpak-utils-private.h"
+#include "flatpak-trace-private.h"
+#include "flatpak-profile-private.h"
+#include "flatpak-memory-private.h"
 #include "flatpak-error.h"
 
 /**
@@ -102,8 +105,11 @@ struct _FlatpakTransactionOperation
   FlatpakTransactionOperationType kind;
   gboolean                        non_fatal;
   gboolean                        failed;
+  gboolean                        completed;
   gboolean                        skip;
   gboolean                        update_only_deploy;
+  gboolean                        download_queued;
+  gboolean                        download_done;
 
   gboolean                        resolved;
   char                           *resolved_commit;
@@ -156,9 +162,22 @@ struct _FlatpakTransactionPrivate
   gboolean                     disable_related;
   gboolean                     reinstall;
   gboolean                     force_uninstall;
+  gboolean                     resumable;
+  gboolean                     dry_run;
   gboolean                     can_run;
   char                        *default_arch;
   guint                        max_op;
+  guint                        max_parallel_downloads;
+
+  /* Signalled by the download pool workers as operations finish
+   * downloading, so the execution loop can pipeline deploys with the
+   * remaining downloads */
+  GMutex                       download_lock;
+  GCond                        download_cond;
+
+  /* State of an earlier interrupted transaction, loaded when resumable
+   * is set; NULL if there is none */
+  GKeyFile                    *saved_state;
 
   gboolean                     needs_resolve;
 };
@@ -189,6 +208,7 @@ struct _FlatpakTransactionProgress
   gboolean             estimating;
   int                  progress;
   guint64              total_transferred;
+  guint                fetched_objects;
   guint64              start_time;
 
   gboolean             done;
@@ -305,6 +325,21 @@ flatpak_transaction_progress_get_bytes_transferred (FlatpakTransactionProgress *
   return self->total_transferred;
 }
 
+/**
+ * flatpak_transaction_progress_get_fetched_objects:
+ * @self: a #FlatpakTransactionProgress
+ *
+ * Gets the number of objects that have been fetched.
+ *
+ * Returns: the number of fetched objects
+ * Since: 1.4
+ */
+guint
+flatpak_transaction_progress_get_fetched_objects (FlatpakTransactionProgress *self)
+{
+  return self->fetched_objects;
+}
+
 /**
  * flatpak_transaction_progress_get_start_time:
  * @self: a #FlatpakTransactionProgress
@@ -363,19 +398,25 @@ got_progress_cb (const char *status,
   FlatpakTransactionProgress *p = user_data;
   guint64 bytes_transferred;
   guint64 transferred_extra_data_bytes;
+  guint fetched;
   guint64 start_time;
 
   ostree_async_progress_get (p->ostree_progress,
                              "bytes-transferred", "t", &bytes_transferred,
                              "transferred-extra-data-bytes", "t", &transferred_extra_data_bytes,
+                             "fetched", "u", &fetched,
                              "start-time", "t", &start_time,
                              NULL);
 
-  g_free (p->status);
-  p->status = g_strdup (status);
+  if (g_strcmp0 (p->status, status) != 0)
+    {
+      g_free (p->status);
+      p->status = g_strdup (status);
+    }
   p->progress = progress;
   p->estimating = estimating;
   p->total_transferred = bytes_transferred + transferred_extra_data_bytes;
+  p->fetched_objects = fetched;
   p->start_time = start_time;
 
   if (!p->done)
@@ -560,7 +601,10 @@ flatpak_transaction_operation_finalize (GObject *object)
     g_bytes_unref (self->external_metadata);
   g_free (self->resolved_commit);
   if (self->resolved_metadata)
-    g_bytes_unref (self->resolved_metadata);
+    {
+      flatpak_memory_free (FLATPAK_MEMORY_TRANSACTION, g_bytes_get_size (self->resolved_metadata));
+      g_bytes_unref (self->resolved_metadata);
+    }
   if (self->resolved_metakey)
     g_key_file_unref (self->resolved_metakey);
   if (self->resolved_old_metadata)
@@ -569,6 +613,8 @@ flatpak_transaction_operation_finalize (GObject *object)
     g_key_file_unref (self->resolved_old_metakey);
   g_list_free (self->run_before_ops);
 
+  flatpak_memory_free (FLATPAK_MEMORY_TRANSACTION, sizeof (FlatpakTransactionOperation));
+
   G_OBJECT_CLASS (flatpak_transaction_operation_parent_class)->finalize (object);
 }
 
@@ -583,6 +629,7 @@ flatpak_transaction_operation_class_init (FlatpakTransactionOperationClass *klas
 static void
 flatpak_transaction_operation_init (FlatpakTransactionOperation *self)
 {
+  flatpak_memory_alloc (FLATPAK_MEMORY_TRANSACTION, sizeof (FlatpakTransactionOperation));
 }
 
 static FlatpakTransactionOperation *
@@ -833,11 +880,15 @@ flatpak_transaction_finalize (GObject *object)
   g_hash_table_unref (priv->remote_states);
   g_list_free_full (priv->ops, (GDestroyNotify) g_object_unref);
   g_clear_object (&priv->dir);
+  g_clear_pointer (&priv->saved_state, g_key_file_unref);
 
   g_ptr_array_unref (priv->added_origin_remotes);
 
   g_ptr_array_free (priv->extra_dependency_dirs, TRUE);
 
+  g_mutex_clear (&priv->download_lock);
+  g_cond_clear (&priv->download_cond);
+
   G_OBJECT_CLASS (flatpak_transaction_parent_class)->finalize (object);
 }
 
@@ -1124,6 +1175,9 @@ flatpak_transaction_init (FlatpakTransaction *self)
   priv->added_origin_remotes = g_ptr_array_new_with_free_func (g_free);
   priv->extra_dependency_dirs = g_ptr_array_new_with_free_func (g_object_unref);
   priv->can_run = TRUE;
+  priv->max_parallel_downloads = 1;
+  g_mutex_init (&priv->download_lock);
+  g_cond_init (&priv->download_cond);
 }
 
 
@@ -1213,6 +1267,28 @@ flatpak_transaction_set_no_deploy (FlatpakTransaction *self,
   priv->no_deploy = no_deploy;
 }
 
+/**
+ * flatpak_transaction_set_max_parallel_downloads:
+ * @self: a #FlatpakTransaction
+ * @max_parallel_downloads: the maximum number of concurrent downloads
+ *
+ * Sets how many operations the transaction may download concurrently
+ * before deploying them. The data for different operations is
+ * independent, so the downloads can overlap, while deploys are always
+ * carried out one at a time in dependency order. The default of 1
+ * downloads and deploys each operation in turn.
+ *
+ * Since: 1.4
+ */
+void
+flatpak_transaction_set_max_parallel_downloads (FlatpakTransaction *self,
+                                                guint               max_parallel_downloads)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+
+  priv->max_parallel_downloads = MAX (max_parallel_downloads, 1);
+}
+
 /**
  * flatpak_transaction_set_disable_static_deltas:
  * @self: a #FlatpakTransaction
@@ -1316,6 +1392,122 @@ flatpak_transaction_set_force_uninstall (FlatpakTransaction *self,
   priv->force_uninstall = force_uninstall;
 }
 
+/**
+ * flatpak_transaction_set_dry_run:
+ * @self: a #FlatpakTransaction
+ * @dry_run: whether to only simulate the transaction
+ *
+ * Sets whether the transaction should only work out what it would do,
+ * without touching the network or the installation. The operations are
+ * resolved as usual, but only against remote metadata already cached on
+ * disk (resolution fails with %FLATPAK_ERROR_NOT_CACHED for a remote
+ * whose summary has never been fetched), and flatpak_transaction_run()
+ * returns right after emitting #FlatpakTransaction::ready without
+ * pulling or deploying anything. At that point
+ * flatpak_transaction_get_operations() along with
+ * flatpak_transaction_operation_get_download_size() and
+ * flatpak_transaction_operation_get_installed_size() answer what would
+ * change and how much would be downloaded.
+ *
+ * Since: 1.4
+ */
+void
+flatpak_transaction_set_dry_run (FlatpakTransaction *self,
+                                 gboolean            dry_run)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+
+  priv->dry_run = dry_run;
+}
+
+/**
+ * flatpak_transaction_set_resumable:
+ * @self: a #FlatpakTransaction
+ * @resumable: whether to persist and resume transaction state
+ *
+ * Sets whether the transaction should persist its state under the
+ * installation while it runs. When a resumable transaction is
+ * interrupted (crash, reboot, network loss), a later resumable
+ * transaction for the same refs continues where it stopped: the
+ * operations are pinned to the commits the interrupted transaction had
+ * resolved instead of being re-resolved, and operations that already
+ * completed are skipped. The saved state is removed when the
+ * transaction finishes successfully.
+ *
+ * Since: 1.4
+ */
+void
+flatpak_transaction_set_resumable (FlatpakTransaction *self,
+                                   gboolean            resumable)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+
+  priv->resumable = resumable;
+}
+
+static GFile *
+flatpak_transaction_get_state_file (FlatpakTransaction *self)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+
+  return g_file_get_child (flatpak_dir_get_path (priv->dir), ".transaction-state");
+}
+
+static void
+flatpak_transaction_load_saved_state (FlatpakTransaction *self)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+  g_autoptr(GFile) state_file = flatpak_transaction_get_state_file (self);
+  g_autofree char *path = g_file_get_path (state_file);
+  g_autoptr(GKeyFile) keyfile = g_key_file_new ();
+
+  if (!g_key_file_load_from_file (keyfile, path, G_KEY_FILE_NONE, NULL))
+    return;
+
+  g_debug ("Resuming interrupted transaction state from %s", path);
+  priv->saved_state = g_steal_pointer (&keyfile);
+}
+
+static void
+flatpak_transaction_save_state (FlatpakTransaction *self)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+  g_autoptr(GFile) state_file = flatpak_transaction_get_state_file (self);
+  g_autofree char *path = g_file_get_path (state_file);
+  g_autoptr(GKeyFile) keyfile = g_key_file_new ();
+  g_autoptr(GError) local_error = NULL;
+  GList *l;
+
+  for (l = priv->ops; l != NULL; l = l->next)
+    {
+      FlatpakTransactionOperation *op = l->data;
+
+      if (op->resolved_commit == NULL)
+        continue;
+
+      g_key_file_set_string (keyfile, op->ref, "remote", op->remote);
+      g_key_file_set_string (keyfile, op->ref, "kind",
+                             flatpak_transaction_operation_type_to_string (op->kind));
+      g_key_file_set_string (keyfile, op->ref, "commit", op->resolved_commit);
+      g_key_file_set_boolean (keyfile, op->ref, "completed", op->completed);
+    }
+
+  /* Failure to persist state never fails the transaction itself, it
+     only makes a resume after an interruption start over */
+  if (!g_key_file_save_to_file (keyfile, path, &local_error))
+    g_debug ("Failed to save transaction state to %s: %s", path, local_error->message);
+}
+
+static void
+flatpak_transaction_clear_saved_state (FlatpakTransaction *self)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+  g_autoptr(GFile) state_file = flatpak_transaction_get_state_file (self);
+
+  g_file_delete (state_file, NULL, NULL);
+  g_clear_pointer (&priv->saved_state, g_key_file_unref);
+}
+
 /**
  * flatpak_transaction_set_default_arch:
  * @self: a #FlatpakTransaction
@@ -1412,7 +1604,10 @@ flatpak_transaction_ensure_remote_state (FlatpakTransaction             *self,
   if (state)
     return flatpak_remote_state_ref (state);
 
-  state = flatpak_dir_get_remote_state_optional (priv->dir, remote, NULL, error);
+  if (priv->dry_run)
+    state = flatpak_dir_get_remote_state (priv->dir, remote, TRUE /* only_cached */, NULL, error);
+  else
+    state = flatpak_dir_get_remote_state_optional (priv->dir, remote, NULL, error);
 
   if (state)
     g_hash_table_insert (priv->remote_states, state->remote_name, flatpak_remote_state_ref (state));
@@ -2044,6 +2239,8 @@ flatpak_transaction_update_metadata (FlatpakTransaction *self,
 static void
 emit_new_op (FlatpakTransaction *self, FlatpakTransactionOperation *op, FlatpakTransactionProgress *progress)
 {
+  FLATPAK_TRACE (op_start, kind_to_str (op->kind), op->ref);
+  flatpak_profile_begin (kind_to_str (op->kind), op->ref);
   g_signal_emit (self, signals[NEW_OPERATION], 0, op, progress);
 }
 
@@ -2064,6 +2261,9 @@ emit_op_done (FlatpakTransaction          *self,
         commit = g_strdup (flatpak_deploy_data_get_commit (deploy_data));
     }
 
+  FLATPAK_TRACE (op_done, kind_to_str (op->kind), op->ref);
+  flatpak_profile_end (kind_to_str (op->kind));
+
   g_signal_emit (self, signals[OPERATION_DONE], 0, op, commit, details);
 }
 
@@ -2131,6 +2331,7 @@ mark_op_resolved (FlatpakTransactionOperation *op,
         {
           op->resolved_metadata = g_bytes_ref (metadata);
           op->resolved_metakey = g_steal_pointer (&metakey);
+          flatpak_memory_alloc (FLATPAK_MEMORY_TRANSACTION, g_bytes_get_size (metadata));
         }
       else
         g_message ("Warning: Failed to parse metadata for %s\n", op->ref);
@@ -2171,6 +2372,10 @@ resolve_p2p_ops (FlatpakTransaction *self,
       g_assert (!op->resolved);
 
       resolve = flatpak_dir_resolve_new (op->remote, op->ref, op->commit);
+      /* Lets the resolver answer from the summary's xa.cache when the
+       * found commit matches what the origin published, skipping the
+       * per-ref commit fetch */
+      resolve->state = flatpak_transaction_ensure_remote_state (self, op->kind, op->remote, NULL);
       g_ptr_array_add (resolves, resolve);
     }
 
@@ -2259,6 +2464,17 @@ resolve_ops (FlatpakTransaction *self,
             priv->max_op = MAX (priv->max_op, RUNTIME_INSTALL);
         }
 
+      /* When resuming, pin the op to the commit the interrupted
+         transaction had resolved, so we continue that update rather
+         than starting over against a possibly newer commit */
+      if (priv->saved_state != NULL && op->commit == NULL)
+        {
+          g_autofree char *saved_remote = g_key_file_get_string (priv->saved_state, op->ref, "remote", NULL);
+
+          if (g_strcmp0 (saved_remote, op->remote) == 0)
+            op->commit = g_key_file_get_string (priv->saved_state, op->ref, "commit", NULL);
+        }
+
       state = flatpak_transaction_ensure_remote_state (self, op->kind, op->remote, error);
       if (state == NULL)
         return FALSE;
@@ -2364,6 +2580,9 @@ resolve_all_ops (FlatpakTransaction *self,
 {
   FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
 
+  FLATPAK_TRACE (resolve_start);
+  flatpak_profile_begin ("resolve", NULL);
+
   while (priv->needs_resolve)
     {
       priv->needs_resolve = FALSE;
@@ -2371,6 +2590,9 @@ resolve_all_ops (FlatpakTransaction *self,
         return FALSE;
     }
 
+  FLATPAK_TRACE (resolve_done);
+  flatpak_profile_end ("resolve");
+
   return TRUE;
 }
 
@@ -2857,6 +3079,194 @@ flatpak_transaction_run (FlatpakTransaction *transaction,
   return FLATPAK_TRANSACTION_GET_CLASS (transaction)->run (transaction, cancellable, error);
 }
 
+typedef struct
+{
+  FlatpakTransaction *transaction;
+  GCancellable       *cancellable;
+} PrefetchDownloadsData;
+
+static void
+prefetch_download_op (FlatpakTransactionOperation *op,
+                      PrefetchDownloadsData       *data)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (data->transaction);
+  g_autoptr(FlatpakDir) dir = NULL;
+  g_autoptr(GMainContextPopDefault) context = NULL;
+  g_autoptr(GError) local_error = NULL;
+  FlatpakRemoteState *state;
+  gboolean res = TRUE;
+
+  /* The remote states were created during resolution, so this is just a
+   * lookup and doesn't mutate the hash table */
+  state = g_hash_table_lookup (priv->remote_states, op->remote);
+  if (state == NULL)
+    return;
+
+  /* Each worker uses its own FlatpakDir (and thus OstreeRepo handle),
+   * and its own main context for the sync ostree calls */
+  dir = flatpak_dir_clone (priv->dir);
+  context = flatpak_main_context_new_default ();
+
+  if (!flatpak_dir_ensure_repo (dir, data->cancellable, &local_error))
+    {
+      g_debug ("Prefetch of %s failed: %s", op->ref, local_error->message);
+      return;
+    }
+
+  if (op->kind == FLATPAK_TRANSACTION_OPERATION_INSTALL)
+    res = flatpak_dir_install (dir,
+                               FALSE, TRUE, /* pull, don't deploy */
+                               priv->disable_static_deltas,
+                               priv->reinstall,
+                               priv->max_op >= APP_UPDATE,
+                               state, op->ref, op->resolved_commit,
+                               (const char **) op->subpaths,
+                               (const char **) op->previous_ids,
+                               NULL,
+                               data->cancellable, &local_error);
+  else if (op->kind == FLATPAK_TRANSACTION_OPERATION_UPDATE && !op->update_only_deploy)
+    res = flatpak_dir_update (dir,
+                              FALSE, TRUE, /* pull, don't deploy */
+                              priv->disable_static_deltas,
+                              op->commit != NULL, /* Allow downgrade if we specify commit */
+                              priv->max_op >= APP_UPDATE,
+                              priv->max_op == APP_INSTALL || priv->max_op == RUNTIME_INSTALL,
+                              state, op->ref, op->resolved_commit,
+                              NULL,
+                              (const char **) op->subpaths,
+                              (const char **) op->previous_ids,
+                              NULL,
+                              data->cancellable, &local_error);
+
+  if (!res && !g_error_matches (local_error, FLATPAK_ERROR, FLATPAK_ERROR_ALREADY_INSTALLED))
+    g_debug ("Prefetch of %s failed: %s", op->ref, local_error->message);
+}
+
+static void
+prefetch_download_worker (gpointer task_data,
+                          gpointer user_data)
+{
+  FlatpakTransactionOperation *op = task_data;
+  PrefetchDownloadsData *data = user_data;
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (data->transaction);
+
+  prefetch_download_op (op, data);
+
+  g_mutex_lock (&priv->download_lock);
+  op->download_done = TRUE;
+  g_cond_broadcast (&priv->download_cond);
+  g_mutex_unlock (&priv->download_lock);
+}
+
+/* Starts downloading the data for all the pull-needing operations, up
+ * to max_parallel_downloads at a time, in execution order. Only ops
+ * that are independent until deploy (installs and updates) are queued.
+ * The execution loop waits per-op (see below) and deploys each op while
+ * the later ones are still downloading; the caller must free the
+ * returned pool (waiting for outstanding tasks) after the loop. */
+static GThreadPool *
+flatpak_transaction_start_downloads (FlatpakTransaction    *self,
+                                     PrefetchDownloadsData *data)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+  GThreadPool *pool;
+  GList *l;
+
+  pool = g_thread_pool_new (prefetch_download_worker, data,
+                            priv->max_parallel_downloads, FALSE, NULL);
+  if (pool == NULL)
+    return NULL;
+
+  for (l = priv->ops; l != NULL; l = l->next)
+    {
+      FlatpakTransactionOperation *op = l->data;
+
+      if (op->skip)
+        continue;
+
+      if (op->kind != FLATPAK_TRANSACTION_OPERATION_INSTALL &&
+          op->kind != FLATPAK_TRANSACTION_OPERATION_UPDATE)
+        continue;
+
+      op->download_queued = TRUE;
+      g_thread_pool_push (pool, op, NULL);
+    }
+
+  return pool;
+}
+
+static gpointer
+prewarm_remotes_thread (gpointer data)
+{
+  g_auto(GStrv) hosts = data;
+  g_autoptr(GResolver) resolver = g_resolver_get_default ();
+  int i;
+
+  for (i = 0; hosts[i] != NULL; i++)
+    {
+      GList *addresses = g_resolver_lookup_by_name (resolver, hosts[i], NULL, NULL);
+      g_resolver_free_addresses (addresses);
+    }
+
+  return NULL;
+}
+
+/* Resolve the DNS names of the distinct remote hosts involved in the
+ * transaction in the background, so that the system resolver cache is
+ * warm by the time the first pull opens its connection. The addresses
+ * themselves are discarded; a failed lookup just means the pull does
+ * the resolving itself, as before. */
+static void
+flatpak_transaction_prewarm_remotes (FlatpakTransaction *self)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+  g_autoptr(GHashTable) hosts = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autoptr(GPtrArray) host_array = g_ptr_array_new ();
+  GHashTableIter iter;
+  gpointer key;
+  GThread *thread;
+  GList *l;
+
+  for (l = priv->ops; l != NULL; l = l->next)
+    {
+      FlatpakTransactionOperation *op = l->data;
+      g_autofree char *url = NULL;
+      g_autoptr(GSocketConnectable) address = NULL;
+      const char *host;
+
+      if (op->skip || op->remote == NULL)
+        continue;
+
+      if (!ostree_repo_remote_get_url (flatpak_dir_get_repo (priv->dir), op->remote, &url, NULL))
+        continue;
+
+      if (!g_str_has_prefix (url, "http:") && !g_str_has_prefix (url, "https:") &&
+          !g_str_has_prefix (url, "oci+http:") && !g_str_has_prefix (url, "oci+https:"))
+        continue;
+
+      address = g_network_address_parse_uri (g_str_has_prefix (url, "oci+") ? url + 4 : url, 0, NULL);
+      if (address == NULL)
+        continue;
+
+      host = g_network_address_get_hostname (G_NETWORK_ADDRESS (address));
+      if (host != NULL)
+        g_hash_table_add (hosts, g_strdup (host));
+    }
+
+  if (g_hash_table_size (hosts) == 0)
+    return;
+
+  g_hash_table_iter_init (&iter, hosts);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    g_ptr_array_add (host_array, g_strdup (key));
+  g_ptr_array_add (host_array, NULL);
+
+  thread = g_thread_new ("flatpak-prewarm",
+                         prewarm_remotes_thread,
+                         g_ptr_array_free (g_steal_pointer (&host_array), FALSE));
+  g_thread_unref (thread);
+}
+
 static gboolean
 flatpak_transaction_real_run (FlatpakTransaction *self,
                               GCancellable       *cancellable,
@@ -2869,6 +3279,8 @@ flatpak_transaction_real_run (FlatpakTransaction *self,
   gboolean needs_triggers = FALSE;
   g_autoptr(GMainContextPopDefault) main_context = NULL;
   gboolean ready_res = FALSE;
+  GThreadPool *download_pool = NULL;
+  PrefetchDownloadsData download_data = { self, cancellable };
   int i;
 
   if (!priv->can_run)
@@ -2891,7 +3303,10 @@ flatpak_transaction_real_run (FlatpakTransaction *self,
                                      "This can lead to incorrect file ownership and permission errors."));
     }
 
-  if (!priv->no_pull &&
+  if (priv->resumable)
+    flatpak_transaction_load_saved_state (self);
+
+  if (!priv->no_pull && !priv->dry_run &&
       !flatpak_transaction_update_metadata (self, cancellable, error))
     return FALSE;
 
@@ -2971,11 +3386,85 @@ flatpak_transaction_real_run (FlatpakTransaction *self,
         }
     }
 
+  /* Skip operations a previously interrupted transaction already
+     completed at the very same commit */
+  if (priv->saved_state != NULL)
+    {
+      for (l = priv->ops; l != NULL; l = l->next)
+        {
+          FlatpakTransactionOperation *op = l->data;
+          g_autofree char *saved_remote = NULL;
+          g_autofree char *saved_commit = NULL;
+
+          if (op->skip || op->resolved_commit == NULL)
+            continue;
+
+          if (!g_key_file_get_boolean (priv->saved_state, op->ref, "completed", NULL))
+            continue;
+
+          saved_remote = g_key_file_get_string (priv->saved_state, op->ref, "remote", NULL);
+          saved_commit = g_key_file_get_string (priv->saved_state, op->ref, "commit", NULL);
+          if (g_strcmp0 (saved_remote, op->remote) == 0 &&
+              g_strcmp0 (saved_commit, op->resolved_commit) == 0)
+            {
+              g_debug ("%s was already completed by an interrupted transaction, skipping", op->ref);
+              op->skip = TRUE;
+            }
+        }
+    }
+
+  /* In a dry run we are done once everything is resolved: the caller
+     inspects the operations and their sizes, nothing is pulled or
+     deployed */
+  if (priv->dry_run)
+    {
+      g_signal_emit (self, signals[READY], 0, &ready_res);
+      return TRUE;
+    }
+
+  /* Start this before the ready signal, so the lookups overlap with any
+   * user confirmation too */
+  if (!priv->no_pull)
+    flatpak_transaction_prewarm_remotes (self);
 
   g_signal_emit (self, signals[READY], 0, &ready_res);
   if (!ready_res)
     return flatpak_fail_error (error, FLATPAK_ERROR_ABORTED, _("Aborted by user"));
 
+  /* Persist the resolution only once the transaction is confirmed, so
+     an abort above leaves no state behind */
+  if (priv->resumable)
+    flatpak_transaction_save_state (self);
+
+  /* If enabled, overlap the downloads for independent operations with
+   * the (ordered) execution loop below, which waits for each op's
+   * download and then finds the objects already in the local repo, so
+   * the deploy of one op proceeds while the next ones still download.
+   * Download errors are ignored here, the execution loop re-runs the
+   * pull and reports them with the usual signals. */
+  if (priv->max_parallel_downloads > 1 && !priv->no_pull &&
+      !flatpak_dir_use_system_helper (priv->dir, NULL))
+    download_pool = flatpak_transaction_start_downloads (self, &download_data);
+
+  /* When deploying several refs, batch their durability syncs into a
+   * single syncfs at the end; a lone deploy keeps the smaller crash
+   * window of syncing before the move in place */
+  if (!priv->no_deploy && !flatpak_dir_use_system_helper (priv->dir, NULL))
+    {
+      guint n_remaining_ops = 0;
+
+      for (l = priv->ops; l != NULL; l = l->next)
+        {
+          FlatpakTransactionOperation *op = l->data;
+
+          if (!op->skip)
+            n_remaining_ops++;
+        }
+
+      if (n_remaining_ops > 1)
+        flatpak_dir_defer_checkout_sync (priv->dir);
+    }
+
   for (l = priv->ops; l != NULL; l = l->next)
     {
       FlatpakTransactionOperation *op = l->data;
@@ -2990,6 +3479,16 @@ flatpak_transaction_real_run (FlatpakTransaction *self,
 
       priv->current_op = op;
 
+      /* If this op was queued on the download pool, wait for its
+       * download so the pull below is effectively a local no-op */
+      if (op->download_queued)
+        {
+          g_mutex_lock (&priv->download_lock);
+          while (!op->download_done)
+            g_cond_wait (&priv->download_cond, &priv->download_lock);
+          g_mutex_unlock (&priv->download_lock);
+        }
+
       kind = op->kind;
       pref = strchr (op->ref, '/') + 1;
 
@@ -3154,6 +3653,11 @@ flatpak_transaction_real_run (FlatpakTransaction *self,
       if (res)
         {
           g_autoptr(GVariant) deploy_data = NULL;
+
+          op->completed = TRUE;
+          if (priv->resumable)
+            flatpak_transaction_save_state (self);
+
           deploy_data = flatpak_dir_get_deploy_data (priv->dir, op->ref, FLATPAK_DEPLOY_VERSION_ANY, NULL, NULL);
 
           if (deploy_data)
@@ -3197,8 +3701,18 @@ flatpak_transaction_real_run (FlatpakTransaction *self,
     }
   priv->current_op = NULL;
 
+  /* Wait for any downloads still queued (e.g. after an early abort) */
+  if (download_pool != NULL)
+    g_thread_pool_free (download_pool, FALSE, TRUE);
+
+  /* Make any deploys whose sync was deferred above durable; without
+   * this the transaction can't claim success */
+  if (!flatpak_dir_flush_checkout_sync (priv->dir, cancellable,
+                                        succeeded ? error : NULL))
+    succeeded = FALSE;
+
   if (needs_triggers)
-    flatpak_dir_run_triggers (priv->dir, cancellable, NULL);
+    flatpak_dir_maybe_run_triggers (priv->dir, cancellable, NULL);
 
   if (needs_prune && !priv->disable_prune)
     flatpak_dir_prune (priv->dir, cancellable, NULL);
@@ -3206,5 +3720,10 @@ flatpak_transaction_real_run (FlatpakTransaction *self,
   for (i = 0; i < priv->added_origin_remotes->len; i++)
     flatpak_dir_prune_origin_remote (priv->dir, g_ptr_array_index (priv->added_origin_remotes, i));
 
+  /* On failure the state is kept for the next resumable transaction
+     to continue from */
+  if (priv->resumable && succeeded)
+    flatpak_transaction_clear_saved_state (self);
+
   return succeeded;
 }
@@ -152,6 +152,8 @@ int         flatpak_transaction_progress_get_progress (FlatpakTransactionProgres
 FLATPAK_EXTERN
 guint64     flatpak_transaction_progress_get_bytes_transferred (FlatpakTransactionProgress *self);
 FLATPAK_EXTERN
+guint       flatpak_transaction_progress_get_fetched_objects (FlatpakTransactionProgress *self);
+FLATPAK_EXTERN
 guint64     flatpak_transaction_progress_get_start_time (FlatpakTransactionProgress *self);
 
 
@@ -183,6 +185,9 @@ FLATPAK_EXTERN
 void                flatpak_transaction_set_no_deploy (FlatpakTransaction *self,
                                                        gboolean            no_deploy);
 FLATPAK_EXTERN
+void                flatpak_transaction_set_max_parallel_downloads (FlatpakTransaction *self,
+                                                                    guint               max_parallel_downloads);
+FLATPAK_EXTERN
 void                flatpak_transaction_set_disable_static_deltas (FlatpakTransaction *self,
                                                                    gboolean            disable_static_deltas);
 FLATPAK_EXTERN
@@ -201,6 +206,12 @@ FLATPAK_EXTERN
 void                flatpak_transaction_set_force_uninstall (FlatpakTransaction *self,
                                                              gboolean            force_uninstall);
 FLATPAK_EXTERN
+void                flatpak_transaction_set_dry_run (FlatpakTransaction *self,
+                                                     gboolean            dry_run);
+FLATPAK_EXTERN
+void                flatpak_transaction_set_resumable (FlatpakTransaction *self,
+                                                       gboolean            resumable);
+FLATPAK_EXTERN
 void                flatpak_transaction_set_default_arch (FlatpakTransaction *self,
                                                           const char         *arch);
 FLATPAK_EXTERN
@@ -31,6 +31,7 @@ typedef enum {
   FLATPAK_HTTP_FLAGS_NONE = 0,
   FLATPAK_HTTP_FLAGS_ACCEPT_OCI = 1 << 0,
   FLATPAK_HTTP_FLAGS_STORE_COMPRESSED = 2 << 0,
+  FLATPAK_HTTP_FLAGS_CACHE = 4 << 0,
 } FlatpakHTTPFlags;
 
 typedef void (*FlatpakLoadUriProgress) (guint64  downloaded_bytes,
@@ -43,6 +44,13 @@ GBytes * flatpak_load_http_uri (SoupSession           *soup_session,
                                 gpointer               user_data,
                                 GCancellable          *cancellable,
                                 GError               **error);
+GHashTable * flatpak_load_http_uris (SoupSession        *soup_session,
+                                     const char * const *uris,
+                                     FlatpakHTTPFlags    flags,
+                                     GCancellable       *cancellable);
+int flatpak_http_race_uris (SoupSession        *soup_session,
+                            const char * const *uris,
+                            GCancellable       *cancellable);
 gboolean flatpak_download_http_uri (SoupSession           *soup_session,
                                     const char            *uri,
                                     FlatpakHTTPFlags       flags,
@@ -51,6 +59,16 @@ gboolean flatpak_download_http_uri (SoupSession           *soup_session,
                                     gpointer               user_data,
                                     GCancellable          *cancellable,
                                     GError               **error);
+gboolean flatpak_download_http_uri_resume (SoupSession           *soup_session,
+                                           const char            *uri,
+                                           FlatpakHTTPFlags       flags,
+                                           GOutputStream         *out,
+                                           guint64                resume_offset,
+                                           gboolean              *out_range_ignored,
+                                           FlatpakLoadUriProgress progress,
+                                           gpointer               user_data,
+                                           GCancellable          *cancellable,
+                                           GError               **error);
 gboolean flatpak_cache_http_uri (SoupSession           *soup_session,
                                  const char            *uri,
                                  FlatpakHTTPFlags       flags,
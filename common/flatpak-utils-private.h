@@ -32,6 +32,7 @@
 #include "flatpak-context-private.h"
 #include "flatpak-error.h"
 #include "flatpak-utils-http-private.h"
+#include "flatpak-checksum-private.h"
 #include <ostree.h>
 #include <json-glib/json-glib.h>
 
@@ -112,14 +113,20 @@ const char ** flatpak_get_arches (void);
 gboolean flatpak_is_linux32_arch (const char *arch);
 
 const char ** flatpak_get_gl_drivers (void);
+const char * flatpak_get_gtk_theme (void);
 gboolean flatpak_extension_matches_reason (const char *extension_id,
                                            const char *reason,
                                            gboolean    default_value);
 
 const char * flatpak_get_bwrap (void);
+void flatpak_startup_trace (const char *phase);
 
 char *flatpak_get_timezone (void);
 
+char *flatpak_host_probe_cache_lookup (const char *key);
+void flatpak_host_probe_cache_store (const char *key,
+                                     const char *value);
+
 char **flatpak_strv_merge (char   **strv1,
                            char   **strv2);
 char **flatpak_subpaths_merge (char **subpaths1,
@@ -128,18 +135,18 @@ char **flatpak_subpaths_merge (char **subpaths1,
 char *flatpak_get_lang_from_locale (const char *locale);
 char **flatpak_get_current_locale_langs (void);
 
-gboolean flatpak_write_update_checksum (GOutputStream *out,
-                                        gconstpointer  data,
-                                        gsize          len,
-                                        gsize         *out_bytes_written,
-                                        GChecksum     *checksum,
-                                        GCancellable  *cancellable,
-                                        GError       **error);
+gboolean flatpak_write_update_checksum (GOutputStream   *out,
+                                        gconstpointer    data,
+                                        gsize            len,
+                                        gsize           *out_bytes_written,
+                                        FlatpakChecksum *checksum,
+                                        GCancellable    *cancellable,
+                                        GError         **error);
 
 
 gboolean flatpak_splice_update_checksum (GOutputStream         * out,
                                          GInputStream          *in,
-                                         GChecksum             *checksum,
+                                         FlatpakChecksum       *checksum,
                                          FlatpakLoadUriProgress progress,
                                          gpointer progress_data,
                                          GCancellable          *cancellable,
@@ -171,6 +178,15 @@ gboolean flatpak_name_matches_one_wildcard_prefix (const char         *string,
                                                    const char * const *maybe_wildcard_prefixes,
                                                    gboolean            require_exact_match);
 
+typedef struct FlatpakNameMatcher FlatpakNameMatcher;
+
+FlatpakNameMatcher *flatpak_name_matcher_new (const char * const *wildcarded_prefixes,
+                                              gboolean            require_exact_match);
+gboolean flatpak_name_matcher_matches (FlatpakNameMatcher *matcher,
+                                       const char         *name);
+void flatpak_name_matcher_free (FlatpakNameMatcher *matcher);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakNameMatcher, flatpak_name_matcher_free)
+
 gboolean flatpak_get_allowed_exports (const char     *source_path,
                                       const char     *app_id,
                                       FlatpakContext *context,
@@ -191,6 +207,25 @@ gboolean flatpak_id_has_subref_suffix (const char *id);
 char **flatpak_decompose_ref (const char *ref,
                               GError    **error);
 
+/* A decomposed ref that points into the original string instead of
+   copying it, see flatpak_ref_parse_view() */
+typedef struct
+{
+  gboolean    is_app; /* Otherwise a runtime */
+  const char *id;     /* Not NUL-terminated, use id_len */
+  gsize       id_len;
+  const char *arch;   /* Not NUL-terminated, use arch_len */
+  gsize       arch_len;
+  const char *branch; /* The last segment, so NUL-terminated */
+} FlatpakRefView;
+
+gboolean flatpak_ref_parse_view (const char     *full_ref,
+                                 FlatpakRefView *view);
+gboolean flatpak_ref_view_has_id (const FlatpakRefView *view,
+                                  const char           *id);
+gboolean flatpak_ref_view_has_arch (const FlatpakRefView *view,
+                                    const char           *arch);
+
 FlatpakKinds flatpak_kinds_from_bools (gboolean app,
                                        gboolean runtime);
 
@@ -25,6 +25,8 @@
 #include "flatpak-dir-private.h"
 #include "flatpak-oci-registry-private.h"
 #include "flatpak-run-private.h"
+#include "flatpak-trace-private.h"
+#include "flatpak-profile-private.h"
 #include "valgrind-private.h"
 
 #include <glib/gi18n-lib.h>
@@ -128,13 +130,13 @@ flatpak_debug2 (const char *format, ...)
 }
 
 gboolean
-flatpak_write_update_checksum (GOutputStream *out,
-                               gconstpointer  data,
-                               gsize          len,
-                               gsize         *out_bytes_written,
-                               GChecksum     *checksum,
-                               GCancellable  *cancellable,
-                               GError       **error)
+flatpak_write_update_checksum (GOutputStream   *out,
+                               gconstpointer    data,
+                               gsize            len,
+                               gsize           *out_bytes_written,
+                               FlatpakChecksum *checksum,
+                               GCancellable    *cancellable,
+                               GError         **error)
 {
   if (out)
     {
@@ -148,7 +150,7 @@ flatpak_write_update_checksum (GOutputStream *out,
     }
 
   if (checksum)
-    g_checksum_update (checksum, data, len);
+    flatpak_checksum_update (checksum, data, len);
 
   return TRUE;
 }
@@ -156,7 +158,7 @@ flatpak_write_update_checksum (GOutputStream *out,
 gboolean
 flatpak_splice_update_checksum (GOutputStream         *out,
                                 GInputStream          *in,
-                                GChecksum             *checksum,
+                                FlatpakChecksum       *checksum,
                                 FlatpakLoadUriProgress progress,
                                 gpointer               progress_data,
                                 GCancellable          *cancellable,
@@ -513,6 +515,100 @@ flatpak_get_arches (void)
   return (const char **) arches;
 }
 
+/* Caches host facts that can't change within a boot (gpu drivers,
+ * timezone, sound server config, ...) in a keyfile on the (tmpfs) user
+ * runtime dir, so every launch after the first one reads one small
+ * file instead of re-probing /sys and parsing config files. The cache
+ * is keyed on the boot id, in case the runtime dir survives a reboot. */
+#define HOST_PROBE_CACHE_GROUP "Host Probes"
+
+G_LOCK_DEFINE_STATIC (host_probe_cache);
+static GKeyFile *host_probe_cache; /* protected by the lock above */
+static char *host_probe_cache_path;
+
+static char *
+flatpak_get_boot_id (void)
+{
+  char *boot_id = NULL;
+
+  if (g_file_get_contents ("/proc/sys/kernel/random/boot_id", &boot_id, NULL, NULL))
+    g_strstrip (boot_id);
+
+  return boot_id;
+}
+
+/* Must be called with the lock held */
+static GKeyFile *
+host_probe_cache_ensure (void)
+{
+  g_autofree char *boot_id = NULL;
+
+  if (host_probe_cache != NULL)
+    return host_probe_cache;
+
+  host_probe_cache_path = g_build_filename (g_get_user_runtime_dir (),
+                                            ".flatpak", "host-probes", NULL);
+  boot_id = flatpak_get_boot_id ();
+
+  host_probe_cache = g_key_file_new ();
+  if (g_key_file_load_from_file (host_probe_cache, host_probe_cache_path,
+                                 G_KEY_FILE_NONE, NULL))
+    {
+      g_autofree char *cached_boot_id =
+        g_key_file_get_string (host_probe_cache, HOST_PROBE_CACHE_GROUP, "boot-id", NULL);
+
+      if (boot_id != NULL && g_strcmp0 (cached_boot_id, boot_id) == 0)
+        return host_probe_cache;
+
+      /* Stale (or unverifiable), start over */
+      g_key_file_free (host_probe_cache);
+      host_probe_cache = g_key_file_new ();
+    }
+
+  if (boot_id != NULL)
+    g_key_file_set_string (host_probe_cache, HOST_PROBE_CACHE_GROUP, "boot-id", boot_id);
+
+  return host_probe_cache;
+}
+
+/* Returns the cached probe result, or NULL if it hasn't been probed
+ * this boot. A probe with an empty result is stored as "". */
+char *
+flatpak_host_probe_cache_lookup (const char *key)
+{
+  char *value;
+
+  G_LOCK (host_probe_cache);
+  value = g_key_file_get_string (host_probe_cache_ensure (),
+                                 HOST_PROBE_CACHE_GROUP, key, NULL);
+  G_UNLOCK (host_probe_cache);
+
+  return value;
+}
+
+void
+flatpak_host_probe_cache_store (const char *key,
+                                const char *value)
+{
+  g_autoptr(GError) local_error = NULL;
+  g_autofree char *dir = NULL;
+  GKeyFile *cache;
+
+  G_LOCK (host_probe_cache);
+
+  cache = host_probe_cache_ensure ();
+  g_key_file_set_string (cache, HOST_PROBE_CACHE_GROUP, key, value);
+
+  /* Saving is best effort, worst case the next launch re-probes */
+  dir = g_path_get_dirname (host_probe_cache_path);
+  if (g_mkdir_with_parents (dir, 0700) != 0 ||
+      !g_key_file_save_to_file (cache, host_probe_cache_path, &local_error))
+    g_debug ("Failed to save host probe cache: %s",
+             local_error ? local_error->message : g_strerror (errno));
+
+  G_UNLOCK (host_probe_cache);
+}
+
 const char **
 flatpak_get_gl_drivers (void)
 {
@@ -527,25 +623,36 @@ flatpak_get_gl_drivers (void)
         new_drivers_c = g_strsplit (env, ":", -1);
       else
         {
-          g_autofree char *nvidia_version = NULL;
-          char *dot;
-          GPtrArray *array = g_ptr_array_new ();
+          g_autofree char *cached = flatpak_host_probe_cache_lookup ("gl-drivers");
 
-          if (g_file_get_contents ("/sys/module/nvidia/version",
-                                   &nvidia_version, NULL, NULL))
+          if (cached != NULL)
+            new_drivers_c = g_strsplit (cached, ";", -1);
+          else
             {
-              g_strstrip (nvidia_version);
-              /* Convert dots to dashes */
-              while ((dot = strchr (nvidia_version, '.')) != NULL)
-                *dot = '-';
-              g_ptr_array_add (array, g_strconcat ("nvidia-", nvidia_version, NULL));
-            }
+              g_autofree char *nvidia_version = NULL;
+              g_autofree char *joined = NULL;
+              char *dot;
+              GPtrArray *array = g_ptr_array_new ();
+
+              if (g_file_get_contents ("/sys/module/nvidia/version",
+                                       &nvidia_version, NULL, NULL))
+                {
+                  g_strstrip (nvidia_version);
+                  /* Convert dots to dashes */
+                  while ((dot = strchr (nvidia_version, '.')) != NULL)
+                    *dot = '-';
+                  g_ptr_array_add (array, g_strconcat ("nvidia-", nvidia_version, NULL));
+                }
 
-          g_ptr_array_add (array, (char *) "default");
-          g_ptr_array_add (array, (char *) "host");
+              g_ptr_array_add (array, (char *) "default");
+              g_ptr_array_add (array, (char *) "host");
 
-          g_ptr_array_add (array, NULL);
-          new_drivers_c = (char **) g_ptr_array_free (array, FALSE);
+              g_ptr_array_add (array, NULL);
+              new_drivers_c = (char **) g_ptr_array_free (array, FALSE);
+
+              joined = g_strjoinv (";", new_drivers_c);
+              flatpak_host_probe_cache_store ("gl-drivers", joined);
+            }
         }
 
       new_drivers = (gsize) new_drivers_c;
@@ -561,12 +668,22 @@ flatpak_get_have_intel_gpu (void)
   static int have_intel = -1;
 
   if (have_intel == -1)
-    have_intel = g_file_test ("/sys/module/i915", G_FILE_TEST_EXISTS);
+    {
+      g_autofree char *cached = flatpak_host_probe_cache_lookup ("have-intel-gpu");
+
+      if (cached != NULL)
+        have_intel = g_strcmp0 (cached, "1") == 0;
+      else
+        {
+          have_intel = g_file_test ("/sys/module/i915", G_FILE_TEST_EXISTS);
+          flatpak_host_probe_cache_store ("have-intel-gpu", have_intel ? "1" : "0");
+        }
+    }
 
   return have_intel;
 }
 
-static const char *
+const char *
 flatpak_get_gtk_theme (void)
 {
   static char *gtk_theme;
@@ -637,8 +754,43 @@ flatpak_get_bwrap (void)
   return HELPER;
 }
 
-char *
-flatpak_get_timezone (void)
+/* Launch phase tracing, enabled by setting FLATPAK_TRACE_STARTUP.
+ * Each call ends the current setup phase and emits one machine
+ * readable span line on stderr, with monotonic microseconds since the
+ * first call and since the previous call, so launch latency can be
+ * tracked per phase across releases. */
+void
+flatpak_startup_trace (const char *phase)
+{
+  static gint64 start_time = 0;
+  static gint64 last_time = 0;
+  static int enabled = -1;
+  gint64 now;
+
+  /* The same phase boundaries double as static tracepoints, which are
+   * always armed (each is just a nop) and don't need the env var, and
+   * as --profile marks */
+  FLATPAK_TRACE (run_phase, phase);
+  flatpak_profile_mark (phase);
+
+  if (enabled == -1)
+    enabled = g_getenv ("FLATPAK_TRACE_STARTUP") != NULL;
+
+  if (!enabled)
+    return;
+
+  now = g_get_monotonic_time ();
+  if (start_time == 0)
+    start_time = last_time = now;
+
+  g_printerr ("FLATPAK_TRACE_STARTUP: phase=%s total_us=%" G_GINT64_FORMAT " span_us=%" G_GINT64_FORMAT "\n",
+              phase, now - start_time, now - last_time);
+
+  last_time = now;
+}
+
+static char *
+flatpak_get_timezone_uncached (void)
 {
   g_autofree gchar *symlink = NULL;
   gchar *etc_timezone = NULL;
@@ -677,6 +829,21 @@ flatpak_get_timezone (void)
   return g_strdup ("UTC");
 }
 
+char *
+flatpak_get_timezone (void)
+{
+  g_autofree char *cached = flatpak_host_probe_cache_lookup ("timezone");
+  char *timezone;
+
+  if (cached != NULL)
+    return g_steal_pointer (&cached);
+
+  timezone = flatpak_get_timezone_uncached ();
+  flatpak_host_probe_cache_store ("timezone", timezone);
+
+  return timezone;
+}
+
 static gboolean
 is_valid_initial_name_character (gint c, gboolean allow_dash)
 {
@@ -840,36 +1007,80 @@ flatpak_has_name_prefix (const char *string,
     !is_valid_name_character (*rest, FALSE);
 }
 
+typedef struct
+{
+  char    *prefix;
+  gsize    prefix_len; /* without the trailing ".*" */
+  gboolean has_wildcard;
+} WildcardPrefix;
+
+/* A wildcarded prefix list compiled once, so matching a batch of
+ * filenames (e.g. every exported icon) doesn't redo the length and
+ * wildcard analysis of each pattern for each name */
+struct FlatpakNameMatcher
+{
+  GArray  *prefixes; /* of WildcardPrefix */
+  gboolean require_exact_match;
+};
+
+FlatpakNameMatcher *
+flatpak_name_matcher_new (const char * const *wildcarded_prefixes,
+                          gboolean            require_exact_match)
+{
+  FlatpakNameMatcher *matcher = g_new0 (FlatpakNameMatcher, 1);
+  const char * const *iter;
+
+  matcher->prefixes = g_array_new (FALSE, FALSE, sizeof (WildcardPrefix));
+  matcher->require_exact_match = require_exact_match;
+
+  for (iter = wildcarded_prefixes; *iter != NULL; ++iter)
+    {
+      WildcardPrefix compiled;
+
+      compiled.prefix = g_strdup (*iter);
+      compiled.prefix_len = strlen (compiled.prefix);
+      compiled.has_wildcard = g_str_has_suffix (compiled.prefix, ".*");
+      if (compiled.has_wildcard)
+        compiled.prefix_len -= 2;
+
+      g_array_append_val (matcher->prefixes, compiled);
+    }
+
+  return matcher;
+}
+
+void
+flatpak_name_matcher_free (FlatpakNameMatcher *matcher)
+{
+  guint i;
+
+  for (i = 0; i < matcher->prefixes->len; i++)
+    g_free (g_array_index (matcher->prefixes, WildcardPrefix, i).prefix);
+  g_array_free (matcher->prefixes, TRUE);
+  g_free (matcher);
+}
+
 gboolean
-flatpak_name_matches_one_wildcard_prefix (const char         *name,
-                                          const char * const *wildcarded_prefixes,
-                                          gboolean            require_exact_match)
+flatpak_name_matcher_matches (FlatpakNameMatcher *matcher,
+                              const char         *name)
 {
-  const char * const *iter = wildcarded_prefixes;
   const char *remainder;
   gsize longest_match_len = 0;
+  guint i;
 
   /* Find longest valid match */
-  for (; *iter != NULL; ++iter)
+  for (i = 0; i < matcher->prefixes->len; i++)
     {
-      const char *prefix = *iter;
-      gsize prefix_len = strlen (prefix);
-      gsize match_len = strlen (prefix);
-      gboolean has_wildcard = FALSE;
+      WildcardPrefix *prefix = &g_array_index (matcher->prefixes, WildcardPrefix, i);
       const char *end_of_match;
+      gsize match_len;
 
-      if (g_str_has_suffix (prefix, ".*"))
-        {
-          has_wildcard = TRUE;
-          prefix_len -= 2;
-        }
-
-      if (strncmp (name, prefix, prefix_len) != 0)
+      if (strncmp (name, prefix->prefix, prefix->prefix_len) != 0)
         continue;
 
-      end_of_match = name + prefix_len;
+      end_of_match = name + prefix->prefix_len;
 
-      if (has_wildcard &&
+      if (prefix->has_wildcard &&
           end_of_match[0] == '.' &&
           is_valid_initial_name_character (end_of_match[1], TRUE))
         {
@@ -890,7 +1101,7 @@ flatpak_name_matches_one_wildcard_prefix (const char         *name,
   if (longest_match_len == 0)
     return FALSE;
 
-  if (require_exact_match)
+  if (matcher->require_exact_match)
     return name[longest_match_len] == 0;
 
   /* non-exact matches can be exact, or can be followed by characters that would make
@@ -906,6 +1117,17 @@ flatpak_name_matches_one_wildcard_prefix (const char         *name,
     !is_valid_name_character (*remainder, FALSE);
 }
 
+gboolean
+flatpak_name_matches_one_wildcard_prefix (const char         *name,
+                                          const char * const *wildcarded_prefixes,
+                                          gboolean            require_exact_match)
+{
+  g_autoptr(FlatpakNameMatcher) matcher =
+    flatpak_name_matcher_new (wildcarded_prefixes, require_exact_match);
+
+  return flatpak_name_matcher_matches (matcher, name);
+}
+
 gboolean
 flatpak_get_allowed_exports (const char     *source_path,
                              const char     *app_id,
@@ -1181,6 +1403,69 @@ flatpak_decompose_ref (const char *full_ref,
   return g_steal_pointer (&parts);
 }
 
+/* Splits a ref into its segments without copying anything. Unlike
+ * flatpak_decompose_ref() this only checks the shape of the ref, not
+ * that the name and branch contents are valid, so it is meant for
+ * refs that are already known to be well formed, such as those listed
+ * from a repo. Loops that look at every ref should use this rather
+ * than flatpak_decompose_ref(), which allocates five strings per
+ * call.
+ */
+gboolean
+flatpak_ref_parse_view (const char     *full_ref,
+                        FlatpakRefView *view)
+{
+  const char *id, *arch, *branch;
+
+  if (g_str_has_prefix (full_ref, "app/"))
+    {
+      view->is_app = TRUE;
+      id = full_ref + strlen ("app/");
+    }
+  else if (g_str_has_prefix (full_ref, "runtime/"))
+    {
+      view->is_app = FALSE;
+      id = full_ref + strlen ("runtime/");
+    }
+  else
+    return FALSE;
+
+  arch = strchr (id, '/');
+  if (arch == NULL)
+    return FALSE;
+  arch++;
+
+  branch = strchr (arch, '/');
+  if (branch == NULL)
+    return FALSE;
+  branch++;
+
+  if (strchr (branch, '/') != NULL)
+    return FALSE;
+
+  view->id = id;
+  view->id_len = (arch - 1) - id;
+  view->arch = arch;
+  view->arch_len = (branch - 1) - arch;
+  view->branch = branch;
+
+  return view->id_len > 0 && view->arch_len > 0 && *branch != 0;
+}
+
+gboolean
+flatpak_ref_view_has_id (const FlatpakRefView *view,
+                         const char           *id)
+{
+  return strncmp (view->id, id, view->id_len) == 0 && id[view->id_len] == 0;
+}
+
+gboolean
+flatpak_ref_view_has_arch (const FlatpakRefView *view,
+                           const char           *arch)
+{
+  return strncmp (view->arch, arch, view->arch_len) == 0 && arch[view->arch_len] == 0;
+}
+
 static const char *
 next_element (const char **partial_ref)
 {
@@ -1959,6 +2244,88 @@ flatpak_openat_noatime (int           dfd,
     }
 }
 
+#ifndef FICLONE
+#define FICLONE _IOW (0x94, 9, int)
+#endif
+
+/* Tries to copy the content of the regular file @src to @dest by
+ * cloning extents (FICLONE), falling back to copy_file_range (). This
+ * shares or at least avoids double-buffering the data on filesystems
+ * that support it. Returns FALSE (with no error set) if neither fast
+ * path worked, in which case the caller should do a regular copy. */
+static gboolean
+flatpak_file_copy_data_fast (GFile     *src,
+                             GFile     *dest,
+                             GFileInfo *src_info,
+                             gboolean   no_chown)
+{
+  glnx_autofd int src_fd = -1;
+  glnx_autofd int dest_fd = -1;
+  guint32 mode = g_file_info_get_attribute_uint32 (src_info, "unix::mode");
+
+  src_fd = open (flatpak_file_get_path_cached (src), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+  if (src_fd == -1)
+    return FALSE;
+
+  dest_fd = open (flatpak_file_get_path_cached (dest), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                  mode & 07777);
+  if (dest_fd == -1)
+    return FALSE;
+
+  if (ioctl (dest_fd, FICLONE, src_fd) != 0)
+    {
+      gboolean copied = FALSE;
+
+#ifdef HAVE_COPY_FILE_RANGE
+      if (errno == EXDEV || errno == EINVAL || errno == ENOTTY || errno == EOPNOTSUPP)
+        {
+          struct stat stbuf;
+
+          if (fstat (src_fd, &stbuf) == 0)
+            {
+              off_t remaining = stbuf.st_size;
+
+              copied = TRUE;
+              while (remaining > 0)
+                {
+                  ssize_t res = copy_file_range (src_fd, NULL, dest_fd, NULL, remaining, 0);
+                  if (res <= 0)
+                    {
+                      copied = FALSE;
+                      break;
+                    }
+                  remaining -= res;
+                }
+            }
+        }
+#endif
+
+      if (!copied)
+        {
+          (void) unlink (flatpak_file_get_path_cached (dest));
+          return FALSE;
+        }
+    }
+
+  if (!no_chown &&
+      fchown (dest_fd,
+              g_file_info_get_attribute_uint32 (src_info, "unix::uid"),
+              g_file_info_get_attribute_uint32 (src_info, "unix::gid")) != 0)
+    {
+      (void) unlink (flatpak_file_get_path_cached (dest));
+      return FALSE;
+    }
+
+  /* The O_CREAT mode is subject to the umask, so set it again */
+  if (fchmod (dest_fd, mode & 07777) != 0)
+    {
+      (void) unlink (flatpak_file_get_path_cached (dest));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 gboolean
 flatpak_cp_a (GFile         *src,
               GFile         *dest,
@@ -2058,9 +2425,13 @@ flatpak_cp_a (GFile         *src,
             }
           else
             {
-              if (!g_file_copy (src_child, dest_child, copyflags,
-                                cancellable, NULL, NULL, error))
-                goto out;
+              if (g_file_info_get_file_type (child_info) != G_FILE_TYPE_REGULAR ||
+                  !flatpak_file_copy_data_fast (src_child, dest_child, child_info, no_chown))
+                {
+                  if (!g_file_copy (src_child, dest_child, copyflags,
+                                    cancellable, NULL, NULL, error))
+                    goto out;
+                }
             }
         }
 
@@ -2223,14 +2594,191 @@ flatpak_mkdir_p (GFile        *dir,
                                  error);
 }
 
+/* A parallel rm -rf. Directories are scanned by thread pool tasks:
+ * regular entries are unlinked inline and each subdirectory becomes a
+ * new task, everything relative to an openat()ed fd so no path is
+ * re-resolved. A directory can only be removed once its subtrees are
+ * gone, so each one counts its live subdirectories and the last
+ * finisher removes it and cascades up.
+ */
+typedef struct
+{
+  GThreadPool  *pool;
+  GMutex        mutex;
+  GCond         cond;
+  guint         outstanding; /* Tasks queued or running */
+  GError       *first_error;
+  GCancellable *cancellable;
+} RmRfJob;
+
+typedef struct RmRfDir RmRfDir;
+struct RmRfDir
+{
+  RmRfJob *job;
+  RmRfDir *parent;     /* NULL for the toplevel */
+  int      dfd;        /* Owned */
+  int      parent_dfd; /* For the final rmdir, kept open by parent until we're done */
+  char    *name;       /* Relative to parent_dfd */
+  gint     pending;    /* Our own scan + subdirectories still alive (atomic) */
+};
+
+static void
+rm_rf_job_note_error (RmRfJob *job, GError *error)
+{
+  g_mutex_lock (&job->mutex);
+  if (job->first_error == NULL)
+    job->first_error = error;
+  else
+    g_error_free (error);
+  g_mutex_unlock (&job->mutex);
+}
+
+/* Called when the scan of @dir or one of its subtrees completes; the
+ * last one removes the now-empty directory and credits the parent */
+static void
+rm_rf_dir_finish (RmRfDir *dir)
+{
+  while (dir != NULL && g_atomic_int_dec_and_test (&dir->pending))
+    {
+      RmRfDir *parent = dir->parent;
+
+      if (unlinkat (dir->parent_dfd, dir->name, AT_REMOVEDIR) != 0)
+        {
+          GError *local_error = NULL;
+
+          glnx_set_error_from_errno (&local_error);
+          rm_rf_job_note_error (dir->job, local_error);
+        }
+
+      close (dir->dfd);
+      g_free (dir->name);
+      g_free (dir);
+
+      dir = parent;
+    }
+}
+
+static void
+rm_rf_dir_scan (gpointer data, gpointer user_data)
+{
+  RmRfDir *dir = data;
+  RmRfJob *job = dir->job;
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  GError *local_error = NULL;
+
+  if (!g_cancellable_is_cancelled (job->cancellable) &&
+      glnx_dirfd_iterator_init_at (dir->dfd, ".", FALSE, &dfd_iter, &local_error))
+    {
+      while (TRUE)
+        {
+          struct dirent *dent;
+
+          if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&dfd_iter, &dent, NULL, &local_error) ||
+              dent == NULL)
+            break;
+
+          if (dent->d_type == DT_DIR)
+            {
+              int child_dfd = openat (dfd_iter.fd, dent->d_name,
+                                      O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+              RmRfDir *child;
+
+              if (child_dfd < 0)
+                {
+                  glnx_set_error_from_errno (&local_error);
+                  break;
+                }
+
+              child = g_new0 (RmRfDir, 1);
+              child->job = job;
+              child->parent = dir;
+              child->dfd = child_dfd;
+              child->parent_dfd = dir->dfd;
+              child->name = g_strdup (dent->d_name);
+              child->pending = 1;
+
+              g_atomic_int_inc (&dir->pending);
+
+              g_mutex_lock (&job->mutex);
+              job->outstanding++;
+              g_mutex_unlock (&job->mutex);
+              g_thread_pool_push (job->pool, child, NULL);
+            }
+          else if (unlinkat (dfd_iter.fd, dent->d_name, 0) != 0)
+            {
+              glnx_set_error_from_errno (&local_error);
+              break;
+            }
+        }
+    }
+
+  if (local_error != NULL)
+    rm_rf_job_note_error (job, local_error);
+
+  rm_rf_dir_finish (dir);
+
+  g_mutex_lock (&job->mutex);
+  job->outstanding--;
+  if (job->outstanding == 0)
+    g_cond_signal (&job->cond);
+  g_mutex_unlock (&job->mutex);
+}
+
 gboolean
 flatpak_rm_rf (GFile        *dir,
                GCancellable *cancellable,
                GError      **error)
 {
-  return glnx_shutil_rm_rf_at (AT_FDCWD,
-                               flatpak_file_get_path_cached (dir),
-                               cancellable, error);
+  const char *path = flatpak_file_get_path_cached (dir);
+  RmRfJob job = { 0, };
+  RmRfDir *top;
+  int dfd;
+
+  dfd = openat (AT_FDCWD, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (dfd < 0)
+    {
+      /* Non-directories and missing paths don't benefit from the
+         parallel walk */
+      return glnx_shutil_rm_rf_at (AT_FDCWD, path, cancellable, error);
+    }
+
+  g_mutex_init (&job.mutex);
+  g_cond_init (&job.cond);
+  job.cancellable = cancellable;
+  job.pool = g_thread_pool_new (rm_rf_dir_scan, &job, MIN (g_get_num_processors (), 8), FALSE, NULL);
+
+  top = g_new0 (RmRfDir, 1);
+  top->job = &job;
+  top->dfd = dfd;
+  top->parent_dfd = AT_FDCWD;
+  top->name = g_strdup (path);
+  top->pending = 1;
+
+  job.outstanding = 1;
+  g_thread_pool_push (job.pool, top, NULL);
+
+  g_mutex_lock (&job.mutex);
+  while (job.outstanding > 0)
+    g_cond_wait (&job.cond, &job.mutex);
+  g_mutex_unlock (&job.mutex);
+
+  g_thread_pool_free (job.pool, FALSE, TRUE);
+  g_mutex_clear (&job.mutex);
+  g_cond_clear (&job.cond);
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    {
+      g_clear_error (&job.first_error);
+      return FALSE;
+    }
+
+  if (job.first_error != NULL)
+    {
+      g_propagate_error (error, job.first_error);
+      return FALSE;
+    }
+
+  return TRUE;
 }
 
 char *
@@ -2497,11 +3045,12 @@ flatpak_summary_match_subrefs (GVariant   *summary,
 {
   g_autoptr(GVariant) refs = NULL;
   GPtrArray *res = g_ptr_array_new ();
-  gsize n, i;
+  gsize n, i, start;
   g_auto(GStrv) parts = NULL;
-  g_autofree char *parts_prefix = NULL;
-  g_autofree char *ref_prefix = NULL;
+  g_autofree char *id_prefix = NULL;
   g_autofree char *ref_suffix = NULL;
+  gsize prefix_len;
+  int pos;
 
   /* Work out which refs list to use, based on the @collection_id. */
   refs = summary_find_refs_list (summary, collection_id);
@@ -2510,39 +3059,42 @@ flatpak_summary_match_subrefs (GVariant   *summary,
     {
       /* Match against the refs. */
       parts = g_strsplit (ref, "/", 0);
-      parts_prefix = g_strconcat (parts[1], ".", NULL);
 
-      ref_prefix = g_strconcat (parts[0], "/", NULL);
+      /* Any matching ref shares the "<kind>/<id>." prefix, and the
+       * refs list is sorted, so the candidates form one contiguous
+       * run; bsearch for its start rather than scanning every ref in
+       * the summary */
+      id_prefix = g_strconcat (parts[0], "/", parts[1], ".", NULL);
+      prefix_len = strlen (id_prefix);
       ref_suffix = g_strconcat ("/", parts[2], "/", parts[3], NULL);
 
       n = g_variant_n_children (refs);
-      for (i = 0; i < n; i++)
+      if (flatpak_variant_bsearch_str (refs, id_prefix, &pos))
+        start = pos;
+      else /* On a miss the position can be on either side of the run start */
+        start = (pos > 0) ? pos - 1 : 0;
+
+      for (i = start; i < n; i++)
         {
           g_autoptr(GVariant) child = NULL;
           g_autoptr(GVariant) cur_v = NULL;
           const char *cur;
-          const char *id_start;
+          int cmp;
 
           child = g_variant_get_child_value (refs, i);
           cur_v = g_variant_get_child_value (child, 0);
           cur = g_variant_get_data (cur_v);
 
-          /* Must match type */
-          if (!g_str_has_prefix (cur, ref_prefix))
-            continue;
+          cmp = strncmp (cur, id_prefix, prefix_len);
+          if (cmp < 0)
+            continue; /* Still just before the run */
+          if (cmp > 0)
+            break; /* Sorted, so there can be no matches past the run */
 
           /* Must match arch & branch */
           if (!g_str_has_suffix (cur, ref_suffix))
             continue;
 
-          id_start = strchr (cur, '/');
-          if (id_start == NULL)
-            continue;
-
-          /* But only prefix of id */
-          if (!g_str_has_prefix (id_start + 1, parts_prefix))
-            continue;
-
           g_ptr_array_add (res, g_strdup (cur));
         }
     }
@@ -3069,23 +3621,199 @@ populate_commit_data_cache (GVariant   *metadata,
           if (g_hash_table_lookup (commit_data_cache, old_rev))
             continue;
 
-          g_variant_get_child (old_commit_data_v, 0, "t", &old_installed_size);
-          old_installed_size = GUINT64_FROM_BE (old_installed_size);
-          g_variant_get_child (old_commit_data_v, 1, "t", &old_download_size);
-          old_download_size = GUINT64_FROM_BE (old_download_size);
-          g_variant_get_child (old_commit_data_v, 2, "s", &old_metadata);
+          g_variant_get_child (old_commit_data_v, 0, "t", &old_installed_size);
+          old_installed_size = GUINT64_FROM_BE (old_installed_size);
+          g_variant_get_child (old_commit_data_v, 1, "t", &old_download_size);
+          old_download_size = GUINT64_FROM_BE (old_download_size);
+          g_variant_get_child (old_commit_data_v, 2, "s", &old_metadata);
+
+          old_rev_data = g_new0 (CommitData, 1);
+          old_rev_data->installed_size = old_installed_size;
+          old_rev_data->download_size = old_download_size;
+          old_rev_data->metadata_contents = g_steal_pointer (&old_metadata);
+
+          if (sparse_cache)
+            old_rev_data->sparse_data = g_variant_lookup_value (sparse_cache, old_ref, G_VARIANT_TYPE_VARDICT);
+
+          g_hash_table_insert (commit_data_cache, g_steal_pointer (&old_rev), old_rev_data);
+        }
+    }
+}
+
+/* Returns the arch a summary ref is specific to, or %NULL if it is
+ * relevant for all arches (e.g. the ostree-metadata ref) */
+static char *
+summary_ref_get_arch (const char *ref)
+{
+  g_auto(GStrv) parts = g_strsplit (ref, "/", -1);
+  guint n_parts = g_strv_length (parts);
+
+  if (n_parts == 4 &&
+      (strcmp (parts[0], "app") == 0 || strcmp (parts[0], "runtime") == 0))
+    return g_strdup (parts[2]);
+
+  if (n_parts == 2 &&
+      (strcmp (parts[0], "appstream") == 0 || strcmp (parts[0], "appstream2") == 0))
+    return g_strdup (parts[1]);
+
+  return NULL;
+}
+
+/* Publish the sha256 of a summary file next to it (as <file>.digest), so
+ * clients can cheaply check whether their saved copy is still current
+ * before downloading the full file. */
+static gboolean
+flatpak_repo_write_summary_digest (GFile   *summary_file,
+                                   GBytes  *summary_bytes,
+                                   GError **error)
+{
+  g_autofree char *digest = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, summary_bytes);
+  g_autofree char *digest_path = g_strconcat (flatpak_file_get_path_cached (summary_file), ".digest", NULL);
+
+  return g_file_set_contents (digest_path, digest, -1, error);
+}
+
+/* Write per-arch shards of the summary file below summaries/ in the repo,
+ * so that single-arch clients (xa.summary-arch in the remote config) can
+ * download only the refs they can actually use. Each shard is a regular
+ * summary file, just restricted to one arch (plus arch-independent refs),
+ * and the combined summary always remains available as a fallback. */
+static gboolean
+flatpak_repo_write_arch_summaries (OstreeRepo   *repo,
+                                   GCancellable *cancellable,
+                                   GError      **error)
+{
+  g_autoptr(GVariant) summary = NULL;
+  g_autoptr(GVariant) ref_list = NULL;
+  g_autoptr(GVariant) metadata = NULL;
+  g_autoptr(GHashTable) arches = NULL;
+  g_autoptr(GFile) summaries_dir = NULL;
+  GHashTableIter arch_iter;
+  gpointer arch_key;
+  gsize n_refs, n_meta, i, j;
+
+  summary = flatpak_repo_load_summary (repo, error);
+  if (summary == NULL)
+    return FALSE;
+
+  ref_list = g_variant_get_child_value (summary, 0);
+  metadata = g_variant_get_child_value (summary, 1);
+
+  arches = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  n_refs = g_variant_n_children (ref_list);
+  for (i = 0; i < n_refs; i++)
+    {
+      g_autoptr(GVariant) entry = g_variant_get_child_value (ref_list, i);
+      const char *ref;
+      char *arch;
+
+      g_variant_get_child (entry, 0, "&s", &ref);
+      arch = summary_ref_get_arch (ref);
+      if (arch != NULL)
+        g_hash_table_add (arches, arch);
+    }
+
+  summaries_dir = g_file_get_child (ostree_repo_get_path (repo), "summaries");
+  if (!flatpak_mkdir_p (summaries_dir, cancellable, error))
+    return FALSE;
+
+  g_hash_table_iter_init (&arch_iter, arches);
+  while (g_hash_table_iter_next (&arch_iter, &arch_key, NULL))
+    {
+      const char *shard_arch = arch_key;
+      GVariantBuilder refs_builder;
+      GVariantBuilder metadata_builder;
+      g_autoptr(GVariant) shard = NULL;
+      g_autoptr(GBytes) shard_bytes = NULL;
+      g_autofree char *shard_name = g_strconcat (shard_arch, ".summary", NULL);
+      g_autoptr(GFile) shard_file = g_file_get_child (summaries_dir, shard_name);
+
+      g_variant_builder_init (&refs_builder, G_VARIANT_TYPE ("a(s(taya{sv}))"));
+      for (i = 0; i < n_refs; i++)
+        {
+          g_autoptr(GVariant) entry = g_variant_get_child_value (ref_list, i);
+          const char *ref;
+          g_autofree char *ref_arch = NULL;
+
+          g_variant_get_child (entry, 0, "&s", &ref);
+          ref_arch = summary_ref_get_arch (ref);
+          if (ref_arch == NULL || strcmp (ref_arch, shard_arch) == 0)
+            g_variant_builder_add_value (&refs_builder, entry);
+        }
+
+      g_variant_builder_init (&metadata_builder, G_VARIANT_TYPE_VARDICT);
+      n_meta = g_variant_n_children (metadata);
+      for (i = 0; i < n_meta; i++)
+        {
+          g_autoptr(GVariant) mentry = g_variant_get_child_value (metadata, i);
+          g_autoptr(GVariant) mvalue = NULL;
+          g_autoptr(GVariant) payload = NULL;
+          const char *mkey;
+
+          g_variant_get_child (mentry, 0, "&s", &mkey);
+          mvalue = g_variant_get_child_value (mentry, 1);
+          payload = g_variant_get_variant (mvalue);
 
-          old_rev_data = g_new0 (CommitData, 1);
-          old_rev_data->installed_size = old_installed_size;
-          old_rev_data->download_size = old_download_size;
-          old_rev_data->metadata_contents = g_steal_pointer (&old_metadata);
+          if (strcmp (mkey, "xa.cache") == 0)
+            {
+              g_autoptr(GVariant) cache = g_variant_get_variant (payload);
+              GVariantBuilder cache_builder;
+              gsize n_cache = g_variant_n_children (cache);
 
-          if (sparse_cache)
-            old_rev_data->sparse_data = g_variant_lookup_value (sparse_cache, old_ref, G_VARIANT_TYPE_VARDICT);
+              g_variant_builder_init (&cache_builder, G_VARIANT_TYPE ("a{s(tts)}"));
+              for (j = 0; j < n_cache; j++)
+                {
+                  g_autoptr(GVariant) centry = g_variant_get_child_value (cache, j);
+                  const char *cref;
+                  g_autofree char *cref_arch = NULL;
+
+                  g_variant_get_child (centry, 0, "&s", &cref);
+                  cref_arch = summary_ref_get_arch (cref);
+                  if (cref_arch == NULL || strcmp (cref_arch, shard_arch) == 0)
+                    g_variant_builder_add_value (&cache_builder, centry);
+                }
+              g_variant_builder_add (&metadata_builder, "{sv}", mkey,
+                                     g_variant_new_variant (g_variant_builder_end (&cache_builder)));
+            }
+          else if (strcmp (mkey, "xa.sparse-cache") == 0)
+            {
+              GVariantBuilder sparse_builder;
+              gsize n_sparse = g_variant_n_children (payload);
 
-          g_hash_table_insert (commit_data_cache, g_steal_pointer (&old_rev), old_rev_data);
+              g_variant_builder_init (&sparse_builder, G_VARIANT_TYPE ("a{sa{sv}}"));
+              for (j = 0; j < n_sparse; j++)
+                {
+                  g_autoptr(GVariant) sentry = g_variant_get_child_value (payload, j);
+                  const char *sref;
+                  g_autofree char *sref_arch = NULL;
+
+                  g_variant_get_child (sentry, 0, "&s", &sref);
+                  sref_arch = summary_ref_get_arch (sref);
+                  if (sref_arch == NULL || strcmp (sref_arch, shard_arch) == 0)
+                    g_variant_builder_add_value (&sparse_builder, sentry);
+                }
+              g_variant_builder_add (&metadata_builder, "{sv}", mkey,
+                                     g_variant_builder_end (&sparse_builder));
+            }
+          else
+            {
+              g_variant_builder_add (&metadata_builder, "{sv}", mkey, payload);
+            }
         }
+
+      shard = g_variant_ref_sink (g_variant_new ("(@a(s(taya{sv}))@a{sv})",
+                                                 g_variant_builder_end (&refs_builder),
+                                                 g_variant_builder_end (&metadata_builder)));
+
+      if (!flatpak_variant_save (shard_file, shard, cancellable, error))
+        return FALSE;
+
+      shard_bytes = g_variant_get_data_as_bytes (shard);
+      if (!flatpak_repo_write_summary_digest (shard_file, shard_bytes, error))
+        return FALSE;
     }
+
+  return TRUE;
 }
 
 /* Update the metadata in the summary file for @repo, and then re-sign the file.
@@ -3425,6 +4153,29 @@ flatpak_repo_update (OstreeRepo   *repo,
         return FALSE;
     }
 
+  {
+    g_autoptr(GFile) summary_file = g_file_get_child (ostree_repo_get_path (repo), "summary");
+    g_autoptr(GMappedFile) summary_mfile = NULL;
+
+    summary_mfile = g_mapped_file_new (flatpak_file_get_path_cached (summary_file), FALSE, NULL);
+    if (summary_mfile != NULL)
+      {
+        g_autoptr(GBytes) summary_bytes = g_mapped_file_get_bytes (summary_mfile);
+
+        if (!flatpak_repo_write_summary_digest (summary_file, summary_bytes, error))
+          return FALSE;
+      }
+  }
+
+  /* Collection-enabled repos announce their refs via the collection map
+   * and signed ostree-metadata branch, which the shards can't represent,
+   * so only shard plain repos */
+  if (collection_id == NULL)
+    {
+      if (!flatpak_repo_write_arch_summaries (repo, cancellable, error))
+        return FALSE;
+    }
+
   return TRUE;
 
 out:
@@ -4333,12 +5084,44 @@ flatpak_extension_matches_reason (const char *extension_id,
   return FALSE;
 }
 
+/* Whether any installation can have unmaintained extensions at all.
+ * Almost no installation has them, and checking the base dirs once
+ * here is much cheaper than probing every installation again for
+ * every extension point below. */
+static gboolean
+have_unmaintained_extensions (void)
+{
+  g_autoptr(GFile) user_base_dir = flatpak_get_user_base_dir_location ();
+  g_autoptr(GFile) user_extension_dir = g_file_get_child (user_base_dir, "extension");
+  GPtrArray *system_base_dirs;
+  int i;
+
+  if (g_file_query_exists (user_extension_dir, NULL))
+    return TRUE;
+
+  system_base_dirs = flatpak_get_system_base_dir_locations (NULL, NULL);
+  if (system_base_dirs == NULL)
+    return TRUE; /* Can't tell, assume there might be some */
+
+  for (i = 0; i < system_base_dirs->len; i++)
+    {
+      g_autoptr(GFile) extension_dir =
+        g_file_get_child (g_ptr_array_index (system_base_dirs, i), "extension");
+
+      if (g_file_query_exists (extension_dir, NULL))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
 static GList *
 add_extension (GKeyFile   *metakey,
                const char *group,
                const char *extension,
                const char *arch,
                const char *branch,
+               gboolean    check_unmaintained,
                GList      *res)
 {
   FlatpakExtension *ext;
@@ -4367,7 +5150,8 @@ add_extension (GKeyFile   *metakey,
 
   ref = g_build_filename ("runtime", extension, arch, branch, NULL);
 
-  files = flatpak_find_unmaintained_extension_dir_if_exists (extension, arch, branch, NULL);
+  if (check_unmaintained)
+    files = flatpak_find_unmaintained_extension_dir_if_exists (extension, arch, branch, NULL);
 
   if (files == NULL)
     {
@@ -4415,8 +5199,9 @@ add_extension (GKeyFile   *metakey,
             }
         }
 
-      unmaintained_refs = flatpak_list_unmaintained_refs (prefix, arch, branch,
-                                                          NULL, NULL);
+      if (check_unmaintained)
+        unmaintained_refs = flatpak_list_unmaintained_refs (prefix, arch, branch,
+                                                            NULL, NULL);
       for (j = 0; unmaintained_refs != NULL && unmaintained_refs[j] != NULL; j++)
         {
           g_autofree char *extended_dir = g_build_filename (directory, unmaintained_refs[j] + strlen (prefix), NULL);
@@ -4469,12 +5254,15 @@ flatpak_list_extensions (GKeyFile   *metakey,
   g_auto(GStrv) groups = NULL;
   int i, j;
   GList *res;
+  gboolean check_unmaintained;
 
   res = NULL;
 
   if (arch == NULL)
     arch = flatpak_get_arch ();
 
+  check_unmaintained = have_unmaintained_extensions ();
+
   groups = g_key_file_get_groups (metakey, NULL);
   for (i = 0; groups[i] != NULL; i++)
     {
@@ -4505,7 +5293,8 @@ flatpak_list_extensions (GKeyFile   *metakey,
             }
 
           for (j = 0; branches[j] != NULL; j++)
-            res = add_extension (metakey, groups[i], name, arch, branches[j], res);
+            res = add_extension (metakey, groups[i], name, arch, branches[j],
+                                 check_unmaintained, res);
         }
     }
 
@@ -4944,6 +5733,21 @@ flatpak_bundle_load (GFile   *file,
                                                        FALSE));
 }
 
+/* Hint the kernel that the bundle is about to be read once, start to
+ * end, so readahead runs ahead of the delta executor instead of the
+ * default window trailing it */
+static void
+flatpak_bundle_advise_sequential (GFile *file)
+{
+  glnx_autofd int fd = open (flatpak_file_get_path_cached (file), O_RDONLY | O_CLOEXEC);
+
+  if (fd >= 0)
+    {
+      posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+      posix_fadvise (fd, 0, 0, POSIX_FADV_WILLNEED);
+    }
+}
+
 gboolean
 flatpak_pull_from_bundle (OstreeRepo   *repo,
                           GFile        *file,
@@ -4984,6 +5788,8 @@ flatpak_pull_from_bundle (OstreeRepo   *repo,
   /* Don’t need to set the collection ID here, since the remote binds this ref to the collection. */
   ostree_repo_transaction_set_ref (repo, remote, ref, to_checksum);
 
+  flatpak_bundle_advise_sequential (file);
+
   if (!ostree_repo_static_delta_execute_offline (repo,
                                                  file,
                                                  FALSE,
@@ -5161,6 +5967,395 @@ flatpak_mirror_image_from_oci (FlatpakOciRegistry    *dst_registry,
 }
 
 
+/* Number of layers we download concurrently while earlier layers are
+ * being decompressed and applied */
+#define DEFAULT_MAX_LAYER_FETCHES 3
+
+typedef struct
+{
+  GMutex              lock;
+  GCond               cond;
+  FlatpakOciRegistry *registry;
+  const char         *oci_repository;
+  GCancellable       *cancellable;
+} LayerFetchData;
+
+typedef struct
+{
+  LayerFetchData *data;
+  const char     *digest; /* owned by the manifest */
+  int             fd;     /* the downloaded layer, once done */
+  guint64         fetched;
+  gboolean        done;
+  GError         *error;
+} LayerFetchJob;
+
+static void
+layer_fetch_progress (guint64  downloaded_bytes,
+                      gpointer user_data)
+{
+  LayerFetchJob *job = user_data;
+  LayerFetchData *data = job->data;
+
+  /* Called on the worker thread; the pull thread picks this up when
+   * reporting overall progress */
+  g_mutex_lock (&data->lock);
+  job->fetched = downloaded_bytes;
+  g_cond_broadcast (&data->cond);
+  g_mutex_unlock (&data->lock);
+}
+
+static void
+layer_fetch_worker (gpointer item,
+                    gpointer user_data)
+{
+  LayerFetchJob *job = item;
+  LayerFetchData *data = job->data;
+  g_autoptr(GMainContextPopDefault) context = NULL;
+  g_autoptr(FlatpakOciRegistry) registry = NULL;
+  g_autoptr(GError) local_error = NULL;
+  int fd = -1;
+
+  context = flatpak_main_context_new_default ();
+
+  registry = flatpak_oci_registry_clone (data->registry, data->cancellable, &local_error);
+  if (registry != NULL)
+    fd = flatpak_oci_registry_download_blob (registry, data->oci_repository, FALSE,
+                                             job->digest,
+                                             layer_fetch_progress, job,
+                                             data->cancellable, &local_error);
+
+  g_mutex_lock (&data->lock);
+  job->fd = fd;
+  if (fd == -1)
+    job->error = g_steal_pointer (&local_error);
+  job->done = TRUE;
+  g_cond_broadcast (&data->cond);
+  g_mutex_unlock (&data->lock);
+}
+
+static void
+layer_fetch_cancelled_cb (GCancellable *cancellable,
+                          gpointer      user_data)
+{
+  g_cancellable_cancel (user_data);
+}
+
+static void
+layer_fetch_shutdown (GThreadPool    *pool,
+                      LayerFetchData *data,
+                      LayerFetchJob  *jobs,
+                      guint           n_jobs,
+                      GCancellable   *caller_cancellable,
+                      gulong          cancel_id)
+{
+  guint i;
+
+  if (pool == NULL)
+    return;
+
+  /* Stop any still-running downloads; resumable partial blobs are kept
+   * on disk for the next attempt */
+  g_cancellable_cancel (data->cancellable);
+  g_thread_pool_free (pool, TRUE, TRUE);
+
+  if (cancel_id != 0)
+    g_cancellable_disconnect (caller_cancellable, cancel_id);
+
+  for (i = 0; i < n_jobs; i++)
+    {
+      if (jobs[i].fd != -1)
+        close (jobs[i].fd);
+      g_clear_error (&jobs[i].error);
+    }
+
+  g_cond_clear (&data->cond);
+  g_mutex_clear (&data->lock);
+}
+
+static guint
+get_max_layer_fetches (void)
+{
+  const char *env = g_getenv ("FLATPAK_OCI_MAX_LAYER_FETCHES");
+
+  if (env != NULL && atoi (env) > 0)
+    return atoi (env);
+
+  return DEFAULT_MAX_LAYER_FETCHES;
+}
+
+#define LAYER_PIPELINE_CHUNK_SIZE (256 * 1024)
+#define LAYER_PIPELINE_MAX_CHUNKS 8
+
+/* Decompresses a gzipped layer on a separate thread, handing decoded
+ * chunks to the pull thread via a bounded queue. That way the gunzip
+ * cpu work overlaps with libarchive parsing and the object writes to
+ * the repo, instead of all three running back to back on one thread.
+ * The thread also maintains the sha256 of the compressed stream, like
+ * flatpak_archive_read_open_fd_with_checksum () does inline. */
+typedef struct
+{
+  int              src_fd;    /* the compressed layer, owned by the caller */
+  FlatpakChecksum *checksum;  /* over the compressed bytes, owned by the caller */
+  GAsyncQueue     *chunks;    /* decoded GBytes, an empty one marks the end */
+  GAsyncQueue     *slots;     /* tokens bounding the number of queued chunks */
+  gint             cancelled; /* atomic */
+  GThread         *thread;
+  GError          *error;     /* set by the thread before queueing the end marker */
+  GBytes          *current;   /* the chunk libarchive is currently reading from */
+} LayerPipeline;
+
+static gpointer
+layer_pipeline_thread (gpointer user_data)
+{
+  LayerPipeline *pipeline = user_data;
+  g_autoptr(GZlibDecompressor) decompressor = g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP);
+  guchar in_buffer[LAYER_PIPELINE_CHUNK_SIZE];
+  gsize in_start = 0, in_avail = 0;
+  gboolean in_eof = FALSE;
+  gboolean finished = FALSE;
+
+  while (!finished && !g_atomic_int_get (&pipeline->cancelled))
+    {
+      g_autofree guchar *out_buffer = NULL;
+      g_autoptr(GError) local_error = NULL;
+      gsize bytes_consumed = 0, bytes_written = 0;
+      GConverterResult res;
+      ssize_t bytes_read;
+
+      if (in_avail == 0 && !in_eof)
+        {
+          do
+            bytes_read = read (pipeline->src_fd, in_buffer, sizeof (in_buffer));
+          while (G_UNLIKELY (bytes_read == -1 && errno == EINTR));
+
+          if (bytes_read < 0)
+            {
+              glnx_throw_errno_prefix (&pipeline->error, "Reading layer");
+              break;
+            }
+
+          if (bytes_read == 0)
+            in_eof = TRUE;
+          else
+            {
+              flatpak_checksum_update (pipeline->checksum, in_buffer, bytes_read);
+              in_start = 0;
+              in_avail = bytes_read;
+            }
+        }
+
+      out_buffer = g_malloc (LAYER_PIPELINE_CHUNK_SIZE);
+      res = g_converter_convert (G_CONVERTER (decompressor),
+                                 in_buffer + in_start, in_avail,
+                                 out_buffer, LAYER_PIPELINE_CHUNK_SIZE,
+                                 in_eof ? G_CONVERTER_INPUT_AT_END : 0,
+                                 &bytes_consumed, &bytes_written,
+                                 &local_error);
+      if (res == G_CONVERTER_ERROR)
+        {
+          g_propagate_error (&pipeline->error, g_steal_pointer (&local_error));
+          break;
+        }
+
+      in_start += bytes_consumed;
+      in_avail -= bytes_consumed;
+
+      if (res == G_CONVERTER_FINISHED)
+        finished = TRUE;
+
+      if (bytes_written > 0)
+        {
+          /* Wait for a free slot so we don't run arbitrarily far ahead
+           * of the consumer */
+          g_async_queue_pop (pipeline->slots);
+          if (g_atomic_int_get (&pipeline->cancelled))
+            break;
+
+          g_async_queue_push (pipeline->chunks,
+                              g_bytes_new_take (g_steal_pointer (&out_buffer),
+                                                bytes_written));
+        }
+    }
+
+  /* Checksum whatever follows the gzip stream so the digest covers the
+   * whole blob */
+  while (finished && pipeline->error == NULL &&
+         !g_atomic_int_get (&pipeline->cancelled))
+    {
+      ssize_t bytes_read;
+
+      do
+        bytes_read = read (pipeline->src_fd, in_buffer, sizeof (in_buffer));
+      while (G_UNLIKELY (bytes_read == -1 && errno == EINTR));
+
+      if (bytes_read < 0)
+        {
+          glnx_throw_errno_prefix (&pipeline->error, "Reading layer");
+          break;
+        }
+
+      if (bytes_read == 0)
+        break;
+
+      flatpak_checksum_update (pipeline->checksum, in_buffer, bytes_read);
+    }
+
+  /* Always queue the end marker, even on errors, so the consumer never
+   * blocks waiting for more data */
+  g_async_queue_push (pipeline->chunks, g_bytes_new (NULL, 0));
+
+  return NULL;
+}
+
+static int
+layer_pipeline_open_cb (struct archive *a, void *user_data)
+{
+  return ARCHIVE_OK;
+}
+
+static ssize_t
+layer_pipeline_read_cb (struct archive *a, void *user_data, const void **buff)
+{
+  LayerPipeline *pipeline = user_data;
+
+  if (pipeline->current != NULL)
+    {
+      if (g_bytes_get_size (pipeline->current) == 0)
+        goto at_end;
+
+      g_clear_pointer (&pipeline->current, g_bytes_unref);
+      g_async_queue_push (pipeline->slots, GINT_TO_POINTER (1));
+    }
+
+  pipeline->current = g_async_queue_pop (pipeline->chunks);
+  if (g_bytes_get_size (pipeline->current) == 0)
+    goto at_end;
+
+  *buff = g_bytes_get_data (pipeline->current, NULL);
+  return g_bytes_get_size (pipeline->current);
+
+at_end:
+  /* The thread sets its error before queueing the end marker */
+  if (pipeline->error != NULL)
+    {
+      archive_set_error (a, EIO, "%s", pipeline->error->message);
+      return -1;
+    }
+
+  return 0;
+}
+
+static int
+layer_pipeline_close_cb (struct archive *a, void *user_data)
+{
+  /* The pipeline outlives the archive, see layer_pipeline_free () */
+  return ARCHIVE_OK;
+}
+
+static LayerPipeline *
+layer_pipeline_new (int              layer_fd,
+                    FlatpakChecksum *checksum)
+{
+  LayerPipeline *pipeline = g_new0 (LayerPipeline, 1);
+  int i;
+
+  pipeline->src_fd = layer_fd;
+  pipeline->checksum = checksum;
+  pipeline->chunks = g_async_queue_new ();
+  pipeline->slots = g_async_queue_new ();
+  for (i = 0; i < LAYER_PIPELINE_MAX_CHUNKS; i++)
+    g_async_queue_push (pipeline->slots, GINT_TO_POINTER (1));
+
+  pipeline->thread = g_thread_new ("flatpak-gunzip", layer_pipeline_thread, pipeline);
+
+  return pipeline;
+}
+
+static gboolean
+layer_pipeline_open_archive (LayerPipeline  *pipeline,
+                             struct archive *a,
+                             GError        **error)
+{
+  if (archive_read_open2 (a, pipeline,
+                          layer_pipeline_open_cb,
+                          layer_pipeline_read_cb,
+                          NULL, /* not seekable */
+                          layer_pipeline_close_cb) != ARCHIVE_OK)
+    return propagate_libarchive_error (error, a);
+
+  return TRUE;
+}
+
+/* Waits for the decompressor to reach the end of the blob, so the
+ * checksum is complete even when libarchive stopped reading at the
+ * end-of-archive marker, then reports any error it hit. */
+static gboolean
+layer_pipeline_finish (LayerPipeline *pipeline,
+                       GError       **error)
+{
+  gboolean at_end = pipeline->current != NULL &&
+                    g_bytes_get_size (pipeline->current) == 0;
+
+  if (pipeline->current != NULL && !at_end)
+    {
+      g_clear_pointer (&pipeline->current, g_bytes_unref);
+      g_async_queue_push (pipeline->slots, GINT_TO_POINTER (1));
+    }
+
+  while (!at_end)
+    {
+      g_autoptr(GBytes) chunk = g_async_queue_pop (pipeline->chunks);
+
+      if (g_bytes_get_size (chunk) == 0)
+        at_end = TRUE;
+      else
+        g_async_queue_push (pipeline->slots, GINT_TO_POINTER (1));
+    }
+
+  g_thread_join (g_steal_pointer (&pipeline->thread));
+
+  if (pipeline->error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&pipeline->error));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+layer_pipeline_free (LayerPipeline *pipeline)
+{
+  GBytes *chunk;
+
+  if (pipeline->thread != NULL)
+    {
+      g_atomic_int_set (&pipeline->cancelled, 1);
+      /* Unblock the thread if it is waiting for a slot */
+      g_async_queue_push (pipeline->slots, GINT_TO_POINTER (1));
+      g_thread_join (pipeline->thread);
+    }
+
+  while ((chunk = g_async_queue_try_pop (pipeline->chunks)) != NULL)
+    g_bytes_unref (chunk);
+
+  g_clear_pointer (&pipeline->current, g_bytes_unref);
+  g_async_queue_unref (pipeline->chunks);
+  g_async_queue_unref (pipeline->slots);
+  g_clear_error (&pipeline->error);
+  g_free (pipeline);
+}
+
+static gboolean
+layer_is_gzipped (int layer_fd)
+{
+  guchar magic[2];
+
+  return pread (layer_fd, magic, sizeof (magic), 0) == sizeof (magic) &&
+         magic[0] == 0x1f && magic[1] == 0x8b;
+}
+
 char *
 flatpak_pull_from_oci (OstreeRepo            *repo,
                        FlatpakOciRegistry    *registry,
@@ -5187,6 +6382,13 @@ flatpak_pull_from_oci (OstreeRepo            *repo,
   g_autoptr(GVariantBuilder) metadata_builder = g_variant_builder_new (G_VARIANT_TYPE ("a{sv}"));
   g_autoptr(GVariant) metadata = NULL;
   GHashTable *annotations;
+  LayerFetchData fetch_data = { 0 };
+  LayerPipeline *layer_pipeline = NULL;
+  g_autofree LayerFetchJob *jobs = NULL;
+  GThreadPool *fetch_pool = NULL;
+  g_autoptr(GCancellable) fetch_cancellable = NULL;
+  gulong cancel_id = 0;
+  guint max_fetches;
   int i;
 
   g_assert (ref != NULL);
@@ -5232,24 +6434,98 @@ flatpak_pull_from_oci (OstreeRepo            *repo,
                  progress_data.n_layers, progress_data.pulled_layers,
                  progress_user_data);
 
+  /* For remote registries, download layers concurrently in the
+   * background while earlier layers are decompressed and written to
+   * the repo, so the network and cpu work overlap. The unpack itself
+   * has to stay in layer order. */
+  max_fetches = get_max_layer_fetches ();
+  if (!flatpak_oci_registry_is_local (registry) &&
+      progress_data.n_layers > 1 && max_fetches > 1)
+    {
+      g_mutex_init (&fetch_data.lock);
+      g_cond_init (&fetch_data.cond);
+      fetch_data.registry = registry;
+      fetch_data.oci_repository = oci_repository;
+
+      fetch_cancellable = g_cancellable_new ();
+      fetch_data.cancellable = fetch_cancellable;
+      if (cancellable)
+        cancel_id = g_cancellable_connect (cancellable, G_CALLBACK (layer_fetch_cancelled_cb),
+                                           g_object_ref (fetch_cancellable), g_object_unref);
+
+      fetch_pool = g_thread_pool_new (layer_fetch_worker, NULL,
+                                      MIN (max_fetches, progress_data.n_layers),
+                                      FALSE, NULL);
+      if (fetch_pool != NULL)
+        {
+          jobs = g_new0 (LayerFetchJob, progress_data.n_layers);
+          for (i = 0; manifest->layers[i] != NULL; i++)
+            {
+              jobs[i].data = &fetch_data;
+              jobs[i].digest = manifest->layers[i]->digest;
+              jobs[i].fd = -1;
+              g_thread_pool_push (fetch_pool, &jobs[i], NULL);
+            }
+        }
+    }
+
   for (i = 0; manifest->layers[i] != NULL; i++)
     {
       FlatpakOciDescriptor *layer = manifest->layers[i];
       OstreeRepoImportArchiveOptions opts = { 0, };
       g_autoptr(FlatpakAutoArchiveRead) a = NULL;
       glnx_autofd int layer_fd = -1;
-      g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+      g_autoptr(FlatpakChecksum) checksum = flatpak_checksum_new ();
       const char *layer_checksum;
 
       opts.autocreate_parents = TRUE;
       opts.ignore_unsupported_content = TRUE;
 
-      layer_fd = flatpak_oci_registry_download_blob (registry, oci_repository, FALSE,
-                                                     layer->digest,
-                                                     oci_layer_progress, &progress_data,
-                                                     cancellable, error);
-      if (layer_fd == -1)
-        goto error;
+      if (jobs != NULL)
+        {
+          LayerFetchJob *job = &jobs[i];
+
+          g_mutex_lock (&fetch_data.lock);
+          while (!job->done)
+            {
+              gint64 end_time = g_get_monotonic_time () + G_USEC_PER_SEC;
+
+              g_cond_wait_until (&fetch_data.cond, &fetch_data.lock, end_time);
+
+              if (progress_cb)
+                {
+                  guint64 fetched = 0;
+                  guint32 j;
+
+                  for (j = 0; j < progress_data.n_layers; j++)
+                    fetched += jobs[j].done ? manifest->layers[j]->size : jobs[j].fetched;
+
+                  g_mutex_unlock (&fetch_data.lock);
+                  progress_cb (progress_data.total_size, MIN (fetched, progress_data.total_size),
+                               progress_data.n_layers, progress_data.pulled_layers,
+                               progress_user_data);
+                  g_mutex_lock (&fetch_data.lock);
+                }
+            }
+
+          layer_fd = glnx_steal_fd (&job->fd);
+          if (layer_fd == -1)
+            {
+              g_propagate_error (error, g_steal_pointer (&job->error));
+              g_mutex_unlock (&fetch_data.lock);
+              goto error;
+            }
+          g_mutex_unlock (&fetch_data.lock);
+        }
+      else
+        {
+          layer_fd = flatpak_oci_registry_download_blob (registry, oci_repository, FALSE,
+                                                         layer->digest,
+                                                         oci_layer_progress, &progress_data,
+                                                         cancellable, error);
+          if (layer_fd == -1)
+            goto error;
+        }
 
       a = archive_read_new ();
 #ifdef HAVE_ARCHIVE_READ_SUPPORT_FILTER_ALL
@@ -5259,7 +6535,16 @@ flatpak_pull_from_oci (OstreeRepo            *repo,
 #endif
       archive_read_support_format_all (a);
 
-      if (!flatpak_archive_read_open_fd_with_checksum (a, layer_fd, checksum, error))
+      /* Gzipped layers are decompressed on a separate thread, so the
+       * cpu work overlaps with the object writes below. Anything else
+       * is handled inline by libarchive as before. */
+      if (layer_is_gzipped (layer_fd))
+        {
+          layer_pipeline = layer_pipeline_new (layer_fd, checksum);
+          if (!layer_pipeline_open_archive (layer_pipeline, a, error))
+            goto error;
+        }
+      else if (!flatpak_archive_read_open_fd_with_checksum (a, layer_fd, checksum, error))
         goto error;
 
       if (!ostree_repo_import_archive_to_mtree (repo, &opts, a, archive_mtree, NULL, cancellable, error))
@@ -5271,7 +6556,16 @@ flatpak_pull_from_oci (OstreeRepo            *repo,
           goto error;
         }
 
-      layer_checksum = g_checksum_get_string (checksum);
+      if (layer_pipeline != NULL)
+        {
+          gboolean finished = layer_pipeline_finish (layer_pipeline, error);
+
+          g_clear_pointer (&layer_pipeline, layer_pipeline_free);
+          if (!finished)
+            goto error;
+        }
+
+      layer_checksum = flatpak_checksum_get_string (checksum);
       if (!g_str_has_prefix (layer->digest, "sha256:") ||
           strcmp (layer->digest + strlen ("sha256:"), layer_checksum) != 0)
         {
@@ -5283,6 +6577,9 @@ flatpak_pull_from_oci (OstreeRepo            *repo,
       progress_data.previous_layers_size += layer->size;
     }
 
+  layer_fetch_shutdown (g_steal_pointer (&fetch_pool), &fetch_data,
+                        jobs, progress_data.n_layers, cancellable, cancel_id);
+
   if (!ostree_repo_write_mtree (repo, archive_mtree, &archive_root, cancellable, error))
     goto error;
 
@@ -5317,6 +6614,9 @@ flatpak_pull_from_oci (OstreeRepo            *repo,
 
 error:
 
+  g_clear_pointer (&layer_pipeline, layer_pipeline_free);
+  layer_fetch_shutdown (g_steal_pointer (&fetch_pool), &fetch_data,
+                        jobs, progress_data.n_layers, cancellable, cancel_id);
   ostree_repo_abort_transaction (repo, cancellable, NULL);
   return NULL;
 }
@@ -5818,6 +7118,10 @@ progress_cb (OstreeAsyncProgress *progress, gpointer user_data)
   FlatpakProgressCallback progress_cb = g_object_get_data (G_OBJECT (progress), "callback");
   guint last_progress = GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (progress), "last_progress"));
   guint last_total = GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (progress), "last_total"));
+  guint update_freq = GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (progress), "update-frequency"));
+  guint last_update_ms = GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (progress), "last-update-ms"));
+  g_autofree char *current_status = NULL;
+  guint now_ms;
   GString *buf;
   g_autofree char *status = NULL;
   guint outstanding_fetches;
@@ -5854,6 +7158,21 @@ progress_cb (OstreeAsyncProgress *progress, gpointer user_data)
   if (outstanding_fetchesv == NULL)
     return;
 
+  /* Rate-limit the updates. During fast local pulls the async progress
+     notifications arrive much faster than anyone can display them, and the
+     bookkeeping below is not free. The final status update is always let
+     through so the last reported state is never stale. */
+  if (update_freq == 0)
+    update_freq = FLATPAK_DEFAULT_UPDATE_FREQUENCY;
+
+  now_ms = (guint) (g_get_monotonic_time () / 1000);
+  current_status = ostree_async_progress_get_status (progress);
+  if ((current_status == NULL || *current_status == 0) &&
+      now_ms - last_update_ms < update_freq)
+    return;
+
+  g_object_set_data (G_OBJECT (progress), "last-update-ms", GUINT_TO_POINTER (now_ms));
+
   buf = g_string_new ("");
 
   /* The heuristic here goes as follows:
@@ -0,0 +1,38 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#ifndef __FLATPAK_ZSTD_COMPRESSOR_H__
+#define __FLATPAK_ZSTD_COMPRESSOR_H__
+
+#include "config.h"
+
+#ifdef HAVE_ZSTD
+
+#include <gio/gio.h>
+
+#define FLATPAK_TYPE_ZSTD_COMPRESSOR (flatpak_zstd_compressor_get_type ())
+
+G_DECLARE_FINAL_TYPE (FlatpakZstdCompressor, flatpak_zstd_compressor, FLATPAK, ZSTD_COMPRESSOR, GObject)
+
+FlatpakZstdCompressor *flatpak_zstd_compressor_new (int level);
+
+#endif /* HAVE_ZSTD */
+
+#endif /* __FLATPAK_ZSTD_COMPRESSOR_H__ */
@@ -0,0 +1,206 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#include "config.h"
+
+#ifdef HAVE_ZSTD
+
+#include "flatpak-zstd-compressor-private.h"
+
+#include <zstd.h>
+
+#ifndef ZSTD_CLEVEL_DEFAULT
+#define ZSTD_CLEVEL_DEFAULT 3
+#endif
+
+/* A GConverter that produces a zstd stream, usable wherever
+ * GZlibCompressor is, e.g. with GConverterOutputStream or direct
+ * g_converter_convert() calls. */
+struct _FlatpakZstdCompressor
+{
+  GObject       parent;
+
+  ZSTD_CStream *cstream;
+  int           level;
+};
+
+static void flatpak_zstd_compressor_iface_init (GConverterIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (FlatpakZstdCompressor, flatpak_zstd_compressor, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (G_TYPE_CONVERTER,
+                                                flatpak_zstd_compressor_iface_init))
+
+static void
+flatpak_zstd_compressor_finalize (GObject *object)
+{
+  FlatpakZstdCompressor *self = FLATPAK_ZSTD_COMPRESSOR (object);
+
+  if (self->cstream)
+    ZSTD_freeCStream (self->cstream);
+
+  G_OBJECT_CLASS (flatpak_zstd_compressor_parent_class)->finalize (object);
+}
+
+static void
+flatpak_zstd_compressor_class_init (FlatpakZstdCompressorClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = flatpak_zstd_compressor_finalize;
+}
+
+static void
+flatpak_zstd_compressor_init (FlatpakZstdCompressor *self)
+{
+}
+
+static gboolean
+flatpak_zstd_compressor_ensure_stream (FlatpakZstdCompressor *self,
+                                       GError               **error)
+{
+  size_t res;
+
+  if (self->cstream == NULL)
+    {
+      self->cstream = ZSTD_createCStream ();
+      if (self->cstream == NULL)
+        {
+          g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                               "Failed to allocate zstd stream");
+          return FALSE;
+        }
+    }
+
+  res = ZSTD_initCStream (self->cstream, self->level);
+  if (ZSTD_isError (res))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Failed to initialize zstd stream: %s", ZSTD_getErrorName (res));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+flatpak_zstd_compressor_reset (GConverter *converter)
+{
+  FlatpakZstdCompressor *self = FLATPAK_ZSTD_COMPRESSOR (converter);
+
+  if (self->cstream)
+    ZSTD_initCStream (self->cstream, self->level);
+}
+
+static GConverterResult
+flatpak_zstd_compressor_convert (GConverter     *converter,
+                                 const void     *inbuf,
+                                 gsize           inbuf_size,
+                                 void           *outbuf,
+                                 gsize           outbuf_size,
+                                 GConverterFlags flags,
+                                 gsize          *bytes_read,
+                                 gsize          *bytes_written,
+                                 GError        **error)
+{
+  FlatpakZstdCompressor *self = FLATPAK_ZSTD_COMPRESSOR (converter);
+  ZSTD_inBuffer input = { inbuf, inbuf_size, 0 };
+  ZSTD_outBuffer output = { outbuf, outbuf_size, 0 };
+  size_t res;
+
+  if (self->cstream == NULL &&
+      !flatpak_zstd_compressor_ensure_stream (self, error))
+    return G_CONVERTER_ERROR;
+
+  res = ZSTD_compressStream (self->cstream, &output, &input);
+  if (ZSTD_isError (res))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Zstd compression failed: %s", ZSTD_getErrorName (res));
+      return G_CONVERTER_ERROR;
+    }
+
+  if ((flags & G_CONVERTER_INPUT_AT_END) != 0 && input.pos == input.size)
+    {
+      res = ZSTD_endStream (self->cstream, &output);
+      if (ZSTD_isError (res))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Zstd compression failed: %s", ZSTD_getErrorName (res));
+          return G_CONVERTER_ERROR;
+        }
+
+      if (res == 0)
+        {
+          *bytes_read = input.pos;
+          *bytes_written = output.pos;
+          return G_CONVERTER_FINISHED;
+        }
+    }
+  else if ((flags & G_CONVERTER_FLUSH) != 0 && input.pos == input.size)
+    {
+      res = ZSTD_flushStream (self->cstream, &output);
+      if (ZSTD_isError (res))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Zstd compression failed: %s", ZSTD_getErrorName (res));
+          return G_CONVERTER_ERROR;
+        }
+
+      if (res == 0)
+        {
+          *bytes_read = input.pos;
+          *bytes_written = output.pos;
+          return G_CONVERTER_FLUSHED;
+        }
+    }
+
+  *bytes_read = input.pos;
+  *bytes_written = output.pos;
+
+  if (input.pos == 0 && output.pos == 0)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
+                           "Output buffer too small");
+      return G_CONVERTER_ERROR;
+    }
+
+  return G_CONVERTER_CONVERTED;
+}
+
+static void
+flatpak_zstd_compressor_iface_init (GConverterIface *iface)
+{
+  iface->convert = flatpak_zstd_compressor_convert;
+  iface->reset = flatpak_zstd_compressor_reset;
+}
+
+/* Pass level <= 0 for the zstd default level */
+FlatpakZstdCompressor *
+flatpak_zstd_compressor_new (int level)
+{
+  FlatpakZstdCompressor *self;
+
+  self = g_object_new (FLATPAK_TYPE_ZSTD_COMPRESSOR, NULL);
+  self->level = level > 0 ? level : ZSTD_CLEVEL_DEFAULT;
+
+  return self;
+}
+
+#endif /* HAVE_ZSTD */
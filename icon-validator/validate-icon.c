@@ -38,14 +38,14 @@ validate_icon (const char *arg_width,
   format = gdk_pixbuf_get_file_info (filename, &width, &height);
   if (format == NULL)
     {
-      g_printerr ("Format not recognized\n");
+      g_printerr ("%s: Format not recognized\n", filename);
       return 1;
     }
 
   name = gdk_pixbuf_format_get_name (format);
   if (!g_strv_contains (allowed_formats, name))
     {
-      g_printerr ("Format %s not accepted\n", name);
+      g_printerr ("%s: Format %s not accepted\n", filename, name);
       return 1;
     }
 
@@ -73,14 +73,14 @@ validate_icon (const char *arg_width,
 
   if (width > max_width || height > max_height)
     {
-      g_printerr ("Image too large (%dx%d). Max. size %dx%d\n", width, height, max_width, max_height);
+      g_printerr ("%s: Image too large (%dx%d). Max. size %dx%d\n", filename, width, height, max_width, max_height);
       return 1;
     }
 
   pixbuf = gdk_pixbuf_new_from_file (filename, &error);
   if (pixbuf == NULL)
     {
-      g_printerr ("Failed to load image: %s\n", error->message);
+      g_printerr ("%s: Failed to load image: %s\n", filename, error->message);
       return 1;
     }
 
@@ -133,7 +133,7 @@ path_is_usrmerged (const char *dir)
 static int
 rerun_in_sandbox (const char *arg_width,
                   const char *arg_height,
-                  const char *filename)
+                  char      **filenames)
 {
   const char * const usrmerged_dirs[] = { "bin", "lib64", "lib", "sbin" };
   int i;
@@ -195,15 +195,19 @@ rerun_in_sandbox (const char *arg_width,
             "--setenv", "GIO_USE_VFS", "local",
             "--unsetenv", "TMPDIR",
             "--die-with-parent",
-            "--ro-bind", filename, filename,
             NULL);
 
+  for (i = 0; filenames[i] != NULL; i++)
+    add_args (args, "--ro-bind", filenames[i], filenames[i], NULL);
+
   if (g_getenv ("G_MESSAGES_DEBUG"))
     add_args (args, "--setenv", "G_MESSAGES_DEBUG", g_getenv ("G_MESSAGES_DEBUG"), NULL);
   if (g_getenv ("G_MESSAGES_PREFIXED"))
     add_args (args, "--setenv", "G_MESSAGES_PREFIXED", g_getenv ("G_MESSAGES_PREFIXED"), NULL);
 
-  add_args (args, validate_icon, arg_width, arg_height, filename, NULL);
+  add_args (args, validate_icon, arg_width, arg_height, NULL);
+  for (i = 0; filenames[i] != NULL; i++)
+    add_args (args, filenames[i], NULL);
   g_ptr_array_add (args, NULL);
 
   {
@@ -239,7 +243,7 @@ main (int argc, char *argv[])
   GOptionContext *context;
   GError *error = NULL;
 
-  context = g_option_context_new ("WIDTH HEIGHT PATH");
+  context = g_option_context_new ("WIDTH HEIGHT PATH…");
   g_option_context_add_main_entries (context, entries, NULL);
   if (!g_option_context_parse (context, &argc, &argv, &error))
     {
@@ -247,14 +251,24 @@ main (int argc, char *argv[])
       return 1;
     }
 
-  if (argc != 4)
+  if (argc < 4)
     {
-      g_printerr ("Usage: %s [OPTION…] WIDTH HEIGHT PATH\n", argv[0]);
+      g_printerr ("Usage: %s [OPTION…] WIDTH HEIGHT PATH…\n", argv[0]);
       return 1;
     }
 
   if (opt_sandbox)
-    return rerun_in_sandbox (argv[1], argv[2], argv[3]);
+    {
+      return rerun_in_sandbox (argv[1], argv[2], &argv[3]);
+    }
   else
-    return validate_icon (argv[1], argv[2], argv[3]);
+    {
+      int i, res = 0;
+
+      /* Validate the whole batch, reporting every invalid icon */
+      for (i = 3; i < argc; i++)
+        res |= validate_icon (argv[1], argv[2], argv[i]);
+
+      return res;
+    }
 }
@@ -85,7 +85,13 @@ static guint idle_timeout_id = 0;
 static gboolean
 idle_timeout_cb (gpointer user_data)
 {
-  if (name_owner_id && g_hash_table_size (client_pid_data_hash) == 0)
+  guint n_pids;
+
+  G_LOCK (pid_data);
+  n_pids = g_hash_table_size (client_pid_data_hash);
+  G_UNLOCK (pid_data);
+
+  if (name_owner_id && n_pids == 0)
     {
       g_debug ("Idle - unowning name");
       unref_skeleton_in_timeout ();
@@ -120,6 +126,12 @@ typedef struct
   gboolean watch_bus;
 } PidData;
 
+/* Spawn invocations are dispatched to worker threads (we set
+   HANDLE_METHOD_INVOCATIONS_IN_THREAD on the skeleton), while the child
+   watches fire on the main loop, so access to the pid hash needs to be
+   serialized. */
+G_LOCK_DEFINE_STATIC (pid_data);
+
 static void
 pid_data_free (PidData *data)
 {
@@ -147,7 +159,9 @@ child_watch_died (GPid     pid,
                                  NULL);
 
   /* This frees the pid_data, so be careful */
+  G_LOCK (pid_data);
   g_hash_table_remove (client_pid_data_hash, GUINT_TO_POINTER (pid_data->pid));
+  G_UNLOCK (pid_data);
 
   /* This might have caused us to go to idle (zero children) */
   schedule_idle_callback ();
@@ -286,6 +300,180 @@ filesystem_sandbox_arg (const char *path,
   return g_string_free (g_steal_pointer (&s), FALSE);
 }
 
+/* The parts of the "flatpak run" command line that only depend on the
+   calling app, preassembled once and shared between spawns. Templates are
+   immutable after creation, so worker threads can use them without
+   locking once they hold a ref. */
+typedef struct
+{
+  int       refcount;
+  char     *digest; /* checksum of the app-info data this was built from */
+  char     *app_id;
+  char     *instance_path;
+  char    **shares;
+  char    **run_prefix;          /* flatpak run + instance extra args */
+  char    **run_prefix_sandbox;  /* flatpak run --sandbox */
+  char     *app_spec;            /* app-id/arch/branch argument */
+  char     *runtime_arg;         /* --runtime= */
+  char     *runtime_version_arg; /* --runtime-version= */
+  char     *commit_arg;          /* --commit=, or NULL */
+  char     *runtime_commit_arg;  /* --runtime-commit=, or NULL */
+} SpawnTemplate;
+
+static GHashTable *spawn_template_cache = NULL; /* app id => SpawnTemplate */
+G_LOCK_DEFINE_STATIC (spawn_templates);
+
+static SpawnTemplate *
+spawn_template_ref (SpawnTemplate *template)
+{
+  g_atomic_int_inc (&template->refcount);
+  return template;
+}
+
+static void
+spawn_template_unref (SpawnTemplate *template)
+{
+  if (g_atomic_int_dec_and_test (&template->refcount))
+    {
+      g_free (template->digest);
+      g_free (template->app_id);
+      g_free (template->instance_path);
+      g_strfreev (template->shares);
+      g_strfreev (template->run_prefix);
+      g_strfreev (template->run_prefix_sandbox);
+      g_free (template->app_spec);
+      g_free (template->runtime_arg);
+      g_free (template->runtime_version_arg);
+      g_free (template->commit_arg);
+      g_free (template->runtime_commit_arg);
+      g_free (template);
+    }
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (SpawnTemplate, spawn_template_unref)
+
+static SpawnTemplate *
+spawn_template_new (GKeyFile   *app_info,
+                    const char *app_id,
+                    const char *digest)
+{
+  SpawnTemplate *template;
+  g_autofree char *runtime_ref = NULL;
+  g_auto(GStrv) runtime_parts = NULL;
+  g_autofree char *branch = NULL;
+  g_autofree char *arch = NULL;
+  g_autofree char *app_commit = NULL;
+  g_autofree char *runtime_commit = NULL;
+  g_auto(GStrv) extra_args = NULL;
+  gboolean devel;
+  GPtrArray *prefix;
+  gsize i;
+
+  runtime_ref = g_key_file_get_string (app_info,
+                                       FLATPAK_METADATA_GROUP_APPLICATION,
+                                       FLATPAK_METADATA_KEY_RUNTIME, NULL);
+  if (runtime_ref == NULL)
+    return NULL;
+
+  runtime_parts = g_strsplit (runtime_ref, "/", -1);
+
+  branch = g_key_file_get_string (app_info,
+                                  FLATPAK_METADATA_GROUP_INSTANCE,
+                                  FLATPAK_METADATA_KEY_BRANCH, NULL);
+  arch = g_key_file_get_string (app_info,
+                                FLATPAK_METADATA_GROUP_INSTANCE,
+                                FLATPAK_METADATA_KEY_ARCH, NULL);
+  app_commit = g_key_file_get_string (app_info,
+                                      FLATPAK_METADATA_GROUP_INSTANCE,
+                                      FLATPAK_METADATA_KEY_APP_COMMIT, NULL);
+  runtime_commit = g_key_file_get_string (app_info,
+                                          FLATPAK_METADATA_GROUP_INSTANCE,
+                                          FLATPAK_METADATA_KEY_RUNTIME_COMMIT, NULL);
+
+  template = g_new0 (SpawnTemplate, 1);
+  template->refcount = 1;
+  template->digest = g_strdup (digest);
+  template->app_id = g_strdup (app_id);
+  template->instance_path = g_key_file_get_string (app_info,
+                                                   FLATPAK_METADATA_GROUP_INSTANCE,
+                                                   FLATPAK_METADATA_KEY_INSTANCE_PATH, NULL);
+  template->shares = g_key_file_get_string_list (app_info, FLATPAK_METADATA_GROUP_CONTEXT,
+                                                 FLATPAK_METADATA_KEY_SHARED, NULL, NULL);
+
+  extra_args = g_key_file_get_string_list (app_info,
+                                           FLATPAK_METADATA_GROUP_INSTANCE,
+                                           FLATPAK_METADATA_KEY_EXTRA_ARGS, NULL, NULL);
+  devel = g_key_file_get_boolean (app_info, FLATPAK_METADATA_GROUP_INSTANCE,
+                                  FLATPAK_METADATA_KEY_DEVEL, NULL);
+
+  prefix = g_ptr_array_new ();
+  g_ptr_array_add (prefix, g_strdup ("flatpak"));
+  g_ptr_array_add (prefix, g_strdup ("run"));
+  for (i = 0; extra_args != NULL && extra_args[i] != NULL; i++)
+    g_ptr_array_add (prefix, g_strdup (extra_args[i]));
+  if (devel)
+    g_ptr_array_add (prefix, g_strdup ("--devel"));
+  g_ptr_array_add (prefix, NULL);
+  template->run_prefix = (char **) g_ptr_array_free (prefix, FALSE);
+
+  prefix = g_ptr_array_new ();
+  g_ptr_array_add (prefix, g_strdup ("flatpak"));
+  g_ptr_array_add (prefix, g_strdup ("run"));
+  g_ptr_array_add (prefix, g_strdup ("--sandbox"));
+  if (devel)
+    g_ptr_array_add (prefix, g_strdup ("--devel"));
+  g_ptr_array_add (prefix, NULL);
+  template->run_prefix_sandbox = (char **) g_ptr_array_free (prefix, FALSE);
+
+  template->app_spec = g_strdup_printf ("%s/%s/%s", app_id, arch ? arch : "", branch ? branch : "");
+  template->runtime_arg = g_strdup_printf ("--runtime=%s", runtime_parts[1]);
+  template->runtime_version_arg = g_strdup_printf ("--runtime-version=%s", runtime_parts[3]);
+  if (app_commit)
+    template->commit_arg = g_strdup_printf ("--commit=%s", app_commit);
+  if (runtime_commit)
+    template->runtime_commit_arg = g_strdup_printf ("--runtime-commit=%s", runtime_commit);
+
+  return template;
+}
+
+/* Returns a ref to the cached template for @app_id, rebuilding it if the
+   app-info content changed (say, after an app update). Returns NULL if
+   the app info has no runtime. */
+static SpawnTemplate *
+spawn_template_get (GKeyFile   *app_info,
+                    const char *app_id)
+{
+  SpawnTemplate *template;
+  g_autofree char *data = NULL;
+  g_autofree char *digest = NULL;
+
+  data = g_key_file_to_data (app_info, NULL, NULL);
+  digest = g_compute_checksum_for_string (G_CHECKSUM_SHA256, data, -1);
+
+  G_LOCK (spawn_templates);
+
+  template = g_hash_table_lookup (spawn_template_cache, app_id);
+  if (template != NULL && strcmp (template->digest, digest) != 0)
+    {
+      g_hash_table_remove (spawn_template_cache, app_id);
+      template = NULL;
+    }
+
+  if (template == NULL)
+    {
+      template = spawn_template_new (app_info, app_id, digest);
+      if (template != NULL)
+        g_hash_table_replace (spawn_template_cache, template->app_id, template);
+    }
+
+  if (template != NULL)
+    spawn_template_ref (template);
+
+  G_UNLOCK (spawn_templates);
+
+  return template;
+}
+
 static gboolean
 handle_spawn (PortalFlatpak         *object,
               GDBusMethodInvocation *invocation,
@@ -309,19 +497,11 @@ handle_spawn (PortalFlatpak         *object,
   GKeyFile *app_info;
   g_autoptr(GPtrArray) flatpak_argv = g_ptr_array_new_with_free_func (g_free);
   g_autofree char *app_id = NULL;
-  g_autofree char *branch = NULL;
-  g_autofree char *arch = NULL;
-  g_autofree char *app_commit = NULL;
-  g_autofree char *runtime_ref = NULL;
-  g_auto(GStrv) runtime_parts = NULL;
-  g_autofree char *runtime_commit = NULL;
-  g_autofree char *instance_path = NULL;
-  g_auto(GStrv) extra_args = NULL;
-  g_auto(GStrv) shares = NULL;
+  g_autoptr(SpawnTemplate) template = NULL;
+  const char * const *run_prefix;
   g_auto(GStrv) sandbox_expose = NULL;
   g_auto(GStrv) sandbox_expose_ro = NULL;
   gboolean sandboxed;
-  gboolean devel;
 
   app_info = g_object_get_data (G_OBJECT (invocation), "app-info");
   g_assert (app_info != NULL);
@@ -359,46 +539,18 @@ handle_spawn (PortalFlatpak         *object,
       return TRUE;
     }
 
-  runtime_ref = g_key_file_get_string (app_info,
-                                       FLATPAK_METADATA_GROUP_APPLICATION,
-                                       FLATPAK_METADATA_KEY_RUNTIME, NULL);
-  if (runtime_ref == NULL)
+  template = spawn_template_get (app_info, app_id);
+  if (template == NULL)
     {
       g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
                                              "No runtime found");
       return TRUE;
     }
 
-  runtime_parts = g_strsplit (runtime_ref, "/", -1);
-
-  branch = g_key_file_get_string (app_info,
-                                  FLATPAK_METADATA_GROUP_INSTANCE,
-                                  FLATPAK_METADATA_KEY_BRANCH, NULL);
-  instance_path = g_key_file_get_string (app_info,
-                                         FLATPAK_METADATA_GROUP_INSTANCE,
-                                         FLATPAK_METADATA_KEY_INSTANCE_PATH, NULL);
-  arch = g_key_file_get_string (app_info,
-                                FLATPAK_METADATA_GROUP_INSTANCE,
-                                FLATPAK_METADATA_KEY_ARCH, NULL);
-  extra_args = g_key_file_get_string_list (app_info,
-                                           FLATPAK_METADATA_GROUP_INSTANCE,
-                                           FLATPAK_METADATA_KEY_EXTRA_ARGS, NULL, NULL);
-  app_commit = g_key_file_get_string (app_info,
-                                      FLATPAK_METADATA_GROUP_INSTANCE,
-                                      FLATPAK_METADATA_KEY_APP_COMMIT, NULL);
-  runtime_commit = g_key_file_get_string (app_info,
-                                          FLATPAK_METADATA_GROUP_INSTANCE,
-                                          FLATPAK_METADATA_KEY_RUNTIME_COMMIT, NULL);
-  shares = g_key_file_get_string_list (app_info, FLATPAK_METADATA_GROUP_CONTEXT,
-                                       FLATPAK_METADATA_KEY_SHARED, NULL, NULL);
-
-  devel = g_key_file_get_boolean (app_info, FLATPAK_METADATA_GROUP_INSTANCE,
-                                  FLATPAK_METADATA_KEY_DEVEL, NULL);
-
   g_variant_lookup (arg_options, "sandbox-expose", "^as", &sandbox_expose);
   g_variant_lookup (arg_options, "sandbox-expose-ro", "^as", &sandbox_expose_ro);
 
-  if (instance_path == NULL &&
+  if (template->instance_path == NULL &&
       ((sandbox_expose != NULL && sandbox_expose[0] != NULL) ||
        (sandbox_expose_ro != NULL && sandbox_expose_ro[0] != NULL)))
     {
@@ -514,38 +666,28 @@ handle_spawn (PortalFlatpak         *object,
       env = g_environ_setenv (env, var, val, TRUE);
     }
 
-  g_ptr_array_add (flatpak_argv, g_strdup ("flatpak"));
-  g_ptr_array_add (flatpak_argv, g_strdup ("run"));
-
   sandboxed = (arg_flags & FLATPAK_SPAWN_FLAGS_SANDBOX) != 0;
 
-  if (sandboxed)
-    g_ptr_array_add (flatpak_argv, g_strdup ("--sandbox"));
-  else
-    {
-      for (i = 0; extra_args != NULL && extra_args[i] != NULL; i++)
-        g_ptr_array_add (flatpak_argv, g_strdup (extra_args[i]));
-    }
-
-  if (devel)
-    g_ptr_array_add (flatpak_argv, g_strdup ("--devel"));
+  run_prefix = (const char * const *) (sandboxed ? template->run_prefix_sandbox : template->run_prefix);
+  for (i = 0; run_prefix[i] != NULL; i++)
+    g_ptr_array_add (flatpak_argv, g_strdup (run_prefix[i]));
 
   /* Inherit launcher network access from launcher, unless
      NO_NETWORK set. */
-  if (shares != NULL && g_strv_contains ((const char * const *) shares, "network") &&
+  if (template->shares != NULL && g_strv_contains ((const char * const *) template->shares, "network") &&
       !(arg_flags & FLATPAK_SPAWN_FLAGS_NO_NETWORK))
     g_ptr_array_add (flatpak_argv, g_strdup ("--share=network"));
   else
     g_ptr_array_add (flatpak_argv, g_strdup ("--unshare=network"));
 
-  if (instance_path)
+  if (template->instance_path)
     {
       for (i = 0; sandbox_expose != NULL && sandbox_expose[i] != NULL; i++)
         g_ptr_array_add (flatpak_argv,
-                         filesystem_sandbox_arg (instance_path, sandbox_expose[i], FALSE));
+                         filesystem_sandbox_arg (template->instance_path, sandbox_expose[i], FALSE));
       for (i = 0; sandbox_expose_ro != NULL && sandbox_expose_ro[i] != NULL; i++)
         g_ptr_array_add (flatpak_argv,
-                         filesystem_sandbox_arg (instance_path, sandbox_expose_ro[i], TRUE));
+                         filesystem_sandbox_arg (template->instance_path, sandbox_expose_ro[i], TRUE));
     }
 
   for (i = 0; sandbox_expose_ro != NULL && sandbox_expose_ro[i] != NULL; i++)
@@ -554,15 +696,15 @@ handle_spawn (PortalFlatpak         *object,
       g_debug ("exposing %s", expose);
     }
 
-  g_ptr_array_add (flatpak_argv, g_strdup_printf ("--runtime=%s", runtime_parts[1]));
-  g_ptr_array_add (flatpak_argv, g_strdup_printf ("--runtime-version=%s", runtime_parts[3]));
+  g_ptr_array_add (flatpak_argv, g_strdup (template->runtime_arg));
+  g_ptr_array_add (flatpak_argv, g_strdup (template->runtime_version_arg));
 
   if ((arg_flags & FLATPAK_SPAWN_FLAGS_LATEST_VERSION) == 0)
     {
-      if (app_commit)
-        g_ptr_array_add (flatpak_argv, g_strdup_printf ("--commit=%s", app_commit));
-      if (runtime_commit)
-        g_ptr_array_add (flatpak_argv, g_strdup_printf ("--runtime-commit=%s", runtime_commit));
+      if (template->commit_arg)
+        g_ptr_array_add (flatpak_argv, g_strdup (template->commit_arg));
+      if (template->runtime_commit_arg)
+        g_ptr_array_add (flatpak_argv, g_strdup (template->runtime_commit_arg));
     }
 
   if (arg_cwd_path != NULL)
@@ -571,7 +713,7 @@ handle_spawn (PortalFlatpak         *object,
   if (arg_argv[0][0] != 0)
     g_ptr_array_add (flatpak_argv, g_strdup_printf ("--command=%s", arg_argv[0]));
 
-  g_ptr_array_add (flatpak_argv, g_strdup_printf ("%s/%s/%s", app_id, arch ? arch : "", branch ? branch : ""));
+  g_ptr_array_add (flatpak_argv, g_strdup (template->app_spec));
   for (i = 1; arg_argv[i] != NULL; i++)
     g_ptr_array_add (flatpak_argv, g_strdup (arg_argv[i]));
   g_ptr_array_add (flatpak_argv, NULL);
@@ -625,8 +767,10 @@ handle_spawn (PortalFlatpak         *object,
 
   g_debug ("Client Pid is %d", pid_data->pid);
 
+  G_LOCK (pid_data);
   g_hash_table_replace (client_pid_data_hash, GUINT_TO_POINTER (pid_data->pid),
                         pid_data);
+  G_UNLOCK (pid_data);
 
   portal_flatpak_complete_spawn (object, invocation, NULL, pid);
   return TRUE;
@@ -643,10 +787,12 @@ handle_spawn_signal (PortalFlatpak         *object,
 
   g_debug ("spawn_signal(%d %d)", arg_pid, arg_signal);
 
+  G_LOCK (pid_data);
   pid_data = g_hash_table_lookup (client_pid_data_hash, GUINT_TO_POINTER (arg_pid));
   if (pid_data == NULL ||
       strcmp (pid_data->client, g_dbus_method_invocation_get_sender (invocation)) != 0)
     {
+      G_UNLOCK (pid_data);
       g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
                                              G_DBUS_ERROR_UNIX_PROCESS_ID_UNKNOWN,
                                              "No such pid");
@@ -659,6 +805,7 @@ handle_spawn_signal (PortalFlatpak         *object,
     killpg (pid_data->pid, arg_signal);
   else
     kill (pid_data->pid, arg_signal);
+  G_UNLOCK (pid_data);
 
   portal_flatpak_complete_spawn_signal (portal, invocation);
 
@@ -722,6 +869,7 @@ name_owner_changed (GDBusConnection *connection,
       gpointer value = NULL;
       GList *list = NULL, *l;
 
+      G_LOCK (pid_data);
       g_hash_table_iter_init (&iter, client_pid_data_hash);
       while (g_hash_table_iter_next (&iter, NULL, &value))
         {
@@ -737,6 +885,7 @@ name_owner_changed (GDBusConnection *connection,
           g_debug ("%s dropped off the bus, killing %d", pid_data->client, pid_data->pid);
           killpg (pid_data->pid, SIGINT);
         }
+      G_UNLOCK (pid_data);
 
       g_list_free (list);
     }
@@ -819,6 +968,15 @@ binary_file_changed_cb (GFileMonitor     *file_monitor,
   if (!got_it)
     {
       g_debug ("binary file changed");
+
+      /* The deploy we run from changed, so cached spawn templates may
+         describe stale commits; requests served while we drain rebuild
+         them from the caller's app info. */
+      G_LOCK (spawn_templates);
+      if (spawn_template_cache != NULL)
+        g_hash_table_remove_all (spawn_template_cache);
+      G_UNLOCK (spawn_templates);
+
       unref_skeleton_in_timeout ();
     }
 
@@ -896,6 +1054,8 @@ main (int    argc,
     g_log_set_handler (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, message_handler, NULL);
 
   client_pid_data_hash = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify) pid_data_free);
+  spawn_template_cache = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                                (GDestroyNotify) spawn_template_unref);
 
   session_bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
   if (session_bus == NULL)
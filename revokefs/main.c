@@ -50,6 +50,136 @@ static char *base_path = NULL;
 static int basefd = -1;
 static int writer_socket = -1;
 
+/* The fuse loop is multi-threaded, so to let writes to different files
+ * proceed in parallel we keep a pool of request channels to the writer.
+ * Operations on a remote fd are spread over the pool keyed on the fd,
+ * which keeps the request/reply ordering POSIX requires for one open
+ * file, but lets separate files use separate channels. Path-based
+ * operations all use the primary channel so they stay ordered with
+ * respect to each other. */
+typedef struct {
+  int socket;
+  GMutex lock;
+} WriterChannel;
+
+static WriterChannel writer_channels[MAX_WRITER_CHANNELS];
+static int n_writer_channels = 0;
+
+static WriterChannel *
+writer_channel_lock (guint64 key)
+{
+  WriterChannel *channel = &writer_channels[key % n_writer_channels];
+
+  g_mutex_lock (&channel->lock);
+  return channel;
+}
+
+static void
+writer_channel_unlock (WriterChannel *channel)
+{
+  g_mutex_unlock (&channel->lock);
+}
+
+static void
+setup_writer_channels (void)
+{
+  int n_channels, i;
+
+  writer_channels[0].socket = writer_socket;
+  g_mutex_init (&writer_channels[0].lock);
+  n_writer_channels = 1;
+
+  /* The writer caps how many channels it accepts; if it refuses one we
+   * just share the ones we got so far. */
+  n_channels = MIN (g_get_num_processors (), MAX_WRITER_CHANNELS);
+  for (i = 1; i < n_channels; i++)
+    {
+      int sockets[2];
+
+      if (socketpair (AF_UNIX, SOCK_SEQPACKET, 0, sockets) != 0)
+        break;
+
+      if (request_add_channel (writer_socket, sockets[1]) != 0)
+        {
+          close (sockets[0]);
+          close (sockets[1]);
+          break;
+        }
+
+      close (sockets[1]);
+      writer_channels[n_writer_channels].socket = sockets[0];
+      g_mutex_init (&writer_channels[n_writer_channels].lock);
+      n_writer_channels++;
+    }
+}
+
+/* Writes to a remote fd are coalesced into a per-file buffer and sent
+ * in batches, fused with the following fsync or close when possible.
+ * This gives write-back semantics: an error from a deferred write is
+ * reported by the next operation on the file (the kernel calls flush
+ * on close, so it is not lost), and a path-based stat can lag behind
+ * the buffered data until it is flushed. The buffer leaves room for
+ * the segment header so a flush always fits in one request. */
+#define WRITE_BUFFER_SIZE (MAX_DATA_SIZE - 2 * sizeof (RevokefsWriteSegment))
+
+typedef struct {
+  guint64 buf_offset;
+  size_t buf_size;
+  int error;
+  guchar buffer[WRITE_BUFFER_SIZE];
+} RemoteFile;
+
+/* Maps remote fd => RemoteFile. The table itself is protected by
+ * remote_files_lock, the entries by the channel lock for their fd. */
+static GHashTable *remote_files;
+static GMutex remote_files_lock;
+
+static RemoteFile *
+remote_file_lookup (guint64 fd)
+{
+  RemoteFile *file;
+
+  g_mutex_lock (&remote_files_lock);
+  file = g_hash_table_lookup (remote_files, GUINT_TO_POINTER ((guint) fd));
+  g_mutex_unlock (&remote_files_lock);
+
+  return file;
+}
+
+/* Sends the pending data (if any) fused with @flags. Called with the
+ * channel lock for @fd held. */
+static int
+remote_file_flush (WriterChannel *channel, guint64 fd, RemoteFile *file, guint32 flags)
+{
+  RevokefsWriteSegment segment;
+  const guchar *segment_data = file->buffer;
+  int res;
+
+  if (file->buf_size == 0 && flags == 0)
+    return 0;
+
+  segment.offset = file->buf_offset;
+  segment.size = file->buf_size;
+
+  res = request_writev (channel->socket, fd, flags,
+                        &segment, &segment_data,
+                        file->buf_size > 0 ? 1 : 0);
+  if (res < 0)
+    {
+      file->error = res;
+      return res;
+    }
+
+  if (res != file->buf_size)
+    {
+      file->error = -EIO;
+      return -EIO;
+    }
+
+  file->buf_size = 0;
+  return 0;
+}
+
 static inline const char *
 ENSURE_RELPATH (const char *path)
 {
@@ -145,33 +275,57 @@ callback_mknod (const char *path, mode_t mode, dev_t rdev)
 static int
 callback_mkdir (const char *path, mode_t mode)
 {
+  WriterChannel *channel;
+  int res;
+
   path = ENSURE_RELPATH (path);
-  return request_mkdir (writer_socket, path, mode);
+
+  channel = writer_channel_lock (0);
+  res = request_mkdir (channel->socket, path, mode);
+  writer_channel_unlock (channel);
+  return res;
 }
 
 static int
 callback_unlink (const char *path)
 {
+  WriterChannel *channel;
+  int res;
+
   path = ENSURE_RELPATH (path);
-  return request_unlink (writer_socket, path);
+
+  channel = writer_channel_lock (0);
+  res = request_unlink (channel->socket, path);
+  writer_channel_unlock (channel);
+  return res;
 }
 
 static int
 callback_rmdir (const char *path)
 {
+  WriterChannel *channel;
+  int res;
+
   path = ENSURE_RELPATH (path);
-  return request_rmdir (writer_socket, path);
+
+  channel = writer_channel_lock (0);
+  res = request_rmdir (channel->socket, path);
+  writer_channel_unlock (channel);
+  return res;
 }
 
 static int
 callback_symlink (const char *from, const char *to)
 {
   struct stat stbuf;
+  WriterChannel *channel;
   int res;
 
   to = ENSURE_RELPATH (to);
 
-  res = request_symlink (writer_socket, from, to);
+  channel = writer_channel_lock (0);
+  res = request_symlink (channel->socket, from, to);
+  writer_channel_unlock (channel);
   if (res < 0)
     return res;
 
@@ -187,48 +341,87 @@ callback_symlink (const char *from, const char *to)
 static int
 callback_rename (const char *from, const char *to)
 {
+  WriterChannel *channel;
+  int res;
+
   from = ENSURE_RELPATH (from);
   to = ENSURE_RELPATH (to);
 
-  return request_rename (writer_socket, from, to);
+  channel = writer_channel_lock (0);
+  res = request_rename (channel->socket, from, to);
+  writer_channel_unlock (channel);
+  return res;
 }
 
 static int
 callback_link (const char *from, const char *to)
 {
+  WriterChannel *channel;
+  int res;
+
   from = ENSURE_RELPATH (from);
   to = ENSURE_RELPATH (to);
 
-  return request_link (writer_socket, from, to);
+  channel = writer_channel_lock (0);
+  res = request_link (channel->socket, from, to);
+  writer_channel_unlock (channel);
+  return res;
 }
 
 static int
 callback_chmod (const char *path, mode_t mode)
 {
+  WriterChannel *channel;
+  int res;
+
   path = ENSURE_RELPATH (path);
-  return request_chmod (writer_socket, path, mode);
+
+  channel = writer_channel_lock (0);
+  res = request_chmod (channel->socket, path, mode);
+  writer_channel_unlock (channel);
+  return res;
 }
 
 static int
 callback_chown (const char *path, uid_t uid, gid_t gid)
 {
+  WriterChannel *channel;
+  int res;
+
   path = ENSURE_RELPATH (path);
-  return request_chown (writer_socket, path, uid, gid);
+
+  channel = writer_channel_lock (0);
+  res = request_chown (channel->socket, path, uid, gid);
+  writer_channel_unlock (channel);
+  return res;
 }
 
 static int
 callback_truncate (const char *path, off_t size)
 {
+  WriterChannel *channel;
+  int res;
+
   path = ENSURE_RELPATH (path);
-  return request_truncate (writer_socket, path, size);
+
+  channel = writer_channel_lock (0);
+  res = request_truncate (channel->socket, path, size);
+  writer_channel_unlock (channel);
+  return res;
 }
 
 static int
 callback_utimens (const char *path, const struct timespec tv[2])
 {
+  WriterChannel *channel;
+  int res;
+
   path = ENSURE_RELPATH (path);
 
-  return request_utimens (writer_socket, path, tv);
+  channel = writer_channel_lock (0);
+  res = request_utimens (channel->socket, path, tv);
+  writer_channel_unlock (channel);
+  return res;
 }
 
 static int
@@ -250,11 +443,18 @@ do_open (const char *path, mode_t mode, struct fuse_file_info *finfo)
   else
     {
       /* Write */
+      WriterChannel *channel = writer_channel_lock (0);
 
-      fd = request_open (writer_socket, path, mode, finfo->flags);
+      fd = request_open (channel->socket, path, mode, finfo->flags);
+      writer_channel_unlock (channel);
       if (fd < 0)
         return fd;
 
+      g_mutex_lock (&remote_files_lock);
+      g_hash_table_insert (remote_files, GUINT_TO_POINTER (fd),
+                           g_new0 (RemoteFile, 1));
+      g_mutex_unlock (&remote_files_lock);
+
       finfo->fh = fd + REMOTE_FD_OFFSET;
     }
 
@@ -274,21 +474,64 @@ callback_create(const char *path, mode_t mode, struct fuse_file_info *finfo)
 }
 
 static int
-callback_read (const char *path, char *buf, size_t size, off_t offset,
-               struct fuse_file_info *finfo)
+callback_read_buf (const char *path, struct fuse_bufvec **bufp,
+                   size_t size, off_t offset, struct fuse_file_info *finfo)
 {
-  int r;
+  /* Freed by libfuse with free(), so don't use g_malloc here */
+  struct fuse_bufvec *src = malloc (sizeof (struct fuse_bufvec));
+
+  if (src == NULL)
+    return -ENOMEM;
+
   if (finfo->fh >= REMOTE_FD_OFFSET)
     {
-      return request_read (writer_socket, finfo->fh - REMOTE_FD_OFFSET, buf, size, offset);
+      guint64 fd = finfo->fh - REMOTE_FD_OFFSET;
+      WriterChannel *channel;
+      RemoteFile *file;
+      char *mem;
+      int r;
+
+      mem = malloc (size);
+      if (mem == NULL)
+        {
+          free (src);
+          return -ENOMEM;
+        }
+
+      channel = writer_channel_lock (fd);
+      file = remote_file_lookup (fd);
+
+      /* Make sure the read sees any buffered writes */
+      if (file != NULL && file->buf_size > 0)
+        r = remote_file_flush (channel, fd, file, 0);
+      else
+        r = 0;
+      if (r == 0)
+        r = request_read (channel->socket, fd, mem, size, offset);
+      writer_channel_unlock (channel);
+
+      if (r < 0)
+        {
+          free (mem);
+          free (src);
+          return r;
+        }
+
+      *src = FUSE_BUFVEC_INIT (r);
+      src->buf[0].mem = mem;
     }
   else
     {
-      r = pread (finfo->fh, buf, size, offset);
-      if (r == -1)
-        return -errno;
-      return r;
+      /* Hand the backing fd to libfuse, which splices the data to the
+       * kernel instead of copying it through userspace */
+      *src = FUSE_BUFVEC_INIT (size);
+      src->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+      src->buf[0].fd = finfo->fh;
+      src->buf[0].pos = offset;
     }
+
+  *bufp = src;
+  return 0;
 }
 
 static int
@@ -299,7 +542,67 @@ callback_write (const char *path, const char *buf, size_t size, off_t offset,
 
   if (finfo->fh >= REMOTE_FD_OFFSET)
     {
-      return request_write (writer_socket, finfo->fh - REMOTE_FD_OFFSET, buf, size, offset);
+      guint64 fd = finfo->fh - REMOTE_FD_OFFSET;
+      WriterChannel *channel = writer_channel_lock (fd);
+      RemoteFile *file = remote_file_lookup (fd);
+
+      if (file == NULL)
+        {
+          r = -EBADFD;
+        }
+      else if (file->error != 0)
+        {
+          r = file->error;
+        }
+      else if (file->buf_size > 0 &&
+               offset == file->buf_offset + file->buf_size &&
+               file->buf_size + size <= sizeof (file->buffer))
+        {
+          /* Contiguous with the pending data, just append */
+          memcpy (file->buffer + file->buf_size, buf, size);
+          file->buf_size += size;
+          r = size;
+        }
+      else if (file->buf_size == 0 && size <= sizeof (file->buffer))
+        {
+          file->buf_offset = offset;
+          memcpy (file->buffer, buf, size);
+          file->buf_size = size;
+          r = size;
+        }
+      else if (file->buf_size > 0 &&
+               2 * sizeof (RevokefsWriteSegment) + file->buf_size + size <= MAX_DATA_SIZE)
+        {
+          /* Send the pending data and the new write as one batch */
+          RevokefsWriteSegment segments[2] = {
+            { file->buf_offset, file->buf_size },
+            { offset, size },
+          };
+          const guchar *segment_data[2] = { file->buffer, (const guchar *) buf };
+
+          r = request_writev (channel->socket, fd, 0, segments, segment_data, 2);
+          if (r == file->buf_size + size)
+            {
+              file->buf_size = 0;
+              r = size;
+            }
+          else
+            {
+              if (r >= 0)
+                r = -EIO;
+              file->error = r;
+            }
+        }
+      else
+        {
+          /* Too big to batch: flush, then send the write on its own */
+          r = remote_file_flush (channel, fd, file, 0);
+          if (r == 0)
+            r = request_write (channel->socket, fd, buf, size, offset);
+        }
+
+      writer_channel_unlock (channel);
+      return r;
     }
   else
     {
@@ -323,7 +626,29 @@ callback_release (const char *path, struct fuse_file_info *finfo)
 {
   if (finfo->fh >= REMOTE_FD_OFFSET)
     {
-      return request_close (writer_socket, finfo->fh - REMOTE_FD_OFFSET);
+      guint64 fd = finfo->fh - REMOTE_FD_OFFSET;
+      WriterChannel *channel = writer_channel_lock (fd);
+      RemoteFile *file = remote_file_lookup (fd);
+      int res;
+
+      if (file != NULL && file->error == 0)
+        {
+          /* Fuses the final write with the close */
+          res = remote_file_flush (channel, fd, file, REVOKE_FS_WRITEV_CLOSE);
+        }
+      else
+        {
+          res = request_close (channel->socket, fd);
+        }
+
+      if (file != NULL)
+        {
+          g_mutex_lock (&remote_files_lock);
+          g_hash_table_remove (remote_files, GUINT_TO_POINTER ((guint) fd));
+          g_mutex_unlock (&remote_files_lock);
+        }
+      writer_channel_unlock (channel);
+      return res;
     }
   else
     {
@@ -337,7 +662,19 @@ callback_fsync (const char *path, int crap, struct fuse_file_info *finfo)
 {
   if (finfo->fh >= REMOTE_FD_OFFSET)
     {
-      return request_fsync (writer_socket, finfo->fh - REMOTE_FD_OFFSET);
+      guint64 fd = finfo->fh - REMOTE_FD_OFFSET;
+      WriterChannel *channel = writer_channel_lock (fd);
+      RemoteFile *file = remote_file_lookup (fd);
+      int res;
+
+      if (file == NULL)
+        res = request_fsync (channel->socket, fd);
+      else if (file->error != 0)
+        res = file->error;
+      else
+        res = remote_file_flush (channel, fd, file, REVOKE_FS_WRITEV_FSYNC);
+      writer_channel_unlock (channel);
+      return res;
     }
   else
     {
@@ -347,6 +684,51 @@ callback_fsync (const char *path, int crap, struct fuse_file_info *finfo)
     }
 }
 
+static int
+callback_flush (const char *path, struct fuse_file_info *finfo)
+{
+  if (finfo->fh >= REMOTE_FD_OFFSET)
+    {
+      guint64 fd = finfo->fh - REMOTE_FD_OFFSET;
+      WriterChannel *channel = writer_channel_lock (fd);
+      RemoteFile *file = remote_file_lookup (fd);
+      int res = 0;
+
+      if (file != NULL)
+        {
+          if (file->error != 0)
+            res = file->error;
+          else
+            res = remote_file_flush (channel, fd, file, 0);
+        }
+      writer_channel_unlock (channel);
+      return res;
+    }
+
+  return 0;
+}
+
+static int
+callback_fgetattr (const char *path, struct stat *st_data, struct fuse_file_info *finfo)
+{
+  /* Flush any buffered writes so the stat sees them */
+  if (finfo->fh >= REMOTE_FD_OFFSET)
+    {
+      guint64 fd = finfo->fh - REMOTE_FD_OFFSET;
+      WriterChannel *channel = writer_channel_lock (fd);
+      RemoteFile *file = remote_file_lookup (fd);
+      int res = 0;
+
+      if (file != NULL && file->error == 0)
+        res = remote_file_flush (channel, fd, file, 0);
+      writer_channel_unlock (channel);
+      if (res < 0)
+        return res;
+    }
+
+  return callback_getattr (path, st_data);
+}
+
 static int
 callback_access (const char *path, int mode)
 {
@@ -412,11 +794,13 @@ struct fuse_operations callback_oper = {
   .utimens = callback_utimens,
   .create = callback_create,
   .open = callback_open,
-  .read = callback_read,
+  .read_buf = callback_read_buf,
   .write = callback_write,
   .statfs = callback_statfs,
+  .flush = callback_flush,
   .release = callback_release,
   .fsync = callback_fsync,
+  .fgetattr = callback_fgetattr,
   .access = callback_access,
 
   /* Extended attributes support for userland interaction */
@@ -571,6 +955,9 @@ main (int argc, char *argv[])
       writer_socket = sockets[0];
     }
 
+  setup_writer_channels ();
+  remote_files = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
+
   fuse_main (args.argc, args.argv, &callback_oper, NULL);
 
   return 0;
@@ -44,47 +44,44 @@ static int basefd = -1;
 
 static GHashTable *outstanding_fds;
 
-static GMutex mutex;
+/* Protects outstanding_fds and n_channels, which are shared between the
+ * per-channel serving threads. */
+static GMutex writer_mutex;
+static int n_channels = 1;
 
+static void writer_serve (int fuse_socket, int exit_with_fd);
+
+/* Sends a request and waits for the reply. The caller must have exclusive
+ * access to writer_socket for the whole exchange; the fuse side guarantees
+ * this by holding the channel lock. */
 static ssize_t
-do_request (int writer_socket,
-            RevokefsRequest *request,
-            const guchar *data,
-            size_t data_size,
-            const guchar *data2,
-            size_t data2_size,
-            RevokefsResponse *response,
-            guchar *response_data,
-            size_t response_data_size)
+do_request_vecs (int writer_socket,
+                 RevokefsRequest *request,
+                 const struct iovec *data_vecs,
+                 int n_data_vecs,
+                 RevokefsResponse *response,
+                 guchar *response_data,
+                 size_t response_data_size)
 {
   size_t request_size;
   size_t response_max_size;
   ssize_t written_size, read_size;
-  struct iovec write_vecs[2] = {};
+  struct iovec *write_vecs = g_newa (struct iovec, n_data_vecs + 1);
   int n_write_vecs = 0;
   struct iovec read_vecs[2] = {};
   int n_read_vecs = 0;
-  g_autoptr(GMutexLocker) locker = NULL;
+  int i;
 
   request_size = sizeof (RevokefsRequest);
   write_vecs[n_write_vecs].iov_base = (char *)request;
   write_vecs[n_write_vecs++].iov_len = request_size;
 
-  if (data)
+  for (i = 0; i < n_data_vecs; i++)
     {
-      write_vecs[n_write_vecs].iov_base = (char *)data;
-      write_vecs[n_write_vecs++].iov_len = data_size;
-      request_size += data_size;
+      write_vecs[n_write_vecs++] = data_vecs[i];
+      request_size += data_vecs[i].iov_len;
     }
 
-  if (data2)
-    {
-      write_vecs[n_write_vecs].iov_base = (char *)data2;
-      write_vecs[n_write_vecs++].iov_len = data2_size;
-      request_size += data2_size;
-    }
-
-  locker = g_mutex_locker_new (&mutex);
   written_size = TEMP_FAILURE_RETRY (writev (writer_socket, write_vecs, n_write_vecs));
   if (written_size == -1)
     {
@@ -124,6 +121,36 @@ do_request (int writer_socket,
   return read_size - sizeof (RevokefsResponse);
 }
 
+static ssize_t
+do_request (int writer_socket,
+            RevokefsRequest *request,
+            const guchar *data,
+            size_t data_size,
+            const guchar *data2,
+            size_t data2_size,
+            RevokefsResponse *response,
+            guchar *response_data,
+            size_t response_data_size)
+{
+  struct iovec data_vecs[2] = {};
+  int n_data_vecs = 0;
+
+  if (data)
+    {
+      data_vecs[n_data_vecs].iov_base = (char *)data;
+      data_vecs[n_data_vecs++].iov_len = data_size;
+    }
+
+  if (data2)
+    {
+      data_vecs[n_data_vecs].iov_base = (char *)data2;
+      data_vecs[n_data_vecs++].iov_len = data2_size;
+    }
+
+  return do_request_vecs (writer_socket, request, data_vecs, n_data_vecs,
+                          response, response_data, response_data_size);
+}
+
 static int
 request_path_i64_i64 (int writer_socket, RevokefsOps op, const char *path, guint64 arg1, guint64 arg2)
 {
@@ -518,6 +545,18 @@ request_utimens (int writer_socket, const char *path, const struct timespec tv[2
                             (guchar *)tv, sizeof (struct timespec) * 2);
 }
 
+static gboolean
+fd_is_outstanding (int fd)
+{
+  gboolean res;
+
+  g_mutex_lock (&writer_mutex);
+  res = g_hash_table_lookup (outstanding_fds, GUINT_TO_POINTER(fd)) != NULL;
+  g_mutex_unlock (&writer_mutex);
+
+  return res;
+}
+
 static ssize_t
 handle_open (RevokefsRequest *request,
              gsize data_size,
@@ -546,7 +585,9 @@ handle_open (RevokefsRequest *request,
 
       if (response->result == 0)
         {
+          g_mutex_lock (&writer_mutex);
           g_hash_table_insert (outstanding_fds, GUINT_TO_POINTER(fd), GUINT_TO_POINTER(1));
+          g_mutex_unlock (&writer_mutex);
           response->result = fd;
         }
       else
@@ -575,7 +616,7 @@ handle_read (RevokefsRequest *request,
   if (size > MAX_DATA_SIZE)
     size = MAX_DATA_SIZE;
 
-  if (g_hash_table_lookup (outstanding_fds, GUINT_TO_POINTER(fd)) == NULL)
+  if (!fd_is_outstanding (fd))
     {
       response->result = -EBADFD;
       return 0;
@@ -622,7 +663,7 @@ handle_write (RevokefsRequest *request,
   int fd = request->arg1;
   off_t offset = request->arg2;
 
-  if (g_hash_table_lookup (outstanding_fds, GUINT_TO_POINTER(fd)) == NULL)
+  if (!fd_is_outstanding (fd))
     {
       response->result = -EBADFD;
       return 0;
@@ -658,6 +699,140 @@ request_write (int writer_socket, int fd, const char *buf, size_t size, off_t of
   return response.result;
 }
 
+static int
+write_all (int fd, const guchar *data, size_t size, off_t offset)
+{
+  while (size > 0)
+    {
+      ssize_t r = pwrite (fd, data, size, offset);
+      if (r == -1)
+        {
+          if (errno == EINTR)
+            continue;
+          return -errno;
+        }
+
+      data += r;
+      size -= r;
+      offset += r;
+    }
+
+  return 0;
+}
+
+static ssize_t
+handle_writev (RevokefsRequest *request,
+               gsize data_size,
+               RevokefsResponse *response)
+{
+  int fd = request->arg1;
+  guint64 n_segments = request->arg2;
+  guint32 flags = request->arg3;
+  RevokefsWriteSegment *segments;
+  guchar *segment_data;
+  gsize header_size;
+  gssize total = 0;
+  int res = 0;
+  guint64 i;
+
+  if (n_segments > MAX_DATA_SIZE / sizeof (RevokefsWriteSegment))
+    {
+      g_printerr ("Invalid writev segment count\n");
+      exit (1);
+    }
+
+  header_size = n_segments * sizeof (RevokefsWriteSegment);
+  if (header_size > data_size)
+    {
+      g_printerr ("Invalid writev data size\n");
+      exit (1);
+    }
+
+  segments = (RevokefsWriteSegment *) request->data;
+  segment_data = request->data + header_size;
+  data_size -= header_size;
+
+  if (!fd_is_outstanding (fd))
+    {
+      response->result = -EBADFD;
+      return 0;
+    }
+
+  for (i = 0; i < n_segments; i++)
+    {
+      if (segments[i].size > data_size)
+        {
+          g_printerr ("Invalid writev segment size\n");
+          exit (1);
+        }
+
+      res = write_all (fd, segment_data, segments[i].size, segments[i].offset);
+      if (res < 0)
+        break;
+
+      segment_data += segments[i].size;
+      data_size -= segments[i].size;
+      total += segments[i].size;
+    }
+
+  if (res == 0 &&
+      (flags & REVOKE_FS_WRITEV_FSYNC) != 0 &&
+      fsync (fd) == -1)
+    res = -errno;
+
+  if ((flags & REVOKE_FS_WRITEV_CLOSE) != 0)
+    {
+      g_mutex_lock (&writer_mutex);
+      g_hash_table_remove (outstanding_fds, GUINT_TO_POINTER(fd));
+      g_mutex_unlock (&writer_mutex);
+      close (fd);
+    }
+
+  if (res < 0)
+    response->result = res;
+  else
+    response->result = total;
+
+  return 0;
+}
+
+int
+request_writev (int writer_socket, int fd, guint32 flags,
+                const RevokefsWriteSegment *segments,
+                const guchar * const *segment_data,
+                int n_segments)
+{
+  RevokefsRequest request = { REVOKE_FS_WRITEV };
+  RevokefsResponse response;
+  struct iovec *data_vecs = g_newa (struct iovec, n_segments + 1);
+  size_t total_len = n_segments * sizeof (RevokefsWriteSegment);
+  ssize_t response_data_len;
+  int i;
+
+  data_vecs[0].iov_base = (char *) segments;
+  data_vecs[0].iov_len = n_segments * sizeof (RevokefsWriteSegment);
+  for (i = 0; i < n_segments; i++)
+    {
+      data_vecs[i + 1].iov_base = (char *) segment_data[i];
+      data_vecs[i + 1].iov_len = segments[i].size;
+      total_len += segments[i].size;
+    }
+
+  if (total_len > MAX_DATA_SIZE)
+    return -EINVAL;
+
+  request.arg1 = fd;
+  request.arg2 = n_segments;
+  request.arg3 = flags;
+
+  response_data_len = do_request_vecs (writer_socket, &request, data_vecs, n_segments + 1,
+                                       &response, NULL, 0);
+  if (response_data_len != 0)
+    return -EIO;
+
+  return response.result;
+}
+
 static ssize_t
 handle_fsync (RevokefsRequest *request,
               gsize data_size,
@@ -666,7 +841,7 @@ handle_fsync (RevokefsRequest *request,
   int r;
   int fd = request->arg1;
 
-  if (g_hash_table_lookup (outstanding_fds, GUINT_TO_POINTER(fd)) == NULL)
+  if (!fd_is_outstanding (fd))
     {
       response->result = -EBADFD;
       return 0;
@@ -704,8 +879,13 @@ handle_close (RevokefsRequest *request,
               RevokefsResponse *response)
 {
   int fd = request->arg1;
+  gboolean was_outstanding;
 
-  if (!g_hash_table_remove (outstanding_fds, GUINT_TO_POINTER(fd)))
+  g_mutex_lock (&writer_mutex);
+  was_outstanding = g_hash_table_remove (outstanding_fds, GUINT_TO_POINTER(fd));
+  g_mutex_unlock (&writer_mutex);
+
+  if (!was_outstanding)
     {
       response->result = -EBADFD;
       return 0;
@@ -758,24 +938,138 @@ request_access (int writer_socket, const char *path, int mode)
   return request_path_int (writer_socket, REVOKE_FS_ACCESS, path, mode);
 }
 
-void
-do_writer (int basefd_arg,
-           int fuse_socket,
-           int exit_with_fd)
+static gpointer
+channel_thread (gpointer data)
+{
+  writer_serve (GPOINTER_TO_INT (data), -1);
+  return NULL;
+}
+
+static ssize_t
+handle_add_channel (RevokefsRequest *request,
+                    gsize data_size,
+                    RevokefsResponse *response,
+                    int channel_fd)
+{
+  GThread *thread;
+  gboolean too_many;
+
+  if (channel_fd == -1)
+    {
+      response->result = -EINVAL;
+      return 0;
+    }
+
+  g_mutex_lock (&writer_mutex);
+  too_many = n_channels >= MAX_WRITER_CHANNELS;
+  if (!too_many)
+    n_channels++;
+  g_mutex_unlock (&writer_mutex);
+
+  if (too_many)
+    {
+      close (channel_fd);
+      response->result = -EMFILE;
+      return 0;
+    }
+
+  thread = g_thread_try_new ("revokefs-writer", channel_thread,
+                             GINT_TO_POINTER (channel_fd), NULL);
+  if (thread == NULL)
+    {
+      close (channel_fd);
+      g_mutex_lock (&writer_mutex);
+      n_channels--;
+      g_mutex_unlock (&writer_mutex);
+      response->result = -ENOMEM;
+      return 0;
+    }
+
+  g_thread_unref (thread);
+  response->result = 0;
+  return 0;
+}
+
+int
+request_add_channel (int writer_socket, int channel_fd)
+{
+  RevokefsRequest request = { REVOKE_FS_ADD_CHANNEL };
+  RevokefsResponse response;
+  struct msghdr msg = { 0 };
+  struct iovec iov = { &request, sizeof (request) };
+  char cmsg_buffer[CMSG_SPACE (sizeof (int))] = { 0 };
+  struct cmsghdr *cmsg;
+  ssize_t written_size, read_size;
+
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsg_buffer;
+  msg.msg_controllen = sizeof (cmsg_buffer);
+
+  cmsg = CMSG_FIRSTHDR (&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+  memcpy (CMSG_DATA (cmsg), &channel_fd, sizeof (int));
+
+  written_size = TEMP_FAILURE_RETRY (sendmsg (writer_socket, &msg, 0));
+  if (written_size != sizeof (request))
+    return -EIO;
+
+  read_size = TEMP_FAILURE_RETRY (read (writer_socket, &response, sizeof (response)));
+  if (read_size < sizeof (RevokefsResponse))
+    return -EIO;
+
+  return response.result;
+}
+
+/* Receives one request, possibly with an attached fd (SCM_RIGHTS). */
+static ssize_t
+read_request (int fuse_socket, guchar *buffer, size_t buffer_size, int *passed_fd)
+{
+  struct msghdr msg = { 0 };
+  struct iovec iov = { buffer, buffer_size };
+  char cmsg_buffer[CMSG_SPACE (sizeof (int))];
+  struct cmsghdr *cmsg;
+  ssize_t size;
+
+  *passed_fd = -1;
+
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsg_buffer;
+  msg.msg_controllen = sizeof (cmsg_buffer);
+
+  size = TEMP_FAILURE_RETRY (recvmsg (fuse_socket, &msg, MSG_CMSG_CLOEXEC));
+  if (size <= 0)
+    return size;
+
+  for (cmsg = CMSG_FIRSTHDR (&msg); cmsg != NULL; cmsg = CMSG_NXTHDR (&msg, cmsg))
+    {
+      if (cmsg->cmsg_level == SOL_SOCKET &&
+          cmsg->cmsg_type == SCM_RIGHTS &&
+          cmsg->cmsg_len == CMSG_LEN (sizeof (int)))
+        memcpy (passed_fd, CMSG_DATA (cmsg), sizeof (int));
+    }
+
+  return size;
+}
+
+static void
+writer_serve (int fuse_socket,
+              int exit_with_fd)
 {
   guchar request_buffer[MAX_REQUEST_SIZE];
   RevokefsRequest *request = (RevokefsRequest *)&request_buffer;
   guchar response_buffer[MAX_RESPONSE_SIZE];
   RevokefsResponse *response = (RevokefsResponse *)&response_buffer;
 
-  basefd = basefd_arg;
-  outstanding_fds = g_hash_table_new (g_direct_hash, g_direct_equal);
-
   while (1)
     {
       ssize_t data_size, size;
       ssize_t response_data_size, response_size, written_size;
       int res;
+      int passed_fd;
       struct pollfd pollfds[2] =  {
          {fuse_socket, POLLIN, 0 },
          {exit_with_fd, POLLIN, 0 },
@@ -797,7 +1091,7 @@ do_writer (int basefd_arg,
       if (pollfds[0].revents & POLLIN == 0)
         continue;
 
-      size = TEMP_FAILURE_RETRY (read (fuse_socket, request_buffer, sizeof (request_buffer)));
+      size = read_request (fuse_socket, request_buffer, sizeof (request_buffer), &passed_fd);
       if (size == -1)
         {
           perror ("Got error reading from fuse socket: ");
@@ -819,6 +1113,13 @@ do_writer (int basefd_arg,
       data_size = size - sizeof (RevokefsRequest);
       memset (response_buffer, 0, sizeof(RevokefsResponse));
 
+      if (passed_fd != -1 && request->op != REVOKE_FS_ADD_CHANNEL)
+        {
+          /* No other op expects an attached fd */
+          close (passed_fd);
+          passed_fd = -1;
+        }
+
       switch (request->op)
         {
         case REVOKE_FS_MKDIR:
@@ -860,6 +1161,9 @@ do_writer (int basefd_arg,
         case REVOKE_FS_WRITE:
           response_data_size = handle_write (request, data_size, response);
           break;
+        case REVOKE_FS_WRITEV:
+          response_data_size = handle_writev (request, data_size, response);
+          break;
         case REVOKE_FS_FSYNC:
           response_data_size = handle_fsync (request, data_size, response);
           break;
@@ -869,6 +1173,10 @@ do_writer (int basefd_arg,
         case REVOKE_FS_ACCESS:
           response_data_size = handle_access (request, data_size, response);
           break;
+        case REVOKE_FS_ADD_CHANNEL:
+          response_data_size = handle_add_channel (request, data_size, response, passed_fd);
+          passed_fd = -1; /* ownership was passed on */
+          break;
         default:
           g_printerr ("Invalid request op %d", (guint) request->op);
           exit (1);
@@ -896,3 +1204,14 @@ do_writer (int basefd_arg,
         }
     }
 }
+
+void
+do_writer (int basefd_arg,
+           int fuse_socket,
+           int exit_with_fd)
+{
+  basefd = basefd_arg;
+  outstanding_fds = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  writer_serve (fuse_socket, exit_with_fd);
+}
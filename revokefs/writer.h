@@ -22,6 +22,16 @@
 #ifndef __REVOKEFS_WRITER_H__
 #define __REVOKEFS_WRITER_H__
 
+typedef struct {
+  guint64 offset;
+  guint64 size;
+} RevokefsWriteSegment;
+
+/* Flags for REVOKE_FS_WRITEV, fusing a following fsync or close into
+ * the same round trip */
+#define REVOKE_FS_WRITEV_FSYNC (1 << 0)
+#define REVOKE_FS_WRITEV_CLOSE (1 << 1)
+
 int request_mkdir(int writer_socket, const char *path, mode_t mode);
 int request_rmdir (int writer_socket, const char *path);
 int request_unlink (int writer_socket, const char *path);
@@ -35,9 +45,14 @@ int request_utimens (int writer_socket, const char *path, const struct timespec
 int request_open (int writer_socket, const char *path, mode_t mode, int flags);
 int request_read (int writer_socket, int fd, char *buf, size_t size, off_t offset);
 int request_write (int writer_socket, int fd, const char *buf, size_t size, off_t offset);
+int request_writev (int writer_socket, int fd, guint32 flags,
+                    const RevokefsWriteSegment *segments,
+                    const guchar * const *segment_data,
+                    int n_segments);
 int request_fsync (int writer_socket, int fd);
 int request_close (int writer_socket, int fd);
 int request_access (int writer_socket, const char *path, int mode);
+int request_add_channel (int writer_socket, int channel_fd);
 
 void  do_writer (int basefd, int socket, int exit_with_fd);
 
@@ -59,6 +74,8 @@ typedef enum {
   REVOKE_FS_FSYNC,
   REVOKE_FS_CLOSE,
   REVOKE_FS_ACCESS,
+  REVOKE_FS_ADD_CHANNEL,
+  REVOKE_FS_WRITEV,
 } RevokefsOps;
 
 typedef struct {
@@ -82,4 +99,7 @@ typedef struct {
 #define MAX_REQUEST_SIZE REQUEST_SIZE(MAX_DATA_SIZE)
 #define MAX_RESPONSE_SIZE RESPONSE_SIZE(MAX_DATA_SIZE)
 
+/* Upper bound on request channels between the fuse side and the writer */
+#define MAX_WRITER_CHANNELS 8
+
 #endif /* __REVOKEFS_WRITER_H__ */
@@ -24,11 +24,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <fcntl.h>
 #include <sys/ioctl.h>
 #include <gio/gio.h>
 #include <gio/gunixfdlist.h>
 #include "flatpak-dbus-generated.h"
 #include "flatpak-utils-private.h"
+#include "flatpak-dir-private.h"
+#include "flatpak-run-private.h"
 
 static char *monitor_dir;
 static char *p11_kit_server_socket_path;
@@ -87,6 +90,135 @@ handle_request_session (FlatpakSessionHelper  *object,
   return TRUE;
 }
 
+typedef struct
+{
+  char          *app_id;
+  char          *app_ref;
+  char          *deploy_path;
+  FlatpakDeploy *deploy;
+} WarmAppData;
+
+static GHashTable *warm_apps = NULL; /* app id -> WarmAppData */
+
+static void
+warm_app_data_free (WarmAppData *data)
+{
+  g_free (data->app_id);
+  g_free (data->app_ref);
+  g_free (data->deploy_path);
+  g_clear_object (&data->deploy);
+  g_free (data);
+}
+
+/* (Re)resolves the current deploy of @app_id, reusing the cached
+ * FlatpakDeploy (with its parsed metadata and overrides) as long as it
+ * still points at the same deploy directory, so app updates and
+ * make-current changes are picked up on the next launch. */
+static WarmAppData *
+warm_app_resolve (const char *app_id,
+                  GError    **error)
+{
+  WarmAppData *data;
+  g_autofree char *current_ref = NULL;
+  g_autofree char *deploy_path = NULL;
+  g_autoptr(FlatpakDeploy) deploy = NULL;
+  g_autoptr(GFile) deploy_dir = NULL;
+
+  current_ref = flatpak_find_current_ref (app_id, NULL, error);
+  if (current_ref == NULL)
+    return NULL;
+
+  deploy = flatpak_find_deploy_for_ref (current_ref, NULL, NULL, error);
+  if (deploy == NULL)
+    return NULL;
+
+  deploy_dir = flatpak_deploy_get_dir (deploy);
+  deploy_path = g_file_get_path (deploy_dir);
+
+  data = g_hash_table_lookup (warm_apps, app_id);
+  if (data != NULL &&
+      strcmp (data->app_ref, current_ref) == 0 &&
+      strcmp (data->deploy_path, deploy_path) == 0)
+    return data; /* Still current, keep the warm state */
+
+  if (data == NULL)
+    {
+      data = g_new0 (WarmAppData, 1);
+      data->app_id = g_strdup (app_id);
+      g_hash_table_insert (warm_apps, data->app_id, data);
+    }
+
+  g_free (data->app_ref);
+  g_free (data->deploy_path);
+  g_clear_object (&data->deploy);
+  data->app_ref = g_steal_pointer (&current_ref);
+  data->deploy_path = g_steal_pointer (&deploy_path);
+  data->deploy = g_steal_pointer (&deploy);
+
+  return data;
+}
+
+static gboolean
+handle_warm_up_app (FlatpakSessionHelper  *object,
+                    GDBusMethodInvocation *invocation,
+                    const char            *app_id,
+                    gpointer               user_data)
+{
+  g_autoptr(GError) error = NULL;
+
+  g_debug ("WarmUpApp %s", app_id);
+
+  if (warm_app_resolve (app_id, &error) == NULL)
+    {
+      g_dbus_method_invocation_return_gerror (invocation, error);
+      return TRUE;
+    }
+
+  flatpak_session_helper_complete_warm_up_app (object, invocation);
+
+  return TRUE;
+}
+
+static gboolean
+handle_launch_warm_app (FlatpakSessionHelper  *object,
+                        GDBusMethodInvocation *invocation,
+                        const char            *app_id,
+                        const char * const    *args,
+                        gpointer               user_data)
+{
+  WarmAppData *data;
+  g_autoptr(GError) error = NULL;
+  g_autofree char *instance_dir = NULL;
+  g_autofree char *instance = NULL;
+
+  g_debug ("LaunchWarmApp %s", app_id);
+
+  data = warm_app_resolve (app_id, &error);
+  if (data == NULL)
+    {
+      g_dbus_method_invocation_return_gerror (invocation, error);
+      return TRUE;
+    }
+
+  if (!flatpak_run_app (data->app_ref, data->deploy,
+                        NULL, NULL, NULL, NULL,
+                        FLATPAK_RUN_FLAG_BACKGROUND,
+                        NULL, NULL,
+                        (char **) args,
+                        args != NULL ? g_strv_length ((char **) args) : 0,
+                        &instance_dir,
+                        NULL, &error))
+    {
+      g_dbus_method_invocation_return_gerror (invocation, error);
+      return TRUE;
+    }
+
+  instance = g_path_get_basename (instance_dir);
+  flatpak_session_helper_complete_launch_warm_app (object, invocation, instance);
+
+  return TRUE;
+}
+
 
 static void
 child_watch_died (GPid     pid,
@@ -458,9 +590,11 @@ on_bus_acquired (GDBusConnection *connection,
 
   helper = flatpak_session_helper_skeleton_new ();
 
-  flatpak_session_helper_set_version (FLATPAK_SESSION_HELPER (helper), 1);
+  flatpak_session_helper_set_version (FLATPAK_SESSION_HELPER (helper), 2);
 
   g_signal_connect (helper, "handle-request-session", G_CALLBACK (handle_request_session), NULL);
+  g_signal_connect (helper, "handle-warm-up-app", G_CALLBACK (handle_warm_up_app), NULL);
+  g_signal_connect (helper, "handle-launch-warm-app", G_CALLBACK (handle_launch_warm_app), NULL);
 
   if (!g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON (helper),
                                          connection,
@@ -514,8 +648,14 @@ typedef struct
   char         *real;
   GFileMonitor *monitor_source;
   GFileMonitor *monitor_real;
+  guint         update_timeout;
 } MonitorData;
 
+/* How long to wait for a burst of changes to settle before copying,
+   so that e.g. a VPN rewriting resolv.conf many times in a row results
+   in a single update of the sandboxed copy. */
+#define MONITOR_SETTLE_MS 100
+
 static void
 monitor_data_free (MonitorData *data)
 {
@@ -527,6 +667,8 @@ monitor_data_free (MonitorData *data)
       g_signal_handlers_disconnect_by_data (data->monitor_real, data);
       g_object_unref (data->monitor_real);
     }
+  if (data->update_timeout != 0)
+    g_source_remove (data->update_timeout);
   g_free (data);
 }
 
@@ -536,17 +678,26 @@ static void
 copy_file (const char *source,
            const char *target_dir)
 {
-  char *basename = g_path_get_basename (source);
-  char *dest = g_build_filename (target_dir, basename, NULL);
-  gchar *contents = NULL;
+  g_autofree char *basename = g_path_get_basename (source);
+  g_autofree char *dest = g_build_filename (target_dir, basename, NULL);
+  g_autofree char *tmp = g_strconcat (dest, ".tmp", NULL);
+  g_autofree gchar *contents = NULL;
   gsize len;
+  glnx_autofd int fd = -1;
 
-  if (g_file_get_contents (source, &contents, &len, NULL))
-    g_file_set_contents (dest, contents, len, NULL);
+  if (!g_file_get_contents (source, &contents, &len, NULL))
+    return;
+
+  /* The copies are only caches of host state, so unlike
+     g_file_set_contents we don't fsync before renaming into place;
+     sandboxes atomically see either the old or the new content. */
+  fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1)
+    return;
 
-  g_free (basename);
-  g_free (dest);
-  g_free (contents);
+  if (glnx_loop_write (fd, contents, len) < 0 ||
+      rename (tmp, dest) == -1)
+    unlink (tmp);
 }
 
 static void file_changed (GFileMonitor     *monitor,
@@ -629,6 +780,17 @@ file_monitor_do (MonitorData *data)
     }
 }
 
+static gboolean
+file_changed_settled (gpointer user_data)
+{
+  MonitorData *data = user_data;
+
+  data->update_timeout = 0;
+  file_monitor_do (data);
+
+  return G_SOURCE_REMOVE;
+}
+
 static void
 file_changed (GFileMonitor     *monitor,
               GFile            *file,
@@ -639,7 +801,11 @@ file_changed (GFileMonitor     *monitor,
   if (event_type != G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT)
     return;
 
-  file_monitor_do (data);
+  /* Debounce: wait for the change burst to settle and do one copy for
+     the whole of it. */
+  if (data->update_timeout != 0)
+    g_source_remove (data->update_timeout);
+  data->update_timeout = g_timeout_add (MONITOR_SETTLE_MS, file_changed_settled, data);
 }
 
 static MonitorData *
@@ -821,6 +987,7 @@ main (int    argc,
     g_log_set_handler (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, message_handler, NULL);
 
   client_pid_data_hash = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify) pid_data_free);
+  warm_apps = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify) warm_app_data_free);
 
   session_bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
   if (session_bus == NULL)
@@ -31,6 +31,7 @@
 #include <pwd.h>
 #include <gio/gunixfdlist.h>
 #include <sys/mount.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 
 #include "flatpak-dbus-generated.h"
@@ -53,6 +54,11 @@ static gboolean no_idle_exit = FALSE;
 
 #define IDLE_TIMEOUT_SECS 10 * 60
 
+/* How long a validated FlatpakDir (with its repo handle and summary
+ * caches) is reused between requests before it is reconstructed */
+#define DIR_CACHE_TIMEOUT_SECS 5 * 60
+static gint dir_cache_timeout = DIR_CACHE_TIMEOUT_SECS;
+
 /* This uses a weird Auto prefix to avoid conflicts with later added polkit types.
  */
 typedef PolkitAuthorizationResult AutoPolkitAuthorizationResult;
@@ -215,24 +221,102 @@ schedule_idle_callback (void)
   G_UNLOCK (idle);
 }
 
+typedef struct
+{
+  FlatpakDir *dir;
+  guint64     config_mtime;
+  gint64      last_used;
+} CachedDir;
+
+/* Maps installation id => CachedDir, protected by the cached_dirs lock
+ * since the method handlers run in their own threads */
+G_LOCK_DEFINE_STATIC (cached_dirs);
+static GHashTable *cached_dirs = NULL;
+
+static void
+cached_dir_free (CachedDir *cached)
+{
+  g_object_unref (cached->dir);
+  g_free (cached);
+}
+
+static guint64
+dir_get_config_mtime (FlatpakDir *dir)
+{
+  g_autoptr(GFile) config_file = g_file_resolve_relative_path (flatpak_dir_get_path (dir), "repo/config");
+  struct stat st;
+
+  if (stat (flatpak_file_get_path_cached (config_file), &st) != 0)
+    return 0;
+
+  return (guint64) st.st_mtim.tv_sec * G_USEC_PER_SEC + st.st_mtim.tv_nsec / 1000;
+}
+
 static FlatpakDir *
 dir_get_system (const char *installation,
                 pid_t       source_pid,
                 GError    **error)
 {
   FlatpakDir *system = NULL;
+  CachedDir *cached;
+  const char *cache_key = installation ? installation : "";
 
-  if (installation != NULL && *installation != '\0')
-    system = flatpak_dir_get_system_by_id (installation, NULL, error);
-  else
-    system = flatpak_dir_get_system_default ();
+  G_LOCK (cached_dirs);
+
+  if (cached_dirs == NULL)
+    cached_dirs = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                         g_free, (GDestroyNotify) cached_dir_free);
+
+  cached = g_hash_table_lookup (cached_dirs, cache_key);
+  if (cached != NULL &&
+      (g_get_monotonic_time () - cached->last_used > (gint64) dir_cache_timeout * G_USEC_PER_SEC ||
+       dir_get_config_mtime (cached->dir) != cached->config_mtime))
+    {
+      /* Expired, or the configuration changed under us */
+      g_hash_table_remove (cached_dirs, cache_key);
+      cached = NULL;
+    }
+
+  /* FlatpakDir is not thread-safe, so only hand out the cached dir
+     when no other request is currently using it */
+  if (cached != NULL &&
+      g_atomic_int_get (&G_OBJECT (cached->dir)->ref_count) == 1)
+    {
+      cached->last_used = g_get_monotonic_time ();
+      system = g_object_ref (cached->dir);
+    }
+
+  G_UNLOCK (cached_dirs);
 
-  /* This can happen in case of error with flatpak_dir_get_system_by_id(). */
   if (system == NULL)
-    return NULL;
+    {
+      if (installation != NULL && *installation != '\0')
+        system = flatpak_dir_get_system_by_id (installation, NULL, error);
+      else
+        system = flatpak_dir_get_system_default ();
+
+      /* This can happen in case of error with flatpak_dir_get_system_by_id(). */
+      if (system == NULL)
+        return NULL;
+
+      flatpak_dir_set_no_system_helper (system, TRUE);
+
+      if (dir_cache_timeout > 0)
+        {
+          G_LOCK (cached_dirs);
+          if (g_hash_table_lookup (cached_dirs, cache_key) == NULL)
+            {
+              cached = g_new0 (CachedDir, 1);
+              cached->dir = g_object_ref (system);
+              cached->config_mtime = dir_get_config_mtime (system);
+              cached->last_used = g_get_monotonic_time ();
+              g_hash_table_insert (cached_dirs, g_strdup (cache_key), cached);
+            }
+          G_UNLOCK (cached_dirs);
+        }
+    }
 
   flatpak_dir_set_source_pid (system, source_pid);
-  flatpak_dir_set_no_system_helper (system, TRUE);
 
   return system;
 }
@@ -313,6 +397,35 @@ flatpak_invocation_return_error (GDBusMethodInvocation *invocation,
     }
 }
 
+/* Like flatpak_invocation_return_error, but stores the error for the
+ * caller to return. Frees @source. */
+static gboolean
+set_error_with_context (GError **error, GError **source, const char *fmt, ...) G_GNUC_PRINTF (3, 4);
+
+static gboolean
+set_error_with_context (GError **error, GError **source, const char *fmt, ...)
+{
+  if ((*source)->domain == FLATPAK_ERROR)
+    {
+      g_propagate_error (error, g_steal_pointer (source));
+    }
+  else
+    {
+      va_list args;
+      g_autofree char *prefix = NULL;
+
+      va_start (args, fmt);
+      g_vasprintf (&prefix, fmt, args);
+      va_end (args);
+
+      g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                   "%s: %s", prefix, (*source)->message);
+      g_clear_error (source);
+    }
+
+  return FALSE;
+}
+
 static gboolean
 get_connection_uid (GDBusMethodInvocation *invocation, uid_t *out_uid, GError **error)
 {
@@ -370,19 +483,19 @@ take_ongoing_pull_by_dir (const gchar *src_dir)
 }
 
 static gboolean
-handle_deploy (FlatpakSystemHelper   *object,
-               GDBusMethodInvocation *invocation,
-               const gchar           *arg_repo_path,
-               guint32                arg_flags,
-               const gchar           *arg_ref,
-               const gchar           *arg_origin,
-               const gchar *const    *arg_subpaths,
-               const gchar *const    *arg_previous_ids,
-               const gchar           *arg_installation)
+do_deploy (FlatpakDir            *system,
+           GDBusMethodInvocation *invocation,
+           const gchar           *arg_repo_path,
+           guint32                arg_flags,
+           const gchar           *arg_ref,
+           const gchar           *arg_origin,
+           const gchar *const    *arg_subpaths,
+           const gchar *const    *arg_previous_ids,
+           const gchar           *arg_installation,
+           GError               **error)
 {
-  g_autoptr(FlatpakDir) system = NULL;
   g_autoptr(GFile) repo_file = g_file_new_for_path (arg_repo_path);
-  g_autoptr(GError) error = NULL;
+  g_autoptr(GError) local_error = NULL;
   g_autoptr(GFile) deploy_dir = NULL;
   g_autoptr(OstreeAsyncProgress) ostree_progress = NULL;
   gboolean is_oci;
@@ -393,36 +506,26 @@ handle_deploy (FlatpakSystemHelper   *object,
   g_autoptr(OngoingPull) ongoing_pull = NULL;
   g_autofree gchar *src_dir = NULL;
 
-  g_debug ("Deploy %s %u %s %s %s", arg_repo_path, arg_flags, arg_ref, arg_origin, arg_installation);
-
-  system = dir_get_system (arg_installation, get_sender_pid (invocation), &error);
-  if (system == NULL)
-    {
-      g_dbus_method_invocation_return_gerror (invocation, error);
-      return TRUE;
-    }
-
   src_dir = g_path_get_dirname (arg_repo_path);
   ongoing_pull = take_ongoing_pull_by_dir (src_dir);
   if (ongoing_pull != NULL)
     {
-      g_autoptr(GError) local_error = NULL;
       uid_t uid;
 
       /* Ensure that pull's uid is same as the caller's uid */
       if (!get_connection_uid (invocation, &uid, &local_error))
         {
-          g_dbus_method_invocation_return_gerror (invocation, local_error);
-          return TRUE;
+          g_propagate_error (error, g_steal_pointer (&local_error));
+          return FALSE;
         }
       else
         {
           if (ongoing_pull->uid != uid)
             {
-              g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                                                     "Ongoing pull's uid(%d) does not match with peer uid(%d)",
-                                                     ongoing_pull->uid, uid);
-              return TRUE;
+              g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                           "Ongoing pull's uid(%d) does not match with peer uid(%d)",
+                           ongoing_pull->uid, uid);
+              return FALSE;
             }
         }
 
@@ -434,10 +537,10 @@ handle_deploy (FlatpakSystemHelper   *object,
                                              getuid() == 0 ? 0 : -1,
                                              &local_error))
         {
-          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                                                 "Failed to canonicalize permissions of repo %s: %s",
-                                                 arg_repo_path, local_error->message);
-          return TRUE;
+          g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                       "Failed to canonicalize permissions of repo %s: %s",
+                       arg_repo_path, local_error->message);
+          return FALSE;
         }
 
       /* At this point, the cache-dir's repo is owned by root. Hence, any failure
@@ -447,16 +550,16 @@ handle_deploy (FlatpakSystemHelper   *object,
 
   if ((arg_flags & ~FLATPAK_HELPER_DEPLOY_FLAGS_ALL) != 0)
     {
-      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
-                                             "Unsupported flags enabled: 0x%x", (arg_flags & ~FLATPAK_HELPER_DEPLOY_FLAGS_ALL));
-      return TRUE;
+      g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                   "Unsupported flags enabled: 0x%x", (arg_flags & ~FLATPAK_HELPER_DEPLOY_FLAGS_ALL));
+      return FALSE;
     }
 
   if (!g_file_query_exists (repo_file, NULL))
     {
-      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
-                                             "Path does not exist");
-      return TRUE;
+      g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                   "Path does not exist");
+      return FALSE;
     }
 
   no_deploy = (arg_flags & FLATPAK_HELPER_DEPLOY_FLAGS_NO_DEPLOY) != 0;
@@ -471,16 +574,15 @@ handle_deploy (FlatpakSystemHelper   *object,
       real_origin = flatpak_dir_get_origin (system, arg_ref, NULL, NULL);
       if (g_strcmp0 (real_origin, arg_origin) != 0)
         {
-          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
-                                                 "Wrong origin %s for update", arg_origin);
-          return TRUE;
+          g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                       "Wrong origin %s for update", arg_origin);
+          return FALSE;
         }
     }
 
-  if (!flatpak_dir_ensure_repo (system, NULL, &error))
+  if (!flatpak_dir_ensure_repo (system, NULL, &local_error))
     {
-      flatpak_invocation_return_error (invocation, error, "Can't open system repo %s", arg_installation);
-      return TRUE;
+      return set_error_with_context (error, &local_error, "Can't open system repo %s", arg_installation);
     }
 
   is_oci = flatpak_dir_get_remote_oci (system, arg_origin);
@@ -507,60 +609,60 @@ handle_deploy (FlatpakSystemHelper   *object,
 
       if (upstream_url == NULL)
         {
-          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                                                 "Remote %s is disabled", arg_origin);
-          return TRUE;
+          g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                       "Remote %s is disabled", arg_origin);
+          return FALSE;
         }
 
-      registry = flatpak_oci_registry_new (registry_uri, FALSE, -1, NULL, &error);
+      registry = flatpak_oci_registry_new (registry_uri, FALSE, -1, NULL, &local_error);
       if (registry == NULL)
         {
-          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                                                 "Can't open child OCI registry: %s", error->message);
-          return TRUE;
+          g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                       "Can't open child OCI registry: %s", local_error->message);
+          return FALSE;
         }
 
-      index = flatpak_oci_registry_load_index (registry, NULL, &error);
+      index = flatpak_oci_registry_load_index (registry, NULL, &local_error);
       if (index == NULL)
         {
-          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                                                 "Can't open child OCI registry index: %s", error->message);
-          return TRUE;
+          g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                       "Can't open child OCI registry index: %s", local_error->message);
+          return FALSE;
         }
 
       desc = flatpak_oci_index_get_manifest (index, arg_ref);
       if (desc == NULL)
         {
-          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                                                 "Can't find ref %s in child OCI registry index", arg_ref);
-          return TRUE;
+          g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                       "Can't find ref %s in child OCI registry index", arg_ref);
+          return FALSE;
         }
 
       versioned = flatpak_oci_registry_load_versioned (registry, NULL, desc->parent.digest, NULL,
-                                                       NULL, &error);
+                                                       NULL, &local_error);
       if (versioned == NULL || !FLATPAK_IS_OCI_MANIFEST (versioned))
         {
-          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                                                 "Can't open child manifest");
-          return TRUE;
+          g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                       "Can't open child manifest");
+          return FALSE;
         }
 
-      state = flatpak_dir_get_remote_state (system, arg_origin, FALSE, NULL, &error);
+      state = flatpak_dir_get_remote_state (system, arg_origin, FALSE, NULL, &local_error);
       if (state == NULL)
         {
-          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                                                 "%s: Can't get remote state: %s", arg_origin, error->message);
-          return TRUE;
+          g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                       "%s: Can't get remote state: %s", arg_origin, local_error->message);
+          return FALSE;
         }
 
       /* We need to use list_all_remote_refs because we don't care about
        * enumerate vs. noenumerate.
        */
-      if (!flatpak_dir_list_all_remote_refs (system, state, &remote_refs, NULL, &error))
+      if (!flatpak_dir_list_all_remote_refs (system, state, &remote_refs, NULL, &local_error))
         {
-          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                                                 "%s: Can't list refs: %s", arg_origin, error->message);
-          return TRUE;
+          g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                       "%s: Can't list refs: %s", arg_origin, local_error->message);
+          return FALSE;
         }
 
       collection_ref.collection_id = state->collection_id;
@@ -569,26 +671,26 @@ handle_deploy (FlatpakSystemHelper   *object,
       verified_digest = g_hash_table_lookup (remote_refs, &collection_ref);
       if (!verified_digest)
         {
-          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                                                 "%s: ref %s not found", arg_origin, arg_ref);
-          return TRUE;
+          g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                       "%s: ref %s not found", arg_origin, arg_ref);
+          return FALSE;
         }
 
       if (!g_str_has_prefix (desc->parent.digest, "sha256:") ||
           strcmp (desc->parent.digest + strlen ("sha256:"), verified_digest) != 0)
         {
-          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                                                 "%s: manifest hash in downloaded content does not match ref %s", arg_origin, arg_ref);
-          return TRUE;
+          g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                       "%s: manifest hash in downloaded content does not match ref %s", arg_origin, arg_ref);
+          return FALSE;
         }
 
       checksum = flatpak_pull_from_oci (flatpak_dir_get_repo (system), registry, NULL, desc->parent.digest, FLATPAK_OCI_MANIFEST (versioned),
-                                        arg_origin, arg_ref, NULL, NULL, NULL, &error);
+                                        arg_origin, arg_ref, NULL, NULL, NULL, &local_error);
       if (checksum == NULL)
         {
-          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                                                 "Can't pull ref %s from child OCI registry index: %s", arg_ref, error->message);
-          return TRUE;
+          g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                       "Can't pull ref %s from child OCI registry index: %s", arg_ref, local_error->message);
+          return FALSE;
         }
     }
   else if (strlen (arg_repo_path) > 0)
@@ -605,10 +707,9 @@ handle_deploy (FlatpakSystemHelper   *object,
                                              arg_ref,
                                              (const char **) arg_subpaths,
                                              ostree_progress,
-                                             NULL, &error))
+                                             NULL, &local_error))
         {
-          flatpak_invocation_return_error (invocation, error, "Error pulling from repo");
-          return TRUE;
+          return set_error_with_context (error, &local_error, "Error pulling from repo");
         }
 
       if (ostree_progress)
@@ -621,24 +722,22 @@ handle_deploy (FlatpakSystemHelper   *object,
       if (!ostree_repo_remote_get_url (flatpak_dir_get_repo (system),
                                        arg_origin,
                                        &url,
-                                       &error))
+                                       &local_error))
         {
-          flatpak_invocation_return_error (invocation, error, "Error getting remote url");
-          return TRUE;
+          return set_error_with_context (error, &local_error, "Error getting remote url");
         }
 
       if (!g_str_has_prefix (url, "file:"))
         {
-          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                                                 "Local pull url doesn't start with file://");
-          return TRUE;
+          g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                       "Local pull url doesn't start with file://");
+          return FALSE;
         }
 
-      state = flatpak_dir_get_remote_state_optional (system, arg_origin, NULL, &error);
+      state = flatpak_dir_get_remote_state_optional (system, arg_origin, NULL, &local_error);
       if (state == NULL)
         {
-          flatpak_invocation_return_error (invocation, error, "Error getting remote state");
-          return TRUE;
+          return set_error_with_context (error, &local_error, "Error getting remote state");
         }
 
       /* Work around ostree-pull spinning the default main context for the sync calls */
@@ -648,10 +747,9 @@ handle_deploy (FlatpakSystemHelper   *object,
 
       if (!flatpak_dir_pull (system, state, arg_ref, NULL, NULL, (const char **) arg_subpaths, NULL,
                              FLATPAK_PULL_FLAGS_NONE, OSTREE_REPO_PULL_FLAGS_UNTRUSTED, ostree_progress,
-                             NULL, &error))
+                             NULL, &local_error))
         {
-          flatpak_invocation_return_error (invocation, error, "Error pulling from repo");
-          return TRUE;
+          return set_error_with_context (error, &local_error, "Error pulling from repo");
         }
 
       if (ostree_progress)
@@ -665,10 +763,9 @@ handle_deploy (FlatpakSystemHelper   *object,
           if (!flatpak_dir_deploy_update (system, arg_ref, NULL,
                                           (const char **) arg_subpaths,
                                           (const char **) arg_previous_ids,
-                                          NULL, &error))
+                                          NULL, &local_error))
             {
-              flatpak_invocation_return_error (invocation, error, "Error deploying");
-              return TRUE;
+              return set_error_with_context (error, &local_error, "Error deploying");
             }
         }
       else
@@ -676,19 +773,109 @@ handle_deploy (FlatpakSystemHelper   *object,
           if (!flatpak_dir_deploy_install (system, arg_ref, arg_origin,
                                            (const char **) arg_subpaths,
                                            (const char **) arg_previous_ids,
-                                           reinstall, NULL, &error))
+                                           reinstall, NULL, &local_error))
             {
-              flatpak_invocation_return_error (invocation, error, "Error deploying");
-              return TRUE;
+              return set_error_with_context (error, &local_error, "Error deploying");
             }
         }
     }
 
+  return TRUE;
+}
+
+static gboolean
+handle_deploy (FlatpakSystemHelper   *object,
+               GDBusMethodInvocation *invocation,
+               const gchar           *arg_repo_path,
+               guint32                arg_flags,
+               const gchar           *arg_ref,
+               const gchar           *arg_origin,
+               const gchar *const    *arg_subpaths,
+               const gchar *const    *arg_previous_ids,
+               const gchar           *arg_installation)
+{
+  g_autoptr(FlatpakDir) system = NULL;
+  g_autoptr(GError) error = NULL;
+
+  g_debug ("Deploy %s %u %s %s %s", arg_repo_path, arg_flags, arg_ref, arg_origin, arg_installation);
+
+  system = dir_get_system (arg_installation, get_sender_pid (invocation), &error);
+  if (system == NULL)
+    {
+      g_dbus_method_invocation_return_gerror (invocation, error);
+      return TRUE;
+    }
+
+  if (!do_deploy (system, invocation,
+                  arg_repo_path, arg_flags, arg_ref, arg_origin,
+                  arg_subpaths, arg_previous_ids, arg_installation,
+                  &error))
+    {
+      g_dbus_method_invocation_return_gerror (invocation, error);
+      return TRUE;
+    }
+
   flatpak_system_helper_complete_deploy (object, invocation);
 
   return TRUE;
 }
 
+static gboolean
+handle_deploy_batch (FlatpakSystemHelper   *object,
+                     GDBusMethodInvocation *invocation,
+                     GVariant              *arg_operations,
+                     const gchar           *arg_installation)
+{
+  g_autoptr(FlatpakDir) system = NULL;
+  g_autoptr(GError) error = NULL;
+  gsize n_operations, i;
+
+  n_operations = g_variant_n_children (arg_operations);
+
+  g_debug ("DeployBatch %" G_GSIZE_FORMAT " operations %s", n_operations, arg_installation);
+
+  system = dir_get_system (arg_installation, get_sender_pid (invocation), &error);
+  if (system == NULL)
+    {
+      g_dbus_method_invocation_return_gerror (invocation, error);
+      return TRUE;
+    }
+
+  /* The whole batch was authorized as one operation and shares the
+     repo state in @system. Any failure fails the remaining
+     operations, like the client looping over Deploy itself. */
+  for (i = 0; i < n_operations; i++)
+    {
+      g_autoptr(GVariant) op = g_variant_get_child_value (arg_operations, i);
+      const char *repo_path, *ref, *origin;
+      g_autofree const char **subpaths = NULL;
+      g_autofree const char **previous_ids = NULL;
+      guint32 flags;
+
+      g_variant_get_child (op, 0, "^&ay", &repo_path);
+      g_variant_get_child (op, 1, "u", &flags);
+      g_variant_get_child (op, 2, "&s", &ref);
+      g_variant_get_child (op, 3, "&s", &origin);
+      g_variant_get_child (op, 4, "^a&s", &subpaths);
+      g_variant_get_child (op, 5, "^a&s", &previous_ids);
+
+      if (!do_deploy (system, invocation,
+                      repo_path, flags, ref, origin,
+                      (const gchar * const *) subpaths,
+                      (const gchar * const *) previous_ids,
+                      arg_installation, &error))
+        {
+          g_prefix_error (&error, "While deploying %s: ", ref);
+          g_dbus_method_invocation_return_gerror (invocation, error);
+          return TRUE;
+        }
+    }
+
+  flatpak_system_helper_complete_deploy_batch (object, invocation);
+
+  return TRUE;
+}
+
 static gboolean
 handle_cancel_pull (FlatpakSystemHelper   *object,
                     GDBusMethodInvocation *invocation,
@@ -1948,6 +2135,80 @@ flatpak_authorize_method_handler (GDBusInterfaceSkeleton *interface,
       polkit_details_insert (details, "origin", origin);
       polkit_details_insert (details, "ref", ref);
     }
+  else if (g_strcmp0 (method_name, "DeployBatch") == 0)
+    {
+      /* One check covers the whole batch, using the strongest action
+       * among the operations. As for Deploy, the policy implication
+       * app-install > app-update > runtime-install > runtime-update
+       * means this only ever asks for a stronger permission than each
+       * operation would individually. */
+      static const char *deploy_actions[4] = {
+        "org.freedesktop.Flatpak.runtime-update",
+        "org.freedesktop.Flatpak.runtime-install",
+        "org.freedesktop.Flatpak.app-update",
+        "org.freedesktop.Flatpak.app-install",
+      };
+      g_autoptr(GVariant) operations = NULL;
+      g_autoptr(GString) refs = g_string_new ("");
+      const char *installation;
+      int strongest = -1;
+      gsize i, n_operations;
+
+      g_variant_get_child (parameters, 0, "@a(ayussasas)", &operations);
+      g_variant_get_child (parameters, 1, "&s", &installation);
+
+      no_interaction = TRUE;
+
+      n_operations = g_variant_n_children (operations);
+      for (i = 0; i < n_operations; i++)
+        {
+          g_autoptr(GVariant) operation = g_variant_get_child_value (operations, i);
+          const char *ref;
+          guint32 flags;
+          gboolean is_app, is_install;
+          int rank;
+
+          g_variant_get_child (operation, 1, "u", &flags);
+          g_variant_get_child (operation, 2, "&s", &ref);
+
+          if ((flags & FLATPAK_HELPER_DEPLOY_FLAGS_NO_INTERACTION) == 0)
+            no_interaction = FALSE;
+
+          if (refs->len > 0)
+            g_string_append_c (refs, ' ');
+          g_string_append (refs, ref);
+
+          /* Metadata updates don't affect the action needed for the rest */
+          if (g_strcmp0 (ref, OSTREE_REPO_METADATA_REF) == 0)
+            continue;
+
+          if ((flags & FLATPAK_HELPER_DEPLOY_FLAGS_APP_HINT) != 0)
+            is_app = TRUE;
+          else
+            is_app = g_str_has_prefix (ref, "app/");
+
+          if ((flags & FLATPAK_HELPER_DEPLOY_FLAGS_INSTALL_HINT) != 0 ||
+              (flags & FLATPAK_HELPER_DEPLOY_FLAGS_REINSTALL) != 0)
+            is_install = TRUE;
+          else
+            {
+              g_autoptr(FlatpakDir) system = dir_get_system (installation, 0, NULL);
+
+              is_install = !dir_ref_is_installed (system, ref);
+            }
+
+          rank = (is_app ? 2 : 0) + (is_install ? 1 : 0);
+          if (rank > strongest)
+            strongest = rank;
+        }
+
+      if (strongest >= 0)
+        action = deploy_actions[strongest];
+      else /* Empty or metadata-only batch */
+        action = "org.freedesktop.Flatpak.metadata-update";
+
+      polkit_details_insert (details, "refs", refs->str);
+    }
   else if (g_strcmp0 (method_name, "DeployAppstream") == 0)
     {
       guint32 flags;
@@ -2109,7 +2370,7 @@ on_bus_acquired (GDBusConnection *connection,
 
   helper = flatpak_system_helper_skeleton_new ();
 
-  flatpak_system_helper_set_version (FLATPAK_SYSTEM_HELPER (helper), 2);
+  flatpak_system_helper_set_version (FLATPAK_SYSTEM_HELPER (helper), 3);
 
   g_object_set_data_full (G_OBJECT (helper), "track-alive", GINT_TO_POINTER (42), skeleton_died_cb);
 
@@ -2117,6 +2378,7 @@ on_bus_acquired (GDBusConnection *connection,
                                        G_DBUS_INTERFACE_SKELETON_FLAGS_HANDLE_METHOD_INVOCATIONS_IN_THREAD);
 
   g_signal_connect (helper, "handle-deploy", G_CALLBACK (handle_deploy), NULL);
+  g_signal_connect (helper, "handle-deploy-batch", G_CALLBACK (handle_deploy_batch), NULL);
   g_signal_connect (helper, "handle-deploy-appstream", G_CALLBACK (handle_deploy_appstream), NULL);
   g_signal_connect (helper, "handle-uninstall", G_CALLBACK (handle_uninstall), NULL);
   g_signal_connect (helper, "handle-install-bundle", G_CALLBACK (handle_install_bundle), NULL);
@@ -2211,6 +2473,7 @@ main (int    argc,
     { "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose,  "Enable debug output.", NULL },
     { "session", 0, 0, G_OPTION_ARG_NONE, &on_session_bus,  "Run in session, not system scope (for tests).", NULL },
     { "no-idle-exit", 0, 0, G_OPTION_ARG_NONE, &no_idle_exit,  "Don't exit when idle.", NULL },
+    { "dir-cache-timeout", 0, 0, G_OPTION_ARG_INT, &dir_cache_timeout,  "Seconds to keep installation state cached between requests (0 to disable).", "SECS" },
     { "version", 0, 0, G_OPTION_ARG_NONE, &show_version, "Show program version.", NULL},
     { NULL }
   };
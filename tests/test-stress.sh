@@ -0,0 +1,141 @@
+#!/bin/bash
+#
+# Copyright (C) 2019 Red Hat, Inc.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+skip_revokefs_without_fuse
+
+# Concurrency stress test: run many flatpak transactions against one
+# installation from separate processes at once, and verify that the
+# final state is coherent. Scale up with e.g. FLATPAK_TESTS_STRESS_JOBS=20
+# FLATPAK_TESTS_STRESS_ROUNDS=10 for real stress runs; the defaults are
+# sized so the test stays fast in CI.
+
+N_JOBS=${FLATPAK_TESTS_STRESS_JOBS:-5}
+N_ROUNDS=${FLATPAK_TESTS_STRESS_ROUNDS:-3}
+
+echo "1..4"
+
+setup_repo
+
+for i in $(seq $N_JOBS); do
+    GPGARGS="${FL_GPGARGS}" $(dirname $0)/make-test-app.sh repos/test org.test.Stress$i master "" > /dev/null
+done
+update_repo
+
+# Verify that a deploy is either complete or absent: a partially
+# deployed ref (files but no metadata, or a dangling active link)
+# means a transaction tore down or published intermediate state.
+assert_deploy_coherent () {
+    APP_ID=$1
+    APP_DIR=$FL_DIR/app/$APP_ID
+    if [ -d $APP_DIR ]; then
+        for active in $APP_DIR/*/*/active; do
+            test -e $active || continue
+            assert_has_file $(readlink -f $active)/metadata
+            assert_has_dir $(readlink -f $active)/files
+        done
+    fi
+}
+
+# Distinct refs in parallel: all must succeed
+start=$(date +%s)
+declare -a pids=()
+for i in $(seq $N_JOBS); do
+    ${FLATPAK} ${U} install -y test-repo org.test.Stress$i &> stress-install-$i.log &
+    pids+=($!)
+done
+for pid in ${pids[@]}; do
+    wait $pid
+done
+echo "# installed $N_JOBS distinct apps concurrently in $(($(date +%s) - start))s"
+
+for i in $(seq $N_JOBS); do
+    assert_has_dir $FL_DIR/app/org.test.Stress$i/current/active/files
+    assert_deploy_coherent org.test.Stress$i
+done
+
+echo "ok concurrent installs of distinct refs"
+
+# The same ref from all processes at once: exactly the per-ref lock
+# contention case. One wins, the others must either also report success
+# or fail with "already installed" - anything else (or a torn deploy)
+# is a locking bug.
+for i in $(seq $N_JOBS); do
+    ${FLATPAK} ${U} uninstall -y org.test.Stress$i &> /dev/null
+done
+
+pids=()
+for i in $(seq $N_JOBS); do
+    ${FLATPAK} ${U} install -y test-repo org.test.Stress1 &> stress-same-$i.log &
+    pids+=($!)
+done
+for pid in ${pids[@]}; do
+    if ! wait $pid; then
+        losers=$((${losers:-0} + 1))
+    fi
+done
+if [ ${losers:-0} -gt 0 ]; then
+    grep -lq "already installed" stress-same-*.log || \
+        assert_not_reached "concurrent same-ref install failed with an unexpected error"
+fi
+assert_has_dir $FL_DIR/app/org.test.Stress1/current/active/files
+assert_deploy_coherent org.test.Stress1
+${FLATPAK} ${U} info org.test.Stress1 > /dev/null
+
+echo "ok concurrent installs of the same ref"
+
+# Update/uninstall/install churn on one ref: whatever interleaving the
+# kernel picks, every intermediate observer must see a coherent deploy
+start=$(date +%s)
+for round in $(seq $N_ROUNDS); do
+    GPGARGS="${FL_GPGARGS}" $(dirname $0)/make-test-app.sh repos/test org.test.Stress1 master "" ROUND$round > /dev/null
+    update_repo
+
+    pids=()
+    ${FLATPAK} ${U} update -y org.test.Stress1 &> stress-churn-update-$round.log &
+    pids+=($!)
+    ${FLATPAK} ${U} uninstall -y org.test.Stress1 &> stress-churn-uninstall-$round.log &
+    pids+=($!)
+    ${FLATPAK} ${U} install -y test-repo org.test.Stress2 &> stress-churn-install-$round.log &
+    pids+=($!)
+    for pid in ${pids[@]}; do
+        wait $pid || true
+    done
+
+    assert_deploy_coherent org.test.Stress1
+    assert_deploy_coherent org.test.Stress2
+    ${FLATPAK} ${U} install -y test-repo org.test.Stress1 &> /dev/null || true
+    ${FLATPAK} ${U} uninstall -y org.test.Stress2 &> /dev/null || true
+done
+echo "# $N_ROUNDS churn rounds in $(($(date +%s) - start))s"
+
+assert_deploy_coherent org.test.Stress1
+
+echo "ok concurrent update/uninstall/install churn"
+
+# The installation must still be fully operational afterwards
+${FLATPAK} ${U} uninstall -y --all &> /dev/null || true
+${FLATPAK} ${U} install -y test-repo org.test.Hello
+assert_has_dir $FL_DIR/app/org.test.Hello/current/active/files
+${FLATPAK} list ${U} | grep org.test.Hello > /dev/null
+
+echo "ok installation coherent after stress"
@@ -8,6 +8,7 @@
 #include "flatpak.h"
 #include "flatpak-utils-private.h"
 #include "flatpak-appdata-private.h"
+#include "flatpak-json-oci-private.h"
 #include "flatpak-builtins-utils.h"
 #include "flatpak-table-printer.h"
 #include "parse-datetime.h"
@@ -483,11 +484,12 @@ test_parse_appdata (void)
   g_autoptr(GHashTable) comments = NULL;
   g_autofree char *version = NULL;
   g_autofree char *license = NULL;
+  const char * const locales[] = { "fr", NULL };
   gboolean res;
   char *name;
   char *comment;
 
-  res = flatpak_parse_appdata (appdata1, "org.test.Hello", &names, &comments, &version, &license);
+  res = flatpak_parse_appdata (appdata1, "org.test.Hello", NULL, &names, &comments, &version, &license);
   g_assert_true (res);
   g_assert_cmpstr (version, ==, "0.0.1");
   g_assert_null (license);
@@ -505,7 +507,7 @@ test_parse_appdata (void)
   g_clear_pointer (&version, g_free);
   g_clear_pointer (&license, g_free);
 
-  res = flatpak_parse_appdata (appdata2, "org.test.Hello", &names, &comments, &version, &license);
+  res = flatpak_parse_appdata (appdata2, "org.test.Hello", NULL, &names, &comments, &version, &license);
   g_assert_true (res);
   g_assert_cmpstr (version, ==, "0.1.0");
   g_assert_cmpstr (license, ==, "anything goes");
@@ -521,6 +523,122 @@ test_parse_appdata (void)
   g_assert_cmpstr (comment, ==, "Print a greeting");
   comment = g_hash_table_lookup (comments, "de");
   g_assert_cmpstr (comment, ==, "Schreib mal was");
+
+  g_clear_pointer (&names, g_hash_table_unref);
+  g_clear_pointer (&comments, g_hash_table_unref);
+  g_clear_pointer (&version, g_free);
+  g_clear_pointer (&license, g_free);
+
+  /* Only the untranslated strings survive a locale filter that
+   * doesn't include "de" */
+  res = flatpak_parse_appdata (appdata2, "org.test.Hello", locales, &names, &comments, &version, &license);
+  g_assert_true (res);
+  g_assert_cmpstr (version, ==, "0.1.0");
+  g_assert_cmpstr (license, ==, "anything goes");
+  g_assert_cmpint (g_hash_table_size (names), ==, 1);
+  g_assert_cmpint (g_hash_table_size (comments), ==, 1);
+  name = g_hash_table_lookup (names, "C");
+  g_assert_cmpstr (name, ==, "Hello world test app: org.test.Hello");
+  comment = g_hash_table_lookup (comments, "C");
+  g_assert_cmpstr (comment, ==, "Print a greeting");
+}
+
+static gboolean
+stop_after_first_element (gpointer element, gpointer user_data)
+{
+  int *count = user_data;
+
+  (*count)++;
+  return TRUE;
+}
+
+static void
+test_streaming_json (void)
+{
+  const char index_json[] =
+    "{\n"
+    "  \"schemaVersion\": 2,\n"
+    "  \"mediaType\": \"application/vnd.oci.image.index.v1+json\",\n"
+    "  \"manifests\": [\n"
+    "    {\n"
+    "      \"mediaType\": \"application/vnd.oci.image.manifest.v1+json\",\n"
+    "      \"digest\": \"sha256:aaa\",\n"
+    "      \"size\": 100,\n"
+    "      \"unknown\": [1, 2.5, {\"nested\": true}],\n"
+    "      \"annotations\": {\n"
+    "        \"org.opencontainers.image.ref.name\": \"app/org.test.Hello/x86_64/master\"\n"
+    "      }\n"
+    "    },\n"
+    "    {\n"
+    "      \"mediaType\": \"application/vnd.oci.image.manifest.v1+json\",\n"
+    "      \"digest\": \"sha256:bbb\",\n"
+    "      \"size\": 200,\n"
+    "      \"annotations\": {\n"
+    "        \"org.opencontainers.image.ref.name\": \"app/org.test.Goodbye/x86_64/master\"\n"
+    "      }\n"
+    "    }\n"
+    "  ]\n"
+    "}";
+  g_autoptr(GBytes) bytes = g_bytes_new_static (index_json, sizeof (index_json) - 1);
+  g_autoptr(GBytes) garbage = g_bytes_new_static ("not json", 8);
+  g_autoptr(FlatpakOciIndex) index = NULL;
+  g_autoptr(GError) error = NULL;
+  FlatpakOciManifestDescriptor *d;
+  int count = 0;
+
+  index = (FlatpakOciIndex *) flatpak_json_from_bytes (bytes, FLATPAK_TYPE_OCI_INDEX, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (index);
+  g_assert_cmpint (index->parent.version, ==, 2);
+  g_assert_nonnull (index->manifests);
+  g_assert_nonnull (index->manifests[0]);
+  g_assert_nonnull (index->manifests[1]);
+  g_assert_null (index->manifests[2]);
+  g_assert_cmpstr (index->manifests[0]->parent.digest, ==, "sha256:aaa");
+  g_assert_cmpint (index->manifests[0]->parent.size, ==, 100);
+
+  d = flatpak_oci_index_get_manifest (index, "app/org.test.Goodbye/x86_64/master");
+  g_assert_nonnull (d);
+  g_assert_cmpstr (d->parent.digest, ==, "sha256:bbb");
+
+  /* Serializing and reparsing round-trips */
+  {
+    g_autoptr(GBytes) serialized = flatpak_json_to_bytes (FLATPAK_JSON (index));
+    g_autoptr(FlatpakOciIndex) reparsed = NULL;
+
+    reparsed = (FlatpakOciIndex *) flatpak_json_from_bytes (serialized, FLATPAK_TYPE_OCI_INDEX, &error);
+    g_assert_no_error (error);
+    g_assert_nonnull (reparsed);
+    g_assert_cmpint (reparsed->parent.version, ==, 2);
+    g_assert_nonnull (reparsed->manifests);
+    g_assert_nonnull (reparsed->manifests[1]);
+    g_assert_null (reparsed->manifests[2]);
+    g_assert_cmpstr (reparsed->manifests[1]->parent.digest, ==, "sha256:bbb");
+    d = flatpak_oci_index_get_manifest (reparsed, "app/org.test.Hello/x86_64/master");
+    g_assert_nonnull (d);
+    g_assert_cmpstr (d->parent.digest, ==, "sha256:aaa");
+  }
+
+  g_clear_object (&index);
+
+  /* A partial parse stops after the first manifest */
+  index = (FlatpakOciIndex *) flatpak_json_from_bytes_partial (bytes, FLATPAK_TYPE_OCI_INDEX,
+                                                               stop_after_first_element, &count,
+                                                               &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (index);
+  g_assert_cmpint (count, ==, 1);
+  g_assert_nonnull (index->manifests);
+  g_assert_nonnull (index->manifests[0]);
+  g_assert_null (index->manifests[1]);
+  g_assert_cmpstr (index->manifests[0]->parent.digest, ==, "sha256:aaa");
+
+  g_clear_object (&index);
+
+  index = (FlatpakOciIndex *) flatpak_json_from_bytes (garbage, FLATPAK_TYPE_OCI_INDEX, &error);
+  g_assert_null (index);
+  g_assert_nonnull (error);
+  g_clear_error (&error);
 }
 
 static void
@@ -974,6 +1092,7 @@ main (int argc, char *argv[])
   g_test_add_func ("/common/subpaths-merge", test_subpaths_merge);
   g_test_add_func ("/common/lang-from-locale", test_lang_from_locale);
   g_test_add_func ("/common/appdata", test_parse_appdata);
+  g_test_add_func ("/common/streaming-json", test_streaming_json);
   g_test_add_func ("/common/name-matching", test_name_matching);
 
   g_test_add_func ("/app/looks-like-branch", test_looks_like_branch);